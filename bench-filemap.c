@@ -0,0 +1,177 @@
+/**
+ * Micro-benchmark of the filetype conversion in src/inc/libmtp.c.
+ *
+ * $ cc -O2 -Isrc/inc bench-filemap.c -o bench-filemap && ./bench-filemap
+ *
+ * libmtp.c does not build on its own, so this carries a copy of its filemap,
+ * registered in the same order, and converts the PTP format of every object
+ * of a photo and music listing both ways: walking the list, as libmtp.c did
+ * before, and through the dense index it builds at LIBMTP_Init() now.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libmtp.h"
+
+#define PTP_CODE_SPACE 0x10000
+#define OBJECTS 100000
+#define LISTINGS 50
+
+typedef struct filemap_struct {
+  LIBMTP_filetype_t id;
+  uint16_t ptp_id;
+  struct filemap_struct *next;
+} filemap_t;
+
+static const struct {
+  LIBMTP_filetype_t id;
+  uint16_t ptp_id;
+} registrations[] = {
+  { LIBMTP_FILETYPE_FOLDER, 0x3001 },
+  { LIBMTP_FILETYPE_MEDIACARD, 0xb211 },
+  { LIBMTP_FILETYPE_WAV, 0x3008 },
+  { LIBMTP_FILETYPE_MP3, 0x3009 },
+  { LIBMTP_FILETYPE_MP2, 0xb983 },
+  { LIBMTP_FILETYPE_WMA, 0xb901 },
+  { LIBMTP_FILETYPE_OGG, 0xb902 },
+  { LIBMTP_FILETYPE_FLAC, 0xb906 },
+  { LIBMTP_FILETYPE_AAC, 0xb903 },
+  { LIBMTP_FILETYPE_M4A, 0xb215 },
+  { LIBMTP_FILETYPE_MP4, 0xb982 },
+  { LIBMTP_FILETYPE_AUDIBLE, 0xb904 },
+  { LIBMTP_FILETYPE_UNDEF_AUDIO, 0xb900 },
+  { LIBMTP_FILETYPE_WMV, 0xb981 },
+  { LIBMTP_FILETYPE_AVI, 0x300a },
+  { LIBMTP_FILETYPE_MPEG, 0x300b },
+  { LIBMTP_FILETYPE_ASF, 0x300c },
+  { LIBMTP_FILETYPE_QT, 0x300d },
+  { LIBMTP_FILETYPE_UNDEF_VIDEO, 0xb980 },
+  { LIBMTP_FILETYPE_JPEG, 0x3801 },
+  { LIBMTP_FILETYPE_JP2, 0x380f },
+  { LIBMTP_FILETYPE_JPX, 0x3810 },
+  { LIBMTP_FILETYPE_JFIF, 0x3808 },
+  { LIBMTP_FILETYPE_TIFF, 0x380d },
+  { LIBMTP_FILETYPE_BMP, 0x3804 },
+  { LIBMTP_FILETYPE_GIF, 0x3807 },
+  { LIBMTP_FILETYPE_PICT, 0x380a },
+  { LIBMTP_FILETYPE_PNG, 0x380b },
+  { LIBMTP_FILETYPE_WINDOWSIMAGEFORMAT, 0xb881 },
+  { LIBMTP_FILETYPE_VCALENDAR1, 0xbe02 },
+  { LIBMTP_FILETYPE_VCALENDAR2, 0xbe03 },
+  { LIBMTP_FILETYPE_VCARD2, 0xbb82 },
+  { LIBMTP_FILETYPE_VCARD3, 0xbb83 },
+  { LIBMTP_FILETYPE_WINEXEC, 0xbe04 },
+  { LIBMTP_FILETYPE_TEXT, 0x3004 },
+  { LIBMTP_FILETYPE_HTML, 0x3005 },
+  { LIBMTP_FILETYPE_XML, 0xba82 },
+  { LIBMTP_FILETYPE_DOC, 0xba83 },
+  { LIBMTP_FILETYPE_XLS, 0xba85 },
+  { LIBMTP_FILETYPE_PPT, 0xba86 },
+  { LIBMTP_FILETYPE_MHT, 0xba84 },
+  { LIBMTP_FILETYPE_FIRMWARE, 0xb802 },
+  { LIBMTP_FILETYPE_ALBUM, 0xba03 },
+  { LIBMTP_FILETYPE_PLAYLIST, 0xba05 },
+  { LIBMTP_FILETYPE_UNKNOWN, 0x3000 }
+};
+
+/* what a phone listing mostly holds: photos, music and the folders around them */
+static const uint16_t listing_mix[] = {
+  0x3801, 0x3801, 0x3801, 0x3801, 0x380b, 0x3009, 0x3009, 0xb906, 0xb215, 0xb982, 0x3001, 0x3000
+};
+
+static filemap_t *g_filemap = NULL;
+static uint8_t g_filemap_by_ptp[PTP_CODE_SPACE];
+
+static void register_filetype(LIBMTP_filetype_t id, uint16_t ptp_id)
+{
+  filemap_t *entry = calloc(1, sizeof(filemap_t));
+  filemap_t *current;
+
+  entry->id = id;
+  entry->ptp_id = ptp_id;
+
+  if (g_filemap == NULL) {
+    g_filemap = entry;
+    return;
+  }
+  for (current = g_filemap; current->next != NULL; current = current->next);
+  current->next = entry;
+}
+
+static LIBMTP_filetype_t walk(uint16_t intype)
+{
+  filemap_t *current;
+
+  for (current = g_filemap; current != NULL; current = current->next) {
+    if (current->ptp_id == intype) {
+      return current->id;
+    }
+  }
+  return LIBMTP_FILETYPE_UNKNOWN;
+}
+
+static LIBMTP_filetype_t lookup(uint16_t intype)
+{
+  uint8_t entry = g_filemap_by_ptp[intype];
+
+  return entry == 0 ? LIBMTP_FILETYPE_UNKNOWN : (LIBMTP_filetype_t) (entry - 1);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char *name, LIBMTP_filetype_t (*convert)(uint16_t), const uint16_t *formats)
+{
+  unsigned long sum = 0;
+  double start = now();
+  double elapsed;
+  int i, j;
+
+  for (i = 0; i < LISTINGS; i++) {
+    for (j = 0; j < OBJECTS; j++) {
+      sum += convert(formats[j]);
+    }
+  }
+  elapsed = now() - start;
+
+  printf("%-12s %8.1f ns/object %8.2f ms/listing (%lu)\n", name, elapsed / LISTINGS / OBJECTS,
+         elapsed / LISTINGS / 1e6, sum);
+}
+
+int main(void)
+{
+  size_t count = sizeof(registrations) / sizeof(registrations[0]);
+  uint16_t *formats = malloc(OBJECTS * sizeof(uint16_t));
+  filemap_t *current;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    register_filetype(registrations[i].id, registrations[i].ptp_id);
+  }
+  for (current = g_filemap; current != NULL; current = current->next) {
+    if (g_filemap_by_ptp[current->ptp_id] == 0) {
+      g_filemap_by_ptp[current->ptp_id] = (uint8_t) current->id + 1;
+    }
+  }
+
+  srand(1);
+  for (i = 0; i < OBJECTS; i++) {
+    formats[i] = listing_mix[rand() % (sizeof(listing_mix) / sizeof(listing_mix[0]))];
+  }
+
+  printf("%zu filetypes, %d objects per listing\n", count, OBJECTS);
+  run("list walk", walk, formats);
+  run("index", lookup, formats);
+
+  free(formats);
+  return 0;
+}
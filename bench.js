@@ -0,0 +1,139 @@
+'use strict';
+
+/**
+ * Micro-benchmark of the native binding.
+ *
+ * $ node bench.js [local folder to scan] [--device]
+ *
+ * Per-call overhead is measured with functions which do not touch a device,
+ * per-object overhead with a local scan and, with --device, with listing
+ * the root folder of the first storage of the first MTP device.
+ */
+
+const path = require('path');
+const mtpHelper = require('./lib/mtp-helper');
+const MTP_FLAGS = require('./lib/mtp-device-flags').FLAGS;
+
+const args = process.argv.slice(2);
+const withDevice = args.includes('--device');
+const scanFolder = args.find(arg => arg !== '--device') || path.resolve(__dirname);
+
+const nsPer = (start, count) =>
+  (Number(process.hrtime.bigint() - start) / count).toFixed(1);
+
+const report = (name, value, unit) =>
+  console.log(`${name.padEnd(40)} ${String(value).padStart(12)} ${unit}`);
+
+function benchCalls(count = 1000000) {
+  let start = process.hrtime.bigint();
+  for (let i = 0; i < count; i += 1) {
+    mtpHelper.Get_Filetype('song.mp3');
+  }
+  report('call Get_Filetype(string)', nsPer(start, count), 'ns/call');
+
+  const file = new mtpHelper.file_t();
+  let sum = 0;
+
+  start = process.hrtime.bigint();
+  for (let i = 0; i < count; i += 1) {
+    file.id = i;
+    sum += file.id;
+  }
+  report('set + get file_t.id', nsPer(start, count), 'ns/pair');
+
+  start = process.hrtime.bigint();
+  for (let i = 0; i < count / 10; i += 1) {
+    new mtpHelper.file_t();
+  }
+  report('new file_t()', nsPer(start, count / 10), 'ns/object');
+
+  return sum;
+}
+
+function scan(folder) {
+  return new Promise(resolve => {
+    const start = process.hrtime.bigint();
+
+    mtpHelper.Scan_Local_Tree(folder, true, 0, (error, items) => {
+      const elapsed = process.hrtime.bigint() - start;
+      const read = process.hrtime.bigint();
+      let bytes = 0;
+
+      for (let i = 0; i < items.length; i += 1) {
+        bytes += items[i].size + items[i].name.length;
+      }
+
+      resolve({ error, items, elapsed, read: process.hrtime.bigint() - read });
+    });
+  });
+}
+
+async function benchScan(folder) {
+  const { error, items, elapsed, read } = await scan(folder);
+
+  if (error !== 0) {
+    console.error(`scanning ${folder} failed: ${error}`);
+    return;
+  }
+
+  report(`scan ${items.length} local items`, (Number(elapsed) / 1e6).toFixed(2), 'ms');
+  report(
+    'read back every scanned item',
+    (Number(read) / Math.max(items.length, 1)).toFixed(1),
+    'ns/object'
+  );
+}
+
+function benchListing() {
+  mtpHelper.Init();
+
+  return new Promise(resolve => {
+    mtpHelper.Detect_Raw_Devices((error, rawDevices) => {
+      if (error !== 0 || rawDevices.length < 1) {
+        console.error('no MTP device found');
+        resolve();
+        return;
+      }
+
+      const device = mtpHelper.Open_Raw_Device(rawDevices[0]);
+      const storages = device.getStorages();
+      const rounds = 20;
+      let count = 0;
+
+      const start = process.hrtime.bigint();
+      for (let i = 0; i < rounds; i += 1) {
+        const files = mtpHelper.Get_Files_And_Folders(
+          device,
+          storages[0].id,
+          MTP_FLAGS.FILES_AND_FOLDERS_ROOT
+        );
+
+        for (let j = 0; j < files.length; j += 1) {
+          count += files[j].name.length > 0 ? 1 : 0;
+        }
+      }
+      const elapsed = Number(process.hrtime.bigint() - start);
+
+      report(
+        `list the root folder (${count / rounds} objects)`,
+        (elapsed / rounds / 1e6).toFixed(2),
+        'ms'
+      );
+      report('per listed object', (elapsed / Math.max(count, 1)).toFixed(1), 'ns/object');
+
+      mtpHelper.Release_Device(device);
+      resolve();
+    });
+  });
+}
+
+async function run() {
+  benchCalls();
+  await benchScan(scanFolder);
+
+  if (withDevice) {
+    await benchListing();
+  }
+}
+
+run();
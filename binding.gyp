@@ -1,16 +1,80 @@
 {
+	# Entry points only the libmtp sources in src/inc provide. Those are not
+	# built here: the addon links the system libmtp (libmtp-9.lib on Windows),
+	# so each flag stays 0 unless that libmtp is built from src/inc, and the
+	# addon falls back to the stock libmtp calls. See "Build options" in README.md
+	"variables": {
+		# LIBMTP_Send_Files_From_Handler_Batch() for uploadSmallFiles
+		"mtp_send_batch%": 0,
+		# LIBMTP_GetPartialObject_Sized() for chunked downloads and readFileRange
+		"mtp_partial_sized%": 0,
+		# LIBMTP_Update_Object_Cache() for applyDeviceEvent
+		"mtp_cache_events%": 0
+	},
 	"targets": [
 		{
-			"includes": [
-				"auto.gypi"
-			],
+			"target_name": "mtp",
 			"sources": [
-				"src/mtp.cc"
+				"src/binding.cc",
+				"src/mtp.cc",
+				"src/transfer.cc",
+				"src/dispatcher.cc",
+				"src/registry.cc",
+				"src/executor.cc",
+				"src/scheduler.cc",
+				"src/ratelimit.cc",
+				"src/journal.cc",
+				"src/tree.cc",
+				"src/writebehind.cc",
+				"src/sync.cc",
+				"src/checksum.cc",
+				"src/cache.cc",
+				"src/readcache.cc",
+				"src/thumbnail.cc",
+				"src/archive.cc",
+				"src/extract.cc",
+				"src/scan.cc",
+				"src/filetype.cc"
+			],
+			"defines": [
+				"NAPI_VERSION=8"
+			],
+			"cflags_cc!": [
+				"-fno-exceptions"
 			],
+			"cflags_cc": [
+				"-std=c++11"
+			],
+			"xcode_settings": {
+				"GCC_ENABLE_CPP_EXCEPTIONS": "YES",
+				"CLANG_CXX_LANGUAGE_STANDARD": "c++11",
+				"MACOSX_DEPLOYMENT_TARGET": "10.10"
+			},
+			"msvs_settings": {
+				"VCCLCompilerTool": {
+					"ExceptionHandling": 1
+				}
+			},
 			"conditions" : [
+				['mtp_send_batch==1', {
+					"defines": [
+						"MTP_HAVE_SEND_BATCH"
+					]
+				}],
+				['mtp_partial_sized==1', {
+					"defines": [
+						"MTP_HAVE_PARTIAL_SIZED"
+					]
+				}],
+				['mtp_cache_events==1', {
+					"defines": [
+						"MTP_HAVE_CACHE_EVENTS"
+					]
+				}],
 				['OS=="win"', {
 					"include_dirs+": [
-						"src/inc"
+						"src/inc",
+						"libmtp.mpd/src"
 					],
 					"libraries": [
 						"../src/lib/libmtp-9.lib"
@@ -23,8 +87,5 @@
 				}]
 			]
 		}
-	],
-	"includes": [
-		"auto-top.gypi"
 	]
 }
@@ -4,7 +4,6 @@ const mkdirp = require('mkdirp');
 const fs = require('fs');
 const path = require('path');
 const moment = require('moment');
-const junk = require('junk');
 const findLodash = require('lodash/find');
 const mtpNativeModule = require('./mtp-helper');
 const MTP_FLAGS = require('./mtp-device-flags').FLAGS;
@@ -29,15 +28,6 @@ function quickHash(str) {
   return hash;
 }
 
-function isWritable(folderPath) {
-  try {
-    fs.accessSync(folderPath, fs.R_OK | fs.W_OK);
-    return true;
-  } catch (e) {
-    return false;
-  }
-}
-
 function isArray(n) {
   return Array.isArray(n);
 }
@@ -67,6 +57,96 @@ async function promisifiedMkdir({ newFolderPath }) {
   }
 }
 
+/**
+ * Progress counter shared with the native transfer job.
+ * Slots: [0] transferred bytes, [1] total bytes, [2] completed files
+ * @returns {BigUint64Array}
+ */
+function createProgressCounter() {
+  return new BigUint64Array(new SharedArrayBuffer(3 * 8));
+}
+
+/**
+ * Abort slot shared with the native abort token. Any thread holding the
+ * slot can cancel the transfers using Atomics.store(slot, 0, 1).
+ * @returns {Int32Array}
+ */
+function createAbortSlot() {
+  return new Int32Array(new SharedArrayBuffer(4));
+}
+
+/**
+ * Flatten a local file tree into native tree items, folders first
+ * @param mtpNativeModule: {object}
+ * @param nodes: {array}
+ * @param parent: {int} index of the enclosing folder item, -1 for the top
+ * @param items: {array}
+ * @returns {array}
+ */
+function flattenFileTree(mtpNativeModule, nodes, parent = -1, items = []) {
+  for (let i = 0; i < nodes.length; i += 1) {
+    const node = nodes[i];
+    // eslint-disable-next-line new-cap
+    const item = new mtpNativeModule.tree_item_t();
+    item.name = node.name;
+    item.path = node.path;
+    item.parent = parent;
+    item.isFolder = !!node.isFolder;
+    item.size = node.size || 0;
+
+    const index = items.push(item) - 1;
+
+    if (node.isFolder && isArray(node.children)) {
+      flattenFileTree(mtpNativeModule, node.children, index, items);
+    }
+  }
+
+  return items;
+}
+
+/**
+ * Flatten a device file tree into native tree items, folders first
+ * @param mtpNativeModule: {object}
+ * @param nodes: {array}
+ * @param destinationPath: {string} local folder the nodes are copied into
+ * @param parent: {int} index of the enclosing folder item, -1 for the top
+ * @param items: {array}
+ * @returns {array}
+ */
+function flattenDeviceTree(
+  mtpNativeModule,
+  nodes,
+  destinationPath,
+  parent = -1,
+  items = []
+) {
+  for (let i = 0; i < nodes.length; i += 1) {
+    const node = nodes[i];
+    // eslint-disable-next-line new-cap
+    const item = new mtpNativeModule.tree_item_t();
+    item.id = node.id;
+    item.name = node.name;
+    item.path = path.join(destinationPath, node.name);
+    item.parent = parent;
+    item.isFolder = !!node.isFolder;
+    item.size = node.size || 0;
+
+    const index = items.push(item) - 1;
+
+    if (node.isFolder && isArray(node.children)) {
+      flattenDeviceTree(
+        mtpNativeModule,
+        node.children,
+        item.path,
+        index,
+        items
+      );
+    }
+  }
+
+  return items;
+}
+
 /**
  * MTP Class
  */
@@ -84,6 +164,7 @@ class MTP {
       NO_MTP: `No MTP device found`,
       NO_STORAGE: `MTP storage not accessible`,
       LOCAL_FOLDER_NOT_FOUND: `Source folder not found`,
+      LIST_LOCAL_FILES_FAILED: `Some error occured while listing the local files`,
       ILLEGAL_FILE_NAME: `Illegal file name`,
       RENAME_FAILED: `Some error occured while renaming`,
       FILE_INFO_FAILED: `Some error occured while fetching the file information`,
@@ -93,7 +174,24 @@ class MTP {
       CREATE_FOLDER_FAILED: `Some error occured while creating a new folder`,
       CREATE_FOLDER_FILE_FAILED: `A file with a similar name exists`,
       INVALID_PATH_RESOLVE: `Illegal path, could not resolve the path`,
-      INVALID_NOT_FOUND: `Path not found`
+      INVALID_NOT_FOUND: `Path not found`,
+      TRANSFER_ABORTED: `The transfer was cancelled`,
+      LIST_FILES_FAILED: `Some error occured while listing the files`,
+      JOURNAL_OPEN_FAILED: `The transfer journal could not be opened`,
+      SYNC_FAILED: `Some error occured while syncing the folders`,
+      CACHE_OPEN_FAILED: `The download cache could not be opened`,
+      READ_RANGE_FAILED: `Some error occured while reading from the file`,
+      THUMBNAILS_FAILED: `Some error occured while fetching the thumbnails`,
+      EXPORT_ARCHIVE_FAILED: `Some error occured while exporting the archive`,
+      IMPORT_ARCHIVE_FAILED: `Some error occured while importing the archive`
+    };
+
+    // LIBMTP_event_t, for applyDeviceEvent
+    this.EVENT = {
+      STORE_ADDED: 1,
+      STORE_REMOVED: 2,
+      OBJECT_ADDED: 3,
+      OBJECT_REMOVED: 4
     };
   }
 
@@ -111,11 +209,21 @@ class MTP {
 
   /**
    * Detect MTP
+   * With `cached`, the device keeps a table of all its objects, loaded once
+   * on open; keep it current with applyDeviceEvent.
+   * With `handle`, from getDeviceHandle() in another worker, the device that
+   * worker opened is shared instead of detecting one.
+   * @param cached: {boolean} (optional)
+   * @param handle: {number} (optional)
    * @returns {Promise<{data: *, error: *}>}
    */
-  detectMtp() {
+  detectMtp({ cached = false, handle = null } = {}) {
     let error = null;
 
+    if (!undefinedOrNull(handle)) {
+      return Promise.resolve(this.acquireMtp(handle));
+    }
+
     return new Promise(resolve => {
       return this.mtpNativeModule.Detect_Raw_Devices((err, rawDevices) => {
         try {
@@ -135,9 +243,9 @@ class MTP {
             });
           }
 
-          this.device = this.mtpNativeModule.Open_Raw_Device_Uncached(
-            rawDevices[0]
-          );
+          this.device = cached
+            ? this.mtpNativeModule.Open_Raw_Device(rawDevices[0])
+            : this.mtpNativeModule.Open_Raw_Device_Uncached(rawDevices[0]);
 
           if (undefinedOrNull(this.device)) {
             return resolve({
@@ -167,6 +275,45 @@ class MTP {
     });
   }
 
+  /**
+   * Share a device opened in another worker
+   * @param handle: {number}
+   * @returns {{data: *, error: *}}
+   */
+  acquireMtp(handle) {
+    try {
+      const device = this.mtpNativeModule.Acquire_Device(handle);
+
+      if (undefinedOrNull(device)) {
+        this.device = null;
+
+        return {
+          data: null,
+          error: this.ERR.NO_MTP
+        };
+      }
+
+      this.device = device;
+
+      return {
+        error: null,
+        data: {
+          device: this.device,
+          modelName: this.mtpNativeModule.Get_Modelname(this.device),
+          serialNumber: this.mtpNativeModule.Get_Serialnumber(this.device),
+          deviceVersion: this.mtpNativeModule.Get_Deviceversion(this.device)
+        }
+      };
+    } catch (e) {
+      console.error(`MTP -> acquireMtp`, e);
+
+      return {
+        data: null,
+        error: e
+      };
+    }
+  }
+
   /**
    * Throw MTP Error
    * @returns {Promise<{data: null, error: string}>}
@@ -186,6 +333,14 @@ class MTP {
     return this.device;
   }
 
+  /**
+   * Handle of the device, to share it with another worker
+   * @returns {number|null}
+   */
+  getDeviceHandle() {
+    return this.device ? this.device.handle : null;
+  }
+
   /**
    * Detect MTP
    * @returns {string|null}
@@ -760,13 +915,15 @@ class MTP {
    * @param folderPath: {string}
    * @param ignoreHiddenFiles: {boolean}
    * @param recursive: {boolean}
+   * @param abortToken: {object} (optional; see createAbortToken)
    * @returns {Promise<{data: *, error: *}>}
    */
 
   async listMtpFileTree({
     folderPath = null,
     recursive = false,
-    ignoreHiddenFiles = false
+    ignoreHiddenFiles = false,
+    abortToken = null
   }) {
     const filePath = path.resolve(folderPath);
 
@@ -789,7 +946,8 @@ class MTP {
       recursive,
       ignoreHiddenFiles,
       folderId: resolvePathData.id,
-      parentPath: filePath
+      parentPath: filePath,
+      abortToken
     });
 
     if (listMtpFileTreeError) {
@@ -813,6 +971,7 @@ class MTP {
    * @param parentPath: {string}
    * @param ignoreHiddenFiles: {boolean}
    * @param filePath: {string}
+   * @param abortToken: {object} (optional; see createAbortToken)
    * @returns {Promise<{data: *, error: *}>}
    */
   async __listMtpFileTree({
@@ -820,16 +979,30 @@ class MTP {
     recursive = false,
     fileTreeStructure = [],
     parentPath = '',
-    ignoreHiddenFiles = false
+    ignoreHiddenFiles = false,
+    abortToken = null
   }) {
     if (!this.device) return this.throwMtpError();
 
     try {
-      const files = this.mtpNativeModule.Get_Files_And_Folders(
-        this.device,
-        this.storageId,
-        folderId
-      );
+      const { data: files, error: listError } = await this.__scheduleListing({
+        folderId,
+        abortToken
+      });
+
+      if (this.__isAborted(abortToken)) {
+        return Promise.resolve({
+          data: null,
+          error: this.ERR.TRANSFER_ABORTED
+        });
+      }
+
+      if (listError) {
+        return Promise.resolve({
+          data: null,
+          error: listError
+        });
+      }
 
       for (let i = 0; i < files.length; i += 1) {
         const file = files[i];
@@ -861,12 +1034,20 @@ class MTP {
         const lastIndex = fileTreeStructure.push(fileInfo) - 1;
 
         if (MTP_FLAGS.FILETYPE_FOLDER === file.type && recursive) {
-          await this.__listMtpFileTree({
+          const { error: listMtpFileTreeError } = await this.__listMtpFileTree({
             folderId: file.id,
             recursive,
             parentPath: fullPath,
-            fileTreeStructure: fileTreeStructure[lastIndex].children
+            fileTreeStructure: fileTreeStructure[lastIndex].children,
+            abortToken
           });
+
+          if (listMtpFileTreeError === this.ERR.TRANSFER_ABORTED) {
+            return Promise.resolve({
+              data: null,
+              error: listMtpFileTreeError
+            });
+          }
         }
       }
 
@@ -884,6 +1065,74 @@ class MTP {
     }
   }
 
+  /**
+   * List a folder on the device's scheduler, ahead of any bulk transfer
+   * @param folderId: {int}
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  __scheduleListing({ folderId, abortToken = null }) {
+    return new Promise(resolve => {
+      this.mtpNativeModule.Schedule_Get_Files_And_Folders(
+        this.device,
+        this.storageId,
+        folderId,
+        MTP_FLAGS.SCHEDULER_PRIORITY_INTERACTIVE,
+        undefinedOrNull(abortToken) ? this.createAbortToken() : abortToken,
+        (error, files) => {
+          resolve({
+            data: error === 0 ? files : null,
+            error: error === 0 ? null : this.ERR.LIST_FILES_FAILED
+          });
+        }
+      );
+    });
+  }
+
+  /**
+   * Scan Local File Tree
+   * Lists a local folder on a pool of native threads, without blocking the
+   * event loop. The items are flattened the way uploadFileTreeBatched takes
+   * them (pass them as `items`): folders precede their content and `parent`
+   * is the index of the enclosing folder, -1 at the top. Junk files and
+   * entries which are not readable and writable are left out.
+   * @param folderPath: {string}
+   * @param recursive: {boolean}
+   * @param threads: {int} scanner threads, 0 for the default (optional)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  scanLocalFileTree({ folderPath, recursive = true, threads = 0 }) {
+    try {
+      if (!fs.existsSync(folderPath)) {
+        return Promise.resolve({
+          data: null,
+          error: this.ERR.LOCAL_FOLDER_NOT_FOUND
+        });
+      }
+
+      return new Promise(resolve => {
+        this.mtpNativeModule.Scan_Local_Tree(
+          folderPath,
+          recursive,
+          threads,
+          (error, items) => {
+            resolve({
+              data: error === 0 ? items : null,
+              error: error === 0 ? null : this.ERR.LIST_LOCAL_FILES_FAILED
+            });
+          }
+        );
+      });
+    } catch (e) {
+      console.error(`MTP -> scanLocalFileTree`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
   /**
    * List Local File Tree
    * @param folderPath: {string}
@@ -899,41 +1148,37 @@ class MTP {
     if (!this.device) return this.throwMtpError();
 
     try {
-      if (!fs.existsSync(folderPath)) {
+      const {
+        error: scanLocalFileTreeError,
+        data: items
+      } = await this.scanLocalFileTree({ folderPath, recursive });
+
+      if (scanLocalFileTreeError) {
         return Promise.resolve({
           data: null,
-          error: this.ERR.LOCAL_FOLDER_NOT_FOUND
+          error: scanLocalFileTreeError
         });
       }
 
-      const files = fs.readdirSync(folderPath);
-      for (let i = 0; i < files.length; i += 1) {
-        const file = files[i];
+      const nodes = [];
 
-        if (!junk.is(file)) {
-          const fullPath = path.join(folderPath, file);
-          const stats = fs.lstatSync(fullPath);
-          const isFolder = stats.isDirectory();
-          const fileInfo = {
-            id: quickHash(fullPath),
-            name: file,
-            size: stats.size,
-            isFolder,
-            path: fullPath,
-            children: []
-          };
-
-          if (isWritable(fullPath)) {
-            const lastIndex = fileTreeStructure.push(fileInfo) - 1;
-
-            if (isFolder && recursive) {
-              await this.listLocalFileTree({
-                folderPath: fullPath,
-                recursive,
-                fileTreeStructure: fileTreeStructure[lastIndex].children
-              });
-            }
-          }
+      for (let i = 0; i < items.length; i += 1) {
+        const item = items[i];
+        const fileInfo = {
+          id: quickHash(item.path),
+          name: item.name,
+          size: item.size,
+          isFolder: item.isFolder,
+          path: item.path,
+          children: []
+        };
+
+        nodes.push(fileInfo);
+
+        if (item.parent < 0) {
+          fileTreeStructure.push(fileInfo);
+        } else {
+          nodes[item.parent].children.push(fileInfo);
         }
       }
 
@@ -952,40 +1197,74 @@ class MTP {
   }
 
   /**
-   * Download File
-   * @param destinationFilePath: {string}
-   * @param file: {object}
-   * @param callback: {fn}
+   * Create Transfer Job
+   * Aggregates the progress of one or more transfers and throttles the
+   * progress callbacks. A job without a total reports its final progress
+   * when it is flushed: call job.flush() after the last transfer of a job
+   * spread over several calls.
+   * @param minInterval: {int} minimum milliseconds between two callbacks
+   * @param minBytes: {int} minimum bytes transferred between two callbacks
+   * @param total: {int} total bytes planned for the job (optional)
+   * @param counter: {BigUint64Array} see createProgressCounter (optional)
+   * @param rateLimit: {int} bytes per second, 0 for unlimited (optional)
+   * @param rateBurst: {int} bytes allowed in a burst (optional)
+   * @param checksum: {int} MTP_FLAGS.CHECKSUM_XXH64 or CHECKSUM_SHA256; the
+   *   digest of the last completed file is then available as job.digest (optional)
+   * @returns {object}
+   */
+  createTransferJob({
+    minInterval = 0,
+    minBytes = 0,
+    total = 0,
+    counter = null,
+    rateLimit = 0,
+    rateBurst = 0,
+    checksum = MTP_FLAGS.CHECKSUM_NONE
+  } = {}) {
+    // eslint-disable-next-line new-cap
+    const job = new this.mtpNativeModule.transfer_job_t();
+    job.minInterval = minInterval;
+    job.minBytes = minBytes;
+    job.total = total;
+    job.checksum = checksum;
+
+    if (rateLimit > 0) {
+      job.setRateLimit(rateLimit, rateBurst);
+    }
+
+    if (!undefinedOrNull(counter)) {
+      // the job keeps the counter memory alive natively
+      job.setCounter(Buffer.from(counter.buffer));
+    }
+
+    return job;
+  }
+
+  /**
+   * Set Device Rate Limit
+   * Shapes every job transfer of the current device session. Combine it
+   * with a per job limit (see createTransferJob and job.setRateLimit) to
+   * keep background syncs slow while foreground transfers run at full speed.
+   * @param rateLimit: {int} bytes per second, 0 for unlimited
+   * @param rateBurst: {int} bytes allowed in a burst (optional)
    * @returns {Promise<{data: *, error: *}>}
    */
-  downloadFile({ destinationFilePath, file, callback }) {
+  setDeviceRateLimit({ rateLimit = 0, rateBurst = 0 }) {
     if (!this.device) return this.throwMtpError();
 
     try {
-      const downloadedFile = this.mtpNativeModule.Get_File_To_File(
+      this.mtpNativeModule.Set_Device_Rate_Limit(
         this.device,
-        file.id,
-        destinationFilePath,
-        (sent, total) => {
-          if (typeof callback === 'function') {
-            callback({ sent, total, file });
-          }
-        }
+        rateLimit,
+        rateBurst
       );
 
-      if (downloadedFile !== 0) {
-        return Promise.resolve({
-          data: null,
-          error: this.ERR.DOWNLOAD_FILE_FAILED
-        });
-      }
-
       return Promise.resolve({
-        data: downloadedFile,
+        data: true,
         error: null
       });
     } catch (e) {
-      console.error(`MTP -> downloadFile`, e);
+      console.error(`MTP -> setDeviceRateLimit`, e);
 
       return Promise.resolve({
         data: null,
@@ -995,81 +1274,55 @@ class MTP {
   }
 
   /**
-   * Download File Tree
-   * @param rootNode: {boolean}
-   * @param nodes: {array}
-   * @param destinationFilePath: {string}
-   * @param callback: {fn}
-   * @returns {Promise<{data: *, error: *}>}
+   * Create Abort Token
+   * Pass it to the transfer and listing calls and call abort() on it
+   * (or Atomics.store(slot, 0, 1) from another thread) to cancel them.
+   * @param slot: {Int32Array} see createAbortSlot (optional)
+   * @returns {object}
    */
-  async downloadFileTree({
-    rootNode = false,
-    nodes,
-    destinationFilePath,
-    callback
-  }) {
-    if (!this.device) return this.throwMtpError();
-
-    try {
-      if (rootNode && nodes.length < 1) {
-        return Promise.resolve({
-          data: null,
-          error: this.ERR.NO_FILES_COPIED
-        });
-      }
-
-      for (let i = 0; i < nodes.length; i += 1) {
-        const item = nodes[i];
-        const localFilePath = path.join(destinationFilePath, item.name);
+  createAbortToken({ slot = null } = {}) {
+    // eslint-disable-next-line new-cap
+    const abortToken = new this.mtpNativeModule.abort_token_t();
 
-        if (item.isFolder) {
-          const { error: promisifiedMkdirError } = await promisifiedMkdir({
-            newFolderPath: localFilePath
-          });
-
-          if (promisifiedMkdirError) {
-            return Promise.resolve({
-              data: null,
-              error: promisifiedMkdirError
-            });
-          }
+    if (!undefinedOrNull(slot)) {
+      // the token keeps the slot memory alive natively
+      abortToken.attach(Buffer.from(slot.buffer));
+    }
 
-          const { error: downloadFileTreeError } = await this.downloadFileTree({
-            nodes: item.children,
-            destinationFilePath: localFilePath,
-            callback
-          });
+    return abortToken;
+  }
 
-          if (downloadFileTreeError) {
-            return Promise.resolve({
-              data: null,
-              error: downloadFileTreeError
-            });
-          }
+  /**
+   * Open Transfer Journal
+   * Pass the journal to downloadFileTree or uploadFileTree to make them
+   * resumable: items completed before a crash or a disconnect are skipped
+   * when the same tree is transferred again with the same journal.
+   * @param journalPath: {string}
+   * @param syncInterval: {int} completed items between two fsyncs (optional)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  openTransferJournal({ journalPath, syncInterval = null }) {
+    try {
+      // eslint-disable-next-line new-cap
+      const journal = new this.mtpNativeModule.transfer_journal_t();
 
-          continue;
-        }
+      if (!undefinedOrNull(syncInterval)) {
+        journal.syncInterval = syncInterval;
+      }
 
-        const { error: downloadedFileError } = await this.downloadFile({
-          destinationFilePath: localFilePath,
-          file: item,
-          callback
+      if (!journal.open(journalPath)) {
+        return Promise.resolve({
+          data: null,
+          error: this.ERR.JOURNAL_OPEN_FAILED
         });
-
-        if (downloadedFileError) {
-          return Promise.resolve({
-            data: null,
-            error: downloadedFileError
-          });
-        }
       }
 
       return Promise.resolve({
-        data: true,
+        data: journal,
         error: null
       });
     } catch (e) {
-      console.error(`MTP -> downloadFileTree`, e);
+      console.error(`MTP -> openTransferJournal`, e);
 
       return Promise.resolve({
         data: null,
@@ -1079,49 +1332,32 @@ class MTP {
   }
 
   /**
-   * Upload File
-   * @param filePath: {string}
-   * @param parentId: {int}
-   * @param size: {int}
-   * @param callback: {fn}
+   * Open Download Cache
+   * A local cache of downloaded objects, keyed by device serial number,
+   * object id, size and modification time. Pass it to downloadFile and
+   * readFileRange to serve repeated downloads from disk.
+   * @param cacheDirectory: {string}
+   * @param budget: {int} maximum bytes kept in the cache (optional)
    * @returns {Promise<{data: *, error: *}>}
    */
-  uploadFile({ filePath, parentId, size, callback }) {
-    if (!this.device) return this.throwMtpError();
-
+  openDownloadCache({ cacheDirectory, budget = 0 }) {
     try {
       // eslint-disable-next-line new-cap
-      const file = new this.mtpNativeModule.file_t();
-      file.size = size;
-      file.name = path.basename(filePath);
-      file.type = MTP_FLAGS.FILETYPE_UNKNOWN;
-      file.parentId = parentId;
-      file.storageId = this.storageId;
-
-      const uploadedFile = this.mtpNativeModule.Send_File_From_File(
-        this.device,
-        filePath,
-        file,
-        (sent, total) => {
-          if (typeof callback === 'function') {
-            callback({ sent, total, file });
-          }
-        }
-      );
+      const cache = new this.mtpNativeModule.download_cache_t();
 
-      if (uploadedFile !== 0) {
+      if (!cache.open(cacheDirectory, budget)) {
         return Promise.resolve({
           data: null,
-          error: this.ERR.UPLOAD_FILE_FAILED
+          error: this.ERR.CACHE_OPEN_FAILED
         });
       }
 
       return Promise.resolve({
-        data: uploadedFile,
+        data: cache,
         error: null
       });
     } catch (e) {
-      console.error(`MTP -> uploadFile`, e);
+      console.error(`MTP -> openDownloadCache`, e);
 
       return Promise.resolve({
         data: null,
@@ -1131,22 +1367,1328 @@ class MTP {
   }
 
   /**
-   * Upload File Tree
-   * @param nodes: {array}
-   * @param folderPath:{string}
-   * @param parentId: {int} (alternative to folderPath)
+   * Wrap a progress callback so the journal learns the partial offsets
+   * @param journal: {object|null}
+   * @param journalKey: {string}
    * @param callback: {fn}
-   * @returns {Promise<{data: *, error: *}>}
+   * @returns {fn}
    */
-  async uploadFileTree({
-    nodes,
-    folderPath = null,
-    callback,
-    parentId = null
-  }) {
-    if (!this.device) return this.throwMtpError();
+  __journalCallback({ journal, journalKey, callback }) {
+    if (undefinedOrNull(journal)) {
+      return callback;
+    }
 
-    let _parentId = parentId;
+    return progress => {
+      journal.progress(journalKey, progress.sent);
+
+      if (typeof callback === 'function') {
+        callback(progress);
+      }
+    };
+  }
+
+  /**
+   * Resolve the transfer job for a transfer. Throws if `job` is bound to
+   * another abort token
+   * @param job: {object|null}
+   * @param abortToken: {object|null}
+   * @returns {object|null}
+   */
+  __transferJob({ job, abortToken }) {
+    if (undefinedOrNull(abortToken)) {
+      return job;
+    }
+
+    const _job = undefinedOrNull(job) ? this.createTransferJob() : job;
+
+    // a job keeps the token it was bound to, another one is refused rather
+    // than silently replacing it for every other transfer of the job
+    if (!_job.setAbortToken(abortToken)) {
+      throw new Error(
+        'The transfer job is bound to another abort token; clear it first'
+      );
+    }
+
+    return _job;
+  }
+
+  /**
+   * Was the abort token raised
+   * @param abortToken: {object|null}
+   * @returns {boolean}
+   */
+  __isAborted(abortToken) {
+    return !undefinedOrNull(abortToken) && abortToken.isAborted();
+  }
+
+  /**
+   * Download File
+   * @param destinationFilePath: {string}
+   * @param file: {object}
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param cache: {object} (optional; see openDownloadCache)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  downloadFile({
+    destinationFilePath,
+    file,
+    callback,
+    job: _job = null,
+    abortToken = null,
+    cache = null
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      let job = this.__transferJob({ job: _job, abortToken });
+      let downloadedFile;
+
+      if (!undefinedOrNull(cache)) {
+        job = job || this.createTransferJob();
+
+        if (typeof callback === 'function') {
+          job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+            callback({ sent, total, jobSent, jobTotal, file });
+          });
+        }
+
+        downloadedFile = this.mtpNativeModule.Get_File_To_File_Cached(
+          this.device,
+          file.id,
+          destinationFilePath,
+          cache,
+          job
+        );
+      } else if (!undefinedOrNull(job)) {
+        if (typeof callback === 'function') {
+          job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+            callback({ sent, total, jobSent, jobTotal, file });
+          });
+        }
+
+        downloadedFile = this.mtpNativeModule.Get_File_To_File_Job(
+          this.device,
+          file.id,
+          destinationFilePath,
+          job
+        );
+      } else {
+        downloadedFile = this.mtpNativeModule.Get_File_To_File(
+          this.device,
+          file.id,
+          destinationFilePath,
+          (sent, total) => {
+            if (typeof callback === 'function') {
+              callback({ sent, total, file });
+            }
+          }
+        );
+      }
+
+      if (!undefinedOrNull(job) && job !== _job) {
+        job.flush();
+      }
+
+      if (downloadedFile !== 0) {
+        return Promise.resolve({
+          data: null,
+          error: this.__isAborted(abortToken)
+            ? this.ERR.TRANSFER_ABORTED
+            : this.ERR.DOWNLOAD_FILE_FAILED
+        });
+      }
+
+      return Promise.resolve({
+        data: downloadedFile,
+        error: null
+      });
+    } catch (e) {
+      console.error(`MTP -> downloadFile`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Download File In Background
+   * Runs on the device's scheduler as a bulk transfer which yields to
+   * listings and other interactive requests between two chunks.
+   * @param destinationFilePath: {string}
+   * @param file: {object}
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param weight: {int} share of the bulk bandwidth, in chunks per turn
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  downloadFileInBackground({
+    destinationFilePath,
+    file,
+    callback,
+    job: _job = null,
+    abortToken = null,
+    weight = 1
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    let job;
+
+    try {
+      job =
+        this.__transferJob({ job: _job, abortToken }) ||
+        this.createTransferJob();
+    } catch (e) {
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+
+    if (typeof callback === 'function') {
+      job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+        callback({ sent, total, jobSent, jobTotal, file });
+      });
+    }
+
+    return new Promise(resolve => {
+      this.mtpNativeModule.Schedule_Get_File_To_File(
+        this.device,
+        file.id,
+        destinationFilePath,
+        job,
+        weight,
+        error => {
+          if (job !== _job) {
+            job.flush();
+          }
+
+          if (error !== 0) {
+            return resolve({
+              data: null,
+              error: this.__isAborted(abortToken)
+                ? this.ERR.TRANSFER_ABORTED
+                : this.ERR.DOWNLOAD_FILE_FAILED
+            });
+          }
+
+          return resolve({
+            data: error,
+            error: null
+          });
+        }
+      );
+    });
+  }
+
+  /**
+   * Download File Tree
+   * @param rootNode: {boolean}
+   * @param nodes: {array}
+   * @param destinationFilePath: {string}
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param journal: {object} (optional; see openTransferJournal)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  async downloadFileTree({
+    rootNode = false,
+    nodes,
+    destinationFilePath,
+    callback,
+    job = null,
+    abortToken = null,
+    journal = null
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      if (rootNode && nodes.length < 1) {
+        return Promise.resolve({
+          data: null,
+          error: this.ERR.NO_FILES_COPIED
+        });
+      }
+
+      for (let i = 0; i < nodes.length; i += 1) {
+        const item = nodes[i];
+        const localFilePath = path.join(destinationFilePath, item.name);
+
+        if (this.__isAborted(abortToken)) {
+          return Promise.resolve({
+            data: null,
+            error: this.ERR.TRANSFER_ABORTED
+          });
+        }
+
+        if (item.isFolder) {
+          const { error: promisifiedMkdirError } = await promisifiedMkdir({
+            newFolderPath: localFilePath
+          });
+
+          if (promisifiedMkdirError) {
+            return Promise.resolve({
+              data: null,
+              error: promisifiedMkdirError
+            });
+          }
+
+          const { error: downloadFileTreeError } = await this.downloadFileTree({
+            nodes: item.children,
+            destinationFilePath: localFilePath,
+            callback,
+            job,
+            abortToken,
+            journal
+          });
+
+          if (downloadFileTreeError) {
+            return Promise.resolve({
+              data: null,
+              error: downloadFileTreeError
+            });
+          }
+
+          continue;
+        }
+
+        const journalKey = `download:${item.id}:${localFilePath}`;
+
+        if (!undefinedOrNull(journal)) {
+          if (
+            journal.isCompleted(journalKey) &&
+            fs.existsSync(localFilePath)
+          ) {
+            continue;
+          }
+
+          journal.plan(journalKey, item.size);
+        }
+
+        const { error: downloadedFileError } = await this.downloadFile({
+          destinationFilePath: localFilePath,
+          file: item,
+          callback: this.__journalCallback({ journal, journalKey, callback }),
+          job,
+          abortToken
+        });
+
+        if (downloadedFileError) {
+          return Promise.resolve({
+            data: null,
+            error: downloadedFileError
+          });
+        }
+
+        if (!undefinedOrNull(journal)) {
+          journal.complete(journalKey);
+        }
+      }
+
+      if (rootNode && !undefinedOrNull(journal)) {
+        journal.sync();
+      }
+
+      return Promise.resolve({
+        data: true,
+        error: null
+      });
+    } catch (e) {
+      console.error(`MTP -> downloadFileTree`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Download File Tree Batched
+   * Downloads the whole tree as a single background task. Local folders and
+   * files are written by a pool of writer threads while the next file is
+   * read from the device.
+   * @param nodes: {array}
+   * @param destinationFilePath: {string}
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param writerThreads: {int} local writer threads (optional)
+   * @param fsync: {boolean} sync every file before it is reported done
+   * @param weight: {int} share of the bulk bandwidth (optional)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  downloadFileTreeBatched({
+    nodes,
+    destinationFilePath,
+    callback,
+    job: _job = null,
+    abortToken = null,
+    writerThreads = 0,
+    fsync = false,
+    weight = 1
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      const job =
+        this.__transferJob({ job: _job, abortToken }) ||
+        this.createTransferJob();
+
+      if (typeof callback === 'function') {
+        job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+          callback({ sent, total, jobSent, jobTotal });
+        });
+      }
+
+      return new Promise(resolve => {
+        this.mtpNativeModule.Schedule_Download_Tree(
+          this.device,
+          flattenDeviceTree(this.mtpNativeModule, nodes, destinationFilePath),
+          job,
+          writerThreads,
+          fsync,
+          weight,
+          (error, downloaded) => {
+            if (error !== 0) {
+              return resolve({
+                data: null,
+                error: this.__isAborted(abortToken)
+                  ? this.ERR.TRANSFER_ABORTED
+                  : this.ERR.DOWNLOAD_FILE_FAILED
+              });
+            }
+
+            return resolve({
+              data: { downloaded },
+              error: null
+            });
+          }
+        );
+      });
+    } catch (e) {
+      console.error(`MTP -> downloadFileTreeBatched`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Read File Range
+   * Reads `length` bytes at `offset` of a device file. With a cache, cached
+   * objects are read from disk; other reads go through an in-memory block
+   * cache which reads ahead when a file is read sequentially.
+   * @param fileId: {int}
+   * @param offset: {int}
+   * @param length: {int}
+   * @param cache: {object} (optional; see openDownloadCache)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  readFileRange({ fileId, offset = 0, length, cache = null }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      const buffer = Buffer.alloc(length);
+      // eslint-disable-next-line new-cap
+      const _cache = cache || new this.mtpNativeModule.download_cache_t();
+      const read = this.mtpNativeModule.Read_File_Range(
+        this.device,
+        fileId,
+        offset,
+        buffer,
+        _cache
+      );
+
+      if (read < 0) {
+        return Promise.resolve({
+          data: null,
+          error: this.ERR.READ_RANGE_FAILED
+        });
+      }
+
+      return Promise.resolve({
+        data: buffer.slice(0, read),
+        error: null
+      });
+    } catch (e) {
+      console.error(`MTP -> readFileRange`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Get Thumbnails
+   * Fetches the thumbnails of many files into a download cache, in the
+   * order given, so pass the visible files first. Abort the token and call
+   * again when the viewport moves; thumbnails fetched so far stay cached.
+   * JPEG files without a device thumbnail get the one from their EXIF
+   * header.
+   * @param fileIds: {array}
+   * @param cache: {object} see openDownloadCache
+   * @param onThumbnail: {fn} called with {fileId, path, source} per thumbnail, path is null if there is none
+   * @param priority: {int} MTP_FLAGS.SCHEDULER_PRIORITY_* (optional)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  getThumbnails({
+    fileIds,
+    cache,
+    onThumbnail = null,
+    priority = MTP_FLAGS.SCHEDULER_PRIORITY_NORMAL,
+    abortToken = null
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      return new Promise(resolve => {
+        this.mtpNativeModule.Schedule_Get_Thumbnails(
+          this.device,
+          fileIds,
+          priority,
+          cache,
+          undefinedOrNull(abortToken) ? this.createAbortToken() : abortToken,
+          (fileId, error, path, source) => {
+            if (typeof onThumbnail === 'function') {
+              onThumbnail({
+                fileId,
+                path: error === 0 ? path : null,
+                source
+              });
+            }
+          },
+          (error, fetched) => {
+            if (error !== 0) {
+              return resolve({
+                data: null,
+                error: this.__isAborted(abortToken)
+                  ? this.ERR.TRANSFER_ABORTED
+                  : this.ERR.THUMBNAILS_FAILED
+              });
+            }
+
+            return resolve({
+              data: { fetched },
+              error: null
+            });
+          }
+        );
+      });
+    } catch (e) {
+      console.error(`MTP -> getThumbnails`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Set Read Cache Capacity
+   * Caps the memory used by the block cache behind readFileRange.
+   * @param capacity: {int} bytes, 0 for the default
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  setReadCacheCapacity({ capacity = 0 }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      this.mtpNativeModule.Set_Read_Cache_Capacity(this.device, capacity);
+
+      return Promise.resolve({
+        data: true,
+        error: null
+      });
+    } catch (e) {
+      console.error(`MTP -> setReadCacheCapacity`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Apply Device Event
+   * Applies an event of the device (see EVENT) to its object cache, so a
+   * device opened with `cached` follows changes without reloading all its
+   * objects. `data` is false when the cache had to be dropped instead; the
+   * next listing then reloads it. That is always the case unless the addon
+   * is built with mtp_cache_events=1, see "Build options" in README.md
+   * @param event: {int}
+   * @param id: {int} object or storage id of the event
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  applyDeviceEvent({ event, id }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      const result = this.mtpNativeModule.Update_Object_Cache(
+        this.device,
+        event,
+        id
+      );
+
+      return Promise.resolve({
+        data: result === 0,
+        error: null
+      });
+    } catch (e) {
+      console.error(`MTP -> applyDeviceEvent`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Invalidate Read Cache
+   * Drops the cached blocks of a file which was changed outside of this
+   * session.
+   * @param fileId: {int}
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  invalidateReadCache({ fileId }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      this.mtpNativeModule.Invalidate_Read_Cache(this.device, fileId);
+
+      return Promise.resolve({
+        data: true,
+        error: null
+      });
+    } catch (e) {
+      console.error(`MTP -> invalidateReadCache`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Upload File
+   * @param filePath: {string}
+   * @param parentId: {int}
+   * @param size: {int}
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  uploadFile({
+    filePath,
+    parentId,
+    size,
+    callback,
+    job: _job = null,
+    abortToken = null
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      const job = this.__transferJob({ job: _job, abortToken });
+      // eslint-disable-next-line new-cap
+      const file = new this.mtpNativeModule.file_t();
+      file.size = size;
+      file.name = path.basename(filePath);
+      file.type = this.mtpNativeModule.Get_Filetype(file.name);
+      file.parentId = parentId;
+      file.storageId = this.storageId;
+
+      let uploadedFile;
+
+      if (!undefinedOrNull(job)) {
+        if (typeof callback === 'function') {
+          job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+            callback({ sent, total, jobSent, jobTotal, file });
+          });
+        }
+
+        uploadedFile = this.mtpNativeModule.Send_File_From_File_Job(
+          this.device,
+          filePath,
+          file,
+          job
+        );
+      } else {
+        uploadedFile = this.mtpNativeModule.Send_File_From_File(
+          this.device,
+          filePath,
+          file,
+          (sent, total) => {
+            if (typeof callback === 'function') {
+              callback({ sent, total, file });
+            }
+          }
+        );
+      }
+
+      if (!undefinedOrNull(job) && job !== _job) {
+        job.flush();
+      }
+
+      if (uploadedFile !== 0) {
+        return Promise.resolve({
+          data: null,
+          error: this.__isAborted(abortToken)
+            ? this.ERR.TRANSFER_ABORTED
+            : this.ERR.UPLOAD_FILE_FAILED
+        });
+      }
+
+      return Promise.resolve({
+        data: uploadedFile,
+        error: null
+      });
+    } catch (e) {
+      console.error(`MTP -> uploadFile`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Upload File In Background
+   * Runs on the device's scheduler as a bulk transfer which yields to
+   * listings and other interactive requests between two chunks.
+   * @param filePath: {string}
+   * @param parentId: {int}
+   * @param size: {int}
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param weight: {int} share of the bulk bandwidth, in chunks per turn
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  uploadFileInBackground({
+    filePath,
+    parentId,
+    size,
+    callback,
+    job: _job = null,
+    abortToken = null,
+    weight = 1
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    let job;
+
+    try {
+      job =
+        this.__transferJob({ job: _job, abortToken }) ||
+        this.createTransferJob();
+    } catch (e) {
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+    // eslint-disable-next-line new-cap
+    const file = new this.mtpNativeModule.file_t();
+    file.size = size;
+    file.name = path.basename(filePath);
+    file.type = this.mtpNativeModule.Get_Filetype(file.name);
+    file.parentId = parentId;
+    file.storageId = this.storageId;
+
+    if (typeof callback === 'function') {
+      job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+        callback({ sent, total, jobSent, jobTotal, file });
+      });
+    }
+
+    return new Promise(resolve => {
+      this.mtpNativeModule.Schedule_Send_File_From_File(
+        this.device,
+        filePath,
+        file,
+        job,
+        weight,
+        (error, uploadedFile) => {
+          if (job !== _job) {
+            job.flush();
+          }
+
+          if (error !== 0) {
+            return resolve({
+              data: null,
+              error: this.__isAborted(abortToken)
+                ? this.ERR.TRANSFER_ABORTED
+                : this.ERR.UPLOAD_FILE_FAILED
+            });
+          }
+
+          return resolve({
+            data: uploadedFile.id,
+            error: null
+          });
+        }
+      );
+    });
+  }
+
+  /**
+   * Upload File Tree Batched
+   * Uploads the whole tree as a single background task. Each destination
+   * folder is listed once and name conflicts are resolved in memory.
+   * @param nodes: {array}
+   * @param items: {array} flattened tree from scanLocalFileTree (alternative to nodes)
+   * @param folderPath:{string}
+   * @param parentId: {int} (alternative to folderPath)
+   * @param conflictPolicy: {int} MTP_FLAGS.CONFLICT_SKIP|CONFLICT_OVERWRITE|CONFLICT_RENAME
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param weight: {int} share of the bulk bandwidth (optional)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  async uploadFileTreeBatched({
+    nodes = null,
+    items = null,
+    folderPath = null,
+    parentId = null,
+    conflictPolicy = MTP_FLAGS.CONFLICT_OVERWRITE,
+    callback,
+    job: _job = null,
+    abortToken = null,
+    weight = 1
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      let _parentId = parentId;
+
+      if (!undefinedOrNull(folderPath)) {
+        const {
+          error: resolvePathError,
+          data: resolvePathData
+        } = await this.resolvePath({ filePath: path.resolve(folderPath) });
+
+        if (resolvePathError) {
+          return Promise.resolve({
+            data: null,
+            error: resolvePathError
+          });
+        }
+
+        _parentId = resolvePathData.id;
+      }
+
+      const job =
+        this.__transferJob({ job: _job, abortToken }) ||
+        this.createTransferJob();
+
+      if (typeof callback === 'function') {
+        job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+          callback({ sent, total, jobSent, jobTotal });
+        });
+      }
+
+      return new Promise(resolve => {
+        this.mtpNativeModule.Schedule_Upload_Tree(
+          this.device,
+          undefinedOrNull(items)
+            ? flattenFileTree(this.mtpNativeModule, nodes)
+            : items,
+          this.storageId,
+          _parentId,
+          conflictPolicy,
+          job,
+          weight,
+          (error, uploaded, skipped) => {
+            if (error !== 0) {
+              return resolve({
+                data: null,
+                error: this.__isAborted(abortToken)
+                  ? this.ERR.TRANSFER_ABORTED
+                  : this.ERR.UPLOAD_FILE_FAILED
+              });
+            }
+
+            return resolve({
+              data: { uploaded, skipped },
+              error: null
+            });
+          }
+        );
+      });
+    } catch (e) {
+      console.error(`MTP -> uploadFileTreeBatched`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Upload Small Files
+   * Sends many small local files into one device folder as a single
+   * background task, amortizing the per-object overhead of uploadFile.
+   * @param filePaths: {array} local file paths
+   * @param parentId: {int}
+   * @param skipMetadata: {boolean} do not read the new objects back
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param weight: {int} share of the bulk bandwidth (optional)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  uploadSmallFiles({
+    filePaths,
+    parentId,
+    skipMetadata = true,
+    callback,
+    job: _job = null,
+    abortToken = null,
+    weight = 1
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      const job =
+        this.__transferJob({ job: _job, abortToken }) ||
+        this.createTransferJob();
+
+      if (typeof callback === 'function') {
+        job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+          callback({ sent, total, jobSent, jobTotal });
+        });
+      }
+
+      const items = filePaths.map(filePath => {
+        // eslint-disable-next-line new-cap
+        const item = new this.mtpNativeModule.tree_item_t();
+        item.name = path.basename(filePath);
+        item.path = filePath;
+
+        return item;
+      });
+
+      return new Promise(resolve => {
+        this.mtpNativeModule.Schedule_Upload_Small_Files(
+          this.device,
+          items,
+          this.storageId,
+          parentId,
+          skipMetadata,
+          job,
+          weight,
+          (error, sent, roundTrips, baselineRoundTrips) => {
+            if (error !== 0) {
+              return resolve({
+                data: null,
+                error: this.__isAborted(abortToken)
+                  ? this.ERR.TRANSFER_ABORTED
+                  : this.ERR.UPLOAD_FILE_FAILED
+              });
+            }
+
+            // round trips are only measured by a libmtp with batch support
+            return resolve({
+              data: {
+                sent,
+                roundTrips,
+                baselineRoundTrips,
+                roundTripsSavedPerFile:
+                  sent > 0 && baselineRoundTrips > 0
+                    ? (baselineRoundTrips - roundTrips) / sent
+                    : null
+              },
+              error: null
+            });
+          }
+        );
+      });
+    } catch (e) {
+      console.error(`MTP -> uploadSmallFiles`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Sync File Tree
+   * Compares a local folder with a device folder and brings them in sync as
+   * a single background task. With dryRun the plan is only computed.
+   * @param localPath: {string}
+   * @param parentId: {int} device folder
+   * @param mode: {int} MTP_FLAGS.SYNC_MODE_DOWNLOAD, SYNC_MODE_UPLOAD or SYNC_MODE_TWO_WAY
+   * @param deleteExtraneous: {boolean} delete files missing on the source side (mirror modes only)
+   * @param compareHash: {boolean} compare the content of files whose times differ
+   * @param dryRun: {boolean}
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param weight: {int} share of the bulk bandwidth (optional)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  syncFileTree({
+    localPath,
+    parentId,
+    mode = MTP_FLAGS.SYNC_MODE_DOWNLOAD,
+    deleteExtraneous = false,
+    compareHash = false,
+    dryRun = false,
+    callback,
+    job: _job = null,
+    abortToken = null,
+    weight = 1
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      const job =
+        this.__transferJob({ job: _job, abortToken }) ||
+        this.createTransferJob();
+
+      if (typeof callback === 'function') {
+        job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+          callback({ sent, total, jobSent, jobTotal });
+        });
+      }
+
+      const flags =
+        (deleteExtraneous ? MTP_FLAGS.SYNC_DELETE_EXTRANEOUS : 0) |
+        (compareHash ? MTP_FLAGS.SYNC_COMPARE_HASH : 0) |
+        (dryRun ? MTP_FLAGS.SYNC_DRY_RUN : 0);
+
+      return new Promise(resolve => {
+        this.mtpNativeModule.Schedule_Sync_Tree(
+          this.device,
+          localPath,
+          this.storageId,
+          parentId,
+          mode,
+          flags,
+          job,
+          weight,
+          (error, plan, downloadBytes, uploadBytes) => {
+            if (error !== 0) {
+              return resolve({
+                data: null,
+                error: this.__isAborted(abortToken)
+                  ? this.ERR.TRANSFER_ABORTED
+                  : this.ERR.SYNC_FAILED
+              });
+            }
+
+            return resolve({
+              data: {
+                plan: plan.map(action => ({
+                  kind: action.kind,
+                  path: action.path,
+                  from: action.from,
+                  id: action.id,
+                  size: action.size,
+                  isFolder: action.isFolder
+                })),
+                downloadBytes,
+                uploadBytes
+              },
+              error: null
+            });
+          }
+        );
+      });
+    } catch (e) {
+      console.error(`MTP -> syncFileTree`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Export Archive
+   * Streams a device folder and everything below it into a tar or zip
+   * (stored) archive, without temporary files. Pass exactly one of
+   * outputPath, outputFd or outputStream; a stream is not ended.
+   * @param parentId: {int} device folder
+   * @param format: {int} MTP_FLAGS.ARCHIVE_TAR or ARCHIVE_ZIP
+   * @param rootName: {string} folder the entries are put in (optional)
+   * @param outputPath: {string}
+   * @param outputFd: {int}
+   * @param outputStream: {object} a writable stream
+   * @param chunkSize: {int} bytes handed to the stream at once (optional)
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param weight: {int} share of the bulk bandwidth (optional)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  exportArchive({
+    parentId,
+    format = MTP_FLAGS.ARCHIVE_TAR,
+    rootName = '',
+    outputPath = null,
+    outputFd = null,
+    outputStream = null,
+    chunkSize = 1024 * 1024,
+    callback,
+    job: _job = null,
+    abortToken = null,
+    weight = 1
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      const job =
+        this.__transferJob({ job: _job, abortToken }) ||
+        this.createTransferJob();
+
+      if (typeof callback === 'function') {
+        job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+          callback({ sent, total, jobSent, jobTotal });
+        });
+      }
+
+      // eslint-disable-next-line new-cap
+      const stream = new this.mtpNativeModule.archive_stream_t();
+      const fd = !undefinedOrNull(outputPath)
+        ? fs.openSync(outputPath, 'w')
+        : outputFd;
+
+      if (undefinedOrNull(fd)) {
+        stream.__buffer = Buffer.alloc(chunkSize);
+        stream.attach(stream.__buffer);
+      }
+
+      return new Promise(resolve => {
+        this.mtpNativeModule.Schedule_Export_Archive(
+          this.device,
+          this.storageId,
+          parentId,
+          rootName,
+          format,
+          undefinedOrNull(fd) ? -1 : fd,
+          stream,
+          job,
+          weight,
+          length => {
+            const more = outputStream.write(
+              Buffer.from(stream.__buffer.subarray(0, length))
+            );
+
+            if (more) {
+              stream.ack();
+            } else {
+              outputStream.once('drain', () => stream.ack());
+            }
+          },
+          (error, files, bytes) => {
+            if (!undefinedOrNull(outputPath)) {
+              fs.closeSync(fd);
+            }
+
+            if (error !== 0) {
+              return resolve({
+                data: null,
+                error: this.__isAborted(abortToken)
+                  ? this.ERR.TRANSFER_ABORTED
+                  : this.ERR.EXPORT_ARCHIVE_FAILED
+              });
+            }
+
+            return resolve({
+              data: { files, bytes },
+              error: null
+            });
+          }
+        );
+      });
+    } catch (e) {
+      console.error(`MTP -> exportArchive`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Import Archive
+   * Extracts a tar or zip (stored or deflated) archive into a device
+   * folder, without temporary files. Pass exactly one of inputPath,
+   * inputFd or inputStream. Zip archives from a stream need the entry sizes
+   * in their local headers; pass others as a file.
+   * @param parentId: {int} device folder
+   * @param format: {int} MTP_FLAGS.ARCHIVE_TAR or ARCHIVE_ZIP
+   * @param inputPath: {string}
+   * @param inputFd: {int}
+   * @param inputStream: {object} a readable stream
+   * @param conflictPolicy: {int} MTP_FLAGS.CONFLICT_SKIP, CONFLICT_OVERWRITE or CONFLICT_RENAME
+   * @param chunkSize: {int} bytes taken from the stream at once (optional)
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param weight: {int} share of the bulk bandwidth (optional)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  importArchive({
+    parentId,
+    format = MTP_FLAGS.ARCHIVE_TAR,
+    inputPath = null,
+    inputFd = null,
+    inputStream = null,
+    conflictPolicy = MTP_FLAGS.CONFLICT_OVERWRITE,
+    chunkSize = 1024 * 1024,
+    callback,
+    job: _job = null,
+    abortToken = null,
+    weight = 1
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    try {
+      const job =
+        this.__transferJob({ job: _job, abortToken }) ||
+        this.createTransferJob();
+
+      if (typeof callback === 'function') {
+        job.setProgressCallback((sent, total, jobSent, jobTotal) => {
+          callback({ sent, total, jobSent, jobTotal });
+        });
+      }
+
+      // eslint-disable-next-line new-cap
+      const stream = new this.mtpNativeModule.archive_stream_t();
+      const fd = !undefinedOrNull(inputPath)
+        ? fs.openSync(inputPath, 'r')
+        : inputFd;
+      let leftover = null;
+      let ended = false;
+      let waiting = false;
+
+      // fills the chunk once the stream has data, or reports its end
+      const supply = () => {
+        const data = leftover || (ended ? null : inputStream.read());
+
+        waiting = false;
+
+        if (data === null) {
+          if (ended) {
+            stream.supply(0);
+          } else {
+            waiting = true;
+            inputStream.once('readable', supply);
+          }
+          return;
+        }
+
+        const length = data.copy(stream.__buffer, 0);
+
+        leftover = length < data.length ? data.subarray(length) : null;
+        stream.supply(length);
+      };
+
+      if (undefinedOrNull(fd)) {
+        stream.__buffer = Buffer.alloc(chunkSize);
+        stream.attach(stream.__buffer);
+        inputStream.once('end', () => {
+          ended = true;
+
+          if (waiting) {
+            inputStream.removeListener('readable', supply);
+            supply();
+          }
+        });
+      }
+
+      return new Promise(resolve => {
+        this.mtpNativeModule.Schedule_Import_Archive(
+          this.device,
+          this.storageId,
+          parentId,
+          format,
+          undefinedOrNull(fd) ? -1 : fd,
+          stream,
+          conflictPolicy,
+          job,
+          weight,
+          supply,
+          (error, imported, skipped) => {
+            if (!undefinedOrNull(inputPath)) {
+              fs.closeSync(fd);
+            }
+
+            if (error !== 0) {
+              return resolve({
+                data: null,
+                error: this.__isAborted(abortToken)
+                  ? this.ERR.TRANSFER_ABORTED
+                  : this.ERR.IMPORT_ARCHIVE_FAILED
+              });
+            }
+
+            return resolve({
+              data: { imported, skipped },
+              error: null
+            });
+          }
+        );
+      });
+    } catch (e) {
+      console.error(`MTP -> importArchive`, e);
+
+      return Promise.resolve({
+        data: null,
+        error: e
+      });
+    }
+  }
+
+  /**
+   * Upload File Tree
+   * @param nodes: {array}
+   * @param folderPath:{string}
+   * @param parentId: {int} (alternative to folderPath)
+   * @param callback: {fn}
+   * @param job: {object} (optional; see createTransferJob)
+   * @param abortToken: {object} (optional; see createAbortToken)
+   * @param journal: {object} (optional; see openTransferJournal)
+   * @returns {Promise<{data: *, error: *}>}
+   */
+  async uploadFileTree({
+    nodes,
+    folderPath = null,
+    callback,
+    parentId = null,
+    job = null,
+    abortToken = null,
+    journal = null
+  }) {
+    if (!this.device) return this.throwMtpError();
+
+    let _parentId = parentId;
 
     try {
       if (!undefinedOrNull(folderPath)) {
@@ -1170,6 +2712,13 @@ class MTP {
       for (let i = 0; i < nodes.length; i += 1) {
         const item = nodes[i];
 
+        if (this.__isAborted(abortToken)) {
+          return Promise.resolve({
+            data: null,
+            error: this.ERR.TRANSFER_ABORTED
+          });
+        }
+
         if (item.isFolder) {
           const {
             error: createFolderError,
@@ -1189,7 +2738,10 @@ class MTP {
           const { error: uploadFileTreeError } = await this.uploadFileTree({
             nodes: item.children,
             parentId: createFolderData,
-            callback
+            callback,
+            job,
+            abortToken,
+            journal
           });
 
           if (uploadFileTreeError) {
@@ -1202,6 +2754,16 @@ class MTP {
           continue;
         }
 
+        const journalKey = `upload:${_parentId}:${item.name}:${item.path}`;
+
+        if (!undefinedOrNull(journal)) {
+          if (journal.isCompleted(journalKey)) {
+            continue;
+          }
+
+          journal.plan(journalKey, item.size);
+        }
+
         const {
           error: fileExistsError,
           data: fileExistsData
@@ -1234,7 +2796,9 @@ class MTP {
           filePath: item.path,
           parentId: _parentId,
           size: item.size,
-          callback
+          callback: this.__journalCallback({ journal, journalKey, callback }),
+          job,
+          abortToken
         });
 
         if (uploadFileError) {
@@ -1243,6 +2807,14 @@ class MTP {
             error: uploadFileError
           });
         }
+
+        if (!undefinedOrNull(journal)) {
+          journal.complete(journalKey);
+        }
+      }
+
+      if (!undefinedOrNull(journal)) {
+        journal.sync();
       }
 
       return Promise.resolve({
@@ -1261,3 +2833,5 @@ class MTP {
 }
 
 module.exports.MTP = MTP;
+module.exports.createProgressCounter = createProgressCounter;
+module.exports.createAbortSlot = createAbortSlot;
@@ -49,7 +49,44 @@ const FLAGS = {
   FILETYPE_JPX: 41,
   FILETYPE_ALBUM: 42,
   FILETYPE_PLAYLIST: 43,
-  FILETYPE_UNKNOWN: 44
+  FILETYPE_UNKNOWN: 44,
+
+  SCHEDULER_PRIORITY_INTERACTIVE: 0,
+  SCHEDULER_PRIORITY_NORMAL: 1,
+  SCHEDULER_PRIORITY_BULK: 2,
+
+  CONFLICT_SKIP: 0,
+  CONFLICT_OVERWRITE: 1,
+  CONFLICT_RENAME: 2,
+
+  SYNC_MODE_DOWNLOAD: 0,
+  SYNC_MODE_UPLOAD: 1,
+  SYNC_MODE_TWO_WAY: 2,
+
+  SYNC_DELETE_EXTRANEOUS: 1,
+  SYNC_COMPARE_HASH: 2,
+  SYNC_DRY_RUN: 4,
+
+  SYNC_ACTION_MKDIR_LOCAL: 0,
+  SYNC_ACTION_MKDIR_DEVICE: 1,
+  SYNC_ACTION_RENAME_LOCAL: 2,
+  SYNC_ACTION_RENAME_DEVICE: 3,
+  SYNC_ACTION_DOWNLOAD: 4,
+  SYNC_ACTION_UPLOAD: 5,
+  SYNC_ACTION_DELETE_LOCAL: 6,
+  SYNC_ACTION_DELETE_DEVICE: 7,
+  SYNC_ACTION_CONFLICT: 8,
+
+  CHECKSUM_NONE: 0,
+  CHECKSUM_XXH64: 1,
+  CHECKSUM_SHA256: 2,
+
+  THUMBNAIL_CACHED: 0,
+  THUMBNAIL_DEVICE: 1,
+  THUMBNAIL_EXIF: 2,
+
+  ARCHIVE_TAR: 0,
+  ARCHIVE_ZIP: 1
 };
 
 module.exports.FLAGS = FLAGS;
@@ -1,4 +1,27 @@
-const nbind = require('nbind');
 const path = require('path');
-const lib = nbind.init(path.resolve(__dirname, '..', 'build/Release')).lib;
-const mtpHelper = (exports = module.exports = lib);
+const lib = require(path.resolve(__dirname, '..', 'build/Release/mtp.node'));
+const { unpackFiles, unpackTreeItems } = require('./unpack');
+
+const mtpHelper = (exports = module.exports = Object.assign({}, lib, {
+  Get_Files_And_Folders: (...args) =>
+    unpackFiles(lib.Get_Files_And_Folders(...args)),
+
+  Get_Files_And_Folders_Abortable: (...args) =>
+    unpackFiles(lib.Get_Files_And_Folders_Abortable(...args)),
+
+  Schedule_Get_Files_And_Folders: (...args) => {
+    const cb = args.pop();
+
+    return lib.Schedule_Get_Files_And_Folders(...args, (error, files) =>
+      cb(error, unpackFiles(files))
+    );
+  },
+
+  Scan_Local_Tree: (...args) => {
+    const cb = args.pop();
+
+    return lib.Scan_Local_Tree(...args, (error, items) =>
+      cb(error, unpackTreeItems(items))
+    );
+  }
+}));
@@ -0,0 +1,48 @@
+/**
+ * Listings and scans come from the addon packed into typed array columns,
+ * with the names joined by NUL characters; these turn them back into plain
+ * objects with the properties of file_t and tree_item_t.
+ */
+const unpackFiles = packed => {
+  if (!packed) return packed;
+
+  const names = packed.names.split('\0');
+  const files = new Array(packed.length);
+
+  for (let i = 0; i < packed.length; i += 1) {
+    files[i] = {
+      name: names[i],
+      id: packed.ids[i],
+      type: packed.types[i],
+      size: packed.sizes[i],
+      parentId: packed.parentIds[i],
+      storageId: packed.storageIds[i],
+      modificationDate: packed.modificationDates[i]
+    };
+  }
+
+  return files;
+};
+
+const unpackTreeItems = packed => {
+  if (!packed) return packed;
+
+  const names = packed.names.split('\0');
+  const paths = packed.paths.split('\0');
+  const items = new Array(packed.length);
+
+  for (let i = 0; i < packed.length; i += 1) {
+    items[i] = {
+      name: names[i],
+      path: paths[i],
+      parent: packed.parents[i],
+      isFolder: packed.isFolder[i] === 1,
+      size: packed.sizes[i],
+      id: packed.ids[i]
+    };
+  }
+
+  return items;
+};
+
+module.exports = { unpackFiles, unpackTreeItems };
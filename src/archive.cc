@@ -0,0 +1,781 @@
+#include "archive.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dispatcher.h"
+#include "executor.h"
+#include "fileio.h"
+#include "ratelimit.h"
+#include "readcache.h"
+#include "exports.h"
+
+static const size_t TAR_BLOCK = 512;
+static const uint64_t TAR_OCTAL_LIMIT = 077777777777ULL;
+
+static const uint32_t ZIP_LIMIT = 0xFFFFFFFF;
+static const uint16_t ZIP_ENTRIES_LIMIT = 0xFFFF;
+
+archive_stream_state_t::archive_stream_state_t() : data(nullptr), capacity(0), length(0), position(0), busy(false),
+                                                   ended(false) {}
+
+archive_stream_t::archive_stream_t() : m_state(std::make_shared<archive_stream_state_t>()) {}
+
+archive_stream_t::archive_stream_t(const archive_stream_t &stream) : m_state(stream.m_state) {}
+
+bool archive_stream_t::attach(js_buffer_ref_t buf) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+
+    m_state->buffer = buf;
+    m_state->data = buf.data();
+    m_state->capacity = buf.length();
+    m_state->length = 0;
+    m_state->position = 0;
+    m_state->busy = false;
+    m_state->ended = false;
+
+    return m_state->capacity > 0;
+}
+
+void archive_stream_t::ack() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->busy = false;
+}
+
+void archive_stream_t::supply(const uint32_t length) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+
+    m_state->length = length < m_state->capacity ? length : m_state->capacity;
+    m_state->position = 0;
+    m_state->busy = false;
+    m_state->ended = 0 == length;
+}
+
+bool archive_stream_t::isAttached() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return nullptr != m_state->data;
+}
+
+size_t archive_stream_t::put(const unsigned char *data, size_t length) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+
+    if (m_state->busy || nullptr == m_state->data) {
+        return 0;
+    }
+
+    size_t count = length < m_state->capacity ? length : m_state->capacity;
+
+    memcpy(m_state->data, data, count);
+    m_state->length = count;
+    m_state->busy = true;
+
+    return count;
+}
+
+size_t archive_stream_t::take(unsigned char *data, size_t length, bool &request) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+
+    request = false;
+
+    if (m_state->busy || nullptr == m_state->data) {
+        return 0;
+    }
+
+    if (m_state->position < m_state->length) {
+        size_t left = m_state->length - m_state->position;
+        size_t count = length < left ? length : left;
+
+        memcpy(data, m_state->data + m_state->position, count);
+        m_state->position += count;
+
+        return count;
+    }
+
+    if (!m_state->ended) {
+        m_state->busy = true;
+        request = true;
+    }
+
+    return 0;
+}
+
+bool archive_stream_t::isEnded() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->ended && m_state->position >= m_state->length;
+}
+
+archive_output_t::archive_output_t(int fd, archive_stream_t stream, std::shared_ptr <js_function_t> chunkCb) :
+        m_fd(fd), m_stream(stream), m_chunkCb(chunkCb), m_sent(0), m_offset(0) {}
+
+bool archive_output_t::write(const unsigned char *data, size_t length) {
+    m_offset += length;
+
+    if (m_fd >= 0) {
+        return WriteFully(m_fd, data, length);
+    }
+
+    m_staged.insert(m_staged.end(), data, data + length);
+
+    return true;
+}
+
+bool archive_output_t::flush() {
+    if (m_sent < m_staged.size()) {
+        size_t count = m_stream.put(m_staged.data() + m_sent, m_staged.size() - m_sent);
+
+        if (0 == count) {
+            return false;
+        }
+
+        m_sent += count;
+
+        std::shared_ptr <js_function_t> chunkCb = m_chunkCb;
+        PostJsCallback(chunkCb, [chunkCb, count] { (*chunkCb)((uint32_t) count); });
+    }
+
+    if (m_sent < m_staged.size()) {
+        return false;
+    }
+
+    m_staged.clear();
+    m_sent = 0;
+
+    return true;
+}
+
+static const uint32_t *Crc32Table() {
+    static uint32_t table[256];
+    static std::once_flag once;
+
+    std::call_once(once, [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    });
+
+    return table;
+}
+
+uint32_t Crc32(uint32_t crc, const unsigned char *data, size_t length) {
+    const uint32_t *table = Crc32Table();
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static void Put16(std::vector <unsigned char> &out, uint32_t value) {
+    out.push_back((unsigned char) value);
+    out.push_back((unsigned char) (value >> 8));
+}
+
+static void Put32(std::vector <unsigned char> &out, uint32_t value) {
+    Put16(out, value & 0xFFFF);
+    Put16(out, value >> 16);
+}
+
+static void Put64(std::vector <unsigned char> &out, uint64_t value) {
+    Put32(out, (uint32_t) value);
+    Put32(out, (uint32_t) (value >> 32));
+}
+
+static void PutOctal(char *field, size_t width, uint64_t value) {
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i > 0; i--) {
+        field[i - 1] = (char) ('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+class tar_writer_t : public archive_writer_t {
+public:
+    tar_writer_t(archive_output_t &output) : m_output(output), m_size(0), m_written(0) {}
+
+    bool beginEntry(const std::string &path, uint64_t size, time_t mtime, bool folder) override {
+        std::string name = folder ? path + "/" : path;
+        std::string prefix;
+
+        m_size = folder ? 0 : size;
+        m_written = 0;
+
+        if (name.size() > 100 && !Split(name, prefix)) {
+            // GNU long name: the name is the data of a pseudo entry
+            if (!header("././@LongLink", std::string(), name.size() + 1, 0, 'L') ||
+                !m_output.write((const unsigned char *) name.c_str(), name.size() + 1) ||
+                !pad(name.size() + 1)) {
+                return false;
+            }
+            name.resize(100);
+        }
+
+        return header(name, prefix, m_size, mtime, folder ? '5' : '0');
+    }
+
+    bool data(const unsigned char *data, size_t length) override {
+        m_written += length;
+        return m_written <= m_size && m_output.write(data, length);
+    }
+
+    bool endEntry() override {
+        return m_written == m_size && pad(m_size);
+    }
+
+    bool finish() override {
+        unsigned char zeros[TAR_BLOCK * 2] = {0};
+        return m_output.write(zeros, sizeof(zeros));
+    }
+
+private:
+    /* splits a long name into the ustar prefix and name fields */
+    static bool Split(std::string &name, std::string &prefix) {
+        for (std::string::size_type slash = name.find('/'); std::string::npos != slash;
+             slash = name.find('/', slash + 1)) {
+            if (slash > 155) {
+                break;
+            }
+            if (name.size() - slash - 1 <= 100 && slash + 1 < name.size()) {
+                prefix = name.substr(0, slash);
+                name = name.substr(slash + 1);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool header(const std::string &name, const std::string &prefix, uint64_t size, time_t mtime, char type) {
+        char block[TAR_BLOCK] = {0};
+
+        memcpy(block, name.data(), name.size() < 100 ? name.size() : 100);
+        PutOctal(block + 100, 8, '5' == type ? 0755 : 0644);
+        PutOctal(block + 108, 8, 0);
+        PutOctal(block + 116, 8, 0);
+
+        if (size <= TAR_OCTAL_LIMIT) {
+            PutOctal(block + 124, 12, size);
+        } else {
+            // base-256, as understood by GNU and BSD tar
+            block[124] = (char) 0x80;
+            for (int i = 11; i > 0; i--) {
+                block[124 + i] = (char) (size & 0xFF);
+                size >>= 8;
+            }
+        }
+
+        PutOctal(block + 136, 12, mtime > 0 ? (uint64_t) mtime : 0);
+        memset(block + 148, ' ', 8);
+        block[156] = type;
+        memcpy(block + 257, "ustar", 6);
+        memcpy(block + 263, "00", 2);
+        memcpy(block + 345, prefix.data(), prefix.size() < 155 ? prefix.size() : 155);
+
+        uint32_t sum = 0;
+        for (size_t i = 0; i < TAR_BLOCK; i++) {
+            sum += (unsigned char) block[i];
+        }
+        PutOctal(block + 148, 7, sum);
+
+        return m_output.write((const unsigned char *) block, TAR_BLOCK);
+    }
+
+    bool pad(uint64_t size) {
+        unsigned char zeros[TAR_BLOCK] = {0};
+        size_t rest = (size_t) (size % TAR_BLOCK);
+
+        return 0 == rest || m_output.write(zeros, TAR_BLOCK - rest);
+    }
+
+    archive_output_t &m_output;
+    uint64_t m_size;
+    uint64_t m_written;
+};
+
+class zip_writer_t : public archive_writer_t {
+public:
+    zip_writer_t(archive_output_t &output) : m_output(output) {}
+
+    bool beginEntry(const std::string &path, uint64_t size, time_t mtime, bool folder) override {
+        zip_entry_t entry;
+
+        entry.name = folder ? path + "/" : path;
+        entry.offset = m_output.getOffset();
+        entry.announced = folder ? 0 : size;
+        entry.size = 0;
+        entry.crc = 0;
+        entry.folder = folder;
+        entry.zip64 = !folder && size >= ZIP_LIMIT;
+        DosTime(mtime, entry.time, entry.date);
+
+        std::vector <unsigned char> header;
+
+        Put32(header, 0x04034b50);
+        Put16(header, entry.zip64 ? 45 : 20);
+        Put16(header, flags(entry));
+        Put16(header, 0);
+        Put16(header, entry.time);
+        Put16(header, entry.date);
+        Put32(header, 0);
+        // only the CRC waits for the descriptor, so a stream can be read entry by entry
+        Put32(header, entry.zip64 ? ZIP_LIMIT : (uint32_t) entry.announced);
+        Put32(header, entry.zip64 ? ZIP_LIMIT : (uint32_t) entry.announced);
+        Put16(header, (uint32_t) entry.name.size());
+        Put16(header, entry.zip64 ? 20 : 0);
+        header.insert(header.end(), entry.name.begin(), entry.name.end());
+
+        if (entry.zip64) {
+            Put16(header, 0x0001);
+            Put16(header, 16);
+            Put64(header, entry.announced);
+            Put64(header, entry.announced);
+        }
+
+        m_entries.push_back(entry);
+
+        return m_output.write(header.data(), header.size());
+    }
+
+    bool data(const unsigned char *data, size_t length) override {
+        zip_entry_t &entry = m_entries.back();
+
+        entry.crc = Crc32(entry.crc, data, length);
+        entry.size += length;
+
+        return m_output.write(data, length);
+    }
+
+    bool endEntry() override {
+        zip_entry_t &entry = m_entries.back();
+
+        if (entry.folder) {
+            return true;
+        }
+
+        // the local header announced the size, which the data has to match
+        if (entry.size != entry.announced) {
+            return false;
+        }
+
+        std::vector <unsigned char> descriptor;
+
+        Put32(descriptor, 0x08074b50);
+        Put32(descriptor, entry.crc);
+        if (entry.zip64) {
+            Put64(descriptor, entry.size);
+            Put64(descriptor, entry.size);
+        } else {
+            Put32(descriptor, (uint32_t) entry.size);
+            Put32(descriptor, (uint32_t) entry.size);
+        }
+
+        return m_output.write(descriptor.data(), descriptor.size());
+    }
+
+    bool finish() override {
+        uint64_t start = m_output.getOffset();
+
+        for (zip_entry_t &entry : m_entries) {
+            std::vector <unsigned char> header;
+            std::vector <unsigned char> extra;
+            bool large = entry.size >= ZIP_LIMIT;
+            bool far = entry.offset >= ZIP_LIMIT;
+
+            if (large) {
+                Put64(extra, entry.size);
+                Put64(extra, entry.size);
+            }
+            if (far) {
+                Put64(extra, entry.offset);
+            }
+
+            Put32(header, 0x02014b50);
+            Put16(header, 3 << 8 | 45);
+            Put16(header, large || far ? 45 : 20);
+            Put16(header, flags(entry));
+            Put16(header, 0);
+            Put16(header, entry.time);
+            Put16(header, entry.date);
+            Put32(header, entry.crc);
+            Put32(header, large ? ZIP_LIMIT : (uint32_t) entry.size);
+            Put32(header, large ? ZIP_LIMIT : (uint32_t) entry.size);
+            Put16(header, (uint32_t) entry.name.size());
+            Put16(header, extra.empty() ? 0 : (uint32_t) extra.size() + 4);
+            Put16(header, 0);
+            Put16(header, 0);
+            Put16(header, 0);
+            Put32(header, entry.folder ? (040755u << 16) | 0x10 : 0100644u << 16);
+            Put32(header, far ? ZIP_LIMIT : (uint32_t) entry.offset);
+            header.insert(header.end(), entry.name.begin(), entry.name.end());
+
+            if (!extra.empty()) {
+                Put16(header, 0x0001);
+                Put16(header, (uint32_t) extra.size());
+                header.insert(header.end(), extra.begin(), extra.end());
+            }
+
+            if (!m_output.write(header.data(), header.size())) {
+                return false;
+            }
+        }
+
+        uint64_t end = m_output.getOffset();
+        uint64_t size = end - start;
+        uint64_t count = m_entries.size();
+        bool zip64 = count >= ZIP_ENTRIES_LIMIT || start >= ZIP_LIMIT || size >= ZIP_LIMIT;
+        std::vector <unsigned char> trailer;
+
+        if (zip64) {
+            Put32(trailer, 0x06064b50);
+            Put64(trailer, 44);
+            Put16(trailer, 3 << 8 | 45);
+            Put16(trailer, 45);
+            Put32(trailer, 0);
+            Put32(trailer, 0);
+            Put64(trailer, count);
+            Put64(trailer, count);
+            Put64(trailer, size);
+            Put64(trailer, start);
+
+            Put32(trailer, 0x07064b50);
+            Put32(trailer, 0);
+            Put64(trailer, end);
+            Put32(trailer, 1);
+        }
+
+        Put32(trailer, 0x06054b50);
+        Put16(trailer, 0);
+        Put16(trailer, 0);
+        Put16(trailer, zip64 ? ZIP_ENTRIES_LIMIT : (uint32_t) count);
+        Put16(trailer, zip64 ? ZIP_ENTRIES_LIMIT : (uint32_t) count);
+        Put32(trailer, zip64 ? ZIP_LIMIT : (uint32_t) size);
+        Put32(trailer, zip64 ? ZIP_LIMIT : (uint32_t) start);
+        Put16(trailer, 0);
+
+        return m_output.write(trailer.data(), trailer.size());
+    }
+
+private:
+    struct zip_entry_t {
+        std::string name;
+        uint64_t offset;
+        uint64_t announced;
+        uint64_t size;
+        uint32_t crc;
+        uint32_t time;
+        uint32_t date;
+        bool folder;
+        bool zip64;
+    };
+
+    /* file data is followed by a descriptor; names are UTF-8 */
+    static uint32_t flags(const zip_entry_t &entry) {
+        return entry.folder ? 0x0800 : 0x0808;
+    }
+
+    static void DosTime(time_t mtime, uint32_t &time, uint32_t &date) {
+        struct tm tm;
+
+#ifdef _WIN32
+        bool valid = 0 == localtime_s(&tm, &mtime);
+#else
+        bool valid = nullptr != localtime_r(&mtime, &tm);
+#endif
+        if (!valid || tm.tm_year < 80) {
+            time = 0;
+            date = 1 << 5 | 1;
+            return;
+        }
+
+        time = (uint32_t) (tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2);
+        date = (uint32_t) ((tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday);
+    }
+
+    archive_output_t &m_output;
+    std::vector <zip_entry_t> m_entries;
+};
+
+std::unique_ptr <archive_writer_t> archive_writer_t::create(int format, archive_output_t &output) {
+    if (ARCHIVE_ZIP == format) {
+        return std::unique_ptr<archive_writer_t>(new zip_writer_t(output));
+    }
+
+    return std::unique_ptr<archive_writer_t>(new tar_writer_t(output));
+}
+
+class export_ctx_t {
+public:
+    export_ctx_t(LIBMTP_mtpdevice_t *device, transfer_job_t &job, archive_writer_t &writer, archive_output_t &output) :
+            m_device(device), m_job(job), m_writer(writer), m_output(output) {}
+
+    LIBMTP_mtpdevice_t *m_device;
+    transfer_job_t &m_job;
+    archive_writer_t &m_writer;
+    archive_output_t &m_output;
+};
+
+/**
+ * Used for devices without partial reads and for files of up to a chunk.
+ * Stream output is passed on as far as JS takes it and staged otherwise,
+ * never waited for: the device is held here, and JS may be waiting for it
+ * in a call of its own. The next steps hand the rest out.
+ */
+static uint16_t ExportDataPut(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen) {
+    export_ctx_t *ctx = (export_ctx_t *) priv;
+
+    if (ctx->m_job.isAborted() || !ThrottleTransfer(ctx->m_device, ctx->m_job, sendlen)) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    if (!ctx->m_writer.data(data, sendlen)) {
+        return LIBMTP_HANDLER_RETURN_ERROR;
+    }
+
+    ctx->m_output.flush();
+
+    *putlen = sendlen;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+struct export_item_t {
+    std::string path;
+    uint32_t id;
+    uint64_t size;
+    time_t mtime;
+    bool folder;
+};
+
+/**
+ * Walks the subtree depth first and writes each object as it is reached,
+ * one folder listing or one chunk per step. Only the listed but not yet
+ * written objects are kept in memory.
+ */
+class export_task_t : public scheduler_task_t {
+public:
+    export_task_t(uint32_t weight, uint32_t storage, uint32_t parent, const std::string &root, int format, int fd,
+                  archive_stream_t stream, transfer_job_t job, uint32_t chunkSize,
+                  std::shared_ptr <js_function_t> chunkCb, std::shared_ptr <js_function_t> cb) :
+            scheduler_task_t(PRIORITY_BULK, weight), m_storage(storage), m_job(job), m_chunkSize(chunkSize),
+            m_cb(cb), m_output(fd, stream, chunkCb), m_writer(archive_writer_t::create(format, m_output)),
+            m_started(false), m_partial(false), m_open(false), m_done(false), m_offset(0), m_files(0), m_bytes(0) {
+        export_item_t item;
+
+        item.path = root;
+        item.id = parent;
+        item.size = 0;
+        item.mtime = 0;
+        item.folder = true;
+        m_pending.push_back(item);
+    }
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_job.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        if (!m_output.flush()) {
+            defer(ARCHIVE_STREAM_POLL);
+            return false;
+        }
+
+        if (m_done) {
+            m_job.flush();
+
+            std::shared_ptr <js_function_t> cb = m_cb;
+            uint32_t files = m_files;
+            uint64_t bytes = m_bytes;
+            finish([cb, files, bytes] { (*cb)((int) LIBMTP_ERROR_NONE, files, bytes); });
+            return true;
+        }
+
+        if (!m_started) {
+            device_guard_t guard(device, getPriority());
+            m_partial = 0 != LIBMTP_Check_Capability(device, LIBMTP_DEVICECAP_GetPartialObject);
+            m_started = true;
+        }
+
+        if (m_open) {
+            return chunk(device);
+        }
+
+        if (m_pending.empty()) {
+            if (!m_writer->finish()) {
+                fail(LIBMTP_ERROR_GENERAL);
+                return true;
+            }
+
+            m_done = true;
+            return false;
+        }
+
+        export_item_t item = m_pending.back();
+        m_pending.pop_back();
+
+        return item.folder ? folder(device, item) : file(device, item);
+    }
+
+    void fail(int error) override {
+        if (m_open) {
+            m_job.endFile(false);
+            m_open = false;
+        }
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        uint32_t files = m_files;
+        uint64_t bytes = m_bytes;
+        finish([cb, error, files, bytes] { (*cb)(error, files, bytes); });
+    }
+
+private:
+    bool folder(LIBMTP_mtpdevice_t *device, const export_item_t &item) {
+        if (!item.path.empty() && (!m_writer->beginEntry(item.path, 0, item.mtime, true) || !m_writer->endEntry())) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        std::vector <file_t> files;
+
+        {
+            device_guard_t guard(device, getPriority());
+            files = Get_Files_And_Folders(mtpdevice_t(device), m_storage, item.id);
+        }
+
+        // pushed in reverse, so the objects are written in listing order
+        for (std::vector<file_t>::reverse_iterator it = files.rbegin(); it != files.rend(); ++it) {
+            export_item_t child;
+
+            child.path = item.path.empty() ? it->getName() : item.path + "/" + it->getName();
+            child.id = it->getId();
+            child.size = it->getSize();
+            child.mtime = it->getModificationDate();
+            child.folder = LIBMTP_FILETYPE_FOLDER == it->getType();
+            m_pending.push_back(child);
+        }
+
+        return false;
+    }
+
+    bool file(LIBMTP_mtpdevice_t *device, const export_item_t &item) {
+        if (!m_writer->beginEntry(item.path, item.size, item.mtime, false)) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_job.beginFile();
+        m_current = item;
+        m_offset = 0;
+        m_open = true;
+
+        if (0 == item.size || (m_partial && item.size > m_chunkSize)) {
+            return 0 == item.size ? close() : false;
+        }
+
+        export_ctx_t ctx(device, m_job, *m_writer, m_output);
+        int ret;
+
+        {
+            device_guard_t guard(device, getPriority());
+            ret = LIBMTP_Get_File_To_Handler(device, item.id, ExportDataPut, (void *) &ctx,
+                                             TransferJobProgressCallback, (const void *) &m_job);
+        }
+
+        if (0 != ret) {
+            LIBMTP_Clear_Errorstack(device);
+            fail(m_job.isAborted() ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_offset = item.size;
+        m_bytes += item.size;
+
+        return close();
+    }
+
+    bool chunk(LIBMTP_mtpdevice_t *device) {
+        unsigned char *data = nullptr;
+        unsigned int size = 0;
+        int ret;
+
+        {
+            device_guard_t guard(device, getPriority());
+            ret = GetPartialObjectSized(device, m_current.id, m_offset, m_chunkSize, m_current.size, &data, &size);
+        }
+
+        bool written = 0 == ret && size > 0 && m_writer->data(data, size);
+        free(data);
+
+        if (!written) {
+            LIBMTP_Clear_Errorstack(device);
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_offset += size;
+        m_bytes += size;
+        m_job.progress(m_offset, m_current.size);
+
+        if (m_offset >= m_current.size) {
+            return close();
+        }
+
+        defer(ReserveTransfer(device, m_job, size));
+
+        return false;
+    }
+
+    bool close() {
+        if (!m_writer->endEntry()) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_job.endFile(true);
+        m_open = false;
+        m_files++;
+
+        return false;
+    }
+
+    uint32_t m_storage;
+    transfer_job_t m_job;
+    uint32_t m_chunkSize;
+    std::shared_ptr <js_function_t> m_cb;
+    archive_output_t m_output;
+    std::unique_ptr <archive_writer_t> m_writer;
+    std::vector <export_item_t> m_pending;
+    export_item_t m_current;
+    bool m_started;
+    bool m_partial;
+    bool m_open;
+    bool m_done;
+    uint64_t m_offset;
+    uint32_t m_files;
+    uint64_t m_bytes;
+};
+
+void Schedule_Export_Archive(mtpdevice_t device, uint32_t const storage, uint32_t const parent,
+                             const std::string root, int const format, int const fd, archive_stream_t &stream,
+                             transfer_job_t &job, uint32_t const weight, js_function_t &chunkCb,
+                             js_function_t &cb) {
+    std::shared_ptr <device_executor_t> executor = device_executor_t::forDevice(device.m_device);
+
+    executor->submit(std::make_shared<export_task_t>(weight, storage, parent, root, format, fd, stream, job,
+                                                     executor->getChunkSize(), MakeJsCallback(chunkCb),
+                                                     MakeJsCallback(cb)));
+}
+
+JS_CLASS(archive_stream_t){
+        construct<>();
+        construct<const archive_stream_t&>();
+        method(attach);
+        method(ack);
+        method(supply);
+}
@@ -0,0 +1,144 @@
+#ifndef MTP_ARCHIVE_H
+#define MTP_ARCHIVE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "binding.h"
+#include "mtp.h"
+#include "transfer.h"
+
+enum archive_format_t {
+    ARCHIVE_TAR = 0,
+    ARCHIVE_ZIP = 1
+};
+
+/* how often a task looks whether JS is done with the chunk of a stream */
+static const std::chrono::microseconds ARCHIVE_STREAM_POLL(1000);
+
+struct archive_stream_state_t {
+    archive_stream_state_t();
+
+    std::mutex mx;
+    unsigned char *data;
+    size_t capacity;
+    size_t length;
+    size_t position;
+    bool busy;
+    bool ended;
+
+    /* keeps the memory of `data` alive, only set on the JS thread */
+    js_buffer_ref_t buffer;
+};
+
+/**
+ * Moves archive data between a task and a Node stream through one chunk
+ * of JS owned memory, attached with attach() and kept alive by the stream.
+ *
+ * On export the task fills the chunk and hands it to JS; JS writes it to
+ * its stream and calls ack() once the stream wants more. On import the
+ * task asks JS for data once it has used up the chunk, and JS refills it
+ * and calls supply(), with 0 at the end of the stream. Either way at most
+ * one chunk is in flight and the stream's back pressure reaches the device.
+ */
+class archive_stream_t {
+public:
+    archive_stream_t();
+
+    archive_stream_t(const archive_stream_t &stream);
+
+    bool attach(js_buffer_ref_t buf);
+
+    void ack();
+
+    void supply(const uint32_t length);
+
+    bool isAttached();
+
+    /**
+     * Copies up to one chunk of `data` into the attached memory unless JS
+     * still holds the previous chunk. Returns the number of bytes taken.
+     */
+    size_t put(const unsigned char *data, size_t length);
+
+    /**
+     * Takes up to `length` bytes JS supplied. Returns 0 while JS refills
+     * the chunk or at the end of the stream; `request` is set when the
+     * chunk was used up and JS has to be asked for more.
+     */
+    size_t take(unsigned char *data, size_t length, bool &request);
+
+    bool isEnded();
+
+private:
+    std::shared_ptr <archive_stream_state_t> m_state;
+};
+
+/**
+ * Where an archive goes: a file descriptor, or else an archive_stream_t.
+ * Stream output is staged until JS takes it; flush() hands it out.
+ */
+class archive_output_t {
+public:
+    archive_output_t(int fd, archive_stream_t stream, std::shared_ptr <js_function_t> chunkCb);
+
+    bool write(const unsigned char *data, size_t length);
+
+    /**
+     * Returns true once all staged data was handed out.
+     */
+    bool flush();
+
+    uint64_t getOffset() { return m_offset; }
+
+    size_t getStaged() { return m_staged.size() - m_sent; }
+
+private:
+    int m_fd;
+    archive_stream_t m_stream;
+    std::shared_ptr <js_function_t> m_chunkCb;
+    std::vector <unsigned char> m_staged;
+    size_t m_sent;
+    uint64_t m_offset;
+};
+
+/**
+ * Writes entries in tar (ustar, with GNU extensions for long names and
+ * large files) or zip (stored, zip64 where needed) format. The data of an
+ * entry is passed in pieces between beginEntry() and endEntry() and must
+ * add up to the size given to beginEntry().
+ */
+class archive_writer_t {
+public:
+    virtual ~archive_writer_t() {}
+
+    static std::unique_ptr <archive_writer_t> create(int format, archive_output_t &output);
+
+    virtual bool beginEntry(const std::string &path, uint64_t size, time_t mtime, bool folder) = 0;
+
+    virtual bool data(const unsigned char *data, size_t length) = 0;
+
+    virtual bool endEntry() = 0;
+
+    virtual bool finish() = 0;
+};
+
+uint32_t Crc32(uint32_t crc, const unsigned char *data, size_t length);
+
+/**
+ * Streams the device folder `parent` and everything below it into a tar
+ * or zip archive, written to `fd` or, if it is -1, to `stream`, where
+ * `chunkCb(length)` announces each chunk. Entry names start with `root`
+ * unless it is empty. Calls back with cb(error, files, bytes).
+ */
+void Schedule_Export_Archive(mtpdevice_t device, uint32_t const storage, uint32_t const parent,
+                             const std::string root, int const format, int const fd, archive_stream_t &stream,
+                             transfer_job_t &job, uint32_t const weight, js_function_t &chunkCb,
+                             js_function_t &cb);
+
+#endif
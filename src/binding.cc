@@ -0,0 +1,697 @@
+#include "binding.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <mutex>
+
+#include "dispatcher.h"
+#include "exports.h"
+
+/**
+ * What the addon keeps per JS environment: the main thread and every worker
+ * loading it get classes and a dispatcher of their own.
+ */
+struct js_instance_t {
+    std::vector <napi_ref> constructors;
+    std::shared_ptr <js_dispatcher_t> dispatcher;
+};
+
+/* calls from JS into the addon currently running on this thread */
+static thread_local uint32_t callDepth = 0;
+
+void JsThrowTypeError(napi_env env, const std::string &message) {
+    bool pending = false;
+
+    if (napi_ok == napi_is_exception_pending(env, &pending) && !pending) {
+        napi_throw_type_error(env, nullptr, message.c_str());
+    }
+}
+
+bool JsInCall() {
+    return callDepth > 0;
+}
+
+js_call_scope_t::js_call_scope_t() {
+    callDepth++;
+}
+
+js_call_scope_t::~js_call_scope_t() {
+    callDepth--;
+}
+
+js_handle_scope_t::js_handle_scope_t(napi_env env) : m_env(env), m_scope(nullptr) {
+    napi_open_handle_scope(env, &m_scope);
+}
+
+js_handle_scope_t::~js_handle_scope_t() {
+    if (nullptr != m_scope) {
+        napi_close_handle_scope(m_env, m_scope);
+    }
+}
+
+struct js_function_t::ref_t {
+    ref_t(napi_env env, napi_value fn) : env(env), fn(nullptr), context(nullptr),
+                                         dispatcher(js_dispatcher_t::current()) {
+        napi_create_reference(env, fn, 1, &this->fn);
+    }
+
+    /* only callbacks invoked from the event loop need one */
+    napi_async_context getContext() {
+        if (nullptr == context) {
+            napi_value resource = nullptr;
+            napi_value name = nullptr;
+
+            napi_create_object(env, &resource);
+            napi_create_string_utf8(env, "mtp:callback", NAPI_AUTO_LENGTH, &name);
+            napi_async_init(env, resource, name, &context);
+        }
+
+        return context;
+    }
+
+    ~ref_t() {
+        // the environment may be gone already
+        if (dispatcher && !dispatcher->isOpen()) {
+            return;
+        }
+        if (nullptr != context) {
+            napi_async_destroy(env, context);
+        }
+        if (nullptr != fn) {
+            napi_delete_reference(env, fn);
+        }
+    }
+
+    napi_env env;
+    napi_ref fn;
+    napi_async_context context;
+    std::shared_ptr <js_dispatcher_t> dispatcher;
+};
+
+js_function_t::js_function_t(napi_env env, napi_value fn) : m_ref(std::make_shared<ref_t>(env, fn)) {}
+
+napi_env js_function_t::getEnv() const {
+    return m_ref ? m_ref->env : nullptr;
+}
+
+std::shared_ptr <js_dispatcher_t> js_function_t::getDispatcher() const {
+    return m_ref ? m_ref->dispatcher : nullptr;
+}
+
+bool js_function_t::invoke(napi_value *argv, size_t argc, napi_value *result) {
+    napi_env env = m_ref->env;
+    napi_value fn = nullptr;
+    napi_value recv = nullptr;
+    napi_value ret = nullptr;
+    napi_status status;
+
+    for (size_t i = 0; i < argc; i++) {
+        if (nullptr == argv[i]) {
+            return false;
+        }
+    }
+
+    if (napi_ok != napi_get_reference_value(env, m_ref->fn, &fn) || nullptr == fn) {
+        return false;
+    }
+
+    if (JsInCall()) {
+        napi_get_undefined(env, &recv);
+        status = napi_call_function(env, recv, fn, argc, argv, &ret);
+    } else {
+        // from the event loop: runs the microtasks and async hooks like any
+        // other callback into JS, which needs an object as the receiver
+        napi_get_global(env, &recv);
+        status = napi_make_callback(env, m_ref->getContext(), recv, fn, argc, argv, &ret);
+    }
+
+    if (napi_ok == status) {
+        if (nullptr != result) {
+            *result = ret;
+        }
+        return true;
+    }
+
+    bool pending = false;
+    napi_is_exception_pending(env, &pending);
+
+    if (pending && !JsInCall()) {
+        napi_value error = nullptr;
+
+        napi_get_and_clear_last_exception(env, &error);
+        napi_fatal_exception(env, error);
+    }
+
+    return false;
+}
+
+static size_t ElementSize(napi_typedarray_type type) {
+    switch (type) {
+        case napi_int16_array:
+        case napi_uint16_array:
+            return 2;
+        case napi_int32_array:
+        case napi_uint32_array:
+        case napi_float32_array:
+            return 4;
+        case napi_float64_array:
+        case napi_bigint64_array:
+        case napi_biguint64_array:
+            return 8;
+        default:
+            return 1;
+    }
+}
+
+bool js_convert<std::string>::fromJs(napi_env env, napi_value value, holder_t &holder) {
+    size_t length = 0;
+
+    if (napi_ok != napi_get_value_string_utf8(env, value, nullptr, 0, &length)) {
+        JsThrowTypeError(env, "Type mismatch: expected a string");
+        return false;
+    }
+
+    holder.resize(length + 1);
+    napi_get_value_string_utf8(env, value, &holder[0], length + 1, &length);
+    holder.resize(length);
+
+    return true;
+}
+
+bool js_convert<js_function_t>::fromJs(napi_env env, napi_value value, holder_t &holder) {
+    napi_valuetype type = napi_undefined;
+
+    if (napi_ok != napi_typeof(env, value, &type) || napi_function != type) {
+        JsThrowTypeError(env, "Type mismatch: expected a function");
+        return false;
+    }
+
+    holder = js_function_t(env, value);
+
+    return true;
+}
+
+bool js_convert<js_buffer_t>::fromJs(napi_env env, napi_value value, holder_t &holder) {
+    bool is = false;
+    void *data = nullptr;
+    size_t length = 0;
+
+    if (napi_ok == napi_is_buffer(env, value, &is) && is) {
+        napi_get_buffer_info(env, value, &data, &length);
+    } else if (napi_ok == napi_is_typedarray(env, value, &is) && is) {
+        napi_typedarray_type type;
+        size_t count = 0;
+
+        napi_get_typedarray_info(env, value, &type, &count, &data, nullptr, nullptr);
+        length = count * ElementSize(type);
+    } else if (napi_ok == napi_is_arraybuffer(env, value, &is) && is) {
+        napi_get_arraybuffer_info(env, value, &data, &length);
+    } else {
+        JsThrowTypeError(env, "Type mismatch: expected a Buffer");
+        return false;
+    }
+
+    holder = js_buffer_t((unsigned char *) data, length);
+
+    return true;
+}
+
+struct js_buffer_ref_t::ref_t {
+    ref_t(napi_env env, napi_value value) : env(env), value(nullptr), dispatcher(js_dispatcher_t::current()) {
+        napi_create_reference(env, value, 1, &this->value);
+    }
+
+    ~ref_t() {
+        napi_env env = this->env;
+        napi_ref value = this->value;
+
+        // the environment may be gone already, and the buffer with it
+        if (nullptr == value || (dispatcher && !dispatcher->isOpen())) {
+            return;
+        }
+        if (!dispatcher || dispatcher->onThread()) {
+            napi_delete_reference(env, value);
+        } else {
+            dispatcher->post([env, value] { napi_delete_reference(env, value); });
+        }
+    }
+
+    napi_env env;
+    napi_ref value;
+    std::shared_ptr <js_dispatcher_t> dispatcher;
+};
+
+js_buffer_ref_t::js_buffer_ref_t(napi_env env, napi_value value, js_buffer_t buf) :
+        m_buf(buf), m_ref(std::make_shared<ref_t>(env, value)) {}
+
+bool js_convert<js_buffer_ref_t>::fromJs(napi_env env, napi_value value, holder_t &holder) {
+    js_buffer_t buf;
+
+    if (!js_convert<js_buffer_t>::fromJs(env, value, buf)) {
+        return false;
+    }
+
+    holder = js_buffer_ref_t(env, value, buf);
+
+    return true;
+}
+
+bool JsTypedArrayValues(napi_env env, napi_value value, std::vector<double> &values) {
+    bool is = false;
+    napi_typedarray_type type;
+    size_t count = 0;
+    void *data = nullptr;
+
+    if (napi_ok != napi_is_typedarray(env, value, &is) || !is ||
+        napi_ok != napi_get_typedarray_info(env, value, &type, &count, &data, nullptr, nullptr)) {
+        return false;
+    }
+
+    values.resize(count);
+
+    for (size_t i = 0; i < count; i++) {
+        switch (type) {
+            case napi_int8_array:
+                values[i] = ((int8_t *) data)[i];
+                break;
+            case napi_uint8_array:
+            case napi_uint8_clamped_array:
+                values[i] = ((uint8_t *) data)[i];
+                break;
+            case napi_int16_array:
+                values[i] = ((int16_t *) data)[i];
+                break;
+            case napi_uint16_array:
+                values[i] = ((uint16_t *) data)[i];
+                break;
+            case napi_int32_array:
+                values[i] = ((int32_t *) data)[i];
+                break;
+            case napi_uint32_array:
+                values[i] = ((uint32_t *) data)[i];
+                break;
+            case napi_float32_array:
+                values[i] = ((float *) data)[i];
+                break;
+            case napi_float64_array:
+                values[i] = ((double *) data)[i];
+                break;
+            case napi_bigint64_array:
+                values[i] = (double) ((int64_t *) data)[i];
+                break;
+            case napi_biguint64_array:
+                values[i] = (double) ((uint64_t *) data)[i];
+                break;
+        }
+    }
+
+    return true;
+}
+
+/* the object JsWrapNative() is handing to the constructor it calls */
+static thread_local void *adopting = nullptr;
+
+static void FinalizeNative(napi_env env, void *native, void *hint) {
+    ((js_class_record_t *) hint)->destroy(native);
+}
+
+/**
+ * The constructor of every exported class: takes over an object from
+ * JsWrapNative(), or else creates one with the constructor registered for
+ * the number of arguments.
+ */
+static napi_value ConstructNative(napi_env env, napi_callback_info info) {
+    js_call_scope_t scope;
+    napi_value argv[4];
+    size_t argc = 4;
+    napi_value self = nullptr;
+    napi_value target = nullptr;
+    void *data = nullptr;
+    void *native = nullptr;
+
+    if (napi_ok != napi_get_cb_info(env, info, &argc, argv, &self, &data)) {
+        return nullptr;
+    }
+
+    js_class_record_t *cls = (js_class_record_t *) data;
+
+    napi_get_new_target(env, info, &target);
+    if (nullptr == target) {
+        JsThrowTypeError(env, std::string("Class constructor ") + cls->name + " cannot be invoked without 'new'");
+        return nullptr;
+    }
+
+    napi_valuetype type = napi_undefined;
+
+    if (1 == argc && nullptr != adopting && napi_ok == napi_typeof(env, argv[0], &type) && napi_external == type) {
+        napi_get_value_external(env, argv[0], &native);
+
+        if (native != adopting) {
+            native = nullptr;
+        }
+    }
+
+    if (nullptr == native) {
+        bool matched = false;
+
+        for (const js_ctor_t &ctor : cls->ctors) {
+            if (ctor.argc == argc) {
+                matched = true;
+                native = ctor.create(env, argv);
+                break;
+            }
+        }
+
+        if (!matched) {
+            JsThrowTypeError(env, std::string("No constructor of ") + cls->name + " takes " + std::to_string(argc) +
+                                  " arguments");
+        }
+        if (nullptr == native) {
+            return nullptr;
+        }
+    }
+
+    if (napi_ok != napi_wrap(env, self, native, FinalizeNative, cls, nullptr)) {
+        // an adopted object is deleted by JsWrapNative()
+        if (native != adopting) {
+            cls->destroy(native);
+        }
+        return nullptr;
+    }
+
+    napi_type_tag_object(env, self, &cls->tag);
+
+    return self;
+}
+
+napi_value JsWrapNative(napi_env env, js_class_record_t &cls, void *native) {
+    js_instance_t *instance = nullptr;
+    napi_value ctor = nullptr;
+    napi_value external = nullptr;
+    napi_value result = nullptr;
+
+    if (napi_ok != napi_get_instance_data(env, (void **) &instance) || nullptr == instance ||
+        cls.index >= instance->constructors.size() ||
+        napi_ok != napi_get_reference_value(env, instance->constructors[cls.index], &ctor) || nullptr == ctor ||
+        napi_ok != napi_create_external(env, native, nullptr, nullptr, &external)) {
+        cls.destroy(native);
+        return nullptr;
+    }
+
+    void *outer = adopting;
+
+    adopting = native;
+    napi_status status = napi_new_instance(env, ctor, 1, &external, &result);
+    adopting = outer;
+
+    if (napi_ok != status) {
+        // the constructor only fails before wrapping, the object is still ours
+        cls.destroy(native);
+        return nullptr;
+    }
+
+    return result;
+}
+
+void *JsUnwrapNative(napi_env env, js_class_record_t &cls, napi_value value) {
+    napi_valuetype type = napi_undefined;
+    bool tagged = false;
+    void *native = nullptr;
+
+    if (napi_ok != napi_typeof(env, value, &type) || napi_object != type ||
+        napi_ok != napi_check_object_type_tag(env, value, &cls.tag, &tagged) || !tagged ||
+        napi_ok != napi_unwrap(env, value, &native)) {
+        return nullptr;
+    }
+
+    return native;
+}
+
+void *JsCreateFromFields(napi_env env, js_class_record_t &cls, napi_value value) {
+    napi_valuetype type = napi_undefined;
+
+    if (nullptr == cls.create || napi_ok != napi_typeof(env, value, &type) || napi_object != type) {
+        JsThrowTypeError(env, std::string("Type mismatch: expected ") + (cls.name ? cls.name : "an object"));
+        return nullptr;
+    }
+
+    void *native = cls.create();
+
+    for (const js_field_t &field : cls.fields) {
+        napi_value property = nullptr;
+        bool pending = false;
+
+        if (napi_ok != napi_get_named_property(env, value, field.name.c_str(), &property) ||
+            napi_ok != napi_typeof(env, property, &type)) {
+            cls.destroy(native);
+            return nullptr;
+        }
+        if (napi_undefined == type) {
+            continue;
+        }
+
+        field.assign(env, native, property);
+
+        napi_is_exception_pending(env, &pending);
+        if (pending) {
+            cls.destroy(native);
+            return nullptr;
+        }
+    }
+
+    return native;
+}
+
+js_columns_t::js_columns_t(napi_env env, size_t count, size_t elementBytes) :
+        m_env(env), m_count(count), m_result(nullptr), m_buffer(nullptr), m_data(nullptr), m_used(0),
+        m_capacity(count * elementBytes), m_ok(false) {
+    napi_value length = nullptr;
+    void *data = nullptr;
+
+    // an ArrayBuffer V8 allocates itself, as Electron does not take
+    // external ones
+    m_ok = napi_ok == napi_create_object(env, &m_result) &&
+           napi_ok == napi_create_arraybuffer(env, m_capacity, &data, &m_buffer) &&
+           napi_ok == napi_create_double(env, (double) count, &length) &&
+           napi_ok == napi_set_named_property(env, m_result, "length", length);
+    m_data = (unsigned char *) data;
+}
+
+void *js_columns_t::column(const char *name, napi_typedarray_type type, size_t size) {
+    napi_value array = nullptr;
+    size_t offset = m_used;
+
+    if (!m_ok || offset + m_count * size > m_capacity || 0 != offset % size) {
+        m_ok = false;
+        return nullptr;
+    }
+
+    m_used += m_count * size;
+    m_ok = napi_ok == napi_create_typedarray(m_env, type, m_count, m_buffer, offset, &array) &&
+           napi_ok == napi_set_named_property(m_env, m_result, name, array);
+
+    return m_ok ? m_data + offset : nullptr;
+}
+
+double *js_columns_t::float64(const char *name) {
+    return (double *) column(name, napi_float64_array, sizeof(double));
+}
+
+uint32_t *js_columns_t::uint32(const char *name) {
+    return (uint32_t *) column(name, napi_uint32_array, sizeof(uint32_t));
+}
+
+int32_t *js_columns_t::int32(const char *name) {
+    return (int32_t *) column(name, napi_int32_array, sizeof(int32_t));
+}
+
+uint8_t *js_columns_t::uint8(const char *name) {
+    return (uint8_t *) column(name, napi_uint8_array, sizeof(uint8_t));
+}
+
+void js_columns_t::strings(const char *name, const std::string &joined) {
+    napi_value value = nullptr;
+
+    m_ok = m_ok && napi_ok == napi_create_string_utf8(m_env, joined.data(), joined.size(), &value) &&
+           napi_ok == napi_set_named_property(m_env, m_result, name, value);
+}
+
+/**
+ * A tag per class, so an instance of one is never taken for another.
+ */
+static napi_type_tag ClassTag(const char *name) {
+    napi_type_tag tag = {14695981039346656037ULL, 0x6d74702d6e6f6465ULL};
+
+    for (const char *c = name; *c; c++) {
+        tag.lower = (tag.lower ^ (unsigned char) *c) * 1099511628211ULL;
+        tag.upper = (tag.upper ^ (unsigned char) *c) * 1099511628211ULL;
+    }
+
+    return tag;
+}
+
+/**
+ * "getName" is exported as the property "name".
+ */
+static std::string PropertyName(const char *getter) {
+    std::string name(getter);
+
+    if (name.size() > 3 && 0 == name.compare(0, 3, "get")) {
+        name.erase(0, 3);
+        name[0] = (char) tolower((unsigned char) name[0]);
+    }
+
+    return name;
+}
+
+/* the number of classes described so far, under InitMutex() */
+static size_t classCount = 0;
+
+static std::mutex &InitMutex() {
+    static std::mutex mx;
+    return mx;
+}
+
+js_class_builder_t::js_class_builder_t(js_class_record_t &cls, const char *name, napi_env env, napi_value exports) :
+        m_cls(cls), m_describe(nullptr == cls.name), m_env(env), m_exports(exports) {
+    if (m_describe) {
+        m_cls.name = name;
+        m_cls.index = classCount++;
+        m_cls.tag = ClassTag(name);
+    }
+}
+
+void js_class_builder_t::addConstructor(size_t argc, void *(*create)(napi_env, napi_value *)) {
+    js_ctor_t ctor = {argc, create};
+
+    if (m_describe) {
+        m_cls.ctors.push_back(ctor);
+    }
+}
+
+void js_class_builder_t::addDefaultConstructor(js_create_t create) {
+    if (m_describe) {
+        m_cls.create = create;
+    }
+}
+
+void js_class_builder_t::addGetset(const char *getter, napi_callback get, napi_callback set,
+                                   void (*assign)(napi_env, void *, napi_value)) {
+    js_field_t field = {PropertyName(getter), assign};
+
+    if (m_describe) {
+        m_cls.fields.push_back(field);
+    }
+    m_names.push_back(field.name);
+    m_getters.push_back(get);
+    m_setters.push_back(set);
+    m_methods.push_back(nullptr);
+}
+
+void js_class_builder_t::addGetter(const char *getter, napi_callback get) {
+    m_names.push_back(PropertyName(getter));
+    m_getters.push_back(get);
+    m_setters.push_back(nullptr);
+    m_methods.push_back(nullptr);
+}
+
+void js_class_builder_t::addMethod(const char *name, napi_callback method) {
+    m_names.push_back(name);
+    m_getters.push_back(nullptr);
+    m_setters.push_back(nullptr);
+    m_methods.push_back(method);
+}
+
+void js_class_builder_t::finish() {
+    std::vector <napi_property_descriptor> properties(m_names.size());
+    napi_value ctor = nullptr;
+
+    for (size_t i = 0; i < m_names.size(); i++) {
+        napi_property_descriptor &property = properties[i];
+
+        memset(&property, 0, sizeof(property));
+        property.utf8name = m_names[i].c_str();
+        property.getter = m_getters[i];
+        property.setter = m_setters[i];
+        property.method = m_methods[i];
+        property.attributes = nullptr != m_methods[i] ? (napi_property_attributes) (napi_writable | napi_configurable)
+                                                     : napi_default;
+    }
+
+    js_instance_t *instance = nullptr;
+
+    if (napi_ok != napi_get_instance_data(m_env, (void **) &instance) || nullptr == instance ||
+        napi_ok != napi_define_class(m_env, m_cls.name, NAPI_AUTO_LENGTH, ConstructNative, &m_cls,
+                                     properties.size(), properties.data(), &ctor)) {
+        return;
+    }
+
+    if (instance->constructors.size() <= m_cls.index) {
+        instance->constructors.resize(m_cls.index + 1, nullptr);
+    }
+
+    napi_create_reference(m_env, ctor, 1, &instance->constructors[m_cls.index]);
+    napi_set_named_property(m_env, m_exports, m_cls.name, ctor);
+}
+
+void js_global_definer_t::addFunction(const char *name, napi_callback fn) {
+    napi_value value = nullptr;
+
+    if (napi_ok == napi_create_function(m_env, name, NAPI_AUTO_LENGTH, fn, nullptr, &value)) {
+        napi_set_named_property(m_env, m_exports, name, value);
+    }
+}
+
+static std::vector <js_define_t> &Registrations(bool isClass) {
+    static std::vector <js_define_t> classes;
+    static std::vector <js_define_t> globals;
+
+    return isClass ? classes : globals;
+}
+
+js_registration_t::js_registration_t(bool isClass, js_define_t define) {
+    Registrations(isClass).push_back(define);
+}
+
+static void FinalizeInstance(napi_env env, void *data, void *hint) {
+    js_instance_t *instance = (js_instance_t *) data;
+
+    for (napi_ref ctor : instance->constructors) {
+        if (nullptr != ctor) {
+            napi_delete_reference(env, ctor);
+        }
+    }
+
+    delete instance;
+}
+
+/**
+ * Runs for every JS environment loading the addon, the main thread's and
+ * each worker's.
+ */
+static napi_value InitModule(napi_env env, napi_value exports) {
+    js_instance_t *instance = new js_instance_t();
+
+    instance->dispatcher = js_dispatcher_t::create(env);
+
+    if (napi_ok != napi_set_instance_data(env, instance, FinalizeInstance, nullptr)) {
+        delete instance;
+        return nullptr;
+    }
+
+    // the first environment describes the classes for all of them
+    std::lock_guard <std::mutex> lk(InitMutex());
+
+    for (js_define_t define : Registrations(true)) {
+        define(env, exports);
+    }
+    for (js_define_t define : Registrations(false)) {
+        define(env, exports);
+    }
+
+    return exports;
+}
+
+NAPI_MODULE_INIT() {
+    return InitModule(env, exports);
+}
@@ -0,0 +1,557 @@
+#ifndef MTP_BINDING_H
+#define MTP_BINDING_H
+
+#include <stdint.h>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <node_api.h>
+
+/**
+ * The JS side of the addon, on N-API.
+ *
+ * Values cross the boundary through js_convert<T>, which every argument,
+ * return value and callback argument goes through: numbers, strings,
+ * vectors as arrays, and the classes exported with JS_CLASS (see exports.h)
+ * as wrapped native objects. Bulk results can specialise js_convert to hand
+ * over typed arrays instead of one JS object per item, see js_columns_t.
+ */
+
+class js_dispatcher_t;
+
+/**
+ * Leaves a JS exception pending, unless one already is, so the first error
+ * of a call is the one JS sees.
+ */
+void JsThrowTypeError(napi_env env, const std::string &message);
+
+/**
+ * Whether the JS thread is inside a call from JS into the addon, as opposed
+ * to running a callback posted by the dispatcher.
+ */
+bool JsInCall();
+
+/**
+ * Marks a call from JS into the addon for the duration of its scope.
+ */
+class js_call_scope_t {
+public:
+    js_call_scope_t();
+
+    ~js_call_scope_t();
+};
+
+/**
+ * A JS handle scope for the duration of its scope.
+ */
+class js_handle_scope_t {
+public:
+    js_handle_scope_t(napi_env env);
+
+    ~js_handle_scope_t();
+
+private:
+    napi_env m_env;
+    napi_handle_scope m_scope;
+};
+
+/**
+ * The memory of a Buffer, TypedArray or ArrayBuffer passed in from JS. It
+ * is owned by the JS object and only valid as long as the caller keeps that
+ * alive; writes are visible to JS directly.
+ */
+class js_buffer_t {
+public:
+    js_buffer_t() : m_data(nullptr), m_length(0) {}
+
+    js_buffer_t(unsigned char *data, size_t length) : m_data(data), m_length(length) {}
+
+    unsigned char *data() const { return m_data; }
+
+    size_t length() const { return m_length; }
+
+    /* the memory is shared with JS, so there is nothing to copy back */
+    void commit() {}
+
+private:
+    unsigned char *m_data;
+    size_t m_length;
+};
+
+/**
+ * A js_buffer_t whose JS object is kept alive beyond the call it was passed
+ * to, for memory the addon keeps writing to. Copies share one reference,
+ * which is released on the JS thread with the last copy, whichever thread
+ * drops it.
+ */
+class js_buffer_ref_t {
+public:
+    js_buffer_ref_t() {}
+
+    js_buffer_ref_t(napi_env env, napi_value value, js_buffer_t buf);
+
+    bool isEmpty() const { return !m_ref; }
+
+    unsigned char *data() const { return m_buf.data(); }
+
+    size_t length() const { return m_buf.length(); }
+
+private:
+    struct ref_t;
+
+    js_buffer_t m_buf;
+    std::shared_ptr <ref_t> m_ref;
+};
+
+/**
+ * A JS function kept alive beyond the call it was passed to. Copies share
+ * one reference, which is released with the last copy; like any JS value it
+ * may only be called and released on the JS thread, see MakeJsCallback().
+ */
+class js_function_t {
+public:
+    js_function_t() {}
+
+    js_function_t(napi_env env, napi_value fn);
+
+    bool isEmpty() const { return !m_ref; }
+
+    napi_env getEnv() const;
+
+    /* the dispatcher of the environment the function belongs to */
+    std::shared_ptr <js_dispatcher_t> getDispatcher() const;
+
+    template <typename... Args>
+    void operator()(const Args &... args);
+
+    template <typename R, typename... Args>
+    R call(const Args &... args);
+
+private:
+    struct ref_t;
+
+    /**
+     * Calls the function, with `result` left untouched if it throws. An
+     * exception thrown by a callback JS waits on synchronously is left
+     * pending for that call to rethrow; any other one is reported as
+     * uncaught.
+     */
+    bool invoke(napi_value *argv, size_t argc, napi_value *result);
+
+    std::shared_ptr <ref_t> m_ref;
+};
+
+/**
+ * What the addon keeps of an exported class, see JS_CLASS.
+ */
+struct js_field_t {
+    std::string name;
+
+    /* stores a JS value through the setter of the property */
+    void (*assign)(napi_env env, void *native, napi_value value);
+};
+
+struct js_ctor_t {
+    size_t argc;
+
+    /* nullptr with an exception pending if the arguments do not fit */
+    void *(*create)(napi_env env, napi_value *argv);
+};
+
+typedef void *(*js_create_t)();
+
+/**
+ * Shared by every JS environment; the first one to load the addon fills it
+ * in, each gets a constructor of its own in slot `index`.
+ */
+struct js_class_record_t {
+    js_class_record_t(void (*destroy)(void *)) : name(nullptr), index(0), tag(), create(nullptr), destroy(destroy) {}
+
+    const char *name;
+    size_t index;
+    napi_type_tag tag;
+
+    /* the default constructor, nullptr without one */
+    js_create_t create;
+    void (*destroy)(void *native);
+
+    std::vector <js_ctor_t> ctors;
+    std::vector <js_field_t> fields;
+};
+
+template <typename T>
+struct js_class_info {
+    static js_class_record_t &record() {
+        static js_class_record_t cls(destroy);
+        return cls;
+    }
+
+    static void destroy(void *native) { delete (T *) native; }
+};
+
+/**
+ * Wraps a native object in a new instance of its class, which takes it
+ * over; the object is deleted if that fails.
+ */
+napi_value JsWrapNative(napi_env env, js_class_record_t &cls, void *native);
+
+/**
+ * The native object behind an instance of `cls`, or nullptr for any other
+ * value.
+ */
+void *JsUnwrapNative(napi_env env, js_class_record_t &cls, napi_value value);
+
+/**
+ * A new native object with the properties of a plain JS object stored
+ * through the setters of `cls`; nullptr with an exception pending if
+ * `value` is no object or the class has no default constructor.
+ */
+void *JsCreateFromFields(napi_env env, js_class_record_t &cls, napi_value value);
+
+/**
+ * The conversion of one C++ type. `holder_t` keeps an argument converted
+ * from JS for the duration of a call and get() hands it to the callee.
+ *
+ * This is the one for classes exported with JS_CLASS: they go to JS as a
+ * new wrapped copy and come in either as an instance, used in place, or as
+ * a plain object with the same properties.
+ */
+template <typename T, typename Enable = void>
+struct js_convert {
+    struct holder_t {
+        holder_t() : ptr(nullptr) {}
+
+        T *ptr;
+        std::unique_ptr <T> owned;
+    };
+
+    static napi_value toJs(napi_env env, const T &value) {
+        return JsWrapNative(env, js_class_info<T>::record(), new T(value));
+    }
+
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder) {
+        js_class_record_t &cls = js_class_info<T>::record();
+
+        holder.ptr = (T *) JsUnwrapNative(env, cls, value);
+        if (nullptr != holder.ptr) {
+            return true;
+        }
+
+        holder.owned.reset((T *) JsCreateFromFields(env, cls, value));
+        holder.ptr = holder.owned.get();
+
+        return nullptr != holder.ptr;
+    }
+
+    static T &get(holder_t &holder) { return *holder.ptr; }
+};
+
+template <>
+struct js_convert<bool> {
+    typedef bool holder_t;
+
+    static napi_value toJs(napi_env env, bool value) {
+        napi_value result = nullptr;
+        napi_get_boolean(env, value, &result);
+        return result;
+    }
+
+    /* any value, by its truthiness */
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder) {
+        napi_value coerced = nullptr;
+        return napi_ok == napi_coerce_to_bool(env, value, &coerced) &&
+               napi_ok == napi_get_value_bool(env, coerced, &holder);
+    }
+
+    static bool get(holder_t &holder) { return holder; }
+};
+
+/**
+ * Numbers, coerced the way JS would. 64 bit integers go through a double
+ * and are exact up to 2^53.
+ */
+template <typename T>
+struct js_convert<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+    typedef T holder_t;
+
+    static const bool SMALL_INT = std::is_integral<T>::value && sizeof(T) <= sizeof(int32_t);
+
+    static napi_value toJs(napi_env env, T value) {
+        napi_value result = nullptr;
+
+        if (SMALL_INT && std::is_signed<T>::value) {
+            napi_create_int32(env, (int32_t) value, &result);
+        } else if (SMALL_INT) {
+            napi_create_uint32(env, (uint32_t) value, &result);
+        } else {
+            napi_create_double(env, (double) value, &result);
+        }
+
+        return result;
+    }
+
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder) {
+        napi_value number = nullptr;
+
+        if (napi_ok != napi_coerce_to_number(env, value, &number)) {
+            return false;
+        }
+
+        if (SMALL_INT && std::is_signed<T>::value) {
+            int32_t result = 0;
+            napi_get_value_int32(env, number, &result);
+            holder = (T) result;
+        } else if (SMALL_INT) {
+            uint32_t result = 0;
+            napi_get_value_uint32(env, number, &result);
+            holder = (T) result;
+        } else {
+            double result = 0;
+            napi_get_value_double(env, number, &result);
+            holder = FromDouble(result);
+        }
+
+        return true;
+    }
+
+    static T get(holder_t &holder) { return holder; }
+
+private:
+    static T FromDouble(double value) {
+        if (std::is_floating_point<T>::value) {
+            return (T) value;
+        }
+        if (!std::isfinite(value)) {
+            return 0;
+        }
+
+        return value < 0 ? (T) (int64_t) value : (T) (uint64_t) value;
+    }
+};
+
+template <>
+struct js_convert<std::string> {
+    typedef std::string holder_t;
+
+    static napi_value toJs(napi_env env, const std::string &value) {
+        napi_value result = nullptr;
+        napi_create_string_utf8(env, value.data(), value.size(), &result);
+        return result;
+    }
+
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder);
+
+    static std::string &get(holder_t &holder) { return holder; }
+};
+
+template <>
+struct js_convert<char *> {
+    static napi_value toJs(napi_env env, const char *value) {
+        napi_value result = nullptr;
+        napi_create_string_utf8(env, value ? value : "", NAPI_AUTO_LENGTH, &result);
+        return result;
+    }
+};
+
+template <>
+struct js_convert<const char *> : js_convert<char *> {};
+
+template <>
+struct js_convert<js_function_t> {
+    typedef js_function_t holder_t;
+
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder);
+
+    static js_function_t &get(holder_t &holder) { return holder; }
+};
+
+template <>
+struct js_convert<js_buffer_t> {
+    typedef js_buffer_t holder_t;
+
+    /* a Buffer, any TypedArray or an ArrayBuffer */
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder);
+
+    static js_buffer_t &get(holder_t &holder) { return holder; }
+};
+
+template <>
+struct js_convert<js_buffer_ref_t> {
+    typedef js_buffer_ref_t holder_t;
+
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder);
+
+    static js_buffer_ref_t &get(holder_t &holder) { return holder; }
+};
+
+/**
+ * Reads the elements of a TypedArray as numbers; false for any other value.
+ */
+bool JsTypedArrayValues(napi_env env, napi_value value, std::vector<double> &values);
+
+template <typename T>
+napi_value JsFromVector(napi_env env, const std::vector <T> &values) {
+    napi_value result = nullptr;
+
+    if (napi_ok != napi_create_array_with_length(env, values.size(), &result)) {
+        return nullptr;
+    }
+
+    for (size_t i = 0; i < values.size(); i++) {
+        napi_value element = js_convert<T>::toJs(env, values[i]);
+
+        if (nullptr == element || napi_ok != napi_set_element(env, result, (uint32_t) i, element)) {
+            return nullptr;
+        }
+    }
+
+    return result;
+}
+
+template <typename T>
+bool JsTypedArrayToVector(napi_env env, napi_value value, std::vector <T> &values, std::true_type) {
+    std::vector<double> numbers;
+
+    if (!JsTypedArrayValues(env, value, numbers)) {
+        return false;
+    }
+
+    values.clear();
+    values.reserve(numbers.size());
+    for (double number : numbers) {
+        values.push_back((T) (std::isfinite(number) ? number : 0));
+    }
+
+    return true;
+}
+
+template <typename T>
+bool JsTypedArrayToVector(napi_env, napi_value, std::vector <T> &, std::false_type) {
+    return false;
+}
+
+/**
+ * An array, or for numbers also a TypedArray, into a vector.
+ */
+template <typename T>
+bool JsToVector(napi_env env, napi_value value, std::vector <T> &values) {
+    bool isArray = false;
+    uint32_t length = 0;
+
+    if (JsTypedArrayToVector(env, value, values, std::is_arithmetic<T>())) {
+        return true;
+    }
+
+    if (napi_ok != napi_is_array(env, value, &isArray) || !isArray) {
+        JsThrowTypeError(env, "Type mismatch: expected an array");
+        return false;
+    }
+
+    napi_get_array_length(env, value, &length);
+    values.clear();
+    values.reserve(length);
+
+    for (uint32_t i = 0; i < length; i++) {
+        napi_value element = nullptr;
+        typename js_convert<T>::holder_t holder;
+
+        if (napi_ok != napi_get_element(env, value, i, &element) ||
+            !js_convert<T>::fromJs(env, element, holder)) {
+            return false;
+        }
+
+        values.push_back(js_convert<T>::get(holder));
+    }
+
+    return true;
+}
+
+template <typename T>
+struct js_convert<std::vector <T> > {
+    typedef std::vector <T> holder_t;
+
+    static napi_value toJs(napi_env env, const std::vector <T> &values) { return JsFromVector(env, values); }
+
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder) { return JsToVector(env, value, holder); }
+
+    static std::vector <T> &get(holder_t &holder) { return holder; }
+};
+
+/**
+ * The packed form of a bulk result: one ArrayBuffer carved into TypedArray
+ * columns of `count` elements each, plus strings joined by NUL, all set on
+ * one plain object along with `length`. Columns are carved in the order
+ * they are added, so wider elements have to come first to stay aligned.
+ *
+ * lib/mtp-helper.js turns these back into plain objects in JS, which costs
+ * a fraction of creating them one property at a time through N-API.
+ */
+class js_columns_t {
+public:
+    js_columns_t(napi_env env, size_t count, size_t elementBytes);
+
+    double *float64(const char *name);
+
+    uint32_t *uint32(const char *name);
+
+    int32_t *int32(const char *name);
+
+    uint8_t *uint8(const char *name);
+
+    void strings(const char *name, const std::string &joined);
+
+    /* false if any allocation failed, with an exception pending */
+    bool ok() const { return m_ok; }
+
+    napi_value value() const { return m_ok ? m_result : nullptr; }
+
+private:
+    void *column(const char *name, napi_typedarray_type type, size_t size);
+
+    napi_env m_env;
+    size_t m_count;
+    napi_value m_result;
+    napi_value m_buffer;
+    unsigned char *m_data;
+    size_t m_used;
+    size_t m_capacity;
+    bool m_ok;
+};
+
+template <typename... Args>
+void js_function_t::operator()(const Args &... args) {
+    if (!m_ref) {
+        return;
+    }
+
+    napi_env env = getEnv();
+    js_handle_scope_t scope(env);
+    napi_value argv[sizeof...(Args) + 1] = {js_convert<typename std::decay<Args>::type>::toJs(env, args)...};
+
+    invoke(argv, sizeof...(Args), nullptr);
+}
+
+template <typename R, typename... Args>
+R js_function_t::call(const Args &... args) {
+    typename js_convert<R>::holder_t holder = typename js_convert<R>::holder_t();
+
+    if (!m_ref) {
+        return js_convert<R>::get(holder);
+    }
+
+    napi_env env = getEnv();
+    js_handle_scope_t scope(env);
+    napi_value argv[sizeof...(Args) + 1] = {js_convert<typename std::decay<Args>::type>::toJs(env, args)...};
+    napi_value result = nullptr;
+
+    if (invoke(argv, sizeof...(Args), &result) && !js_convert<R>::fromJs(env, result, holder)) {
+        holder = typename js_convert<R>::holder_t();
+    }
+
+    return js_convert<R>::get(holder);
+}
+
+#endif
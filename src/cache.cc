@@ -0,0 +1,513 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+#include "checksum.h"
+#include "executor.h"
+#include "fileio.h"
+#include "ratelimit.h"
+#include "readcache.h"
+#include "exports.h"
+
+static const char ENTRY_SUFFIX[] = ".obj";
+static const char TEMPORARY_SUFFIX[] = ".part";
+
+static const size_t COPY_BLOCK_SIZE = 1024 * 1024;
+
+/* ranged reads of objects up to this size pull the whole object into the cache */
+static const uint64_t RANGE_FILL_LIMIT = 1024 * 1024;
+
+static bool EndsWith(const std::string &name, const char *suffix) {
+    size_t length = strlen(suffix);
+    return name.size() > length && 0 == name.compare(name.size() - length, length, suffix);
+}
+
+struct cache_file_t {
+    std::string name;
+    uint64_t size;
+    time_t mtime;
+};
+
+static bool NewerFirst(const cache_file_t &a, const cache_file_t &b) {
+    return a.mtime > b.mtime;
+}
+
+static std::vector <cache_file_t> ListCacheDirectory(const std::string &directory) {
+    std::vector <cache_file_t> files;
+#ifdef _WIN32
+    struct _finddata64_t data;
+    intptr_t handle = _findfirst64((directory + "/*").c_str(), &data);
+
+    if (-1 == handle) {
+        return files;
+    }
+
+    do {
+        if (0 == (data.attrib & _A_SUBDIR)) {
+            cache_file_t file;
+            file.name = data.name;
+            file.size = (uint64_t) data.size;
+            file.mtime = (time_t) data.time_write;
+            files.push_back(file);
+        }
+    } while (0 == _findnext64(handle, &data));
+
+    _findclose(handle);
+#else
+    DIR *dir = opendir(directory.c_str());
+
+    if (nullptr == dir) {
+        return files;
+    }
+
+    for (struct dirent *ent = readdir(dir); nullptr != ent; ent = readdir(dir)) {
+        struct stat st;
+        cache_file_t file;
+        file.name = ent->d_name;
+
+        if (0 != stat((directory + "/" + file.name).c_str(), &st) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        file.size = (uint64_t) st.st_size;
+        file.mtime = st.st_mtime;
+        files.push_back(file);
+    }
+
+    closedir(dir);
+#endif
+    return files;
+}
+
+/**
+ * Entries are named after the SHA-256 of their key.
+ */
+static std::string EntryName(const std::string &key) {
+    checksum_t sum(CHECKSUM_SHA256);
+    sum.update((const unsigned char *) key.data(), key.size());
+    return sum.hexDigest() + ENTRY_SUFFIX;
+}
+
+download_cache_state_t::download_cache_state_t() : opened(false), budget(download_cache_t::DEFAULT_BUDGET), size(0),
+                                                   hits(0), misses(0), reserved(0) {}
+
+download_cache_t::download_cache_t() : m_state(std::make_shared<download_cache_state_t>()) {}
+
+download_cache_t::download_cache_t(const download_cache_t &cache) : m_state(cache.m_state) {}
+
+/**
+ * Opens the cache in `directory`, creating it if needed. Entries left by
+ * earlier sessions are picked up, unfinished downloads are removed.
+ */
+bool download_cache_t::open(const std::string directory, const uint64_t budget) {
+    std::unique_lock <std::mutex> lk(m_state->mx);
+
+    if (!MakeDirectory(directory.c_str())) {
+        return false;
+    }
+
+    m_state->directory = directory;
+    m_state->budget = budget ? budget : DEFAULT_BUDGET;
+    m_state->size = 0;
+    m_state->uses.clear();
+    m_state->entries.clear();
+
+    std::vector <cache_file_t> files = ListCacheDirectory(directory);
+    std::sort(files.begin(), files.end(), NewerFirst);
+
+    for (cache_file_t &file : files) {
+        if (EndsWith(file.name, TEMPORARY_SUFFIX)) {
+            RemoveFile((directory + "/" + file.name).c_str());
+        } else if (EndsWith(file.name, ENTRY_SUFFIX)) {
+            download_cache_entry_t &entry = m_state->entries[file.name];
+            entry.size = file.size;
+            entry.use = m_state->uses.insert(m_state->uses.end(), file.name);
+            m_state->size += file.size;
+        }
+    }
+
+    m_state->opened = true;
+    evict(lk);
+
+    return true;
+}
+
+void download_cache_t::close() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+
+    m_state->opened = false;
+    m_state->size = 0;
+    m_state->uses.clear();
+    m_state->entries.clear();
+}
+
+uint64_t download_cache_t::getBudget() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->budget;
+}
+
+void download_cache_t::setBudget(const uint64_t budget) {
+    std::unique_lock <std::mutex> lk(m_state->mx);
+    m_state->budget = budget ? budget : DEFAULT_BUDGET;
+    evict(lk);
+}
+
+uint64_t download_cache_t::getSize() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->size;
+}
+
+uint32_t download_cache_t::getEntries() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return (uint32_t) m_state->entries.size();
+}
+
+uint64_t download_cache_t::getHits() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->hits;
+}
+
+uint64_t download_cache_t::getMisses() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->misses;
+}
+
+bool download_cache_t::clear() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    bool ok = true;
+
+    for (std::string &name : m_state->uses) {
+        ok = 0 == RemoveFile((m_state->directory + "/" + name).c_str()) && ok;
+    }
+
+    m_state->size = 0;
+    m_state->uses.clear();
+    m_state->entries.clear();
+
+    return ok;
+}
+
+bool download_cache_t::isOpen() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->opened;
+}
+
+std::string download_cache_t::lookup(const std::string &key) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    std::string name = EntryName(key);
+    std::unordered_map<std::string, download_cache_entry_t>::iterator it = m_state->entries.find(name);
+
+    if (!m_state->opened) {
+        return std::string();
+    }
+
+    if (it == m_state->entries.end()) {
+        m_state->misses++;
+        return std::string();
+    }
+
+    std::string path = m_state->directory + "/" + name;
+
+    // the entry was removed behind our back
+    if (!SetModificationTime(path.c_str(), time(nullptr))) {
+        m_state->size -= it->second.size;
+        m_state->uses.erase(it->second.use);
+        m_state->entries.erase(it);
+        m_state->misses++;
+        return std::string();
+    }
+
+    m_state->uses.splice(m_state->uses.begin(), m_state->uses, it->second.use);
+    m_state->hits++;
+
+    return path;
+}
+
+std::string download_cache_t::reserve() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    uint64_t ticks = (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count();
+
+    return m_state->directory + "/" + std::to_string(ticks) + "-" + std::to_string(++m_state->reserved) +
+           TEMPORARY_SUFFIX;
+}
+
+std::string download_cache_t::commit(const std::string &key, const std::string &temporary) {
+    std::unique_lock <std::mutex> lk(m_state->mx);
+    std::string name = EntryName(key);
+    std::string path = m_state->directory + "/" + name;
+    int fd = OpenFileForRead(temporary.c_str());
+    int64_t size = fd >= 0 ? FileSize(fd) : -1;
+
+    if (fd >= 0) {
+        CloseFile(fd);
+    }
+
+    if (!m_state->opened || size < 0 || 0 != RenameFile(temporary.c_str(), path.c_str())) {
+        RemoveFile(temporary.c_str());
+        return std::string();
+    }
+
+    std::unordered_map<std::string, download_cache_entry_t>::iterator it = m_state->entries.find(name);
+
+    if (it != m_state->entries.end()) {
+        m_state->size -= it->second.size;
+        m_state->uses.erase(it->second.use);
+    }
+
+    download_cache_entry_t &entry = m_state->entries[name];
+    entry.size = (uint64_t) size;
+    entry.use = m_state->uses.insert(m_state->uses.begin(), name);
+    m_state->size += entry.size;
+
+    evict(lk);
+
+    return path;
+}
+
+std::string download_cache_t::keyFor(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t size, time_t mtime) {
+    char *serial = LIBMTP_Get_Serialnumber(device);
+    std::string key = nullptr != serial ? serial : "";
+
+    free(serial);
+
+    return key + ":" + std::to_string(id) + ":" + std::to_string(size) + ":" + std::to_string((int64_t) mtime);
+}
+
+void download_cache_t::evict(std::unique_lock <std::mutex> &lk) {
+    while (m_state->size > m_state->budget && !m_state->uses.empty()) {
+        std::string name = m_state->uses.back();
+        std::unordered_map<std::string, download_cache_entry_t>::iterator it = m_state->entries.find(name);
+
+        RemoveFile((m_state->directory + "/" + name).c_str());
+        m_state->size -= it->second.size;
+        m_state->uses.pop_back();
+        m_state->entries.erase(it);
+    }
+}
+
+class cache_fill_ctx_t {
+public:
+    cache_fill_ctx_t(LIBMTP_mtpdevice_t *device, transfer_job_t &job, checksum_t &sum, int fd, int cacheFd) :
+            m_device(device), m_job(job), m_sum(sum), m_fd(fd), m_cacheFd(cacheFd) {}
+
+    LIBMTP_mtpdevice_t *m_device;
+    transfer_job_t &m_job;
+    checksum_t &m_sum;
+    int m_fd;
+    int m_cacheFd;
+};
+
+/**
+ * Writes the object to its destination and to the cache at once. A failed
+ * cache write only drops the cache copy.
+ */
+static uint16_t CacheFillDataPut(void *params, void *priv, uint32_t sendlen, unsigned char *data,
+                                 uint32_t *putlen) {
+    cache_fill_ctx_t *ctx = (cache_fill_ctx_t *) priv;
+
+    if (ctx->m_job.isAborted() || !ThrottleTransfer(ctx->m_device, ctx->m_job, sendlen)) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    if (!WriteFully(ctx->m_fd, data, sendlen)) {
+        return LIBMTP_HANDLER_RETURN_ERROR;
+    }
+
+    if (ctx->m_cacheFd >= 0 && !WriteFully(ctx->m_cacheFd, data, sendlen)) {
+        CloseFile(ctx->m_cacheFd);
+        ctx->m_cacheFd = -1;
+    }
+
+    ctx->m_sum.update(data, sendlen);
+    *putlen = sendlen;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+static bool CopyCachedFile(const std::string &from, const std::string &to, uint64_t size, transfer_job_t &job,
+                           checksum_t &sum) {
+    int in = OpenFileForRead(from.c_str());
+    int out = in >= 0 ? OpenFileForWrite(to.c_str()) : -1;
+    bool ok = out >= 0;
+
+    if (ok) {
+        std::vector<unsigned char> block(COPY_BLOCK_SIZE);
+        uint64_t copied = 0;
+        int64_t got;
+
+        PreallocateFile(out, size);
+
+        while (ok && (got = ReadFully(in, block.data(), block.size())) > 0) {
+            ok = !job.isAborted() && WriteFully(out, block.data(), (uint64_t) got);
+            sum.update(block.data(), (size_t) got);
+            copied += got;
+            job.progress(copied, size);
+        }
+
+        ok = ok && 0 <= got && copied == size;
+        ok = 0 == CloseFile(out) && ok;
+
+        if (!ok) {
+            RemoveFile(to.c_str());
+        }
+    }
+
+    if (in >= 0) {
+        CloseFile(in);
+    }
+
+    return ok;
+}
+
+/**
+ * Downloads an object to `path`, served from the cache if it holds the
+ * current version of the object, and filling the cache otherwise.
+ */
+int Get_File_To_File_Cached(mtpdevice_t device, uint32_t const id, const std::string path,
+                            download_cache_t &cache, transfer_job_t &job) {
+    device_guard_t guard(device.m_device);
+
+    LIBMTP_file_t *meta = LIBMTP_Get_Filemetadata(device.m_device, id);
+
+    if (nullptr == meta) {
+        LIBMTP_Clear_Errorstack(device.m_device);
+        return -1;
+    }
+
+    uint64_t size = meta->filesize;
+    std::string key = download_cache_t::keyFor(device.m_device, id, size, meta->modificationdate);
+    LIBMTP_destroy_file_t(meta);
+
+    checksum_t sum(job.getChecksum());
+    std::string cached = cache.lookup(key);
+    int result;
+
+    job.beginFile();
+
+    if (!cached.empty()) {
+        result = CopyCachedFile(cached, path, size, job, sum) ? 0 : -1;
+    } else {
+        std::string temporary = cache.isOpen() ? cache.reserve() : std::string();
+        int fd = OpenFileForWrite(path.c_str());
+        int cacheFd = fd >= 0 && !temporary.empty() ? OpenFileForWrite(temporary.c_str()) : -1;
+        cache_fill_ctx_t ctx(device.m_device, job, sum, fd, cacheFd);
+
+        result = fd < 0 ? -1 : LIBMTP_Get_File_To_Handler(device.m_device, id, CacheFillDataPut, (void *) &ctx,
+                                                           TransferJobProgressCallback, (const void *) &job);
+
+        if (fd >= 0 && 0 != CloseFile(fd)) {
+            result = -1;
+        }
+        if (0 != result) {
+            LIBMTP_Clear_Errorstack(device.m_device);
+            RemoveFile(path.c_str());
+        }
+
+        bool filled = ctx.m_cacheFd >= 0 && 0 == CloseFile(ctx.m_cacheFd) && 0 == result;
+
+        if (filled) {
+            cache.commit(key, temporary);
+        } else if (!temporary.empty()) {
+            RemoveFile(temporary.c_str());
+        }
+    }
+
+    if (0 == result && sum.enabled()) {
+        job.setDigest(sum.hexDigest());
+    }
+    job.endFile(0 == result);
+
+    return result;
+}
+
+static int ReadLocalRange(const std::string &path, uint64_t offset, js_buffer_t &buf) {
+    int fd = OpenFileForRead(path.c_str());
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    int64_t got = SeekFile(fd, (int64_t) offset) < 0 ? -1 : ReadFully(fd, buf.data(), buf.length());
+    CloseFile(fd);
+
+    return (int) got;
+}
+
+/**
+ * Reads up to `buf.length()` bytes at `offset` of an object into `buf` and
+ * returns the number of bytes read, or -1. With an open cache, cached
+ * objects are read locally; small objects, or any object on a device
+ * without GetPartialObject, are downloaded into the cache on a miss. Other
+ * reads go through the block cache of the device.
+ */
+int Read_File_Range(mtpdevice_t device, uint32_t const id, uint64_t const offset, js_buffer_t buf,
+                    download_cache_t &cache) {
+    device_guard_t guard(device.m_device);
+
+    bool partial = 0 != LIBMTP_Check_Capability(device.m_device, LIBMTP_DEVICECAP_GetPartialObject);
+
+    if (cache.isOpen()) {
+        LIBMTP_file_t *meta = LIBMTP_Get_Filemetadata(device.m_device, id);
+
+        if (nullptr == meta) {
+            LIBMTP_Clear_Errorstack(device.m_device);
+            return -1;
+        }
+
+        uint64_t size = meta->filesize;
+        std::string key = download_cache_t::keyFor(device.m_device, id, size, meta->modificationdate);
+        LIBMTP_destroy_file_t(meta);
+
+        std::string cached = cache.lookup(key);
+
+        if (!cached.empty()) {
+            return ReadLocalRange(cached, offset, buf);
+        }
+
+        if (!partial || size <= RANGE_FILL_LIMIT) {
+            std::string temporary = cache.reserve();
+
+            if (0 != LIBMTP_Get_File_To_File(device.m_device, id, temporary.c_str(), nullptr, nullptr)) {
+                LIBMTP_Clear_Errorstack(device.m_device);
+                RemoveFile(temporary.c_str());
+                return -1;
+            }
+
+            int got = ReadLocalRange(temporary, offset, buf);
+            cache.commit(key, temporary);
+
+            return got;
+        }
+    }
+
+    if (!partial) {
+        return -1;
+    }
+
+    int64_t got = read_cache_t::forDevice(device.m_device)->read(device.m_device, id, offset,
+                                                                  (unsigned char *) buf.data(),
+                                                                  (uint32_t) buf.length());
+
+    return (int) got;
+}
+
+JS_CLASS(download_cache_t){
+        construct<>();
+        construct<const download_cache_t&>();
+        method(open);
+        method(close);
+        getset(getBudget, setBudget);
+        getter(getSize);
+        getter(getEntries);
+        getter(getHits);
+        getter(getMisses);
+        method(clear);
+}
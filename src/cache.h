@@ -0,0 +1,109 @@
+#ifndef MTP_CACHE_H
+#define MTP_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "binding.h"
+#include "libmtp.h"
+#include "mtp.h"
+#include "transfer.h"
+
+struct download_cache_entry_t {
+    uint64_t size;
+    std::list <std::string>::iterator use;
+};
+
+struct download_cache_state_t {
+    download_cache_state_t();
+
+    std::mutex mx;
+    std::string directory;
+    bool opened;
+
+    uint64_t budget;
+    uint64_t size;
+    uint64_t hits;
+    uint64_t misses;
+    uint32_t reserved;
+
+    /* entry names, most recently used first */
+    std::list <std::string> uses;
+    std::unordered_map <std::string, download_cache_entry_t> entries;
+};
+
+/**
+ * Content-addressed cache of downloaded objects on local disk.
+ *
+ * An entry is keyed by the device serial number, the object id, its size
+ * and its modification time, so a changed object simply misses and its
+ * stale copy ages out. The cache is bounded by a byte budget; the least
+ * recently used entries are evicted first. Use times are kept in the file
+ * modification times, so the order survives a restart.
+ */
+class download_cache_t {
+public:
+    static const uint64_t DEFAULT_BUDGET = 1024ULL * 1024 * 1024;
+
+    download_cache_t();
+
+    download_cache_t(const download_cache_t &cache);
+
+    bool open(const std::string directory, const uint64_t budget);
+
+    void close();
+
+    uint64_t getBudget();
+
+    void setBudget(const uint64_t budget);
+
+    uint64_t getSize();
+
+    uint32_t getEntries();
+
+    uint64_t getHits();
+
+    uint64_t getMisses();
+
+    bool clear();
+
+    bool isOpen();
+
+    /**
+     * Returns the path of a valid entry and marks it used, or an empty
+     * string on a miss.
+     */
+    std::string lookup(const std::string &key);
+
+    /**
+     * Returns a fresh temporary path to download an entry into.
+     */
+    std::string reserve();
+
+    /**
+     * Moves a completely downloaded temporary file into the cache and
+     * evicts entries until the cache fits its budget again. Returns the
+     * path of the entry, or an empty string.
+     */
+    std::string commit(const std::string &key, const std::string &temporary);
+
+    static std::string keyFor(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t size, time_t mtime);
+
+private:
+    void evict(std::unique_lock <std::mutex> &lk);
+
+    std::shared_ptr <download_cache_state_t> m_state;
+};
+
+int Get_File_To_File_Cached(mtpdevice_t device, uint32_t const id, const std::string path,
+                            download_cache_t &cache, transfer_job_t &job);
+
+int Read_File_Range(mtpdevice_t device, uint32_t const id, uint64_t const offset, js_buffer_t buf,
+                    download_cache_t &cache);
+
+#endif
@@ -0,0 +1,416 @@
+#include "checksum.h"
+
+#include <string.h>
+
+#include "fileio.h"
+#include "ratelimit.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define MTP_SHA_NI 1
+#define MTP_SHA_NI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define MTP_SHA_NI 1
+#define MTP_SHA_NI_TARGET
+#endif
+
+static const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static const uint32_t SHA256_K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t SHA256_INIT[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint64_t Rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t Rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static inline uint64_t ReadLE64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline uint32_t ReadLE32(const unsigned char *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint32_t ReadBE32(const unsigned char *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline uint64_t XxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = Rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t XxhMergeRound(uint64_t acc, uint64_t value) {
+    acc ^= XxhRound(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void Sha256Blocks(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    uint32_t w[64];
+
+    for (; blocks > 0; blocks--, data += 64) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = ReadBE32(data + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = Rotr32(w[i - 15], 7) ^ Rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = Rotr32(w[i - 2], 17) ^ Rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (Rotr32(e, 6) ^ Rotr32(e, 11) ^ Rotr32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] +
+                          w[i];
+            uint32_t t2 = (Rotr32(a, 2) ^ Rotr32(a, 13) ^ Rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef MTP_SHA_NI
+
+static bool HasShaExtensions() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool sse = 0 != (info[2] & (1 << 9)) && 0 != (info[2] & (1 << 19));
+    __cpuidex(info, 7, 0);
+    return sse && 0 != (info[1] & (1 << 29));
+#else
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    bool sse = 0 != (ecx & (1 << 9)) && 0 != (ecx & (1 << 19));
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return sse && 0 != (ebx & (1 << 29));
+#endif
+}
+
+/**
+ * SHA-256 with the SHA extensions: four rounds per pair of sha256rnds2 and
+ * the message schedule in sha256msg1/sha256msg2.
+ */
+MTP_SHA_NI_TARGET
+static void Sha256BlocksShaNi(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+
+        for (int i = 0; i < 16; i++) {
+            __m128i &current = w[i & 3];
+
+            if (i < 4) {
+                current = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), mask);
+            } else {
+                __m128i next = _mm_sha256msg1_epu32(current, w[(i + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                current = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+            }
+
+            __m128i message = _mm_add_epi32(current, _mm_loadu_si128((const __m128i *) &SHA256_K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(message, 0x0E));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i *) &state[0], state0);
+    _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+#endif
+
+typedef void (*sha256_blocks_t)(uint32_t *, const unsigned char *, size_t);
+
+static sha256_blocks_t Sha256Implementation() {
+#ifdef MTP_SHA_NI
+    static const sha256_blocks_t implementation = HasShaExtensions() ? Sha256BlocksShaNi : Sha256Blocks;
+    return implementation;
+#else
+    return Sha256Blocks;
+#endif
+}
+
+static size_t BlockSize(int algorithm) {
+    return CHECKSUM_XXH64 == algorithm ? 32 : 64;
+}
+
+checksum_t::checksum_t(int algorithm) : m_algorithm(algorithm), m_length(0), m_buffered(0) {
+    if (CHECKSUM_XXH64 != m_algorithm && CHECKSUM_SHA256 != m_algorithm) {
+        m_algorithm = CHECKSUM_NONE;
+    }
+
+    m_acc[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    m_acc[1] = XXH_PRIME64_2;
+    m_acc[2] = 0;
+    m_acc[3] = 0 - XXH_PRIME64_1;
+
+    memcpy(m_state, SHA256_INIT, sizeof(m_state));
+}
+
+void checksum_t::consume(const unsigned char *data, size_t blocks) {
+    if (CHECKSUM_SHA256 == m_algorithm) {
+        Sha256Implementation()(m_state, data, blocks);
+        return;
+    }
+
+    for (; blocks > 0; blocks--, data += 32) {
+        m_acc[0] = XxhRound(m_acc[0], ReadLE64(data));
+        m_acc[1] = XxhRound(m_acc[1], ReadLE64(data + 8));
+        m_acc[2] = XxhRound(m_acc[2], ReadLE64(data + 16));
+        m_acc[3] = XxhRound(m_acc[3], ReadLE64(data + 24));
+    }
+}
+
+void checksum_t::update(const unsigned char *data, size_t length) {
+    if (!enabled() || 0 == length) {
+        return;
+    }
+
+    size_t blockSize = BlockSize(m_algorithm);
+    m_length += length;
+
+    if (m_buffered > 0) {
+        size_t fill = blockSize - m_buffered < length ? blockSize - m_buffered : length;
+
+        memcpy(m_buffer + m_buffered, data, fill);
+        m_buffered += fill;
+        data += fill;
+        length -= fill;
+
+        if (m_buffered < blockSize) {
+            return;
+        }
+
+        consume(m_buffer, 1);
+        m_buffered = 0;
+    }
+
+    size_t blocks = length / blockSize;
+
+    consume(data, blocks);
+    data += blocks * blockSize;
+    length -= blocks * blockSize;
+
+    memcpy(m_buffer, data, length);
+    m_buffered = length;
+}
+
+std::string checksum_t::hexDigest() {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[32];
+    size_t size = 0;
+
+    if (CHECKSUM_XXH64 == m_algorithm) {
+        uint64_t h;
+
+        if (m_length >= 32) {
+            h = Rotl64(m_acc[0], 1) + Rotl64(m_acc[1], 7) + Rotl64(m_acc[2], 12) + Rotl64(m_acc[3], 18);
+            for (int i = 0; i < 4; i++) {
+                h = XxhMergeRound(h, m_acc[i]);
+            }
+        } else {
+            h = XXH_PRIME64_5;
+        }
+
+        h += m_length;
+
+        const unsigned char *p = m_buffer;
+        size_t left = m_buffered;
+
+        for (; left >= 8; left -= 8, p += 8) {
+            h ^= XxhRound(0, ReadLE64(p));
+            h = Rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        }
+        if (left >= 4) {
+            h ^= (uint64_t) ReadLE32(p) * XXH_PRIME64_1;
+            h = Rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+            left -= 4;
+            p += 4;
+        }
+        for (; left > 0; left--, p++) {
+            h ^= (*p) * XXH_PRIME64_5;
+            h = Rotl64(h, 11) * XXH_PRIME64_1;
+        }
+
+        h ^= h >> 33;
+        h *= XXH_PRIME64_2;
+        h ^= h >> 29;
+        h *= XXH_PRIME64_3;
+        h ^= h >> 32;
+
+        for (int i = 0; i < 8; i++) {
+            digest[i] = (unsigned char) (h >> (56 - 8 * i));
+        }
+        size = 8;
+    } else if (CHECKSUM_SHA256 == m_algorithm) {
+        uint32_t state[8];
+        unsigned char tail[128];
+        size_t tailLength = m_buffered < 56 ? 64 : 128;
+        uint64_t bits = m_length * 8;
+
+        memcpy(state, m_state, sizeof(state));
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, m_buffer, m_buffered);
+        tail[m_buffered] = 0x80;
+
+        for (int i = 0; i < 8; i++) {
+            tail[tailLength - 1 - i] = (unsigned char) (bits >> (8 * i));
+        }
+
+        Sha256Implementation()(state, tail, tailLength / 64);
+
+        for (int i = 0; i < 32; i++) {
+            digest[i] = (unsigned char) (state[i / 4] >> (24 - 8 * (i % 4)));
+        }
+        size = 32;
+    }
+
+    std::string hex;
+    hex.reserve(2 * size);
+
+    for (size_t i = 0; i < size; i++) {
+        hex += digits[digest[i] >> 4];
+        hex += digits[digest[i] & 0x0f];
+    }
+
+    return hex;
+}
+
+class checksum_fd_ctx_t {
+public:
+    checksum_fd_ctx_t(LIBMTP_mtpdevice_t *device, int fd, transfer_job_t &job, checksum_t &sum) :
+            m_device(device), m_fd(fd), m_job(job), m_sum(sum) {}
+
+    LIBMTP_mtpdevice_t *m_device;
+    int m_fd;
+    transfer_job_t &m_job;
+    checksum_t &m_sum;
+};
+
+static uint16_t ChecksumDataPut(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen) {
+    checksum_fd_ctx_t *ctx = (checksum_fd_ctx_t *) priv;
+
+    if (ctx->m_job.isAborted() || !ThrottleTransfer(ctx->m_device, ctx->m_job, sendlen)) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    if (!WriteFully(ctx->m_fd, data, sendlen)) {
+        return LIBMTP_HANDLER_RETURN_ERROR;
+    }
+
+    ctx->m_sum.update(data, sendlen);
+    *putlen = sendlen;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+static uint16_t ChecksumDataGet(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen) {
+    checksum_fd_ctx_t *ctx = (checksum_fd_ctx_t *) priv;
+
+    if (ctx->m_job.isAborted()) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    int64_t got = ReadFully(ctx->m_fd, data, wantlen);
+
+    if (got < 0) {
+        return LIBMTP_HANDLER_RETURN_ERROR;
+    }
+    if (!ThrottleTransfer(ctx->m_device, ctx->m_job, (uint64_t) got)) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    ctx->m_sum.update(data, (size_t) got);
+    *gotlen = (uint32_t) got;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+int GetFileToDescriptorChecksummed(LIBMTP_mtpdevice_t *device, uint32_t id, int fd, transfer_job_t &job,
+                                   checksum_t &sum) {
+    checksum_fd_ctx_t ctx(device, fd, job, sum);
+
+    return LIBMTP_Get_File_To_Handler(device, id, ChecksumDataPut, (void *) &ctx, TransferJobProgressCallback,
+                                      (const void *) &job);
+}
+
+int SendFileFromDescriptorChecksummed(LIBMTP_mtpdevice_t *device, int fd, LIBMTP_file_t *filedata,
+                                      transfer_job_t &job, checksum_t &sum) {
+    checksum_fd_ctx_t ctx(device, fd, job, sum);
+
+    return LIBMTP_Send_File_From_Handler(device, ChecksumDataGet, (void *) &ctx, filedata,
+                                         TransferJobProgressCallback, (const void *) &job);
+}
@@ -0,0 +1,58 @@
+#ifndef MTP_CHECKSUM_H
+#define MTP_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "libmtp.h"
+#include "transfer.h"
+
+enum checksum_algorithm_t {
+    CHECKSUM_NONE = 0,
+    CHECKSUM_XXH64 = 1,
+    CHECKSUM_SHA256 = 2
+};
+
+/**
+ * Incremental digest over the data of one transfer, fed chunk by chunk as
+ * the data passes through. XXH64 is meant for fast change detection,
+ * SHA-256 for integrity checks; SHA-256 uses the x86 SHA extensions when
+ * the CPU has them.
+ */
+class checksum_t {
+public:
+    explicit checksum_t(int algorithm);
+
+    bool enabled() { return CHECKSUM_NONE != m_algorithm; }
+
+    void update(const unsigned char *data, size_t length);
+
+    /**
+     * Lower case hex digest, empty if no algorithm was selected.
+     */
+    std::string hexDigest();
+
+private:
+    void consume(const unsigned char *data, size_t blocks);
+
+    int m_algorithm;
+    uint64_t m_length;
+    uint64_t m_acc[4];
+    uint32_t m_state[8];
+    unsigned char m_buffer[64];
+    size_t m_buffered;
+};
+
+/**
+ * Downloads an object into a file descriptor through a handler, so every
+ * chunk is hashed on its way to the disk. Shaped and reported like the
+ * other job transfers.
+ */
+int GetFileToDescriptorChecksummed(LIBMTP_mtpdevice_t *device, uint32_t id, int fd, transfer_job_t &job,
+                                   checksum_t &sum);
+
+int SendFileFromDescriptorChecksummed(LIBMTP_mtpdevice_t *device, int fd, LIBMTP_file_t *filedata,
+                                      transfer_job_t &job, checksum_t &sum);
+
+#endif
@@ -0,0 +1,127 @@
+#include "dispatcher.h"
+
+/* the dispatcher of the JS environment running on this thread, if any */
+static thread_local std::shared_ptr <js_dispatcher_t> threadDispatcher;
+
+js_dispatcher_t::js_dispatcher_t(uv_loop_t *loop) : m_async(new uv_async_t), m_thread(std::this_thread::get_id()),
+                                                    m_open(true), m_holds(0) {
+    uv_async_init(loop, m_async, drain);
+    m_async->data = this;
+    uv_unref((uv_handle_t *) m_async);
+}
+
+js_dispatcher_t::~js_dispatcher_t() {
+    close(this);
+}
+
+std::shared_ptr <js_dispatcher_t> js_dispatcher_t::current() {
+    return threadDispatcher;
+}
+
+std::shared_ptr <js_dispatcher_t> js_dispatcher_t::create(napi_env env) {
+    uv_loop_t *loop = nullptr;
+
+    if (napi_ok != napi_get_uv_event_loop(env, &loop)) {
+        return nullptr;
+    }
+
+    threadDispatcher = std::shared_ptr<js_dispatcher_t>(new js_dispatcher_t(loop));
+    napi_add_env_cleanup_hook(env, close, threadDispatcher.get());
+
+    return threadDispatcher;
+}
+
+bool js_dispatcher_t::onThread() {
+    return std::this_thread::get_id() == m_thread;
+}
+
+bool js_dispatcher_t::isOpen() {
+    std::lock_guard <std::mutex> lk(m_mx);
+    return m_open;
+}
+
+bool js_dispatcher_t::post(std::function<void()> fn) {
+    {
+        std::lock_guard <std::mutex> lk(m_mx);
+
+        if (!m_open) {
+            return false;
+        }
+
+        m_queue.push_back(fn);
+        uv_async_send(m_async);
+    }
+
+    return true;
+}
+
+void js_dispatcher_t::hold() {
+    if (isOpen() && 0 == m_holds++) {
+        uv_ref((uv_handle_t *) m_async);
+    }
+}
+
+void js_dispatcher_t::unhold() {
+    if (isOpen() && m_holds > 0 && 0 == --m_holds) {
+        uv_unref((uv_handle_t *) m_async);
+    }
+}
+
+void js_dispatcher_t::drain(uv_async_t *handle) {
+    js_dispatcher_t *dispatcher = (js_dispatcher_t *) handle->data;
+    std::deque <std::function<void()>> queue;
+
+    {
+        std::lock_guard <std::mutex> lk(dispatcher->m_mx);
+        queue.swap(dispatcher->m_queue);
+    }
+
+    // every JS callback opens its own handle scope
+    for (std::function<void()> &fn : queue) {
+        fn();
+    }
+}
+
+/**
+ * Runs on the JS thread as its environment is torn down. Whatever is still
+ * queued is dropped; callbacks released after this no longer touch JS.
+ */
+void js_dispatcher_t::close(void *data) {
+    js_dispatcher_t *dispatcher = (js_dispatcher_t *) data;
+    std::deque <std::function<void()>> queue;
+
+    {
+        std::lock_guard <std::mutex> lk(dispatcher->m_mx);
+
+        if (!dispatcher->m_open) {
+            return;
+        }
+
+        dispatcher->m_open = false;
+        queue.swap(dispatcher->m_queue);
+    }
+
+    uv_close((uv_handle_t *) dispatcher->m_async, [](uv_handle_t *handle) { delete (uv_async_t *) handle; });
+
+    if (threadDispatcher.get() == dispatcher) {
+        threadDispatcher.reset();
+    }
+}
+
+std::shared_ptr <js_function_t> MakeJsCallback(js_function_t &cb) {
+    std::shared_ptr <js_dispatcher_t> dispatcher = cb.getDispatcher();
+
+    return std::shared_ptr<js_function_t>(new js_function_t(cb), [dispatcher](js_function_t *fn) {
+        if (!dispatcher || dispatcher->onThread() || !dispatcher->post([fn] { delete fn; })) {
+            delete fn;
+        }
+    });
+}
+
+void PostJsCallback(const std::shared_ptr <js_function_t> &cb, std::function<void()> fn) {
+    std::shared_ptr <js_dispatcher_t> dispatcher = cb->getDispatcher();
+
+    if (dispatcher) {
+        dispatcher->post(fn);
+    }
+}
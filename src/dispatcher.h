@@ -0,0 +1,82 @@
+#ifndef MTP_DISPATCHER_H
+#define MTP_DISPATCHER_H
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <uv.h>
+
+#include "binding.h"
+
+/**
+ * Hands work from native threads over to a JS thread.
+ *
+ * JS callbacks may only be invoked (and released) on the thread of the JS
+ * environment they come from, so the device executors post their progress
+ * reports and completions to the dispatcher of that environment: one per
+ * environment, i.e. one for the main thread and one for each worker which
+ * loads the addon. The async handle only keeps the event loop alive while
+ * some native work is outstanding, see hold() and unhold().
+ */
+class js_dispatcher_t {
+public:
+    /**
+     * The dispatcher of the JS environment running on the calling thread,
+     * nullptr on any other thread.
+     */
+    static std::shared_ptr <js_dispatcher_t> current();
+
+    /**
+     * Creates the dispatcher of an environment as the addon is loaded into
+     * it. It is closed along with the environment.
+     */
+    static std::shared_ptr <js_dispatcher_t> create(napi_env env);
+
+    ~js_dispatcher_t();
+
+    bool onThread();
+
+    bool isOpen();
+
+    /**
+     * Queues `fn` for the JS thread. Returns false, dropping `fn`, once the
+     * environment is gone.
+     */
+    bool post(std::function<void()> fn);
+
+    void hold();
+
+    void unhold();
+
+private:
+    js_dispatcher_t(uv_loop_t *loop);
+
+    static void drain(uv_async_t *handle);
+
+    static void close(void *data);
+
+    std::mutex m_mx;
+    std::deque <std::function<void()>> m_queue;
+    uv_async_t *m_async;
+    std::thread::id m_thread;
+    bool m_open;
+    uint32_t m_holds;
+};
+
+/**
+ * Copies a JS callback so it can outlive the current call. The copy is
+ * always released on its JS thread, whichever thread drops the last
+ * reference.
+ */
+std::shared_ptr <js_function_t> MakeJsCallback(js_function_t &cb);
+
+/**
+ * Posts `fn`, which invokes `cb`, to the JS thread `cb` belongs to.
+ */
+void PostJsCallback(const std::shared_ptr <js_function_t> &cb, std::function<void()> fn);
+
+#endif
@@ -0,0 +1,368 @@
+#include "executor.h"
+
+#include <map>
+#include <stdexcept>
+
+#include "dispatcher.h"
+#include "registry.h"
+
+device_gate_t::device_gate_t() : m_depth(0) {
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        m_waiting[i] = 0;
+    }
+}
+
+void device_gate_t::acquire(int priority) {
+    std::unique_lock <std::mutex> lk(m_mx);
+
+    if (m_depth > 0 && m_owner == std::this_thread::get_id()) {
+        m_depth++;
+        return;
+    }
+
+    m_waiting[priority]++;
+    m_cv.wait(lk, [this, priority] {
+        if (m_depth > 0) {
+            return false;
+        }
+
+        for (int i = 0; i < priority; i++) {
+            if (m_waiting[i] > 0) {
+                return false;
+            }
+        }
+
+        return true;
+    });
+    m_waiting[priority]--;
+
+    m_owner = std::this_thread::get_id();
+    m_depth = 1;
+}
+
+void device_gate_t::release() {
+    std::lock_guard <std::mutex> lk(m_mx);
+
+    if (0 == --m_depth) {
+        m_owner = std::thread::id();
+        m_cv.notify_all();
+    }
+}
+
+device_guard_t::device_guard_t(LIBMTP_mtpdevice_t *device, int priority) :
+        m_gate(device_executor_t::gateFor(device)) {
+    m_gate->acquire(priority);
+}
+
+device_guard_t::~device_guard_t() {
+    m_gate->release();
+}
+
+scheduler_task_t::scheduler_task_t(int priority, uint32_t weight) : m_priority(priority),
+                                                                    m_weight(weight ? weight : 1),
+                                                                    m_finished(false), m_held(false),
+                                                                    m_handle(0),
+                                                                    m_dispatcher(js_dispatcher_t::current()) {
+    if (m_priority < PRIORITY_INTERACTIVE || m_priority >= PRIORITY_CLASSES) {
+        m_priority = PRIORITY_NORMAL;
+    }
+}
+
+/**
+ * Keeps the event loop of the JS thread which created the task alive and
+ * the device open until release(); called on that thread. Returns false if
+ * the device is being released already.
+ */
+bool scheduler_task_t::hold(LIBMTP_mtpdevice_t *device) {
+    if (m_dispatcher && !m_held) {
+        m_dispatcher->hold();
+        m_held = true;
+    }
+
+    if (0 == m_handle) {
+        m_handle = device_registry_t::instance().retain(device);
+    }
+
+    return 0 != m_handle;
+}
+
+/**
+ * Drops what hold() took, once the task will not run again. Dropping the
+ * last reference to the device releases it, which stops the executor, so
+ * that happens on the JS thread after the completion of the task, never on
+ * the executor thread or while a step is running.
+ */
+void scheduler_task_t::release() {
+    std::shared_ptr <js_dispatcher_t> dispatcher = m_held ? m_dispatcher : nullptr;
+    uint32_t handle = m_handle;
+
+    m_held = false;
+    m_handle = 0;
+
+    if (dispatcher && dispatcher->post([dispatcher, handle] {
+        if (0 != handle) {
+            device_registry_t::instance().release(handle);
+        }
+        dispatcher->unhold();
+    })) {
+        return;
+    }
+
+    // without its JS thread the reference goes on a thread of its own
+    if (0 != handle) {
+        std::thread([handle] { device_registry_t::instance().release(handle); }).detach();
+    }
+}
+
+/**
+ * Posts the completion of the task to the JS thread which created it. Only
+ * the first call has an effect.
+ */
+void scheduler_task_t::finish(std::function<void()> notify) {
+    if (m_finished) {
+        return;
+    }
+    m_finished = true;
+
+    if (m_dispatcher) {
+        m_dispatcher->post(notify);
+    }
+}
+
+void scheduler_task_t::defer(std::chrono::microseconds delay) {
+    m_notBefore = std::chrono::steady_clock::now() + delay;
+}
+
+struct device_entry_t {
+    std::shared_ptr <device_gate_t> gate;
+    std::shared_ptr <device_executor_t> executor;
+};
+
+static std::mutex &RegistryMutex() {
+    static std::mutex mx;
+    return mx;
+}
+
+static std::map<LIBMTP_mtpdevice_t *, device_entry_t> &Registry() {
+    static std::map<LIBMTP_mtpdevice_t *, device_entry_t> registry;
+    return registry;
+}
+
+std::shared_ptr <device_executor_t> device_executor_t::forDevice(LIBMTP_mtpdevice_t *device) {
+    std::lock_guard <std::mutex> lk(RegistryMutex());
+    device_entry_t &entry = Registry()[device];
+
+    if (!entry.gate) {
+        entry.gate = std::make_shared<device_gate_t>();
+    }
+    if (!entry.executor) {
+        entry.executor = std::make_shared<device_executor_t>(device);
+    }
+
+    return entry.executor;
+}
+
+std::shared_ptr <device_gate_t> device_executor_t::gateFor(LIBMTP_mtpdevice_t *device) {
+    std::lock_guard <std::mutex> lk(RegistryMutex());
+    device_entry_t &entry = Registry()[device];
+
+    if (!entry.gate) {
+        entry.gate = std::make_shared<device_gate_t>();
+    }
+
+    return entry.gate;
+}
+
+/**
+ * Stops the executor of a device which is about to be released. The running
+ * chunk is allowed to finish, every task still queued fails.
+ */
+void device_executor_t::release(LIBMTP_mtpdevice_t *device) {
+    device_entry_t entry;
+
+    {
+        std::lock_guard <std::mutex> lk(RegistryMutex());
+        std::map<LIBMTP_mtpdevice_t *, device_entry_t>::iterator it = Registry().find(device);
+
+        if (it == Registry().end()) {
+            return;
+        }
+
+        entry = it->second;
+        Registry().erase(it);
+    }
+
+    if (entry.executor) {
+        entry.executor->stop();
+    }
+}
+
+device_executor_t::device_executor_t(LIBMTP_mtpdevice_t *device) : m_device(device), m_bulkCredits(0),
+                                                                   m_chunkSize(DEFAULT_CHUNK_SIZE),
+                                                                   m_stopping(false) {}
+
+device_executor_t::~device_executor_t() {
+    stop();
+}
+
+void device_executor_t::submit(std::shared_ptr <scheduler_task_t> task) {
+    bool open = task->hold(m_device);
+
+    if (open) {
+        std::lock_guard <std::mutex> lk(m_mx);
+
+        if (!m_stopping) {
+            if (!m_thread.joinable()) {
+                m_thread = std::thread(&device_executor_t::run, this);
+            }
+
+            m_queues[task->getPriority()].push_back(task);
+            m_cv.notify_one();
+            return;
+        }
+    }
+
+    task->fail(LIBMTP_ERROR_NO_DEVICE_ATTACHED);
+    task->release();
+}
+
+uint32_t device_executor_t::getChunkSize() {
+    std::lock_guard <std::mutex> lk(m_mx);
+    return m_chunkSize;
+}
+
+void device_executor_t::setChunkSize(uint32_t chunkSize) {
+    std::lock_guard <std::mutex> lk(m_mx);
+    m_chunkSize = chunkSize ? chunkSize : DEFAULT_CHUNK_SIZE;
+}
+
+void device_executor_t::run() {
+    while (true) {
+        std::shared_ptr <scheduler_task_t> task;
+
+        {
+            std::unique_lock <std::mutex> lk(m_mx);
+            std::chrono::steady_clock::time_point wakeAt;
+
+            while (!m_stopping && !(task = next(wakeAt))) {
+                if (std::chrono::steady_clock::time_point::max() == wakeAt) {
+                    m_cv.wait(lk);
+                } else {
+                    m_cv.wait_until(lk, wakeAt);
+                }
+            }
+
+            if (m_stopping) {
+                return;
+            }
+        }
+
+        bool done = true;
+
+        try {
+            done = task->step(m_device);
+        } catch (const std::exception &) {
+            task->fail(LIBMTP_ERROR_GENERAL);
+        }
+
+        if (done) {
+            task->release();
+        }
+
+        std::lock_guard <std::mutex> lk(m_mx);
+
+        if (!done) {
+            requeue(task);
+        } else if (PRIORITY_BULK == task->getPriority()) {
+            m_bulkCredits = 0;
+        }
+    }
+}
+
+void device_executor_t::stop() {
+    {
+        std::lock_guard <std::mutex> lk(m_mx);
+        m_stopping = true;
+        m_cv.notify_all();
+    }
+
+    if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id()) {
+        m_thread.join();
+    }
+
+    std::deque <std::shared_ptr<scheduler_task_t>> pending;
+
+    {
+        std::lock_guard <std::mutex> lk(m_mx);
+
+        for (int i = 0; i < PRIORITY_CLASSES; i++) {
+            pending.insert(pending.end(), m_queues[i].begin(), m_queues[i].end());
+            m_queues[i].clear();
+        }
+    }
+
+    for (std::shared_ptr <scheduler_task_t> &task : pending) {
+        task->fail(LIBMTP_ERROR_NO_DEVICE_ATTACHED);
+        task->release();
+    }
+}
+
+/**
+ * Picks the first task which is not deferred, most urgent class first. When
+ * every queued task is deferred, `wakeAt` is set to the earliest time one of
+ * them becomes runnable again.
+ */
+std::shared_ptr <scheduler_task_t> device_executor_t::next(std::chrono::steady_clock::time_point &wakeAt) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    wakeAt = std::chrono::steady_clock::time_point::max();
+
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        std::deque <std::shared_ptr<scheduler_task_t>> &queue = m_queues[i];
+
+        for (std::deque <std::shared_ptr<scheduler_task_t>>::iterator it = queue.begin(); it != queue.end(); ++it) {
+            std::shared_ptr <scheduler_task_t> task = *it;
+
+            if (task->getNotBefore() > now) {
+                if (task->getNotBefore() < wakeAt) {
+                    wakeAt = task->getNotBefore();
+                }
+                continue;
+            }
+
+            // a task overtaking a deferred one starts a new round robin turn
+            bool head = it == queue.begin();
+            queue.erase(it);
+
+            if (PRIORITY_BULK == i && (0 == m_bulkCredits || !head)) {
+                m_bulkCredits = task->getWeight();
+            }
+
+            return task;
+        }
+    }
+
+    return std::shared_ptr<scheduler_task_t>();
+}
+
+/**
+ * An unfinished bulk task keeps the head of the queue until its turn of
+ * `weight` chunks is used up, then it moves behind the other bulk tasks.
+ */
+void device_executor_t::requeue(std::shared_ptr <scheduler_task_t> task) {
+    std::deque <std::shared_ptr<scheduler_task_t>> &queue = m_queues[task->getPriority()];
+
+    if (PRIORITY_BULK != task->getPriority()) {
+        queue.push_front(task);
+        return;
+    }
+
+    if (m_bulkCredits > 0) {
+        m_bulkCredits--;
+    }
+
+    if (m_bulkCredits > 0) {
+        queue.push_front(task);
+    } else {
+        queue.push_back(task);
+    }
+}
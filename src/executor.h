@@ -0,0 +1,151 @@
+#ifndef MTP_EXECUTOR_H
+#define MTP_EXECUTOR_H
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "libmtp.h"
+
+class js_dispatcher_t;
+
+enum scheduler_priority_t {
+    PRIORITY_INTERACTIVE = 0,
+    PRIORITY_NORMAL = 1,
+    PRIORITY_BULK = 2,
+    PRIORITY_CLASSES = 3
+};
+
+/**
+ * Serializes libmtp access to a single device.
+ *
+ * Both the JS thread and the device executor go through the gate, which
+ * hands the device to the waiter of the most urgent priority class first.
+ * The gate is re-entrant for the thread owning it, so a progress callback
+ * may call back into the addon for the same device.
+ */
+class device_gate_t {
+public:
+    device_gate_t();
+
+    void acquire(int priority);
+
+    void release();
+
+private:
+    std::mutex m_mx;
+    std::condition_variable m_cv;
+    std::thread::id m_owner;
+    uint32_t m_depth;
+    uint32_t m_waiting[PRIORITY_CLASSES];
+};
+
+class device_guard_t {
+public:
+    device_guard_t(LIBMTP_mtpdevice_t *device, int priority = PRIORITY_INTERACTIVE);
+
+    ~device_guard_t();
+
+private:
+    device_guard_t(const device_guard_t &);
+
+    std::shared_ptr <device_gate_t> m_gate;
+};
+
+/**
+ * A unit of work for a device executor. step() performs one slice of the
+ * work (a complete request, or one chunk of a bulk transfer) and returns
+ * true once the task is finished. fail() is called instead for tasks which
+ * can no longer run because the device is being released. A task may defer
+ * its next step, e.g. to honour a rate limit, without occupying the worker.
+ *
+ * From submission until it is done, a task holds a reference to its device,
+ * so the device is never released while the task is queued or running.
+ */
+class scheduler_task_t {
+public:
+    scheduler_task_t(int priority, uint32_t weight);
+
+    virtual ~scheduler_task_t() {}
+
+    virtual bool step(LIBMTP_mtpdevice_t *device) = 0;
+
+    virtual void fail(int error) = 0;
+
+    int getPriority() { return m_priority; }
+
+    uint32_t getWeight() { return m_weight; }
+
+    std::chrono::steady_clock::time_point getNotBefore() { return m_notBefore; }
+
+    bool hold(LIBMTP_mtpdevice_t *device);
+
+    void release();
+
+protected:
+    void finish(std::function<void()> notify);
+
+    void defer(std::chrono::microseconds delay);
+
+private:
+    int m_priority;
+    uint32_t m_weight;
+    bool m_finished;
+    bool m_held;
+    uint32_t m_handle;
+    std::chrono::steady_clock::time_point m_notBefore;
+    std::shared_ptr <js_dispatcher_t> m_dispatcher;
+};
+
+/**
+ * One worker thread per device which runs the scheduled tasks.
+ *
+ * Priority classes are strict: a bulk chunk is only started when no
+ * interactive or normal task is waiting. Bulk tasks share the remaining
+ * time in weighted round robin order, `weight` chunks per turn.
+ */
+class device_executor_t {
+public:
+    static const uint32_t DEFAULT_CHUNK_SIZE = 1024 * 1024;
+
+    static std::shared_ptr <device_executor_t> forDevice(LIBMTP_mtpdevice_t *device);
+
+    static std::shared_ptr <device_gate_t> gateFor(LIBMTP_mtpdevice_t *device);
+
+    static void release(LIBMTP_mtpdevice_t *device);
+
+    explicit device_executor_t(LIBMTP_mtpdevice_t *device);
+
+    ~device_executor_t();
+
+    void submit(std::shared_ptr <scheduler_task_t> task);
+
+    uint32_t getChunkSize();
+
+    void setChunkSize(uint32_t chunkSize);
+
+private:
+    void run();
+
+    void stop();
+
+    std::shared_ptr <scheduler_task_t> next(std::chrono::steady_clock::time_point &wakeAt);
+
+    void requeue(std::shared_ptr <scheduler_task_t> task);
+
+    LIBMTP_mtpdevice_t *m_device;
+    std::mutex m_mx;
+    std::condition_variable m_cv;
+    std::deque <std::shared_ptr<scheduler_task_t>> m_queues[PRIORITY_CLASSES];
+    uint32_t m_bulkCredits;
+    uint32_t m_chunkSize;
+    bool m_stopping;
+    std::thread m_thread;
+};
+
+#endif
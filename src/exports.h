@@ -0,0 +1,378 @@
+#ifndef MTP_EXPORTS_H
+#define MTP_EXPORTS_H
+
+#include <exception>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "binding.h"
+
+/**
+ * Declares what a source file exports to JS:
+ *
+ *     JS_CLASS(file_t) {
+ *         construct<>();
+ *         getset(getName, setName);
+ *         method(getStorages);
+ *     }
+ *
+ *     JS_GLOBAL() {
+ *         function(Init);
+ *     }
+ *
+ * A getter `getName` becomes the property `name`, methods and functions
+ * keep their C++ names. Arguments and results are converted with
+ * js_convert<T>, see binding.h; a conversion that does not fit throws a
+ * TypeError and C++ exceptions are rethrown as JS errors.
+ *
+ * The short names are macros, so include this header last.
+ */
+
+typedef void (*js_define_t)(napi_env env, napi_value exports);
+
+/**
+ * Queues a JS_CLASS or JS_GLOBAL block to run when the module is loaded;
+ * the classes are defined before any of the functions.
+ */
+class js_registration_t {
+public:
+    js_registration_t(bool isClass, js_define_t define);
+};
+
+template <size_t... I>
+struct js_indices {};
+
+template <size_t N, size_t... I>
+struct js_make_indices : js_make_indices<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct js_make_indices<0, I...> {
+    typedef js_indices<I...> type;
+};
+
+template <typename T>
+struct js_arg {
+    typedef js_convert<typename std::remove_cv<typename std::remove_reference<T>::type>::type> convert;
+};
+
+/**
+ * The converted arguments of one call.
+ */
+template <typename... Args>
+struct js_args_t {
+    bool load(napi_env env, napi_value *argv) {
+        return load(env, argv, typename js_make_indices<sizeof...(Args)>::type());
+    }
+
+    /* functions without arguments have nothing to convert */
+    bool load(napi_env, napi_value *, js_indices<>) {
+        return true;
+    }
+
+    template <size_t... I>
+    bool load(napi_env env, napi_value *argv, js_indices<I...>) {
+        bool ok = true;
+        bool loaded[] = {true, (ok = ok && js_arg<Args>::convert::fromJs(env, argv[I], std::get<I>(holders)))...};
+
+        (void) loaded;
+
+        return ok;
+    }
+
+    std::tuple<typename js_arg<Args>::convert::holder_t...> holders;
+};
+
+/**
+ * Runs `fn` and converts its result, turning C++ exceptions into JS ones.
+ */
+template <typename R>
+struct js_result {
+    template <typename F>
+    static napi_value run(napi_env env, F fn) {
+        try {
+            return js_arg<R>::convert::toJs(env, fn());
+        } catch (const std::exception &e) {
+            napi_throw_error(env, nullptr, e.what());
+        }
+
+        return nullptr;
+    }
+};
+
+template <>
+struct js_result<void> {
+    template <typename F>
+    static napi_value run(napi_env env, F fn) {
+        napi_value result = nullptr;
+
+        try {
+            fn();
+            napi_get_undefined(env, &result);
+        } catch (const std::exception &e) {
+            napi_throw_error(env, nullptr, e.what());
+        }
+
+        return result;
+    }
+};
+
+template <typename F, F f>
+struct js_function;
+
+template <typename R, typename... Args, R (*f)(Args...)>
+struct js_function<R (*)(Args...), f> {
+    static napi_value call(napi_env env, napi_callback_info info) {
+        js_call_scope_t scope;
+        napi_value argv[sizeof...(Args) + 1];
+        size_t argc = sizeof...(Args);
+        js_args_t<Args...> args;
+
+        if (napi_ok != napi_get_cb_info(env, info, &argc, argv, nullptr, nullptr) || !args.load(env, argv)) {
+            return nullptr;
+        }
+
+        return js_result<R>::run(env, [&args]() -> R {
+            return apply(args, typename js_make_indices<sizeof...(Args)>::type());
+        });
+    }
+
+    template <size_t... I>
+    static R apply(js_args_t<Args...> &args, js_indices<I...>) {
+        return f(js_arg<Args>::convert::get(std::get<I>(args.holders))...);
+    }
+};
+
+/**
+ * The instance a method of class `T` is called on.
+ */
+template <typename T>
+T *JsThis(napi_env env, napi_callback_info info, size_t &argc, napi_value *argv) {
+    napi_value self = nullptr;
+
+    if (napi_ok != napi_get_cb_info(env, info, &argc, argv, &self, nullptr)) {
+        return nullptr;
+    }
+
+    T *native = (T *) JsUnwrapNative(env, js_class_info<T>::record(), self);
+
+    if (nullptr == native) {
+        JsThrowTypeError(env, "Illegal invocation");
+    }
+
+    return native;
+}
+
+template <typename T, typename R, typename M, typename... Args>
+struct js_member {
+    template <M m>
+    static napi_value call(napi_env env, napi_callback_info info) {
+        js_call_scope_t scope;
+        napi_value argv[sizeof...(Args) + 1];
+        size_t argc = sizeof...(Args);
+        T *native = JsThis<T>(env, info, argc, argv);
+        js_args_t<Args...> args;
+
+        if (nullptr == native || !args.load(env, argv)) {
+            return nullptr;
+        }
+
+        return js_result<R>::run(env, [native, &args]() -> R {
+            return apply<m>(native, args, typename js_make_indices<sizeof...(Args)>::type());
+        });
+    }
+
+    /* stores `value` through a setter when an instance is built from a plain object */
+    template <M m>
+    static void assign(napi_env env, void *native, napi_value value) {
+        js_args_t<Args...> args;
+
+        if (args.load(env, &value)) {
+            apply<m>((T *) native, args, typename js_make_indices<sizeof...(Args)>::type());
+        }
+    }
+
+    template <M m, size_t... I>
+    static R apply(T *native, js_args_t<Args...> &args, js_indices<I...>) {
+        return (native->*m)(js_arg<Args>::convert::get(std::get<I>(args.holders))...);
+    }
+};
+
+/**
+ * A member function of `T`, which may be declared in a base class of it.
+ */
+template <typename T, typename M, M m>
+struct js_method;
+
+template <typename T, typename C, typename R, typename... Args, R (C::*m)(Args...)>
+struct js_method<T, R (C::*)(Args...), m> {
+    static napi_value call(napi_env env, napi_callback_info info) {
+        return js_member<T, R, R (C::*)(Args...), Args...>::template call<m>(env, info);
+    }
+
+    static void assign(napi_env env, void *native, napi_value value) {
+        js_member<T, R, R (C::*)(Args...), Args...>::template assign<m>(env, native, value);
+    }
+};
+
+template <typename T, typename C, typename R, typename... Args, R (C::*m)(Args...) const>
+struct js_method<T, R (C::*)(Args...) const, m> {
+    static napi_value call(napi_env env, napi_callback_info info) {
+        return js_member<T, R, R (C::*)(Args...) const, Args...>::template call<m>(env, info);
+    }
+
+    static void assign(napi_env env, void *native, napi_value value) {
+        js_member<T, R, R (C::*)(Args...) const, Args...>::template assign<m>(env, native, value);
+    }
+};
+
+template <typename T, typename... Args>
+struct js_constructor {
+    static void *create(napi_env env, napi_value *argv) {
+        js_args_t<Args...> args;
+
+        if (!args.load(env, argv)) {
+            return nullptr;
+        }
+
+        try {
+            return apply(args, typename js_make_indices<sizeof...(Args)>::type());
+        } catch (const std::exception &e) {
+            napi_throw_error(env, nullptr, e.what());
+        }
+
+        return nullptr;
+    }
+
+    template <size_t... I>
+    static void *apply(js_args_t<Args...> &args, js_indices<I...>) {
+        return new T(js_arg<Args>::convert::get(std::get<I>(args.holders))...);
+    }
+};
+
+template <typename T, bool isDefault>
+struct js_default_constructor {
+    static js_create_t get() { return nullptr; }
+};
+
+template <typename T>
+struct js_default_constructor<T, true> {
+    static js_create_t get() { return &create; }
+
+    static void *create() { return new T(); }
+};
+
+/**
+ * Collects the constructors and properties of one class and defines it on
+ * the exports, see JS_CLASS.
+ */
+class js_class_builder_t {
+protected:
+    js_class_builder_t(js_class_record_t &cls, const char *name, napi_env env, napi_value exports);
+
+    void addConstructor(size_t argc, void *(*create)(napi_env, napi_value *));
+
+    void addDefaultConstructor(js_create_t create);
+
+    void addGetset(const char *getter, napi_callback get, napi_callback set,
+                   void (*assign)(napi_env, void *, napi_value));
+
+    void addGetter(const char *getter, napi_callback get);
+
+    void addMethod(const char *name, napi_callback method);
+
+    void finish();
+
+private:
+    js_class_record_t &m_cls;
+    bool m_describe;
+    napi_env m_env;
+    napi_value m_exports;
+    std::vector <std::string> m_names;
+    std::vector <napi_callback> m_getters;
+    std::vector <napi_callback> m_setters;
+    std::vector <napi_callback> m_methods;
+    std::vector <bool> m_isMethod;
+};
+
+template <typename T>
+class js_class_definer_t : public js_class_builder_t {
+protected:
+    typedef T Bound;
+
+    js_class_definer_t(const char *name, napi_env env, napi_value exports) :
+            js_class_builder_t(js_class_info<T>::record(), name, env, exports) {}
+
+    template <typename... Args>
+    void construct() {
+        js_create_t create = js_default_constructor<T, 0 == sizeof...(Args)>::get();
+
+        if (nullptr != create) {
+            addDefaultConstructor(create);
+        }
+        addConstructor(sizeof...(Args), &js_constructor<T, Args...>::create);
+    }
+};
+
+class js_global_definer_t {
+protected:
+    js_global_definer_t(napi_env env, napi_value exports) : m_env(env), m_exports(exports) {}
+
+    void addFunction(const char *name, napi_callback fn);
+
+private:
+    napi_env m_env;
+    napi_value m_exports;
+};
+
+#define JS_METHOD(name) (&js_method<Bound, decltype(&Bound::name), &Bound::name>::call)
+
+#define JS_ASSIGN(name) (&js_method<Bound, decltype(&Bound::name), &Bound::name>::assign)
+
+#define JS_CLASS(T)                                                                 \
+    struct js_class_def_##T : js_class_definer_t<T> {                               \
+        js_class_def_##T(napi_env env, napi_value exports) :                        \
+                js_class_definer_t<T>(#T, env, exports) {                           \
+            define();                                                               \
+            finish();                                                               \
+        }                                                                           \
+                                                                                    \
+        void define();                                                              \
+                                                                                    \
+        static void run(napi_env env, napi_value exports) {                         \
+            js_class_def_##T definer(env, exports);                                 \
+        }                                                                           \
+    };                                                                              \
+                                                                                    \
+    static js_registration_t js_class_registration_##T(true, js_class_def_##T::run); \
+                                                                                    \
+    void js_class_def_##T::define()
+
+#define JS_GLOBAL()                                                                 \
+    struct js_global_def : js_global_definer_t {                                    \
+        js_global_def(napi_env env, napi_value exports) :                           \
+                js_global_definer_t(env, exports) {                                 \
+            define();                                                               \
+        }                                                                           \
+                                                                                    \
+        void define();                                                              \
+                                                                                    \
+        static void run(napi_env env, napi_value exports) {                         \
+            js_global_def definer(env, exports);                                    \
+        }                                                                           \
+    };                                                                              \
+                                                                                    \
+    static js_registration_t js_global_registration(false, js_global_def::run);     \
+                                                                                    \
+    void js_global_def::define()
+
+#define getset(get, set) addGetset(#get, JS_METHOD(get), JS_METHOD(set), JS_ASSIGN(set))
+
+#define getter(get) addGetter(#get, JS_METHOD(get))
+
+#define method(name) addMethod(#name, JS_METHOD(name))
+
+#define function(name) addFunction(#name, &js_function<decltype(&name), &name>::call)
+
+#endif
@@ -0,0 +1,1203 @@
+#include "extract.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+
+#include <zlib.h>
+
+#include "dispatcher.h"
+#include "executor.h"
+#include "fileio.h"
+#include "filetype.h"
+#include "ratelimit.h"
+#include "tree.h"
+
+static const size_t TAR_BLOCK = 512;
+
+/* GNU long names and pax headers beyond this size are taken as damage */
+static const uint64_t TAR_EXTENSION_LIMIT = 1024 * 1024;
+
+static const size_t INFLATE_INPUT = 64 * 1024;
+static const size_t SKIP_BUFFER = 64 * 1024;
+
+static const uint32_t ZIP_LIMIT = 0xFFFFFFFF;
+
+/* streamed entries up to this size are staged in memory, larger ones in a temporary file */
+static const uint64_t STAGE_MEMORY_LIMIT = 8 * 1024 * 1024;
+
+/* end of central directory record, comment and zip64 locator */
+static const size_t ZIP_TAIL = 22 + 0xFFFF + 20;
+
+archive_input_t::archive_input_t(int fd, archive_stream_t stream, transfer_job_t job,
+                                 std::shared_ptr <js_function_t> needCb) :
+        m_fd(fd), m_stream(stream), m_job(job), m_needCb(needCb), m_start(0), m_ended(false) {}
+
+size_t archive_input_t::pull(unsigned char *data, size_t length) {
+    if (m_fd >= 0) {
+        int64_t got = ReadFully(m_fd, data, length);
+
+        if (got <= 0) {
+            m_ended = true;
+            return 0;
+        }
+
+        return (size_t) got;
+    }
+
+    bool request;
+    size_t got = m_stream.take(data, length, request);
+
+    if (request) {
+        std::shared_ptr <js_function_t> needCb = m_needCb;
+        PostJsCallback(needCb, [needCb] { (*needCb)(); });
+    }
+
+    if (0 == got && m_stream.isEnded()) {
+        m_ended = true;
+    }
+
+    return got;
+}
+
+const unsigned char *archive_input_t::peek(size_t length) {
+    // the consumed part is only dropped when the staging area has to grow
+    if (m_start > 0 && m_staged.size() - m_start < length) {
+        m_staged.erase(m_staged.begin(), m_staged.begin() + m_start);
+        m_start = 0;
+    }
+
+    while (m_staged.size() - m_start < length) {
+        size_t have = m_staged.size();
+
+        m_staged.resize(m_start + length);
+
+        size_t got = pull(m_staged.data() + have, m_staged.size() - have);
+        m_staged.resize(have + got);
+
+        if (0 == got) {
+            return nullptr;
+        }
+    }
+
+    return m_staged.data() + m_start;
+}
+
+void archive_input_t::consume(size_t length) {
+    m_start += length;
+
+    if (m_start >= m_staged.size()) {
+        m_staged.clear();
+        m_start = 0;
+    }
+}
+
+int64_t archive_input_t::read(unsigned char *data, size_t length) {
+    if (m_start < m_staged.size()) {
+        size_t left = m_staged.size() - m_start;
+        size_t count = length < left ? length : left;
+
+        memcpy(data, m_staged.data() + m_start, count);
+        consume(count);
+
+        return (int64_t) count;
+    }
+
+    for (;;) {
+        size_t got = pull(data, length);
+
+        if (got > 0) {
+            return (int64_t) got;
+        }
+        if (m_ended) {
+            return 0;
+        }
+        if (m_job.isAborted()) {
+            return -1;
+        }
+
+        std::this_thread::sleep_for(ARCHIVE_STREAM_POLL);
+    }
+}
+
+bool archive_input_t::skip(uint64_t length) {
+    std::vector <unsigned char> scratch((size_t) (length < SKIP_BUFFER ? length : SKIP_BUFFER));
+
+    while (length > 0) {
+        int64_t got = read(scratch.data(), (size_t) (length < scratch.size() ? length : scratch.size()));
+
+        if (got <= 0) {
+            return false;
+        }
+
+        length -= (uint64_t) got;
+    }
+
+    return true;
+}
+
+bool archive_input_t::isEnded() {
+    return m_ended;
+}
+
+int64_t archive_input_t::size() {
+    return m_fd >= 0 ? FileSize(m_fd) : -1;
+}
+
+bool archive_input_t::seek(uint64_t offset) {
+    if (m_fd < 0) {
+        return false;
+    }
+
+    m_staged.clear();
+    m_start = 0;
+    m_ended = false;
+
+    return SeekFile(m_fd, (int64_t) offset) >= 0;
+}
+
+static uint32_t Get16(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8;
+}
+
+static uint32_t Get32(const unsigned char *p) {
+    return Get16(p) | Get16(p + 2) << 16;
+}
+
+static uint64_t Get64(const unsigned char *p) {
+    return (uint64_t) Get32(p) | (uint64_t) Get32(p + 4) << 32;
+}
+
+static uint64_t TarPadded(uint64_t size) {
+    return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+static std::string TarString(const unsigned char *field, size_t width) {
+    const char *text = (const char *) field;
+    const void *end = memchr(text, '\0', width);
+
+    return std::string(text, nullptr != end ? (const char *) end - text : width);
+}
+
+/**
+ * Parses an octal field, or a base-256 one as GNU tar writes for large
+ * values.
+ */
+static uint64_t TarNumber(const unsigned char *field, size_t width) {
+    uint64_t value = 0;
+
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7F;
+        for (size_t i = 1; i < width; i++) {
+            value = value << 8 | field[i];
+        }
+        return value;
+    }
+
+    size_t i = 0;
+
+    while (i < width && ' ' == field[i]) {
+        i++;
+    }
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value << 3 | (uint64_t) (field[i] - '0');
+    }
+
+    return value;
+}
+
+static bool TarChecksumValid(const unsigned char *header) {
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        sum += i >= 148 && i < 156 ? ' ' : header[i];
+    }
+
+    return sum == TarNumber(header + 148, 8);
+}
+
+static bool TarZeroBlock(const unsigned char *header) {
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        if (0 != header[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+class tar_reader_t : public archive_reader_t {
+public:
+    tar_reader_t(archive_input_t &input) : m_input(input), m_left(0), m_padding(0), m_paxSize(0), m_paxMtime(0),
+                                           m_hasPaxSize(false), m_hasPaxMtime(false) {}
+
+    int next(archive_entry_t &entry) override {
+        if (m_left + m_padding > 0) {
+            if (!m_input.skip(m_left + m_padding)) {
+                return ARCHIVE_READ_ERROR;
+            }
+            m_left = 0;
+            m_padding = 0;
+        }
+
+        for (;;) {
+            const unsigned char *header = m_input.peek(TAR_BLOCK);
+
+            if (nullptr == header) {
+                return m_input.isEnded() ? ARCHIVE_READ_END : ARCHIVE_READ_MORE;
+            }
+
+            // the end of archive marker; a second zero block is not waited for
+            if (TarZeroBlock(header)) {
+                m_input.consume(TAR_BLOCK);
+                return ARCHIVE_READ_END;
+            }
+
+            if (!TarChecksumValid(header)) {
+                return ARCHIVE_READ_ERROR;
+            }
+
+            uint64_t size = TarNumber(header + 124, 12);
+            char type = (char) header[156];
+
+            if ('L' == type || 'K' == type || 'x' == type || 'g' == type) {
+                if (size > TAR_EXTENSION_LIMIT) {
+                    return ARCHIVE_READ_ERROR;
+                }
+
+                size_t total = TAR_BLOCK + (size_t) TarPadded(size);
+                const unsigned char *block = m_input.peek(total);
+
+                if (nullptr == block) {
+                    return m_input.isEnded() ? ARCHIVE_READ_ERROR : ARCHIVE_READ_MORE;
+                }
+
+                if ('L' == type) {
+                    m_longName = TarString(block + TAR_BLOCK, (size_t) size);
+                } else if ('x' == type) {
+                    pax(block + TAR_BLOCK, (size_t) size);
+                }
+
+                m_input.consume(total);
+                continue;
+            }
+
+            std::string name = TarString(header, 100);
+
+            if (0 == memcmp(header + 257, "ustar", 5)) {
+                std::string prefix = TarString(header + 345, 155);
+
+                if (!prefix.empty()) {
+                    name = prefix + "/" + name;
+                }
+            }
+            if (!m_longName.empty()) {
+                name = m_longName;
+            }
+            if (!m_paxPath.empty()) {
+                name = m_paxPath;
+            }
+            if (m_hasPaxSize) {
+                size = m_paxSize;
+            }
+
+            // links, devices, folders and fifos carry no data
+            bool data = !('1' == type || '2' == type || '3' == type || '4' == type || '5' == type || '6' == type);
+
+            entry.path = name;
+            entry.folder = '5' == type;
+            entry.size = data ? size : 0;
+            entry.mtime = m_hasPaxMtime ? m_paxMtime : (time_t) TarNumber(header + 136, 12);
+            entry.supported = entry.folder || '0' == type || '\0' == type || '7' == type;
+
+            m_left = entry.size;
+            m_padding = TarPadded(m_left) - m_left;
+            m_longName.clear();
+            m_paxPath.clear();
+            m_hasPaxSize = false;
+            m_hasPaxMtime = false;
+
+            m_input.consume(TAR_BLOCK);
+
+            return ARCHIVE_READ_OK;
+        }
+    }
+
+    int64_t read(unsigned char *data, size_t length) override {
+        size_t count = length < m_left ? length : (size_t) m_left;
+
+        if (0 == count) {
+            return 0;
+        }
+
+        int64_t got = m_input.read(data, count);
+
+        if (got > 0) {
+            m_left -= (uint64_t) got;
+        }
+
+        return got;
+    }
+
+    bool verify() override {
+        return 0 == m_left;
+    }
+
+private:
+    /* pax records are "<length> <key>=<value>\n" */
+    void pax(const unsigned char *data, size_t length) {
+        size_t pos = 0;
+
+        while (pos < length) {
+            size_t record = 0;
+            size_t i = pos;
+
+            for (; i < length && data[i] >= '0' && data[i] <= '9'; i++) {
+                record = record * 10 + (data[i] - '0');
+            }
+
+            if (i >= length || ' ' != data[i] || record <= i - pos + 1 || record > length - pos) {
+                return;
+            }
+
+            std::string field((const char *) data + i + 1, record - (i - pos) - 2);
+            std::string::size_type equals = field.find('=');
+
+            if (std::string::npos != equals) {
+                std::string key = field.substr(0, equals);
+                std::string value = field.substr(equals + 1);
+
+                if ("path" == key) {
+                    m_paxPath = value;
+                } else if ("size" == key) {
+                    m_paxSize = strtoull(value.c_str(), nullptr, 10);
+                    m_hasPaxSize = true;
+                } else if ("mtime" == key) {
+                    m_paxMtime = (time_t) strtoll(value.c_str(), nullptr, 10);
+                    m_hasPaxMtime = true;
+                }
+            }
+
+            pos += record;
+        }
+    }
+
+    archive_input_t &m_input;
+    uint64_t m_left;
+    uint64_t m_padding;
+    std::string m_longName;
+    std::string m_paxPath;
+    uint64_t m_paxSize;
+    time_t m_paxMtime;
+    bool m_hasPaxSize;
+    bool m_hasPaxMtime;
+};
+
+struct zip_item_t {
+    std::string name;
+    uint64_t offset;
+    uint64_t compressed;
+    uint64_t size;
+    uint32_t crc;
+    uint32_t method;
+    uint32_t flags;
+};
+
+static time_t DosTimeToTime(uint32_t time, uint32_t date) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_sec = (int) (time & 0x1F) * 2;
+    tm.tm_min = (int) (time >> 5 & 0x3F);
+    tm.tm_hour = (int) (time >> 11);
+    tm.tm_mday = (int) (date & 0x1F);
+    tm.tm_mon = (int) (date >> 5 & 0x0F) - 1;
+    tm.tm_year = (int) (date >> 9) + 80;
+    tm.tm_isdst = -1;
+
+    return mktime(&tm);
+}
+
+/**
+ * Applies the zip64 extra field; it only holds the values whose 32 bit
+ * fields are saturated, in this order.
+ */
+static void ZipExtra(const unsigned char *extra, size_t length, zip_item_t &item, bool central) {
+    for (size_t pos = 0; pos + 4 <= length;) {
+        uint32_t tag = Get16(extra + pos);
+        size_t size = Get16(extra + pos + 2);
+        const unsigned char *field = extra + pos + 4;
+        const unsigned char *end = field + (pos + 4 + size <= length ? size : length - pos - 4);
+
+        if (0x0001 == tag) {
+            if (ZIP_LIMIT == item.size && field + 8 <= end) {
+                item.size = Get64(field);
+                field += 8;
+            }
+            if (ZIP_LIMIT == item.compressed && field + 8 <= end) {
+                item.compressed = Get64(field);
+                field += 8;
+            }
+            if (central && ZIP_LIMIT == item.offset && field + 8 <= end) {
+                item.offset = Get64(field);
+            }
+            return;
+        }
+
+        pos += 4 + size;
+    }
+}
+
+class zip_reader_t : public archive_reader_t {
+public:
+    zip_reader_t(archive_input_t &input) : m_input(input), m_loaded(false), m_index(0), m_left(0), m_produced(0),
+                                           m_crc(0), m_inflating(false), m_inflated(false), m_descriptor(false),
+                                           m_descriptor64(false) {}
+
+    ~zip_reader_t() {
+        endInflate();
+    }
+
+    int next(archive_entry_t &entry) override {
+        endInflate();
+
+        return m_input.isSeekable() ? nextIndexed(entry) : nextSequential(entry);
+    }
+
+    int64_t read(unsigned char *data, size_t length) override {
+        if (8 != m_item.method) {
+            size_t count = length < m_left ? length : (size_t) m_left;
+
+            if (0 == count) {
+                return 0;
+            }
+
+            int64_t got = m_input.read(data, count);
+
+            if (got > 0) {
+                m_left -= (uint64_t) got;
+                m_produced += (uint64_t) got;
+                m_crc = Crc32(m_crc, data, (size_t) got);
+            }
+
+            return got;
+        }
+
+        uInt capacity = length < 0x40000000 ? (uInt) length : 0x40000000;
+
+        m_stream.next_out = data;
+        m_stream.avail_out = capacity;
+
+        while (capacity == m_stream.avail_out && !m_inflated) {
+            if (0 == m_stream.avail_in && m_left > 0) {
+                size_t count = m_left < m_window.size() ? (size_t) m_left : m_window.size();
+                int64_t got = m_input.read(m_window.data(), count);
+
+                if (got <= 0) {
+                    return got;
+                }
+
+                m_left -= (uint64_t) got;
+                m_stream.next_in = m_window.data();
+                m_stream.avail_in = (uInt) got;
+            }
+
+            int ret = inflate(&m_stream, Z_NO_FLUSH);
+
+            if (Z_STREAM_END == ret) {
+                m_inflated = true;
+            } else if (Z_OK != ret && !(Z_BUF_ERROR == ret && m_stream.avail_in > 0)) {
+                return 0;
+            }
+        }
+
+        size_t produced = capacity - m_stream.avail_out;
+
+        m_produced += produced;
+        m_crc = Crc32(m_crc, data, produced);
+
+        return (int64_t) produced;
+    }
+
+    bool verify() override {
+        if (8 == m_item.method && !m_inflated) {
+            return false;
+        }
+
+        if (m_descriptor && (m_left > 0 || !readDescriptor())) {
+            return false;
+        }
+
+        return m_produced == m_item.size && m_crc == m_item.crc;
+    }
+
+private:
+    int nextIndexed(archive_entry_t &entry) {
+        if (!m_loaded) {
+            if (!loadDirectory()) {
+                return ARCHIVE_READ_ERROR;
+            }
+            m_loaded = true;
+        }
+
+        if (m_index >= m_items.size()) {
+            return ARCHIVE_READ_END;
+        }
+
+        zip_item_t &item = m_items[m_index++];
+        const unsigned char *header = m_input.seek(item.offset) ? m_input.peek(30) : nullptr;
+
+        if (nullptr == header || 0x04034b50 != Get32(header)) {
+            return ARCHIVE_READ_ERROR;
+        }
+
+        time_t mtime = DosTimeToTime(Get16(header + 10), Get16(header + 12));
+        size_t length = 30 + Get16(header + 26) + Get16(header + 28);
+
+        if (nullptr == m_input.peek(length)) {
+            return ARCHIVE_READ_ERROR;
+        }
+
+        m_input.consume(length);
+
+        return begin(item, mtime, entry);
+    }
+
+    int nextSequential(archive_entry_t &entry) {
+        if (m_left > 0) {
+            if (!m_input.skip(m_left)) {
+                return ARCHIVE_READ_ERROR;
+            }
+            m_left = 0;
+        }
+
+        if (m_descriptor && !readDescriptor()) {
+            return ARCHIVE_READ_ERROR;
+        }
+
+        const unsigned char *header = m_input.peek(4);
+
+        if (nullptr == header) {
+            return m_input.isEnded() ? ARCHIVE_READ_ERROR : ARCHIVE_READ_MORE;
+        }
+
+        uint32_t signature = Get32(header);
+
+        // the central directory follows the last entry
+        if (0x02014b50 == signature || 0x06054b50 == signature || 0x06064b50 == signature) {
+            return ARCHIVE_READ_END;
+        }
+
+        if (0x04034b50 != signature) {
+            return ARCHIVE_READ_ERROR;
+        }
+
+        header = m_input.peek(30);
+
+        size_t length = nullptr != header ? 30 + Get16(header + 26) + Get16(header + 28) : 0;
+
+        if (nullptr == header || nullptr == (header = m_input.peek(length))) {
+            return m_input.isEnded() ? ARCHIVE_READ_ERROR : ARCHIVE_READ_MORE;
+        }
+
+        zip_item_t item;
+
+        item.flags = Get16(header + 6);
+        item.method = Get16(header + 8);
+        item.crc = Get32(header + 14);
+        item.compressed = Get32(header + 18);
+        item.size = Get32(header + 22);
+        item.offset = 0;
+        item.name = std::string((const char *) header + 30, Get16(header + 26));
+        ZipExtra(header + 30 + item.name.size(), Get16(header + 28), item, false);
+
+        time_t mtime = DosTimeToTime(Get16(header + 10), Get16(header + 12));
+
+        /*
+         * With a data descriptor the CRC follows the data. The sizes are
+         * taken from the local header all the same: writers which leave
+         * them 0 fail the check against the descriptor.
+         */
+        m_descriptor = 0 != (item.flags & 0x0008);
+        m_descriptor64 = ZIP_LIMIT == Get32(header + 18) || ZIP_LIMIT == Get32(header + 22);
+
+        m_input.consume(length);
+
+        return begin(item, mtime, entry);
+    }
+
+    bool loadDirectory() {
+        int64_t size = m_input.size();
+
+        if (size < 22) {
+            return false;
+        }
+
+        size_t tail = (uint64_t) size < ZIP_TAIL ? (size_t) size : ZIP_TAIL;
+        const unsigned char *data = m_input.seek((uint64_t) size - tail) ? m_input.peek(tail) : nullptr;
+
+        if (nullptr == data) {
+            return false;
+        }
+
+        std::vector <unsigned char> end(data, data + tail);
+        size_t record = tail - 22;
+
+        while (0x06054b50 != Get32(end.data() + record)) {
+            if (0 == record--) {
+                return false;
+            }
+        }
+
+        uint64_t count = Get16(end.data() + record + 10);
+        uint64_t offset = Get32(end.data() + record + 16);
+
+        if (record >= 20 && 0x07064b50 == Get32(end.data() + record - 20)) {
+            const unsigned char *zip64 = m_input.seek(Get64(end.data() + record - 12)) ? m_input.peek(56) : nullptr;
+
+            if (nullptr == zip64 || 0x06064b50 != Get32(zip64)) {
+                return false;
+            }
+
+            count = Get64(zip64 + 32);
+            offset = Get64(zip64 + 48);
+        }
+
+        if (!m_input.seek(offset)) {
+            return false;
+        }
+
+        for (uint64_t i = 0; i < count; i++) {
+            const unsigned char *header = m_input.peek(46);
+
+            if (nullptr == header || 0x02014b50 != Get32(header)) {
+                return false;
+            }
+
+            size_t name = Get16(header + 28);
+            size_t extra = Get16(header + 30);
+            size_t length = 46 + name + extra + Get16(header + 32);
+
+            if (nullptr == (header = m_input.peek(length))) {
+                return false;
+            }
+
+            zip_item_t item;
+
+            item.flags = Get16(header + 8);
+            item.method = Get16(header + 10);
+            item.crc = Get32(header + 16);
+            item.compressed = Get32(header + 20);
+            item.size = Get32(header + 24);
+            item.offset = Get32(header + 42);
+            item.name = std::string((const char *) header + 46, name);
+            ZipExtra(header + 46 + name, extra, item, true);
+
+            m_items.push_back(item);
+            m_input.consume(length);
+        }
+
+        return true;
+    }
+
+    int begin(const zip_item_t &item, time_t mtime, archive_entry_t &entry) {
+        bool folder = !item.name.empty() && '/' == item.name[item.name.size() - 1];
+
+        entry.path = folder ? item.name.substr(0, item.name.size() - 1) : item.name;
+        entry.folder = folder;
+        entry.size = folder ? 0 : item.size;
+        entry.mtime = mtime;
+        // encrypted entries are not supported either
+        entry.supported = folder || (0 == (item.flags & 0x0001) && (0 == item.method || 8 == item.method));
+
+        m_item = item;
+        m_left = item.compressed;
+        m_produced = 0;
+        m_crc = 0;
+
+        if (entry.supported && !folder && 8 == item.method) {
+            memset(&m_stream, 0, sizeof(m_stream));
+
+            if (Z_OK != inflateInit2(&m_stream, -MAX_WBITS)) {
+                return ARCHIVE_READ_ERROR;
+            }
+
+            m_window.resize(INFLATE_INPUT);
+            m_inflating = true;
+        }
+
+        return ARCHIVE_READ_OK;
+    }
+
+    /**
+     * Reads the data descriptor behind the entry data, whose signature is
+     * optional, and takes the CRC from it.
+     */
+    bool readDescriptor() {
+        unsigned char descriptor[24];
+        size_t length = m_descriptor64 ? 20 : 12;
+
+        m_descriptor = false;
+
+        if (!readFully(descriptor, 4)) {
+            return false;
+        }
+        if (0x08074b50 == Get32(descriptor) && !readFully(descriptor, 4)) {
+            return false;
+        }
+        if (!readFully(descriptor + 4, length - 4)) {
+            return false;
+        }
+
+        uint64_t compressed = m_descriptor64 ? Get64(descriptor + 4) : Get32(descriptor + 4);
+        uint64_t size = m_descriptor64 ? Get64(descriptor + 12) : Get32(descriptor + 8);
+
+        m_item.crc = Get32(descriptor);
+
+        return compressed == m_item.compressed && size == m_item.size;
+    }
+
+    bool readFully(unsigned char *data, size_t length) {
+        while (length > 0) {
+            int64_t got = m_input.read(data, length);
+
+            if (got <= 0) {
+                return false;
+            }
+
+            data += got;
+            length -= (size_t) got;
+        }
+
+        return true;
+    }
+
+    void endInflate() {
+        if (m_inflating) {
+            inflateEnd(&m_stream);
+            m_inflating = false;
+        }
+        m_inflated = false;
+    }
+
+    archive_input_t &m_input;
+    bool m_loaded;
+    std::vector <zip_item_t> m_items;
+    size_t m_index;
+    zip_item_t m_item;
+    uint64_t m_left;
+    uint64_t m_produced;
+    uint32_t m_crc;
+    z_stream m_stream;
+    std::vector <unsigned char> m_window;
+    bool m_inflating;
+    bool m_inflated;
+    bool m_descriptor;
+    bool m_descriptor64;
+};
+
+std::unique_ptr <archive_reader_t> archive_reader_t::create(int format, archive_input_t &input) {
+    if (ARCHIVE_ZIP == format) {
+        return std::unique_ptr<archive_reader_t>(new zip_reader_t(input));
+    }
+
+    return std::unique_ptr<archive_reader_t>(new tar_reader_t(input));
+}
+
+/**
+ * Splits an entry path into its names. Entries which would end up outside
+ * of the destination folder are refused.
+ */
+static bool SplitEntryPath(const std::string &path, std::vector <std::string> &names) {
+    std::string::size_type start = 0;
+
+    while (start <= path.size()) {
+        std::string::size_type end = path.find_first_of("/\\", start);
+        std::string name = path.substr(start, std::string::npos == end ? std::string::npos : end - start);
+
+        if (".." == name) {
+            return false;
+        }
+        if (!name.empty() && "." != name) {
+            names.push_back(name);
+        }
+        if (std::string::npos == end) {
+            break;
+        }
+
+        start = end + 1;
+    }
+
+    return true;
+}
+
+/**
+ * The data of one entry of a stream, read and verified before the device
+ * is held: reading a stream waits for JS, which may itself be waiting for
+ * the device in a call of its own.
+ */
+class entry_stage_t {
+public:
+    entry_stage_t() : m_file(nullptr), m_position(0) {}
+
+    ~entry_stage_t() {
+        reset();
+    }
+
+    bool fill(archive_reader_t &reader, uint64_t size) {
+        std::vector <unsigned char> buffer;
+
+        reset();
+
+        if (size > STAGE_MEMORY_LIMIT) {
+            m_file = tmpfile();
+
+            if (nullptr == m_file) {
+                return false;
+            }
+
+            buffer.resize(SKIP_BUFFER);
+        } else {
+            m_data.resize((size_t) size);
+        }
+
+        for (uint64_t offset = 0; offset < size;) {
+            uint64_t left = size - offset;
+            size_t length = m_file ? (size_t) (left < buffer.size() ? left : buffer.size()) : (size_t) left;
+            unsigned char *data = m_file ? buffer.data() : m_data.data() + offset;
+            int64_t got = reader.read(data, length);
+
+            if (got <= 0 || (m_file && 1 != fwrite(data, (size_t) got, 1, m_file))) {
+                return false;
+            }
+
+            offset += (uint64_t) got;
+        }
+
+        if (m_file && 0 != fseek(m_file, 0, SEEK_SET)) {
+            return false;
+        }
+
+        return reader.verify();
+    }
+
+    int64_t read(unsigned char *data, size_t length) {
+        if (m_file) {
+            size_t got = fread(data, 1, length, m_file);
+            return ferror(m_file) ? -1 : (int64_t) got;
+        }
+
+        size_t left = m_data.size() - m_position;
+        size_t count = length < left ? length : left;
+
+        memcpy(data, m_data.data() + m_position, count);
+        m_position += count;
+
+        return (int64_t) count;
+    }
+
+    void reset() {
+        if (m_file) {
+            fclose(m_file);
+            m_file = nullptr;
+        }
+
+        m_data.clear();
+        m_position = 0;
+    }
+
+private:
+    std::vector <unsigned char> m_data;
+    FILE *m_file;
+    size_t m_position;
+};
+
+class import_ctx_t {
+public:
+    import_ctx_t(LIBMTP_mtpdevice_t *device, transfer_job_t &job, archive_reader_t &reader, entry_stage_t *stage) :
+            m_device(device), m_job(job), m_reader(reader), m_stage(stage) {}
+
+    LIBMTP_mtpdevice_t *m_device;
+    transfer_job_t &m_job;
+    archive_reader_t &m_reader;
+    /* set when the entry was staged, the reader is not used then */
+    entry_stage_t *m_stage;
+};
+
+static uint16_t ImportDataGet(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen) {
+    import_ctx_t *ctx = (import_ctx_t *) priv;
+
+    if (ctx->m_job.isAborted()) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    int64_t got = ctx->m_stage ? ctx->m_stage->read(data, wantlen) : ctx->m_reader.read(data, wantlen);
+
+    if (got <= 0) {
+        return ctx->m_job.isAborted() ? LIBMTP_HANDLER_RETURN_CANCEL : LIBMTP_HANDLER_RETURN_ERROR;
+    }
+    if (!ThrottleTransfer(ctx->m_device, ctx->m_job, (uint64_t) got)) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    *gotlen = (uint32_t) got;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+/**
+ * Extracts one archive entry per step. Destination folders are listed at
+ * most once and created on first use, like tree uploads do; name conflicts
+ * are resolved by the conflict policy. The files of a stream are staged
+ * before the device is held.
+ */
+class import_task_t : public scheduler_task_t {
+public:
+    import_task_t(uint32_t weight, uint32_t storage, uint32_t parent, int format, int fd, archive_stream_t stream,
+                  int policy, transfer_job_t job, std::shared_ptr <js_function_t> needCb,
+                  std::shared_ptr <js_function_t> cb) :
+            scheduler_task_t(PRIORITY_BULK, weight), m_storage(storage), m_policy(policy), m_job(job), m_cb(cb),
+            m_input(fd, stream, job, needCb), m_reader(archive_reader_t::create(format, m_input)), m_imported(0),
+            m_skipped(0) {
+        m_folders[std::string()] = parent;
+    }
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_job.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        archive_entry_t entry;
+        int read = m_reader->next(entry);
+
+        if (ARCHIVE_READ_MORE == read) {
+            defer(ARCHIVE_STREAM_POLL);
+            return false;
+        }
+
+        if (ARCHIVE_READ_END == read) {
+            m_job.flush();
+
+            std::shared_ptr <js_function_t> cb = m_cb;
+            uint32_t imported = m_imported;
+            uint32_t skipped = m_skipped;
+            finish([cb, imported, skipped] { (*cb)((int) LIBMTP_ERROR_NONE, imported, skipped); });
+            return true;
+        }
+
+        if (ARCHIVE_READ_OK != read) {
+            fail(m_job.isAborted() ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        std::vector <std::string> names;
+
+        if (!entry.supported || !SplitEntryPath(entry.path, names)) {
+            m_skipped++;
+            return false;
+        }
+
+        if (names.empty()) {
+            return false;
+        }
+
+        bool staged = !entry.folder && !m_input.isSeekable();
+
+        if (staged && !m_stage.fill(*m_reader, entry.size)) {
+            m_stage.reset();
+            fail(m_job.isAborted() ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        device_guard_t guard(device, getPriority());
+
+        std::string name = names.back();
+        uint32_t parentId;
+
+        if (!entry.folder) {
+            names.pop_back();
+        }
+
+        if (!folderFor(device, names, parentId)) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        int error = entry.folder ? (int) LIBMTP_ERROR_NONE : importFile(device, entry, name, parentId, staged);
+
+        m_stage.reset();
+
+        if (LIBMTP_ERROR_NONE != error) {
+            fail(error);
+            return true;
+        }
+
+        return false;
+    }
+
+    void fail(int error) override {
+        std::shared_ptr <js_function_t> cb = m_cb;
+        uint32_t imported = m_imported;
+        uint32_t skipped = m_skipped;
+
+        finish([cb, error, imported, skipped] { (*cb)(error, imported, skipped); });
+    }
+
+private:
+    folder_listing_t &listingFor(LIBMTP_mtpdevice_t *device, uint32_t parentId) {
+        std::unordered_map<uint32_t, folder_listing_t>::iterator it = m_listings.find(parentId);
+
+        if (it != m_listings.end()) {
+            return it->second;
+        }
+
+        folder_listing_t &listing = m_listings[parentId];
+        std::vector <file_t> files = Get_Files_And_Folders(mtpdevice_t(device), m_storage, parentId);
+
+        for (file_t &file : files) {
+            listing.insert(std::make_pair(file.getName(), file));
+        }
+
+        return listing;
+    }
+
+    /**
+     * Finds or creates the folder at `names` below the destination. An
+     * existing folder is reused; a file in the way gets the folder a
+     * unique name instead.
+     */
+    bool folderFor(LIBMTP_mtpdevice_t *device, const std::vector <std::string> &names, uint32_t &folderId) {
+        std::string path;
+        uint32_t id = m_folders[path];
+
+        for (const std::string &part : names) {
+            path = path.empty() ? part : path + "/" + part;
+
+            std::unordered_map<std::string, uint32_t>::iterator known = m_folders.find(path);
+
+            if (known != m_folders.end()) {
+                id = known->second;
+                continue;
+            }
+
+            folder_listing_t &listing = listingFor(device, id);
+            folder_listing_t::iterator existing = listing.find(part);
+
+            if (listing.end() != existing && LIBMTP_FILETYPE_FOLDER == existing->second.getType()) {
+                id = existing->second.getId();
+                m_folders[path] = id;
+                continue;
+            }
+
+            std::string name = listing.end() != existing ? UniqueName(listing, part) : part;
+            char *cName = strdup(name.c_str());
+            uint32_t created = LIBMTP_Create_Folder(device, cName, id, m_storage);
+
+            // libmtp may have adjusted the name to the device's constraints
+            name = cName;
+            free(cName);
+
+            if (0 == created) {
+                LIBMTP_Clear_Errorstack(device);
+                return false;
+            }
+
+            file_t folder;
+            folder.setName(name);
+            folder.setId(created);
+            folder.setType(LIBMTP_FILETYPE_FOLDER);
+            folder.setParentId(id);
+            folder.setStorageId(m_storage);
+
+            listing.insert(std::make_pair(name, folder));
+            m_listings[created];
+            m_folders[path] = created;
+            id = created;
+        }
+
+        folderId = id;
+
+        return true;
+    }
+
+    int importFile(LIBMTP_mtpdevice_t *device, archive_entry_t &entry, std::string name, uint32_t parentId,
+                   bool staged) {
+        folder_listing_t &listing = listingFor(device, parentId);
+        folder_listing_t::iterator existing = listing.find(name);
+
+        if (listing.end() != existing) {
+            bool existingFolder = LIBMTP_FILETYPE_FOLDER == existing->second.getType();
+
+            if (CONFLICT_SKIP == m_policy) {
+                m_skipped++;
+                return LIBMTP_ERROR_NONE;
+            }
+
+            // folders are never deleted to make room for a file
+            if (CONFLICT_RENAME == m_policy || existingFolder) {
+                name = UniqueName(listing, name);
+            } else if (0 != LIBMTP_Delete_Object(device, existing->second.getId())) {
+                LIBMTP_Clear_Errorstack(device);
+                name = UniqueName(listing, name);
+            } else {
+                listing.erase(existing);
+            }
+        }
+
+        file_t file;
+        file.setName(name);
+        file.setSize(entry.size);
+        file.setType(FiletypeForName(name));
+        file.setParentId(parentId);
+        file.setStorageId(m_storage);
+        file.get()->modificationdate = entry.mtime;
+
+        import_ctx_t ctx(device, m_job, *m_reader, staged ? &m_stage : nullptr);
+
+        m_job.beginFile();
+        int ret = LIBMTP_Send_File_From_Handler(device, ImportDataGet, (void *) &ctx, file.get(),
+                                                TransferJobProgressCallback, (const void *) &m_job);
+        bool intact = 0 == ret && (staged || m_reader->verify());
+        m_job.endFile(intact);
+
+        if (!intact) {
+            bool aborted = m_job.isAborted();
+
+            // a truncated or damaged object is not left behind
+            if (0 != file.getId()) {
+                LIBMTP_Delete_Object(device, file.getId());
+            }
+            LIBMTP_Clear_Errorstack(device);
+
+            return aborted ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL;
+        }
+
+        listing.insert(std::make_pair(name, file));
+        m_imported++;
+
+        return LIBMTP_ERROR_NONE;
+    }
+
+    uint32_t m_storage;
+    int m_policy;
+    transfer_job_t m_job;
+    std::shared_ptr <js_function_t> m_cb;
+    archive_input_t m_input;
+    std::unique_ptr <archive_reader_t> m_reader;
+    entry_stage_t m_stage;
+    std::unordered_map <std::string, uint32_t> m_folders;
+    std::unordered_map <uint32_t, folder_listing_t> m_listings;
+    uint32_t m_imported;
+    uint32_t m_skipped;
+};
+
+void Schedule_Import_Archive(mtpdevice_t device, uint32_t const storage, uint32_t const parent, int const format,
+                             int const fd, archive_stream_t &stream, int const policy, transfer_job_t &job,
+                             uint32_t const weight, js_function_t &needCb, js_function_t &cb) {
+    device_executor_t::forDevice(device.m_device)->submit(
+            std::make_shared<import_task_t>(weight, storage, parent, format, fd, stream, policy, job,
+                                            MakeJsCallback(needCb), MakeJsCallback(cb)));
+}
@@ -0,0 +1,109 @@
+#ifndef MTP_EXTRACT_H
+#define MTP_EXTRACT_H
+
+#include <stdint.h>
+#include <time.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "binding.h"
+#include "mtp.h"
+#include "transfer.h"
+#include "archive.h"
+
+/**
+ * Where an archive comes from: a file descriptor, or else an
+ * archive_stream_t. Headers are looked at with peek(), which never waits:
+ * it returns nullptr until a stream supplied enough data. Entry data is
+ * read with read() and skip(), which wait for the stream.
+ */
+class archive_input_t {
+public:
+    archive_input_t(int fd, archive_stream_t stream, transfer_job_t job, std::shared_ptr <js_function_t> needCb);
+
+    const unsigned char *peek(size_t length);
+
+    void consume(size_t length);
+
+    /**
+     * Returns the number of bytes read, 0 at the end of the input, or -1
+     * if the job was aborted while waiting.
+     */
+    int64_t read(unsigned char *data, size_t length);
+
+    bool skip(uint64_t length);
+
+    bool isEnded();
+
+    bool isSeekable() { return m_fd >= 0; }
+
+    int64_t size();
+
+    bool seek(uint64_t offset);
+
+private:
+    size_t pull(unsigned char *data, size_t length);
+
+    int m_fd;
+    archive_stream_t m_stream;
+    transfer_job_t m_job;
+    std::shared_ptr <js_function_t> m_needCb;
+    std::vector <unsigned char> m_staged;
+    size_t m_start;
+    bool m_ended;
+};
+
+enum archive_read_t {
+    ARCHIVE_READ_OK = 0,
+    ARCHIVE_READ_MORE = 1,
+    ARCHIVE_READ_END = 2,
+    ARCHIVE_READ_ERROR = 3
+};
+
+struct archive_entry_t {
+    std::string path;
+    uint64_t size;
+    time_t mtime;
+    bool folder;
+    /* links, special files and unknown compression methods are skipped */
+    bool supported;
+};
+
+/**
+ * Reads tar (ustar, GNU and pax extensions) or zip (stored or deflated,
+ * zip64) archives entry by entry. The data of the current entry is read
+ * with read(); whatever is left of it is skipped by the next next().
+ *
+ * Zip archives are read through their central directory when the input is
+ * seekable. From a stream, entries are read in order, which needs their
+ * sizes in the local headers; a data descriptor may still supply the CRC.
+ */
+class archive_reader_t {
+public:
+    virtual ~archive_reader_t() {}
+
+    static std::unique_ptr <archive_reader_t> create(int format, archive_input_t &input);
+
+    virtual int next(archive_entry_t &entry) = 0;
+
+    virtual int64_t read(unsigned char *data, size_t length) = 0;
+
+    /**
+     * Returns false if the entry data turned out to be damaged.
+     */
+    virtual bool verify() = 0;
+};
+
+/**
+ * Extracts a tar or zip archive, read from `fd` or, if it is -1, from
+ * `stream`, into the device folder `parent`. Each folder is created once;
+ * files are sent straight from `fd`, those of a stream are read ahead of
+ * the transfer. `needCb()` asks for more stream data. Calls back with
+ * cb(error, imported, skipped).
+ */
+void Schedule_Import_Archive(mtpdevice_t device, uint32_t const storage, uint32_t const parent, int const format,
+                             int const fd, archive_stream_t &stream, int const policy, transfer_job_t &job,
+                             uint32_t const weight, js_function_t &needCb, js_function_t &cb);
+
+#endif
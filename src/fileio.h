@@ -0,0 +1,217 @@
+#ifndef MTP_FILEIO_H
+#define MTP_FILEIO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/**
+ * Thin wrappers over the POSIX file descriptor calls, so the native
+ * transfer paths build the same way on Windows.
+ */
+
+inline int OpenFileForWrite(const char *path) {
+#ifdef _WIN32
+    return _open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU | S_IRGRP);
+#endif
+}
+
+inline int OpenFileForRead(const char *path) {
+#ifdef _WIN32
+    return _open(path, O_RDONLY | O_BINARY);
+#else
+    return open(path, O_RDONLY);
+#endif
+}
+
+inline int OpenFileForUpdate(const char *path) {
+#ifdef _WIN32
+    return _open(path, O_RDWR | O_CREAT | O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+#endif
+}
+
+inline int CloseFile(int fd) {
+#ifdef _WIN32
+    return _close(fd);
+#else
+    return close(fd);
+#endif
+}
+
+inline int RemoveFile(const char *path) {
+#ifdef _WIN32
+    return _unlink(path);
+#else
+    return unlink(path);
+#endif
+}
+
+/**
+ * Replaces `to` with `from`; atomic on POSIX file systems.
+ */
+inline int RenameFile(const char *from, const char *to) {
+#ifdef _WIN32
+    _unlink(to);
+#endif
+    return rename(from, to);
+}
+
+inline int SyncFile(int fd) {
+#ifdef _WIN32
+    return _commit(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+inline int TruncateFile(int fd, int64_t size) {
+#ifdef _WIN32
+    return _chsize_s(fd, size);
+#else
+    return ftruncate(fd, (off_t) size);
+#endif
+}
+
+inline int64_t SeekFile(int fd, int64_t offset) {
+#ifdef _WIN32
+    return _lseeki64(fd, offset, SEEK_SET);
+#else
+    return (int64_t) lseek(fd, (off_t) offset, SEEK_SET);
+#endif
+}
+
+/**
+ * Creates a single directory; an existing directory is not an error.
+ */
+inline bool MakeDirectory(const char *path) {
+#ifdef _WIN32
+    int result = _mkdir(path);
+#else
+    int result = mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+#endif
+    return 0 == result || EEXIST == errno;
+}
+
+inline bool RemoveDirectory(const char *path) {
+#ifdef _WIN32
+    return 0 == _rmdir(path);
+#else
+    return 0 == rmdir(path);
+#endif
+}
+
+inline bool SetModificationTime(const char *path, time_t mtime) {
+#ifdef _WIN32
+    struct _utimbuf times;
+    times.actime = mtime;
+    times.modtime = mtime;
+    return 0 == _utime(path, &times);
+#else
+    struct utimbuf times;
+    times.actime = mtime;
+    times.modtime = mtime;
+    return 0 == utime(path, &times);
+#endif
+}
+
+/**
+ * Reserves `size` bytes for a file about to be written, so the file system
+ * can allocate it in one go. Only a hint: failures are ignored.
+ */
+inline void PreallocateFile(int fd, uint64_t size) {
+#ifdef __linux__
+    if (size > 0) {
+        posix_fallocate(fd, 0, (off_t) size);
+    }
+#endif
+}
+
+inline int64_t FileSize(int fd) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (0 != _fstat64(fd, &st)) {
+        return -1;
+    }
+#else
+    struct stat st;
+    if (0 != fstat(fd, &st)) {
+        return -1;
+    }
+#endif
+    return (int64_t) st.st_size;
+}
+
+inline bool WriteFully(int fd, const unsigned char *data, uint64_t length) {
+    while (length > 0) {
+        unsigned int chunk = length > 0x40000000 ? 0x40000000 : (unsigned int) length;
+#ifdef _WIN32
+        int written = _write(fd, data, chunk);
+#else
+        ssize_t written = write(fd, data, chunk);
+#endif
+        if (written < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return false;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+/**
+ * Reads up to `length` bytes, only returning less at the end of the file.
+ * Returns -1 on error.
+ */
+inline int64_t ReadFully(int fd, unsigned char *data, uint64_t length) {
+    uint64_t total = 0;
+
+    while (total < length) {
+        uint64_t left = length - total;
+        unsigned int chunk = left > 0x40000000 ? 0x40000000 : (unsigned int) left;
+#ifdef _WIN32
+        int got = _read(fd, data + total, chunk);
+#else
+        ssize_t got = read(fd, data + total, chunk);
+#endif
+        if (got < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return -1;
+        }
+        if (0 == got) {
+            break;
+        }
+
+        total += got;
+    }
+
+    return (int64_t) total;
+}
+
+#endif
@@ -0,0 +1,246 @@
+#include "filetype.h"
+
+#include <string.h>
+
+#include "fileio.h"
+
+struct filetype_extension_t {
+    const char *extension;
+    LIBMTP_filetype_t type;
+};
+
+static const filetype_extension_t EXTENSIONS[] = {
+        {"wav",  LIBMTP_FILETYPE_WAV},
+        {"mp3",  LIBMTP_FILETYPE_MP3},
+        {"wma",  LIBMTP_FILETYPE_WMA},
+        {"ogg",  LIBMTP_FILETYPE_OGG},
+        {"oga",  LIBMTP_FILETYPE_OGG},
+        {"opus", LIBMTP_FILETYPE_OGG},
+        {"aa",   LIBMTP_FILETYPE_AUDIBLE},
+        {"mp4",  LIBMTP_FILETYPE_MP4},
+        {"m4v",  LIBMTP_FILETYPE_MP4},
+        {"wmv",  LIBMTP_FILETYPE_WMV},
+        {"avi",  LIBMTP_FILETYPE_AVI},
+        {"mpeg", LIBMTP_FILETYPE_MPEG},
+        {"mpg",  LIBMTP_FILETYPE_MPEG},
+        {"asf",  LIBMTP_FILETYPE_ASF},
+        {"qt",   LIBMTP_FILETYPE_QT},
+        {"mov",  LIBMTP_FILETYPE_QT},
+        {"jpg",  LIBMTP_FILETYPE_JPEG},
+        {"jpeg", LIBMTP_FILETYPE_JPEG},
+        {"jpe",  LIBMTP_FILETYPE_JPEG},
+        {"jfif", LIBMTP_FILETYPE_JFIF},
+        {"tif",  LIBMTP_FILETYPE_TIFF},
+        {"tiff", LIBMTP_FILETYPE_TIFF},
+        {"bmp",  LIBMTP_FILETYPE_BMP},
+        {"gif",  LIBMTP_FILETYPE_GIF},
+        {"pic",  LIBMTP_FILETYPE_PICT},
+        {"pict", LIBMTP_FILETYPE_PICT},
+        {"png",  LIBMTP_FILETYPE_PNG},
+        {"wmf",  LIBMTP_FILETYPE_WINDOWSIMAGEFORMAT},
+        {"vcs",  LIBMTP_FILETYPE_VCALENDAR1},
+        {"ics",  LIBMTP_FILETYPE_VCALENDAR2},
+        {"vcf",  LIBMTP_FILETYPE_VCARD3},
+        {"exe",  LIBMTP_FILETYPE_WINEXEC},
+        {"com",  LIBMTP_FILETYPE_WINEXEC},
+        {"bat",  LIBMTP_FILETYPE_WINEXEC},
+        {"dll",  LIBMTP_FILETYPE_WINEXEC},
+        {"sys",  LIBMTP_FILETYPE_WINEXEC},
+        {"txt",  LIBMTP_FILETYPE_TEXT},
+        {"htm",  LIBMTP_FILETYPE_HTML},
+        {"html", LIBMTP_FILETYPE_HTML},
+        {"bin",  LIBMTP_FILETYPE_FIRMWARE},
+        {"aac",  LIBMTP_FILETYPE_AAC},
+        {"flac", LIBMTP_FILETYPE_FLAC},
+        {"mp2",  LIBMTP_FILETYPE_MP2},
+        {"m4a",  LIBMTP_FILETYPE_M4A},
+        {"doc",  LIBMTP_FILETYPE_DOC},
+        {"xml",  LIBMTP_FILETYPE_XML},
+        {"xls",  LIBMTP_FILETYPE_XLS},
+        {"ppt",  LIBMTP_FILETYPE_PPT},
+        {"mht",  LIBMTP_FILETYPE_MHT},
+        {"jp2",  LIBMTP_FILETYPE_JP2},
+        {"jpx",  LIBMTP_FILETYPE_JPX}
+};
+
+/* no extension above is longer */
+static const size_t EXTENSION_MAX = 4;
+
+static const uint32_t EXTENSION_SLOT_BITS = 7;
+
+/* spreads the extensions above over the slots without any collision */
+static const uint32_t EXTENSION_MULTIPLIER = 0x0425E7A3;
+
+/**
+ * Packs a lowercased extension of up to EXTENSION_MAX characters into one
+ * integer; 0 if it does not fit.
+ */
+static uint32_t ExtensionKey(const char *extension, size_t length) {
+    uint32_t key = 0;
+
+    if (0 == length || length > EXTENSION_MAX) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) extension[i];
+        key = key << 8 | (c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+    }
+
+    return key;
+}
+
+static uint32_t ExtensionSlot(uint32_t key) {
+    return (key * EXTENSION_MULTIPLIER) >> (32 - EXTENSION_SLOT_BITS);
+}
+
+struct extension_table_t {
+    extension_table_t() {
+        memset(keys, 0, sizeof(keys));
+
+        for (const filetype_extension_t &entry : EXTENSIONS) {
+            uint32_t key = ExtensionKey(entry.extension, strlen(entry.extension));
+            uint32_t slot = ExtensionSlot(key);
+
+            // only an extension added later could make this probe
+            while (0 != keys[slot]) {
+                slot = (slot + 1) & ((1 << EXTENSION_SLOT_BITS) - 1);
+            }
+
+            keys[slot] = key;
+            types[slot] = entry.type;
+        }
+    }
+
+    uint32_t keys[1 << EXTENSION_SLOT_BITS];
+    LIBMTP_filetype_t types[1 << EXTENSION_SLOT_BITS];
+};
+
+static const extension_table_t &ExtensionTable() {
+    static const extension_table_t table;
+    return table;
+}
+
+LIBMTP_filetype_t FiletypeForName(const std::string &name) {
+    std::string::size_type dot = name.rfind('.');
+
+    if (std::string::npos == dot) {
+        return LIBMTP_FILETYPE_UNKNOWN;
+    }
+
+    uint32_t key = ExtensionKey(name.c_str() + dot + 1, name.size() - dot - 1);
+
+    if (0 == key) {
+        return LIBMTP_FILETYPE_UNKNOWN;
+    }
+
+    const extension_table_t &table = ExtensionTable();
+
+    for (uint32_t slot = ExtensionSlot(key); 0 != table.keys[slot];
+         slot = (slot + 1) & ((1 << EXTENSION_SLOT_BITS) - 1)) {
+        if (key == table.keys[slot]) {
+            return table.types[slot];
+        }
+    }
+
+    return LIBMTP_FILETYPE_UNKNOWN;
+}
+
+static bool HasBytes(const unsigned char *data, size_t length, size_t offset, const char *magic, size_t size) {
+    return length >= offset + size && 0 == memcmp(data + offset, magic, size);
+}
+
+LIBMTP_filetype_t FiletypeFromData(const unsigned char *data, size_t length) {
+    if (nullptr == data || length < 4) {
+        return LIBMTP_FILETYPE_UNKNOWN;
+    }
+
+    if (0xFF == data[0] && 0xD8 == data[1] && 0xFF == data[2]) {
+        return LIBMTP_FILETYPE_JPEG;
+    }
+    if (HasBytes(data, length, 0, "\x89PNG", 4)) {
+        return LIBMTP_FILETYPE_PNG;
+    }
+    if (HasBytes(data, length, 0, "GIF8", 4)) {
+        return LIBMTP_FILETYPE_GIF;
+    }
+    if (HasBytes(data, length, 0, "II*\0", 4) || HasBytes(data, length, 0, "MM\0*", 4)) {
+        return LIBMTP_FILETYPE_TIFF;
+    }
+    if (HasBytes(data, length, 0, "RIFF", 4)) {
+        if (HasBytes(data, length, 8, "WAVE", 4)) {
+            return LIBMTP_FILETYPE_WAV;
+        }
+        if (HasBytes(data, length, 8, "AVI ", 4)) {
+            return LIBMTP_FILETYPE_AVI;
+        }
+        return LIBMTP_FILETYPE_UNKNOWN;
+    }
+    if (HasBytes(data, length, 4, "ftyp", 4)) {
+        if (HasBytes(data, length, 8, "M4A ", 4) || HasBytes(data, length, 8, "M4B ", 4)) {
+            return LIBMTP_FILETYPE_M4A;
+        }
+        if (HasBytes(data, length, 8, "qt  ", 4)) {
+            return LIBMTP_FILETYPE_QT;
+        }
+        return LIBMTP_FILETYPE_MP4;
+    }
+    if (HasBytes(data, length, 0, "OggS", 4)) {
+        return LIBMTP_FILETYPE_OGG;
+    }
+    if (HasBytes(data, length, 0, "fLaC", 4)) {
+        return LIBMTP_FILETYPE_FLAC;
+    }
+    if (HasBytes(data, length, 0, "ID3", 3)) {
+        return LIBMTP_FILETYPE_MP3;
+    }
+    // the ASF header object GUID, shared by WMA and WMV
+    if (HasBytes(data, length, 0, "\x30\x26\xB2\x75\x8E\x66\xCF\x11", 8)) {
+        return LIBMTP_FILETYPE_ASF;
+    }
+    if (HasBytes(data, length, 0, "\0\0\1\xBA", 4) || HasBytes(data, length, 0, "\0\0\1\xB3", 4)) {
+        return LIBMTP_FILETYPE_MPEG;
+    }
+    if (HasBytes(data, length, 0, "BM", 2) && length >= 14 && 0 == data[6] && 0 == data[7] && 0 == data[8] &&
+        0 == data[9]) {
+        return LIBMTP_FILETYPE_BMP;
+    }
+    // frame sync: ADTS for AAC has layer 0, MPEG audio layers 1 to 3
+    if (0xFF == data[0] && 0xE0 == (data[1] & 0xE0)) {
+        if (0xF0 == (data[1] & 0xF6)) {
+            return LIBMTP_FILETYPE_AAC;
+        }
+        return 0x02 == (data[1] & 0x06) ? LIBMTP_FILETYPE_MP3 : LIBMTP_FILETYPE_MP2;
+    }
+
+    return LIBMTP_FILETYPE_UNKNOWN;
+}
+
+LIBMTP_filetype_t ClassifyFile(const std::string &name, const unsigned char *data, size_t length) {
+    LIBMTP_filetype_t type = FiletypeForName(name);
+
+    if (LIBMTP_FILETYPE_UNKNOWN != type) {
+        return type;
+    }
+
+    return FiletypeFromData(data, length);
+}
+
+LIBMTP_filetype_t ClassifyFileDescriptor(const std::string &name, int fd) {
+    LIBMTP_filetype_t type = FiletypeForName(name);
+
+    if (LIBMTP_FILETYPE_UNKNOWN != type || fd < 0) {
+        return type;
+    }
+
+    unsigned char data[FILETYPE_SNIFF_SIZE];
+    int64_t got = ReadFully(fd, data, sizeof(data));
+
+    SeekFile(fd, 0);
+
+    return got > 0 ? FiletypeFromData(data, (size_t) got) : LIBMTP_FILETYPE_UNKNOWN;
+}
+
+int Get_Filetype(std::string name) {
+    return FiletypeForName(name);
+}
@@ -0,0 +1,38 @@
+#ifndef MTP_FILETYPE_H
+#define MTP_FILETYPE_H
+
+#include <stdint.h>
+#include <string>
+
+#include "libmtp.h"
+
+/* the leading bytes of a file FiletypeFromData() looks at */
+static const size_t FILETYPE_SNIFF_SIZE = 16;
+
+/**
+ * Maps the extension of `name` to a file type, with the extensions libmtp's
+ * find_filetype() knows and a few more. Returns LIBMTP_FILETYPE_UNKNOWN
+ * for anything else.
+ */
+LIBMTP_filetype_t FiletypeForName(const std::string &name);
+
+/**
+ * Recognises media and image formats by their signature.
+ */
+LIBMTP_filetype_t FiletypeFromData(const unsigned char *data, size_t length);
+
+/**
+ * The type a file is uploaded as: by extension, or else by the signature
+ * in the first bytes of its data if they are at hand.
+ */
+LIBMTP_filetype_t ClassifyFile(const std::string &name, const unsigned char *data, size_t length);
+
+/**
+ * Like ClassifyFile(), reading the first bytes from `fd`, which is opened
+ * for an upload and rewound afterwards.
+ */
+LIBMTP_filetype_t ClassifyFileDescriptor(const std::string &name, int fd);
+
+int Get_Filetype(std::string name);
+
+#endif
@@ -60,6 +60,11 @@ int use_mtpz;
 #define USE_WINDOWS_IO_H
 #include <io.h>
 #endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 
 /**
@@ -131,15 +136,33 @@ static filemap_t *g_filemap = NULL;
 // This holds the global property mapping table
 static propertymap_t *g_propertymap = NULL;
 
+/*
+ * Dense indexes over the two mapping tables, so converting an object does
+ * not walk the lists. A libmtp id indexes its entry directly; a 16 bit PTP
+ * code indexes the libmtp id plus one, 0 meaning unmapped. They are built
+ * by init_filemap() and init_propertymap(), that is at LIBMTP_Init().
+ */
+#define PTP_CODE_SPACE 0x10000
+static filemap_t *g_filemap_by_id[LIBMTP_FILETYPE_UNKNOWN + 1];
+static uint8_t g_filemap_by_ptp[PTP_CODE_SPACE];
+static propertymap_t *g_propertymap_by_id[LIBMTP_PROPERTY_UNKNOWN + 1];
+static uint8_t g_propertymap_by_ptp[PTP_CODE_SPACE];
+
+// Fails to compile should the libmtp ids outgrow the PTP code indexes
+typedef char filemap_ids_fit_index[LIBMTP_FILETYPE_UNKNOWN < 0xFF ? 1 : -1];
+typedef char propertymap_ids_fit_index[LIBMTP_PROPERTY_UNKNOWN < 0xFF ? 1 : -1];
+
 /*
  * Forward declarations of local (static) functions.
  */
 static int register_filetype(char const * const description, LIBMTP_filetype_t const id,
 			     uint16_t const ptp_id);
 static void init_filemap();
+static void index_filemap();
 static int register_property(char const * const description, LIBMTP_property_t const id,
 			     uint16_t const ptp_id);
 static void init_propertymap();
+static void index_propertymap();
 static void add_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 				    LIBMTP_error_number_t errornumber,
 				    char const * const error_text);
@@ -214,13 +237,26 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 				uint32_t const no_tracks);
 static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata);
 static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
+static void add_sent_object_to_cache(LIBMTP_mtpdevice_t *device,
+				     LIBMTP_file_t const * const filedata, uint16_t of);
 static void update_metadata_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
+static void remove_tree_from_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id,
+				   int folder);
+static void invalidate_cache(LIBMTP_mtpdevice_t *device);
+static int is_cached_folder(PTPParams *params, uint32_t object_id);
+static uint16_t add_new_children_to_cache(LIBMTP_mtpdevice_t *device,
+					  uint32_t storage_id, uint32_t parent_id);
 static int set_object_filename(LIBMTP_mtpdevice_t *device,
 		uint32_t object_id,
 		uint16_t ptp_type,
                 const char **newname);
-static char *generate_unique_filename(PTPParams* params, char const * const filename);
-static int check_filename_exists(PTPParams* params, char const * const filename);
+static char *generate_unique_filename(LIBMTP_mtpdevice_t *device, char const * const filename);
+static int check_filename_exists(LIBMTP_mtpdevice_t *device, char const * const filename);
+static void index_cached_object(LIBMTP_mtpdevice_t *device, uint32_t object_id);
+static void unindex_cached_object(LIBMTP_mtpdevice_t *device, uint32_t object_id);
+static void drop_filename_index(LIBMTP_mtpdevice_t *device);
+static uint16_t want_object(LIBMTP_mtpdevice_t *device, uint32_t object_id,
+			    unsigned int want, PTPObject **ob);
 static void LIBMTP_Handle_Event(PTPContainer *ptp_event,
                                 LIBMTP_event_t *event, uint32_t *out1);
 
@@ -408,24 +444,39 @@ static void init_filemap()
   register_filetype("Abstract Album file", LIBMTP_FILETYPE_ALBUM, PTP_OFC_MTP_AbstractAudioAlbum);
   register_filetype("Abstract Playlist file", LIBMTP_FILETYPE_PLAYLIST, PTP_OFC_MTP_AbstractAudioVideoPlaylist);
   register_filetype("Undefined filetype", LIBMTP_FILETYPE_UNKNOWN, PTP_OFC_Undefined);
+  index_filemap();
 }
 
 /**
- * Returns the PTP filetype that maps to a certain libmtp internal file type.
- * @param intype the MTP library interface type
- * @return the PTP (libgphoto2) interface type
+ * Rebuilds the filetype indexes from the mapping list. Where two entries
+ * share a PTP code the first one wins, as it did for the list walk.
  */
-static uint16_t map_libmtp_type_to_ptp_type(LIBMTP_filetype_t intype)
+static void index_filemap()
 {
   filemap_t *current;
 
-  current = g_filemap;
+  memset(g_filemap_by_id, 0, sizeof(g_filemap_by_id));
+  memset(g_filemap_by_ptp, 0, sizeof(g_filemap_by_ptp));
 
-  while (current != NULL) {
-    if(current->id == intype) {
-      return current->ptp_id;
+  for (current = g_filemap; current != NULL; current = current->next) {
+    if ((unsigned) current->id <= LIBMTP_FILETYPE_UNKNOWN && g_filemap_by_id[current->id] == NULL) {
+      g_filemap_by_id[current->id] = current;
     }
-    current = current->next;
+    if (g_filemap_by_ptp[current->ptp_id] == 0) {
+      g_filemap_by_ptp[current->ptp_id] = (uint8_t) current->id + 1;
+    }
+  }
+}
+
+/**
+ * Returns the PTP filetype that maps to a certain libmtp internal file type.
+ * @param intype the MTP library interface type
+ * @return the PTP (libgphoto2) interface type
+ */
+static uint16_t map_libmtp_type_to_ptp_type(LIBMTP_filetype_t intype)
+{
+  if ((unsigned) intype <= LIBMTP_FILETYPE_UNKNOWN && g_filemap_by_id[intype] != NULL) {
+    return g_filemap_by_id[intype]->ptp_id;
   }
   // printf("map_libmtp_type_to_ptp_type: unknown filetype.\n");
   return PTP_OFC_Undefined;
@@ -440,15 +491,10 @@ static uint16_t map_libmtp_type_to_ptp_type(LIBMTP_filetype_t intype)
  */
 static LIBMTP_filetype_t map_ptp_type_to_libmtp_type(uint16_t intype)
 {
-  filemap_t *current;
-
-  current = g_filemap;
+  uint8_t entry = g_filemap_by_ptp[intype];
 
-  while (current != NULL) {
-    if(current->ptp_id == intype) {
-      return current->id;
-    }
-    current = current->next;
+  if (entry != 0) {
+    return (LIBMTP_filetype_t) (entry - 1);
   }
   // printf("map_ptp_type_to_libmtp_type: unknown filetype.\n");
   return LIBMTP_FILETYPE_UNKNOWN;
@@ -702,24 +748,38 @@ static void init_propertymap()
   register_property("Encoding Profile", LIBMTP_PROPERTY_EncodingProfile, PTP_OPC_EncodingProfile);
   register_property("Buy flag", LIBMTP_PROPERTY_BuyFlag, PTP_OPC_BuyFlag);
   register_property("Unknown property", LIBMTP_PROPERTY_UNKNOWN, 0);
+  index_propertymap();
 }
 
 /**
- * Returns the PTP property that maps to a certain libmtp internal property type.
- * @param inproperty the MTP library interface property
- * @return the PTP (libgphoto2) property type
+ * Rebuilds the property indexes from the mapping list, see index_filemap().
  */
-static uint16_t map_libmtp_property_to_ptp_property(LIBMTP_property_t inproperty)
+static void index_propertymap()
 {
   propertymap_t *current;
 
-  current = g_propertymap;
+  memset(g_propertymap_by_id, 0, sizeof(g_propertymap_by_id));
+  memset(g_propertymap_by_ptp, 0, sizeof(g_propertymap_by_ptp));
 
-  while (current != NULL) {
-    if(current->id == inproperty) {
-      return current->ptp_id;
+  for (current = g_propertymap; current != NULL; current = current->next) {
+    if ((unsigned) current->id <= LIBMTP_PROPERTY_UNKNOWN && g_propertymap_by_id[current->id] == NULL) {
+      g_propertymap_by_id[current->id] = current;
     }
-    current = current->next;
+    if (g_propertymap_by_ptp[current->ptp_id] == 0) {
+      g_propertymap_by_ptp[current->ptp_id] = (uint8_t) current->id + 1;
+    }
+  }
+}
+
+/**
+ * Returns the PTP property that maps to a certain libmtp internal property type.
+ * @param inproperty the MTP library interface property
+ * @return the PTP (libgphoto2) property type
+ */
+static uint16_t map_libmtp_property_to_ptp_property(LIBMTP_property_t inproperty)
+{
+  if ((unsigned) inproperty <= LIBMTP_PROPERTY_UNKNOWN && g_propertymap_by_id[inproperty] != NULL) {
+    return g_propertymap_by_id[inproperty]->ptp_id;
   }
   return 0;
 }
@@ -733,15 +793,10 @@ static uint16_t map_libmtp_property_to_ptp_property(LIBMTP_property_t inproperty
  */
 static LIBMTP_property_t map_ptp_property_to_libmtp_property(uint16_t inproperty)
 {
-  propertymap_t *current;
-
-  current = g_propertymap;
+  uint8_t entry = g_propertymap_by_ptp[inproperty];
 
-  while (current != NULL) {
-    if(current->ptp_id == inproperty) {
-      return current->id;
-    }
-    current = current->next;
+  if (entry != 0) {
+    return (LIBMTP_property_t) (entry - 1);
   }
   // printf("map_ptp_type_to_libmtp_type: unknown filetype.\n");
   return LIBMTP_PROPERTY_UNKNOWN;
@@ -806,15 +861,8 @@ void LIBMTP_Init(void)
  */
 char const * LIBMTP_Get_Filetype_Description(LIBMTP_filetype_t intype)
 {
-  filemap_t *current;
-
-  current = g_filemap;
-
-  while (current != NULL) {
-    if(current->id == intype) {
-      return current->description;
-    }
-    current = current->next;
+  if ((unsigned) intype <= LIBMTP_FILETYPE_UNKNOWN && g_filemap_by_id[intype] != NULL) {
+    return g_filemap_by_id[intype]->description;
   }
 
   return "Unknown filetype";
@@ -829,15 +877,8 @@ char const * LIBMTP_Get_Filetype_Description(LIBMTP_filetype_t intype)
  */
 char const * LIBMTP_Get_Property_Description(LIBMTP_property_t inproperty)
 {
-  propertymap_t *current;
-
-  current = g_propertymap;
-
-  while (current != NULL) {
-    if(current->id == inproperty) {
-      return current->description;
-    }
-    current = current->next;
+  if ((unsigned) inproperty <= LIBMTP_PROPERTY_UNKNOWN && g_propertymap_by_id[inproperty] != NULL) {
+    return g_propertymap_by_id[inproperty]->description;
   }
 
   return "Unknown property";
@@ -2434,6 +2475,7 @@ void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
   ptp_free_params(params);
   free(params);
   free_storage_list(device);
+  drop_filename_index(device);
   // Free extension list...
   if (device->extensions != NULL) {
     LIBMTP_device_extension_t *tmp = device->extensions;
@@ -2583,6 +2625,24 @@ void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
   }
 }
 
+/**
+ * Tells if get_all_metadata_fast() stores a property in the object info
+ * rather than in the per-object proplist.
+ */
+static int is_objectinfo_property(uint16_t property)
+{
+  switch (property) {
+  case PTP_OPC_ParentObject:
+  case PTP_OPC_ObjectFormat:
+  case PTP_OPC_ObjectSize:
+  case PTP_OPC_StorageID:
+  case PTP_OPC_ObjectFileName:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
 /**
  * This command gets all handles and stuff by FAST directory retrieveal
  * which is available by getting all metadata for object
@@ -2658,10 +2718,19 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
   }
   lasthandle = 0xffffffff;
   params->objects = calloc (cnt, sizeof(PTPObject));
+  if (params->objects == NULL && cnt != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "get_all_metadata_fast(): "
+			    "could not allocate the object list.");
+    ptp_destroy_object_prop_list(props, nrofprops);
+    return -1;
+  }
   prop = props;
   i = -1;
   for (j=0;j<nrofprops;j++) {
     if (lasthandle != prop->ObjectHandle) {
+      int k, others = 0;
+
       if (i >= 0) {
         params->objects[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
 	if (!params->objects[i].oi.Filename) {
@@ -2672,6 +2741,33 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
       i++;
       lasthandle = prop->ObjectHandle;
       params->objects[i].oid = prop->ObjectHandle;
+
+      /*
+       * Size the per-object proplist in one go: growing it one
+       * property at a time made this quadratic in the properties
+       * per object, and did millions of reallocs on large devices.
+       */
+      for (k=j;k<nrofprops && props[k].ObjectHandle == lasthandle;k++) {
+	if (!is_objectinfo_property(props[k].property)) {
+	  others++;
+	}
+      }
+      if (others > 0) {
+	params->objects[i].mtpprops = calloc(others, sizeof(MTPProperties));
+	if (params->objects[i].mtpprops == NULL) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+				  "get_all_metadata_fast(): "
+				  "could not allocate an object proplist.");
+	  /* Earlier properties belong to the objects by now */
+	  params->nrofobjects = i+1;
+	  for (k=j;k<nrofprops;k++) {
+	    ptp_destroy_object_prop(&props[k]);
+	  }
+	  free(props);
+	  return -1;
+	}
+	params->objects[i].flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+      }
     }
     switch (prop->property) {
     case PTP_OPC_ParentObject:
@@ -2682,11 +2778,8 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
       params->objects[i].oi.ObjectFormat = prop->propval.u16;
       break;
     case PTP_OPC_ObjectSize:
-      // We loose precision here, up to 32 bits! However the commands that
-      // retrieve metadata for files and tracks will make sure that the
-      // PTP_OPC_ObjectSize is read in and duplicated again.
       if (device->object_bitsize == 64) {
-	params->objects[i].oi.ObjectCompressedSize = (uint32_t) prop->propval.u64;
+	params->objects[i].oi.ObjectCompressedSize = prop->propval.u64;
       } else {
 	params->objects[i].oi.ObjectCompressedSize = prop->propval.u32;
       }
@@ -2696,28 +2789,20 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
       params->objects[i].flags |= PTPOBJECT_STORAGEID_LOADED;
       break;
     case PTP_OPC_ObjectFileName:
-      if (prop->propval.str != NULL)
-        params->objects[i].oi.Filename = strdup(prop->propval.str);
-      break;
-    default: {
-      MTPProperties *newprops;
-
-      /* Copy all of the other MTP oprierties into the per-object proplist */
-      if (params->objects[i].nrofmtpprops) {
-        newprops = realloc(params->objects[i].mtpprops,
-		(params->objects[i].nrofmtpprops+1)*sizeof(MTPProperties));
-      } else {
-        newprops = calloc(1,sizeof(MTPProperties));
+      /* The object takes over the string, props is freed flat below */
+      if (prop->propval.str != NULL) {
+	free(params->objects[i].oi.Filename);
+	params->objects[i].oi.Filename = prop->propval.str;
+	prop->propval.str = NULL;
       }
-      if (!newprops) return 0; /* FIXME: error handling? */
-      params->objects[i].mtpprops = newprops;
+      break;
+    default:
+      /* Move all of the other MTP properties into the per-object proplist */
       memcpy(&params->objects[i].mtpprops[params->objects[i].nrofmtpprops],
-	     &props[j],sizeof(props[j]));
+	     prop, sizeof(MTPProperties));
       params->objects[i].nrofmtpprops++;
-      params->objects[i].flags |= PTPOBJECT_MTPPROPLIST_LOADED;
       break;
     }
-    }
     prop++;
   }
   /* mark last entry also */
@@ -2766,8 +2851,8 @@ static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
   // Now descend into any subdirectories found
   for (i = 0; i < currentHandles.n; i++) {
     PTPObject *ob;
-    ret = ptp_object_want(params,currentHandles.Handler[i],
-			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
+    ret = want_object(device, currentHandles.Handler[i],
+		      PTPOBJECT_OBJECTINFO_LOADED, &ob);
     if (ret == PTP_RC_OK) {
       if (ob->oi.ObjectFormat == PTP_OFC_Association)
         get_handles_recursively(device, params,
@@ -2801,13 +2886,7 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
     return;
   }
 
-  if (params->objects != NULL) {
-    for (i=0;i<params->nrofobjects;i++)
-      ptp_free_object (&params->objects[i]);
-    free(params->objects);
-    params->objects = NULL;
-    params->nrofobjects = 0;
-  }
+  invalidate_cache(device);
 
   if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
       && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
@@ -2845,8 +2924,8 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
     PTPObject *ob, *xob;
 
     ob = &params->objects[i];
-    ret = ptp_object_want(params,params->objects[i].oid,
-			  PTPOBJECT_OBJECTINFO_LOADED, &xob);
+    ret = want_object(device, params->objects[i].oid,
+		      PTPOBJECT_OBJECTINFO_LOADED, &xob);
     if (ret != PTP_RC_OK) {
 	LIBMTP_ERROR("broken! %x not found\n", params->objects[i].oid);
     }
@@ -3079,11 +3158,10 @@ static int get_suggested_storage_id(LIBMTP_mtpdevice_t *device,
 				    uint64_t fitsize,
 				    uint32_t parent_id)
 {
-  PTPParams *params = (PTPParams *) device->params;
   PTPObject *ob;
   uint16_t ret;
 
-  ret = ptp_object_want(params, parent_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
+  ret = want_object(device, parent_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
   if ((ret != PTP_RC_OK) || (ob->oi.StorageID == 0)) {
     add_ptp_error_to_errorstack(device, ret, "get_suggested_storage_id(): "
 				"could not get storage id from parent id.");
@@ -4375,7 +4453,7 @@ LIBMTP_file_t *LIBMTP_Get_Filemetadata(LIBMTP_mtpdevice_t *device, uint32_t cons
     flush_handles(device);
   }
 
-  ret = ptp_object_want(params, fileid, PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_MTPPROPLIST_LOADED, &ob);
+  ret = want_object(device, fileid, PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_MTPPROPLIST_LOADED, &ob);
   if (ret != PTP_RC_OK)
     return NULL;
 
@@ -4748,7 +4826,7 @@ static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat
   /*
    * If we have a cached, large set of metadata, then use it!
    */
-  ret = ptp_object_want(params, track->item_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
+  ret = want_object(device, track->item_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
   if (ob->mtpprops) {
     prop = ob->mtpprops;
     for (i=0;i<ob->nrofmtpprops;i++,prop++)
@@ -5060,7 +5138,7 @@ LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t co
   if (params->nrofobjects == 0)
     flush_handles(device);
 
-  ret = ptp_object_want (params, trackid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  ret = want_object(device, trackid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK)
     return NULL;
 
@@ -5536,164 +5614,601 @@ int LIBMTP_Send_Track_From_File(LIBMTP_mtpdevice_t *device,
 
 
 /**
- * This helper function checks if a filename already exists on the device
- * @param PTPParams*
- * @param string representing the filename
- * @return 0 if the filename doesn't exist, -1 if it does
- */
-static int check_filename_exists(PTPParams* params, char const * const filename)
-{
-  int i;
+ * The filename index of a device: the name of every cached object, and
+ * every name with the number of cached objects carrying it, so that the
+ * unique filename checks below do not compare against each object in
+ * turn. Both tables use linear probing and stay at most half full.
+ *
+ * The index is kept current by every path in this file that changes the
+ * object cache: objects added, loaded or renamed are indexed again, see
+ * index_cached_object() and want_object(), removed ones forgotten, and a
+ * reloaded cache drops the index. The number of indexed objects is only
+ * checked against the cache as a last guard.
+ */
+typedef struct {
+  char *name;           /* NULL if the slot is free */
+  uint32_t hash;
+  uint32_t count;       /* cached objects with this name */
+} filename_name_t;
+
+typedef struct {
+  uint32_t oid;
+  int used;
+  char *name;           /* owned by the name table, NULL if unnamed */
+} filename_object_t;
+
+typedef struct {
+  filename_name_t *names;
+  uint32_t names_size;
+  uint32_t names_used;
+  filename_object_t *objects;
+  uint32_t objects_size;
+  uint32_t objects_used;
+} filename_index_t;
 
-  for (i = 0; i < params->nrofobjects; i++) {
-    char *fname = params->objects[i].oi.Filename;
-    if ((fname != NULL) && (strcmp(filename, fname) == 0))
-    {
-      return -1;
-    }
-  }
+/*
+ * The filename indexes live beside the devices rather than in
+ * LIBMTP_mtpdevice_t, whose layout is shared with prebuilt libmtp
+ * binaries. A device only ever touches its own index, but the devices
+ * may be used from different threads, so the table itself is locked.
+ */
+typedef struct filename_index_entry_struct {
+  LIBMTP_mtpdevice_t *device;
+  filename_index_t *index;
+  struct filename_index_entry_struct *next;
+} filename_index_entry_t;
+
+static filename_index_entry_t *g_filename_indexes = NULL;
+#ifdef _WIN32
+static SRWLOCK g_filename_indexes_lock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t g_filename_indexes_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-  return 0;
+static void lock_filename_indexes(void)
+{
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&g_filename_indexes_lock);
+#else
+  pthread_mutex_lock(&g_filename_indexes_lock);
+#endif
+}
+
+static void unlock_filename_indexes(void)
+{
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(&g_filename_indexes_lock);
+#else
+  pthread_mutex_unlock(&g_filename_indexes_lock);
+#endif
 }
 
 /**
- * This helper function returns a unique filename, with a random string before the extension
- * @param string representing the original filename
- * @return a string representing the unique filename
+ * Returns the filename index of a device, NULL if it has none.
  */
-static char *generate_unique_filename(PTPParams* params, char const * const filename)
+static filename_index_t *find_filename_index(LIBMTP_mtpdevice_t *device)
 {
-  int suffix;
-  char * extension_position;
-
-  if (check_filename_exists(params, filename))
-  {
-    extension_position = strrchr(filename,'.');
-
-    char basename[extension_position - filename + 1];
-    strncpy(basename, filename, extension_position - filename);
-    basename[extension_position - filename] = '\0';
+  filename_index_entry_t *entry;
+  filename_index_t *index = NULL;
 
-    suffix = 1;
-    char newname[ strlen(basename) + 6 + strlen(extension_position)];
-    sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
-    while ((check_filename_exists(params, newname)) && (suffix < 1000000)) {
-      suffix++;
-      sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
+  lock_filename_indexes();
+  for (entry = g_filename_indexes; entry != NULL; entry = entry->next) {
+    if (entry->device == device) {
+      index = entry->index;
+      break;
     }
-  return strdup(newname);
-  }
-  else
-  {
-    return strdup(filename);
   }
+  unlock_filename_indexes();
+  return index;
 }
 
 /**
- * This function sends a track from a file descriptor to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
- * @param device a pointer to the device to send the track to.
- * @param fd the filedescriptor for a local file which will be sent.
- * @param metadata a track metadata set to be written along with the file.
- *        After this call the field <code>metadata-&gt;item_id</code>
- *        will contain the new track ID. Other fields such
- *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
- *        or <code>metadata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this track in. Since some
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Send_Track_From_File()
- * @see LIBMTP_Delete_Object()
+ * Sets the filename index of a device, or forgets it with NULL. The
+ * previous index is not freed.
+ * @return 0 on success, -1 if out of memory.
  */
-int LIBMTP_Send_Track_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
-			 int const fd, LIBMTP_track_t * const metadata,
-                         LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+static int set_filename_index(LIBMTP_mtpdevice_t *device, filename_index_t *index)
 {
-  int subcall_ret;
-  LIBMTP_file_t filedata;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPParams *params = (PTPParams *) device->params;
-
-  // Sanity check, is this really a track?
-  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_File_Descriptor(): "
-			    "I don't think this is actually a track, strange filetype...");
-  }
+  filename_index_entry_t **link;
+  filename_index_entry_t *entry;
+  int ret = 0;
 
-  // Wrap around the file transfer function
-  filedata.item_id = metadata->item_id;
-  filedata.parent_id = metadata->parent_id;
-  filedata.storage_id = metadata->storage_id;
-  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
-    filedata.filename = generate_unique_filename(params, metadata->filename);
+  lock_filename_indexes();
+  for (link = &g_filename_indexes; *link != NULL; link = &(*link)->next) {
+    if ((*link)->device == device)
+      break;
   }
-  else {
-    filedata.filename = metadata->filename;
+  entry = *link;
+  if (index == NULL) {
+    if (entry != NULL) {
+      *link = entry->next;
+      free(entry);
+    }
+  } else if (entry != NULL) {
+    entry->index = index;
+  } else {
+    entry = malloc(sizeof(filename_index_entry_t));
+    if (entry == NULL) {
+      ret = -1;
+    } else {
+      entry->device = device;
+      entry->index = index;
+      entry->next = g_filename_indexes;
+      g_filename_indexes = entry;
+    }
   }
-  filedata.filesize = metadata->filesize;
-  filedata.filetype = metadata->filetype;
-  filedata.next = NULL;
-
-  subcall_ret = LIBMTP_Send_File_From_File_Descriptor(device,
-						      fd,
-						      &filedata,
-						      callback,
-						      data);
+  unlock_filename_indexes();
+  return ret;
+}
 
-  if (subcall_ret != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_File_Descriptor(): "
-			    "subcall to LIBMTP_Send_File_From_File_Descriptor failed.");
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
-    return -1;
-  }
+static uint32_t filename_hash(char const * const name)
+{
+  uint32_t hash = 2166136261u;
+  unsigned char const *c;
 
-  // Pick up new item (and parent, storage) ID
-  metadata->item_id = filedata.item_id;
-  metadata->parent_id = filedata.parent_id;
-  metadata->storage_id = filedata.storage_id;
+  for (c = (unsigned char const *) name; *c; c++)
+    hash = (hash ^ *c) * 16777619u;
+  return hash;
+}
 
-  // Set track metadata for the new fine track
-  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
-  if (subcall_ret != 0) {
-    // Subcall will add error to errorstack
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
-    return -1;
-  }
+static uint32_t filename_oid_slot(filename_index_t *index, uint32_t oid)
+{
+  return (oid * 2654435761u) & (index->objects_size - 1);
+}
 
-  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
-  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
+static void filename_index_free(filename_index_t *index)
+{
+  uint32_t i;
 
-  return 0;
+  if (index == NULL)
+    return;
+  for (i = 0; i < index->names_size; i++)
+    free(index->names[i].name);
+  free(index->names);
+  free(index->objects);
+  free(index);
 }
 
 /**
- * This function sends a track from a handler function to an
- * MTP device. A filename and a set of metadata must be
+ * Allocates an empty index sized for <code>capacity</code> objects.
+ * @return the index, or NULL if out of memory.
+ */
+static filename_index_t *filename_index_new(uint32_t capacity)
+{
+  filename_index_t *index = calloc(1, sizeof(filename_index_t));
+  uint32_t size = 16;
+
+  if (index == NULL)
+    return NULL;
+  while (size < capacity * 2 && size < 0x80000000u)
+    size <<= 1;
+  index->names = calloc(size, sizeof(filename_name_t));
+  index->objects = calloc(size, sizeof(filename_object_t));
+  if (index->names == NULL || index->objects == NULL) {
+    filename_index_free(index);
+    return NULL;
+  }
+  index->names_size = size;
+  index->objects_size = size;
+  return index;
+}
+
+static filename_name_t *filename_index_find(filename_index_t *index,
+					    char const * const name,
+					    uint32_t hash)
+{
+  uint32_t mask = index->names_size - 1;
+  uint32_t i;
+
+  for (i = hash & mask; index->names[i].name != NULL; i = (i + 1) & mask) {
+    if (index->names[i].hash == hash && strcmp(index->names[i].name, name) == 0)
+      return &index->names[i];
+  }
+  return NULL;
+}
+
+/**
+ * Drops one object from a name, and the name once no object has it.
+ * Later entries of the probe run move up into the freed slot, so no
+ * deleted markers pile up.
+ */
+static void filename_index_release_name(filename_index_t *index, char *name)
+{
+  uint32_t mask = index->names_size - 1;
+  filename_name_t *entry = filename_index_find(index, name, filename_hash(name));
+  uint32_t i, j;
+
+  if (entry == NULL || --entry->count > 0)
+    return;
+  free(entry->name);
+  entry->name = NULL;
+  index->names_used--;
+  i = entry - index->names;
+  for (j = (i + 1) & mask; index->names[j].name != NULL; j = (j + 1) & mask) {
+    uint32_t home = index->names[j].hash & mask;
+
+    // Move up unless the entry's home lies cyclically in (i, j]
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      index->names[i] = index->names[j];
+      index->names[j].name = NULL;
+      i = j;
+    }
+  }
+}
+
+static void filename_index_remove(filename_index_t *index, uint32_t oid)
+{
+  uint32_t mask = index->objects_size - 1;
+  uint32_t i, j;
+
+  for (i = filename_oid_slot(index, oid); index->objects[i].used; i = (i + 1) & mask) {
+    if (index->objects[i].oid == oid)
+      break;
+  }
+  if (!index->objects[i].used)
+    return;
+  if (index->objects[i].name != NULL)
+    filename_index_release_name(index, index->objects[i].name);
+  index->objects[i].used = 0;
+  index->objects_used--;
+  for (j = (i + 1) & mask; index->objects[j].used; j = (j + 1) & mask) {
+    uint32_t home = filename_oid_slot(index, index->objects[j].oid);
+
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      index->objects[i] = index->objects[j];
+      index->objects[j].used = 0;
+      i = j;
+    }
+  }
+}
+
+/**
+ * Moves all entries into tables twice as large.
+ * @return 0 on success, -1 if out of memory (the index is unchanged).
+ */
+static int filename_index_grow(filename_index_t *index)
+{
+  filename_index_t *larger = filename_index_new(index->objects_size);
+  uint32_t i, j;
+
+  if (larger == NULL)
+    return -1;
+  for (i = 0; i < index->names_size; i++) {
+    if (index->names[i].name == NULL)
+      continue;
+    for (j = index->names[i].hash & (larger->names_size - 1);
+	 larger->names[j].name != NULL;
+	 j = (j + 1) & (larger->names_size - 1));
+    larger->names[j] = index->names[i];
+  }
+  for (i = 0; i < index->objects_size; i++) {
+    if (!index->objects[i].used)
+      continue;
+    for (j = filename_oid_slot(larger, index->objects[i].oid);
+	 larger->objects[j].used;
+	 j = (j + 1) & (larger->objects_size - 1));
+    larger->objects[j] = index->objects[i];
+  }
+  free(index->names);
+  free(index->objects);
+  index->names = larger->names;
+  index->names_size = larger->names_size;
+  index->objects = larger->objects;
+  index->objects_size = larger->objects_size;
+  free(larger);
+  return 0;
+}
+
+/**
+ * Records the name of a cached object, replacing the name it had.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int filename_index_add(filename_index_t *index, uint32_t oid,
+			      char const * const name)
+{
+  filename_name_t *entry = NULL;
+  uint32_t i;
+
+  filename_index_remove(index, oid);
+  if ((index->objects_used + 1) * 2 > index->objects_size &&
+      filename_index_grow(index) != 0)
+    return -1;
+
+  if (name != NULL) {
+    uint32_t hash = filename_hash(name);
+
+    entry = filename_index_find(index, name, hash);
+    if (entry == NULL) {
+      char *copy = strdup(name);
+
+      if (copy == NULL)
+	return -1;
+      for (i = hash & (index->names_size - 1);
+	   index->names[i].name != NULL;
+	   i = (i + 1) & (index->names_size - 1));
+      entry = &index->names[i];
+      entry->name = copy;
+      entry->hash = hash;
+      entry->count = 0;
+      index->names_used++;
+    }
+    entry->count++;
+  }
+
+  for (i = filename_oid_slot(index, oid); index->objects[i].used;
+       i = (i + 1) & (index->objects_size - 1));
+  index->objects[i].oid = oid;
+  index->objects[i].used = 1;
+  index->objects[i].name = entry != NULL ? entry->name : NULL;
+  index->objects_used++;
+  return 0;
+}
+
+/**
+ * Drops the filename index of a device, to be rebuilt when needed.
+ */
+static void drop_filename_index(LIBMTP_mtpdevice_t *device)
+{
+  filename_index_t *index = find_filename_index(device);
+
+  if (index == NULL)
+    return;
+  set_filename_index(device, NULL);
+  filename_index_free(index);
+}
+
+/**
+ * Records a cached object in the filename index of a device, if it has
+ * one. Called after every change of the object in the cache, whether it
+ * succeeded or not: a failed load may still have inserted the object,
+ * and an object which is not cached (any more) is forgotten.
+ */
+static void index_cached_object(LIBMTP_mtpdevice_t *device, uint32_t object_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  filename_index_t *index = find_filename_index(device);
+  PTPObject *ob;
+
+  if (index == NULL)
+    return;
+  if (ptp_object_find(params, object_id, &ob) != PTP_RC_OK) {
+    filename_index_remove(index, object_id);
+    return;
+  }
+  if (filename_index_add(index, object_id, ob->oi.Filename) != 0)
+    drop_filename_index(device);
+}
+
+/**
+ * ptp_object_want() for the code in this file: it inserts an object
+ * missing from the cache and loads its filename, so the object is
+ * indexed again afterwards.
+ */
+static uint16_t want_object(LIBMTP_mtpdevice_t *device, uint32_t object_id,
+			    unsigned int want, PTPObject **ob)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  ret = ptp_object_want(params, object_id, want, ob);
+  index_cached_object(device, object_id);
+  return ret;
+}
+
+/**
+ * Forgets an object in the filename index of a device, if it has one.
+ * Works whether the object is still cached or not.
+ */
+static void unindex_cached_object(LIBMTP_mtpdevice_t *device, uint32_t object_id)
+{
+  filename_index_t *index = find_filename_index(device);
+
+  if (index != NULL)
+    filename_index_remove(index, object_id);
+}
+
+/**
+ * Returns the filename index of a device, built from the object cache
+ * unless it already covers every cached object.
+ * @return the index, or NULL if out of memory.
+ */
+static filename_index_t *get_filename_index(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  filename_index_t *index = find_filename_index(device);
+  uint32_t i;
+
+  if (index != NULL && index->objects_used == params->nrofobjects)
+    return index;
+
+  drop_filename_index(device);
+  index = filename_index_new(params->nrofobjects);
+  if (index == NULL)
+    return NULL;
+  for (i = 0; i < params->nrofobjects; i++) {
+    if (filename_index_add(index, params->objects[i].oid,
+			   params->objects[i].oi.Filename) != 0) {
+      filename_index_free(index);
+      return NULL;
+    }
+  }
+  if (set_filename_index(device, index) != 0) {
+    filename_index_free(index);
+    return NULL;
+  }
+  return index;
+}
+
+/**
+ * This helper function checks if a filename already exists on the device
+ * @param device a pointer to the device.
+ * @param string representing the filename
+ * @return 0 if the filename doesn't exist, -1 if it does
+ */
+static int check_filename_exists(LIBMTP_mtpdevice_t *device, char const * const filename)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  filename_index_t *index = get_filename_index(device);
+  int i;
+
+  if (index != NULL) {
+    return filename_index_find(index, filename, filename_hash(filename)) ? -1 : 0;
+  }
+
+  // Out of memory for the index, fall back to a plain scan
+  for (i = 0; i < params->nrofobjects; i++) {
+    char *fname = params->objects[i].oi.Filename;
+    if ((fname != NULL) && (strcmp(filename, fname) == 0))
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * This helper function returns a unique filename, with a random string before the extension
+ * @param device a pointer to the device.
+ * @param string representing the original filename
+ * @return a string representing the unique filename
+ */
+static char *generate_unique_filename(LIBMTP_mtpdevice_t *device, char const * const filename)
+{
+  int suffix;
+  char const * extension_position;
+
+  if (check_filename_exists(device, filename))
+  {
+    extension_position = strrchr(filename,'.');
+    if (extension_position == NULL)
+      extension_position = filename + strlen(filename);
+
+    char basename[extension_position - filename + 1];
+    strncpy(basename, filename, extension_position - filename);
+    basename[extension_position - filename] = '\0';
+
+    suffix = 1;
+    // Room for "_" and a suffix of up to 1000000
+    char newname[ strlen(basename) + 9 + strlen(extension_position)];
+    sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
+    while ((check_filename_exists(device, newname)) && (suffix < 1000000)) {
+      suffix++;
+      sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
+    }
+  return strdup(newname);
+  }
+  else
+  {
+    return strdup(filename);
+  }
+}
+
+/**
+ * This function sends a track from a file descriptor to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ * @param device a pointer to the device to send the track to.
+ * @param fd the filedescriptor for a local file which will be sent.
+ * @param metadata a track metadata set to be written along with the file.
+ *        After this call the field <code>metadata-&gt;item_id</code>
+ *        will contain the new track ID. Other fields such
+ *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
+ *        or <code>metadata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this track in. Since some
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_Track_From_File()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Send_Track_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
+			 int const fd, LIBMTP_track_t * const metadata,
+                         LIBMTP_progressfunc_t const callback,
+			 void const * const data)
+{
+  int subcall_ret;
+  LIBMTP_file_t filedata;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPParams *params = (PTPParams *) device->params;
+
+  // Sanity check, is this really a track?
+  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_File_Descriptor(): "
+			    "I don't think this is actually a track, strange filetype...");
+  }
+
+  // Wrap around the file transfer function
+  filedata.item_id = metadata->item_id;
+  filedata.parent_id = metadata->parent_id;
+  filedata.storage_id = metadata->storage_id;
+  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
+    filedata.filename = generate_unique_filename(device, metadata->filename);
+  }
+  else {
+    filedata.filename = metadata->filename;
+  }
+  filedata.filesize = metadata->filesize;
+  filedata.filetype = metadata->filetype;
+  filedata.next = NULL;
+
+  subcall_ret = LIBMTP_Send_File_From_File_Descriptor(device,
+						      fd,
+						      &filedata,
+						      callback,
+						      data);
+
+  if (subcall_ret != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_File_Descriptor(): "
+			    "subcall to LIBMTP_Send_File_From_File_Descriptor failed.");
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
+  }
+
+  // Pick up new item (and parent, storage) ID
+  metadata->item_id = filedata.item_id;
+  metadata->parent_id = filedata.parent_id;
+  metadata->storage_id = filedata.storage_id;
+
+  // Set track metadata for the new fine track
+  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
+  if (subcall_ret != 0) {
+    // Subcall will add error to errorstack
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
+  }
+
+  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
+  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
+
+  return 0;
+}
+
+/**
+ * This function sends a track from a handler function to an
+ * MTP device. A filename and a set of metadata must be
  * given as input.
  * @param device a pointer to the device to send the track to.
  * @param get_func the function to call when we have data.
@@ -5751,7 +6266,7 @@ int LIBMTP_Send_Track_From_Handler(LIBMTP_mtpdevice_t *device,
   filedata.parent_id = metadata->parent_id;
   filedata.storage_id = metadata->storage_id;
   if FLAG_UNIQUE_FILENAMES(ptp_usb) {
-    filedata.filename = generate_unique_filename(params, metadata->filename);
+    filedata.filename = generate_unique_filename(device, metadata->filename);
   }
   else {
     filedata.filename = metadata->filename;
@@ -6253,24 +6768,366 @@ static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file
     uint16_t *properties = NULL;
     uint32_t propcnt = 0;
 
-    // default parent handle
-    if (localph == 0)
-      localph = 0xFFFFFFFFU; // Set to -1
+    // default parent handle
+    if (localph == 0)
+      localph = 0xFFFFFFFFU; // Set to -1
+
+    // Must be 0x00000000U for new objects
+    filedata->item_id = 0x00000000U;
+
+    ret = ptp_mtp_getobjectpropssupported(params, of, &propcnt, &properties);
+
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
+
+      ret = ptp_mtp_getobjectpropdesc(params, properties[i], of, &opd);
+      if (ret != PTP_RC_OK) {
+	add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
+				"could not get property description.");
+      } else if (opd.GetSet) {
+	switch (properties[i]) {
+	case PTP_OPC_ObjectFileName:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_ObjectFileName;
+	  prop->datatype = PTP_DTC_STR;
+	  if (filedata->filename != NULL) {
+	    prop->propval.str = strdup(filedata->filename);
+	    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+	      strip_7bit_from_utf8(prop->propval.str);
+	    }
+	  }
+	  break;
+	case PTP_OPC_ProtectionStatus:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_ProtectionStatus;
+	  prop->datatype = PTP_DTC_UINT16;
+	  prop->propval.u16 = 0x0000U; /* Not protected */
+	  break;
+	case PTP_OPC_NonConsumable:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_NonConsumable;
+	  prop->datatype = PTP_DTC_UINT8;
+	  prop->propval.u8 = 0x00; /* It is supported, then it is consumable */
+	  break;
+	case PTP_OPC_Name:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_Name;
+	  prop->datatype = PTP_DTC_STR;
+	  if (filedata->filename != NULL)
+	    prop->propval.str = strdup(filedata->filename);
+	  break;
+	case PTP_OPC_DateModified:
+	  // Tag with current time if that is supported
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = filedata->item_id;
+	    prop->property = PTP_OPC_DateModified;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = get_iso8601_stamp();
+	    filedata->modificationdate = time(NULL);
+	  }
+	  break;
+	}
+      }
+      ptp_free_objectpropdesc(&opd);
+    }
+    free(properties);
+
+    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, &filedata->item_id,
+				     of, filedata->filesize, props, nrofprops);
+
+    /* Free property list */
+    ptp_destroy_object_prop_list(props, nrofprops);
+
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "send_file_object_info():"
+				  "Could not send object property list.");
+      if (ret == PTP_RC_AccessDenied) {
+	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+      }
+      return -1;
+    }
+  } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
+    PTPObjectInfo new_file;
+
+    memset(&new_file, 0, sizeof(PTPObjectInfo));
+
+    new_file.Filename = filedata->filename;
+    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+      strip_7bit_from_utf8(new_file.Filename);
+    }
+    if (filedata->filesize > 0xFFFFFFFFL) {
+      // This is a kludge in the MTP standard for large files.
+      new_file.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
+    } else {
+      new_file.ObjectCompressedSize = (uint32_t) filedata->filesize;
+    }
+    new_file.ObjectFormat = of;
+    new_file.StorageID = store;
+    new_file.ParentObject = localph;
+    new_file.ModificationDate = time(NULL);
+
+    // Create the object
+    ret = ptp_sendobjectinfo(params, &store, &localph, &filedata->item_id, &new_file);
+
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
+				  "Could not send object info.");
+      if (ret == PTP_RC_AccessDenied) {
+	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+      }
+      return -1;
+    }
+    // NOTE: the char* pointers inside new_file are not copies so don't
+    // try to destroy this objectinfo!
+  }
+
+  // Now there IS an object with this parent handle.
+  filedata->parent_id = localph;
+
+  return 0;
+}
+
+/**
+ * Object properties which can be set when sending an object of a certain
+ * format, as found by send_file_object_info(). The batch sender caches
+ * them per format instead of asking the device again for every file.
+ */
+#define SEND_BATCH_FORMATS 8
+
+typedef struct {
+  uint16_t of;
+  uint16_t *properties;
+  uint32_t propcnt;
+  uint32_t supportedcnt;
+} send_batch_format_t;
+
+/**
+ * Looks up the settable properties of a format, asking the device only
+ * for formats which are not cached yet.
+ * @return the format, or NULL if it could not be looked up; it is not
+ *         cached then and the reason is on the error stack.
+ */
+static send_batch_format_t *get_send_batch_format(LIBMTP_mtpdevice_t *device,
+						  send_batch_format_t *formats,
+						  uint32_t *nrofformats,
+						  uint16_t of,
+						  uint32_t *round_trips)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  send_batch_format_t *format;
+  uint16_t *supported = NULL;
+  uint32_t supportedcnt = 0;
+  uint16_t ret;
+  uint32_t i;
+
+  for (i = 0; i < *nrofformats; i++) {
+    if (formats[i].of == of) {
+      return &formats[i];
+    }
+  }
+  if (*nrofformats == SEND_BATCH_FORMATS) {
+    // Evict the oldest entry
+    free(formats[0].properties);
+    memmove(&formats[0], &formats[1], sizeof(send_batch_format_t) * (SEND_BATCH_FORMATS - 1));
+    (*nrofformats)--;
+  }
+
+  ret = ptp_mtp_getobjectpropssupported(params, of, &supportedcnt, &supported);
+  (*round_trips)++;
+  if (ret != PTP_RC_OK) {
+    // Without the properties the files would go without a filename
+    add_ptp_error_to_errorstack(device, ret, "get_send_batch_format(): "
+				"could not get supported properties.");
+    return NULL;
+  }
+
+  format = &formats[*nrofformats];
+  format->of = of;
+  format->propcnt = 0;
+  format->supportedcnt = supportedcnt;
+  format->properties = (uint16_t *) malloc(sizeof(uint16_t) * (supportedcnt ? supportedcnt : 1));
+  if (format->properties == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "get_send_batch_format(): "
+			    "could not allocate the property list.");
+    free(supported);
+    return NULL;
+  }
+  (*nrofformats)++;
+
+  for (i = 0; i < supportedcnt; i++) {
+    PTPObjectPropDesc opd;
+
+    ret = ptp_mtp_getobjectpropdesc(params, supported[i], of, &opd);
+    (*round_trips)++;
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "get_send_batch_format(): "
+				  "could not get property description.");
+      continue;
+    }
+    if (opd.GetSet) {
+      switch (supported[i]) {
+      case PTP_OPC_ObjectFileName:
+      case PTP_OPC_ProtectionStatus:
+      case PTP_OPC_NonConsumable:
+      case PTP_OPC_Name:
+      case PTP_OPC_DateModified:
+	format->properties[format->propcnt++] = supported[i];
+	break;
+      }
+    }
+    ptp_free_objectpropdesc(&opd);
+  }
+  free(supported);
+
+  return format;
+}
+
+/**
+ * This function sends a batch of (typically small) files to the same
+ * folder, amortizing the per-object overhead of
+ * LIBMTP_Send_File_From_Handler():
+ *
+ * - the destination storage and folder are checked once per batch instead
+ *   of once per file,
+ * - the settable object properties are retrieved once per object format
+ *   instead of once per file,
+ * - SendObjectPropList is used for every file whenever the device supports
+ *   it, and
+ * - with <code>LIBMTP_SEND_BATCH_SKIP_METADATA</code> the new objects are
+ *   not read back from the device after sending; <code>parent_id</code>
+ *   and <code>storage_id</code> of the file metadata are filled in from the
+ *   SendObjectPropList/SendObjectInfo response instead, and a cached
+ *   device caches the objects from what was sent.
+ *
+ * Every file is sent with the same data handler, with the corresponding
+ * entry of <code>privs</code> as its private pointer.
+ *
+ * @param device a pointer to the device to send the files to.
+ * @param storage_id the storage to send the files to, 0 for the storage
+ *        of the parent folder.
+ * @param parent_id the folder to send the files to, 0 for the root folder.
+ * @param files the metadata of the files to send. <code>item_id</code>,
+ *        <code>parent_id</code> and <code>storage_id</code> are updated.
+ * @param count the number of files.
+ * @param get_func the data handler.
+ * @param privs one private pointer per file, passed to the data handler.
+ * @param flags a combination of the <code>LIBMTP_SEND_BATCH_*</code> flags.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function.
+ * @param stats if not NULL, receives the number of files sent and the
+ *        number of PTP transactions issued, along with the number
+ *        one LIBMTP_Send_File_From_Handler() call per file would have
+ *        issued.
+ * @return 0 if all files were sent, any other value means failure, in
+ *         which case <code>stats->files</code> tells how many files were
+ *         sent before the failure.
+ * @see LIBMTP_Send_File_From_Handler()
+ */
+int LIBMTP_Send_Files_From_Handler_Batch(LIBMTP_mtpdevice_t *device,
+					 uint32_t const storage_id,
+					 uint32_t const parent_id,
+					 LIBMTP_file_t * const * const files,
+					 uint32_t const count,
+					 MTPDataGetFunc get_func,
+					 void * const * const privs,
+					 int const flags,
+					 LIBMTP_progressfunc_t const callback,
+					 void const * const data,
+					 LIBMTP_send_batch_stats_t *stats)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  send_batch_format_t formats[SEND_BATCH_FORMATS];
+  uint32_t nrofformats = 0;
+  uint32_t store = storage_id;
+  uint32_t parent = parent_id;
+  uint32_t round_trips = 0;
+  uint32_t baseline = 0;
+  uint32_t sent = 0;
+  int use_proplist;
+  int result = 0;
+  uint16_t ret;
+  uint32_t i;
+  uint32_t j;
+
+  if (parent == 0) {
+    parent = 0xFFFFFFFFU;
+  }
 
-    // Must be 0x00000000U for new objects
-    filedata->item_id = 0x00000000U;
+  // Check the destination once for the whole batch
+  if (parent != 0xFFFFFFFFU) {
+    PTPObject *ob;
 
-    ret = ptp_mtp_getobjectpropssupported(params, of, &propcnt, &properties);
+    ret = want_object(device, parent, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+    round_trips++;
+    if (ret != PTP_RC_OK || ob->oi.ObjectFormat != PTP_OFC_Association) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Files_From_Handler_Batch(): "
+				  "destination is not a folder.");
+      result = -1;
+      goto done;
+    }
+    if (store == 0) {
+      store = ob->oi.StorageID;
+    }
+  }
+  if (store == 0) {
+    uint64_t total = 0;
 
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+    for (i = 0; i < count; i++) {
+      total += files[i]->filesize;
+    }
+    store = get_writeable_storageid(device, total);
+    if (store == (uint32_t) -1) {
+      result = -1;
+      goto done;
+    }
+  }
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], of, &opd);
-      if (ret != PTP_RC_OK) {
-	add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
+  use_proplist = ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
+    !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb);
+
+  for (i = 0; i < count; i++) {
+    LIBMTP_file_t *filedata = files[i];
+    uint16_t of = map_libmtp_type_to_ptp_type(filedata->filetype);
+    uint32_t localstore = store;
+    uint32_t localph = parent;
+    MTPDataHandler mtp_handler;
+    PTPDataHandler handler;
+
+    if (FLAG_OGG_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_OGG) {
+      of = PTP_OFC_Undefined;
+    }
+    if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_FLAC) {
+      of = PTP_OFC_Undefined;
+    }
+
+    // Object info (and storage lookup), data phase and the cache refresh
+    baseline += (storage_id == 0 ? 1 : 0) + 3;
+
+    if (use_proplist) {
+      send_batch_format_t *format = get_send_batch_format(device, formats, &nrofformats, of, &round_trips);
+      MTPProperties *props = NULL;
+      MTPProperties *prop = NULL;
+      int nrofprops = 0;
+
+      if (format == NULL) {
+	result = -1;
+	break;
+      }
+
+      baseline += 1 + format->supportedcnt;
+
+      // Must be 0x00000000U for new objects
+      filedata->item_id = 0x00000000U;
+
+      for (j = 0; j < format->propcnt; j++) {
+	switch (format->properties[j]) {
 	case PTP_OPC_ObjectFileName:
 	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
 	  prop->ObjectHandle = filedata->item_id;
@@ -6306,7 +7163,6 @@ static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file
 	    prop->propval.str = strdup(filedata->filename);
 	  break;
 	case PTP_OPC_DateModified:
-	  // Tag with current time if that is supported
 	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
 	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
 	    prop->ObjectHandle = filedata->item_id;
@@ -6318,63 +7174,99 @@ static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file
 	  break;
 	}
       }
-      ptp_free_objectpropdesc(&opd);
-    }
-    free(properties);
 
-    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, &filedata->item_id,
-				     of, filedata->filesize, props, nrofprops);
+      ret = ptp_mtp_sendobjectproplist(params, &localstore, &localph, &filedata->item_id,
+				       of, filedata->filesize, props, nrofprops);
+      ptp_destroy_object_prop_list(props, nrofprops);
+    } else {
+      PTPObjectInfo new_file;
 
-    /* Free property list */
-    ptp_destroy_object_prop_list(props, nrofprops);
+      memset(&new_file, 0, sizeof(PTPObjectInfo));
 
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "send_file_object_info():"
-				  "Could not send object property list.");
-      if (ret == PTP_RC_AccessDenied) {
-	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+      new_file.Filename = filedata->filename;
+      if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+	strip_7bit_from_utf8(new_file.Filename);
       }
-      return -1;
+      if (filedata->filesize > 0xFFFFFFFFL) {
+	new_file.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
+      } else {
+	new_file.ObjectCompressedSize = (uint32_t) filedata->filesize;
+      }
+      new_file.ObjectFormat = of;
+      new_file.StorageID = localstore;
+      new_file.ParentObject = localph;
+      new_file.ModificationDate = time(NULL);
+
+      ret = ptp_sendobjectinfo(params, &localstore, &localph, &filedata->item_id, &new_file);
     }
-  } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
-    PTPObjectInfo new_file;
+    round_trips++;
 
-    memset(&new_file, 0, sizeof(PTPObjectInfo));
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Files_From_Handler_Batch(): "
+				  "Could not send object info.");
+      result = -1;
+      break;
+    }
 
-    new_file.Filename = filedata->filename;
-    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-      strip_7bit_from_utf8(new_file.Filename);
+    ptp_usb->callback_active = 1;
+    ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
+    ptp_usb->current_transfer_complete = 0;
+    ptp_usb->current_transfer_callback = callback;
+    ptp_usb->current_transfer_callback_data = data;
+
+    mtp_handler.getfunc = get_func;
+    mtp_handler.putfunc = NULL;
+    mtp_handler.priv = privs[i];
+
+    handler.getfunc = get_func_wrapper;
+    handler.putfunc = NULL;
+    handler.priv = &mtp_handler;
+
+    ret = ptp_sendobject_from_handler(params, &handler, filedata->filesize);
+    round_trips++;
+
+    ptp_usb->callback_active = 0;
+    ptp_usb->current_transfer_callback = NULL;
+    ptp_usb->current_transfer_callback_data = NULL;
+
+    if (ret == PTP_ERROR_CANCEL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_Files_From_Handler_Batch(): "
+			      "Cancelled transfer.");
+      result = -1;
+      break;
     }
-    if (filedata->filesize > 0xFFFFFFFFL) {
-      // This is a kludge in the MTP standard for large files.
-      new_file.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
-    } else {
-      new_file.ObjectCompressedSize = (uint32_t) filedata->filesize;
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Files_From_Handler_Batch(): "
+				  "Could not send object.");
+      result = -1;
+      break;
     }
-    new_file.ObjectFormat = of;
-    new_file.StorageID = store;
-    new_file.ParentObject = localph;
-    new_file.ModificationDate = time(NULL);
 
-    // Create the object
-    ret = ptp_sendobjectinfo(params, &store, &localph, &filedata->item_id, &new_file);
+    filedata->parent_id = localph;
+    filedata->storage_id = localstore;
 
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
-				  "Could not send object info.");
-      if (ret == PTP_RC_AccessDenied) {
-	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
-      }
-      return -1;
+    if (!(flags & LIBMTP_SEND_BATCH_SKIP_METADATA)) {
+      add_object_to_cache(device, filedata->item_id);
+      round_trips++;
+    } else {
+      add_sent_object_to_cache(device, filedata, of);
     }
-    // NOTE: the char* pointers inside new_file are not copies so don't
-    // try to destroy this objectinfo!
+
+    sent++;
   }
 
-  // Now there IS an object with this parent handle.
-  filedata->parent_id = localph;
+ done:
+  for (i = 0; i < nrofformats; i++) {
+    free(formats[i].properties);
+  }
 
-  return 0;
+  if (stats != NULL) {
+    stats->files = sent;
+    stats->round_trips = round_trips;
+    stats->baseline_round_trips = baseline;
+  }
+
+  return result;
 }
 
 /**
@@ -6790,12 +7682,15 @@ int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t *device,
 {
   uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
+  int folder;
 
+  folder = is_cached_folder(params, object_id);
   ret = ptp_deleteobject(params, object_id, 0);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Object(): could not delete object.");
     return -1;
   }
+  remove_tree_from_cache(device, object_id, folder);
 
   return 0;
 }
@@ -6827,12 +7722,28 @@ int LIBMTP_Move_Object(LIBMTP_mtpdevice_t *device,
 {
   uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+  int stale = 0;
+
+  // Cached objects below a folder moving to another storage carry
+  // the old storage ID, so the cache is dropped rather than patched.
+  if (ptp_object_find(params, object_id, &ob) == PTP_RC_OK &&
+      ob->oi.StorageID != storage_id)
+    stale = is_cached_folder(params, object_id);
 
   ret = ptp_moveobject(params, object_id, storage_id, parent_id);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "LIBMTP_Move_Object(): could not move object.");
     return -1;
   }
+  if (stale) {
+    invalidate_cache(device);
+  } else if (device->cached) {
+    update_metadata_cache(device, object_id);
+  } else {
+    unindex_cached_object(device, object_id);
+    ptp_remove_object_from_cache(params, object_id);
+  }
 
   return 0;
 }
@@ -6863,12 +7774,20 @@ int LIBMTP_Copy_Object(LIBMTP_mtpdevice_t *device,
 {
   uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
+  int folder;
 
+  folder = is_cached_folder(params, object_id);
   ret = ptp_copyobject(params, object_id, storage_id, parent_id);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "LIBMTP_Copy_Object(): could not copy object.");
     return -1;
   }
+  // The copy's ID is not returned; find it among the destination's
+  // children unless a whole folder tree was copied.
+  if (device->cached) {
+    if (folder || add_new_children_to_cache(device, storage_id, parent_id) != PTP_RC_OK)
+      invalidate_cache(device);
+  }
 
   return 0;
 }
@@ -7159,11 +8078,10 @@ int LIBMTP_Set_Object_Filename(LIBMTP_mtpdevice_t *device,
 int LIBMTP_Track_Exists(LIBMTP_mtpdevice_t *device,
            uint32_t const id)
 {
-  PTPParams *params = (PTPParams *) device->params;
   uint16_t ret;
   PTPObject *ob;
 
-  ret = ptp_object_want (params, id, 0, &ob);
+  ret = want_object(device, id, 0, &ob);
   if (ret == PTP_RC_OK)
       return -1;
   return 0;
@@ -7655,7 +8573,7 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist(LIBMTP_mtpdevice_t *device, uint32_t cons
     flush_handles(device);
   }
 
-  ret = ptp_object_want (params, plid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  ret = want_object(device, plid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK)
     return NULL;
 
@@ -8466,7 +9384,7 @@ static void get_album_metadata(LIBMTP_mtpdevice_t *device,
   /*
    * If we have a cached, large set of metadata, then use it!
    */
-  ret = ptp_object_want(params, alb->album_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
+  ret = want_object(device, alb->album_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
   if (ob->mtpprops) {
     prop = ob->mtpprops;
     for (i=0;i<ob->nrofmtpprops;i++,prop++)
@@ -8613,7 +9531,7 @@ LIBMTP_album_t *LIBMTP_Get_Album(LIBMTP_mtpdevice_t *device, uint32_t const albi
   if (params->nrofobjects == 0)
     flush_handles(device);
 
-  ret = ptp_object_want(params, albid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  ret = want_object(device, albid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK)
     return NULL;
 
@@ -8906,7 +9824,7 @@ int LIBMTP_Send_Representative_Sample(LIBMTP_mtpdevice_t *device,
   int supported = 0;
 
   // get the file format for the object we're going to send representative data for
-  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  ret = want_object(device, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK) {
     add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Representative_Sample(): could not get object info.");
     return -1;
@@ -9000,7 +9918,7 @@ int LIBMTP_Get_Representative_Sample(LIBMTP_mtpdevice_t *device,
   int supported = 0;
 
   // get the file format for the object we're going to send representative data for
-  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  ret = want_object(device, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK) {
     add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Sample(): could not get object info.");
     return -1;
@@ -9071,22 +9989,36 @@ int LIBMTP_Get_Thumbnail(LIBMTP_mtpdevice_t *device, uint32_t const id,
 }
 
 
-int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                            uint64_t offset, uint32_t maxbytes,
-                            unsigned char **data, unsigned int *size)
+/**
+ * Read a part of an object whose size the caller already knows, e.g. from
+ * a listing or from an earlier read. Unlike LIBMTP_GetPartialObject() this
+ * does not fetch the object metadata first, so a chunked read costs one
+ * PTP transaction per chunk.
+ * @param device a pointer to the device to read from.
+ * @param id the object ID of the file to read.
+ * @param offset the offset to read at.
+ * @param maxbytes the maximum number of bytes to read.
+ * @param filesize the size of the object; reads are clamped to it.
+ * @param data receives the data, free() it after use.
+ * @param size receives the number of bytes read.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_GetPartialObject()
+ */
+int LIBMTP_GetPartialObject_Sized(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                                  uint64_t offset, uint32_t maxbytes,
+                                  uint64_t const filesize,
+                                  unsigned char **data, unsigned int *size)
 {
   PTPParams	*params = (PTPParams *) device->params;
   uint16_t	ret;
-  LIBMTP_file_t	*mtpfile = LIBMTP_Get_Filemetadata(device, id);
 
   /* Some devices do not like reading over the end and hang instead of progressing */
-  if (offset >= mtpfile->filesize) {
+  if (offset >= filesize) {
     *size = 0;
-    LIBMTP_destroy_file_t (mtpfile);
     return 0;
   }
-  if (offset + maxbytes > mtpfile->filesize) {
-    maxbytes = mtpfile->filesize - offset;
+  if (offset + maxbytes > filesize) {
+    maxbytes = filesize - offset;
   }
   /* The MTP stack of Samsung Galaxy devices has a mysterious bug in
    * GetPartialObject. When GetPartialObject is invoked to read the
@@ -9127,6 +10059,25 @@ int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
 }
 
 
+int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                            uint64_t offset, uint32_t maxbytes,
+                            unsigned char **data, unsigned int *size)
+{
+  LIBMTP_file_t	*mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  uint64_t	filesize;
+
+  if (mtpfile == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_GetPartialObject: could not get object metadata");
+    return -1;
+  }
+  filesize = mtpfile->filesize;
+  LIBMTP_destroy_file_t(mtpfile);
+
+  return LIBMTP_GetPartialObject_Sized(device, id, offset, maxbytes, filesize, data, size);
+}
+
+
 int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
                              uint64_t offset, unsigned char *data, unsigned int size)
 {
@@ -9251,11 +10202,49 @@ static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id)
   uint16_t ret;
 
   ret = ptp_add_object_to_cache(params, object_id);
+  index_cached_object(device, object_id);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "add_object_to_cache(): couldn't add object to cache");
   }
 }
 
+/**
+ * Add an object just sent to the cache of a cached device from what is
+ * known of it, instead of reading it back from the device.
+ * @param device the device whose cache the object is added to.
+ * @param filedata the metadata the object was sent with, with the
+ *        object, parent and storage IDs the device answered.
+ * @param of the PTP object format the object was sent as.
+ */
+static void add_sent_object_to_cache(LIBMTP_mtpdevice_t *device,
+				     LIBMTP_file_t const * const filedata, uint16_t of)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObject *ob;
+  uint16_t ret;
+
+  if (!device->cached)
+    return;
+  ret = ptp_object_find_or_insert(params, filedata->item_id, &ob);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "add_sent_object_to_cache(): couldn't add object to cache");
+    return;
+  }
+  free(ob->oi.Filename);
+  ob->oi.Filename = filedata->filename != NULL ? strdup(filedata->filename) : NULL;
+  if (ob->oi.Filename != NULL && FLAG_ONLY_7BIT_FILENAMES(ptp_usb))
+    strip_7bit_from_utf8(ob->oi.Filename);
+  ob->oi.ObjectFormat = of;
+  ob->oi.ObjectCompressedSize = filedata->filesize;
+  ob->oi.StorageID = filedata->storage_id;
+  // The cache keeps objects in the root of a storage under parent 0
+  ob->oi.ParentObject = filedata->parent_id == 0xFFFFFFFFU ? 0 : filedata->parent_id;
+  ob->oi.ModificationDate = time(NULL);
+  ob->flags |= PTPOBJECT_OBJECTINFO_LOADED | PTPOBJECT_PARENTOBJECT_LOADED |
+    PTPOBJECT_STORAGEID_LOADED;
+  index_cached_object(device, filedata->item_id);
+}
 
 /**
  * Update cache after object has been modified
@@ -9266,10 +10255,249 @@ static void update_metadata_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id
 {
   PTPParams *params = (PTPParams *)device->params;
 
+  unindex_cached_object(device, object_id);
   ptp_remove_object_from_cache(params, object_id);
   add_object_to_cache(device, object_id);
 }
 
+/**
+ * Tells if an object may be a folder, going by the cache: only an object
+ * whose cached object info says otherwise is known not to be one.
+ * @param params the PTP parameters of the device.
+ * @param object_id the object to check.
+ * @return 0 if the object is known to be no folder, 1 otherwise.
+ */
+static int is_cached_folder(PTPParams *params, uint32_t object_id)
+{
+  PTPObject *ob;
+
+  if (ptp_object_find(params, object_id, &ob) != PTP_RC_OK ||
+      !(ob->flags & PTPOBJECT_OBJECTINFO_LOADED))
+    return 1;
+  return ob->oi.ObjectFormat == PTP_OFC_Association;
+}
+
+/**
+ * Drop the whole object cache once it is found to disagree with the
+ * device. A cached device reloads it with the next listing, see
+ * flush_handles().
+ * @param device the device whose cache is dropped.
+ */
+static void invalidate_cache(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+
+  drop_filename_index(device);
+  if (params->objects != NULL) {
+    for (i=0;i<params->nrofobjects;i++)
+      ptp_free_object (&params->objects[i]);
+    free(params->objects);
+    params->objects = NULL;
+    params->nrofobjects = 0;
+  }
+}
+
+/* Verdicts of remove_tree_from_cache() per cached object */
+#define CACHE_UNKNOWN 0
+#define CACHE_KEEP 1
+#define CACHE_DROP 2
+#define CACHE_VISITING 3
+
+/**
+ * Remove an object from the cache, and if it is or may be a folder also
+ * every cached object below it. The cache stays sorted and is compacted
+ * in one pass, so removing a large tree does not shift the table once
+ * per object. Devices which keep the content of a deleted folder leave
+ * it without a parent anyway.
+ * @param device the device which may have the object in its cache.
+ * @param object_id the object to remove.
+ * @param folder 0 if the object is known not to be a folder.
+ */
+static void remove_tree_from_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id,
+				   int folder)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+  uint8_t *verdict;
+  uint32_t i, j, n;
+
+  if (!folder) {
+    unindex_cached_object(device, object_id);
+    ptp_remove_object_from_cache(params, object_id);
+    return;
+  }
+  // The PTP layer may have dropped the object itself already
+  unindex_cached_object(device, object_id);
+  if (params->nrofobjects == 0)
+    return;
+
+  verdict = calloc(params->nrofobjects, sizeof(uint8_t));
+  if (verdict == NULL) {
+    invalidate_cache(device);
+    return;
+  }
+
+  for (i=0;i<params->nrofobjects;i++) {
+    uint8_t found = CACHE_KEEP;
+
+    /*
+     * Walk up to the first ancestor with a verdict, the removed object
+     * or the root, then hand the outcome down the walked chain. A loop
+     * of parents ends the walk on an object being visited.
+     */
+    for (j=i;verdict[j] == CACHE_UNKNOWN;) {
+      PTPObject *cur = &params->objects[j];
+
+      verdict[j] = CACHE_VISITING;
+      if (cur->oid == object_id || cur->oi.ParentObject == object_id) {
+	found = CACHE_DROP;
+	break;
+      }
+      if (cur->oi.ParentObject == 0 ||
+	  ptp_object_find(params, cur->oi.ParentObject, &ob) != PTP_RC_OK)
+	break;
+      j = ob - params->objects;
+    }
+    if (verdict[j] == CACHE_KEEP || verdict[j] == CACHE_DROP)
+      found = verdict[j];
+
+    for (j=i;verdict[j] == CACHE_VISITING;) {
+      verdict[j] = found;
+      if (ptp_object_find(params, params->objects[j].oi.ParentObject, &ob) != PTP_RC_OK)
+	break;
+      j = ob - params->objects;
+    }
+  }
+
+  for (i=0,n=0;i<params->nrofobjects;i++) {
+    if (verdict[i] == CACHE_DROP) {
+      unindex_cached_object(device, params->objects[i].oid);
+      ptp_free_object (&params->objects[i]);
+      continue;
+    }
+    if (n != i)
+      params->objects[n] = params->objects[i];
+    n++;
+  }
+  params->nrofobjects = n;
+  free(verdict);
+}
+
+/**
+ * Add the children of a folder which are not cached yet, such as an
+ * object which was copied into it.
+ * @param device the device whose cache is updated.
+ * @param storage_id the storage of the folder.
+ * @param parent_id the folder, 0 for the root of the storage.
+ * @return PTP_RC_OK on success, else the failing PTP result code.
+ */
+static uint16_t add_new_children_to_cache(LIBMTP_mtpdevice_t *device,
+					  uint32_t storage_id, uint32_t parent_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObjectHandles handles;
+  PTPObject *ob;
+  uint16_t ret;
+  uint32_t i;
+
+  ret = ptp_getobjecthandles(params, storage_id, PTP_GOH_ALL_FORMATS,
+			     parent_id ? parent_id : PTP_GOH_ROOT_PARENT,
+			     &handles);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "add_new_children_to_cache(): "
+				"could not get object handles.");
+    return ret;
+  }
+  for (i=0;i<handles.n && ret == PTP_RC_OK;i++) {
+    if (ptp_object_find(params, handles.Handler[i], &ob) != PTP_RC_OK) {
+      ret = ptp_add_object_to_cache(params, handles.Handler[i]);
+      index_cached_object(device, handles.Handler[i]);
+    }
+  }
+  free(handles.Handler);
+  return ret;
+}
+
+/**
+ * This applies an event read with LIBMTP_Read_Event() to the object
+ * cache of a device, so the cache follows changes made on the device
+ * without reloading every object:
+ *
+ * - an added object is fetched and inserted, a known one refreshed,
+ * - a removed object is dropped along with anything cached below it,
+ * - a removed storage drops its objects, an added one is walked.
+ *
+ * An added object whose parent is missing from a cached device means
+ * the cache has fallen behind; it is then dropped and reloaded in full
+ * by the next listing. Uncached devices only lose stale entries.
+ *
+ * @param device a pointer to the device the event was read from.
+ * @param event the event.
+ * @param param1 the param1 value of the event, the object or storage ID.
+ * @return 0 if the cache was updated or the event does not touch it,
+ *         -1 if the cache was dropped instead.
+ * @see LIBMTP_Read_Event()
+ */
+int LIBMTP_Update_Object_Cache(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_event_t const event,
+			       uint32_t const param1)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+  uint16_t ret;
+  uint32_t i, n;
+
+  switch (event) {
+  case LIBMTP_EVENT_OBJECT_ADDED:
+    unindex_cached_object(device, param1);
+    ptp_remove_object_from_cache(params, param1);
+    if (!device->cached)
+      return 0;
+    ret = ptp_add_object_to_cache(params, param1);
+    index_cached_object(device, param1);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Update_Object_Cache(): "
+				  "could not add object to cache.");
+      break;
+    }
+    if (ptp_object_find(params, param1, &ob) != PTP_RC_OK)
+      break;
+    if (ob->oi.ParentObject != 0 &&
+	ptp_object_find(params, ob->oi.ParentObject, &ob) != PTP_RC_OK)
+      break;
+    return 0;
+  case LIBMTP_EVENT_OBJECT_REMOVED:
+    remove_tree_from_cache(device, param1, is_cached_folder(params, param1));
+    return 0;
+  case LIBMTP_EVENT_STORE_REMOVED:
+    for (i=0,n=0;i<params->nrofobjects;i++) {
+      if (params->objects[i].oi.StorageID == param1) {
+	unindex_cached_object(device, params->objects[i].oid);
+	ptp_free_object (&params->objects[i]);
+	continue;
+      }
+      if (n != i)
+	params->objects[n] = params->objects[i];
+      n++;
+    }
+    params->nrofobjects = n;
+    return 0;
+  case LIBMTP_EVENT_STORE_ADDED:
+    if (!device->cached || params->nrofobjects == 0)
+      return 0;
+    if (get_handles_recursively(device, params, param1,
+				PTP_GOH_ROOT_PARENT) != PTP_RC_OK)
+      break;
+    return 0;
+  default:
+    return 0;
+  }
+
+  invalidate_cache(device);
+  return -1;
+}
+
 
 /**
  * Issue custom (e.g. vendor specific) operation (without data phase)
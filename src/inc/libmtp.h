@@ -456,6 +456,7 @@ typedef struct LIBMTP_folder_struct LIBMTP_folder_t; /**< @see LIBMTP_folder_t *
 typedef struct LIBMTP_object_struct LIBMTP_object_t; /**< @see LIBMTP_object_t */
 typedef struct LIBMTP_filesampledata_struct LIBMTP_filesampledata_t; /**< @see LIBMTP_filesample_t */
 typedef struct LIBMTP_devicestorage_struct LIBMTP_devicestorage_t; /**< @see LIBMTP_devicestorage_t */
+typedef struct LIBMTP_send_batch_stats_struct LIBMTP_send_batch_stats_t; /**< @see LIBMTP_send_batch_stats_struct */
 
 /**
  * The callback type definition. Notice that a progress percentage ratio
@@ -689,6 +690,21 @@ struct LIBMTP_file_struct {
   LIBMTP_file_t *next; /**< Next file in list or NULL if last file */
 };
 
+/**
+ * Statistics of a LIBMTP_Send_Files_From_Handler_Batch() call
+ */
+struct LIBMTP_send_batch_stats_struct {
+  uint32_t files; /**< Number of files sent */
+  uint32_t round_trips; /**< PTP transactions issued by the batch */
+  uint32_t baseline_round_trips; /**< PTP transactions one LIBMTP_Send_File_From_Handler() call per file would have issued */
+};
+
+/**
+ * Do not read the sent objects back from the device, see
+ * LIBMTP_Send_Files_From_Handler_Batch()
+ */
+#define LIBMTP_SEND_BATCH_SKIP_METADATA 0x00000001
+
 /**
  * MTP track struct
  */
@@ -932,6 +948,17 @@ int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *,
 				  LIBMTP_file_t * const,
 				  LIBMTP_progressfunc_t const,
 				  void const * const);
+int LIBMTP_Send_Files_From_Handler_Batch(LIBMTP_mtpdevice_t *,
+					 uint32_t const,
+					 uint32_t const,
+					 LIBMTP_file_t * const * const,
+					 uint32_t const,
+					 MTPDataGetFunc,
+					 void * const * const,
+					 int const,
+					 LIBMTP_progressfunc_t const,
+					 void const * const,
+					 LIBMTP_send_batch_stats_t *);
 int LIBMTP_Set_File_Name(LIBMTP_mtpdevice_t *,
 			 LIBMTP_file_t *,
 			 const char *);
@@ -1037,6 +1064,9 @@ int LIBMTP_Set_Object_Filename(LIBMTP_mtpdevice_t *, uint32_t , char *);
 int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *, uint32_t const,
                             uint64_t, uint32_t,
                             unsigned char **, unsigned int *);
+int LIBMTP_GetPartialObject_Sized(LIBMTP_mtpdevice_t *, uint32_t const,
+                                  uint64_t, uint32_t, uint64_t const,
+                                  unsigned char **, unsigned int *);
 int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t *, uint32_t const,
                              uint64_t, unsigned char *, unsigned int);
 int LIBMTP_BeginEditObject(LIBMTP_mtpdevice_t *, uint32_t const);
@@ -1049,6 +1079,8 @@ int LIBMTP_TruncateObject(LIBMTP_mtpdevice_t *, uint32_t const, uint64_t);
  * @{
  */
 int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *, LIBMTP_event_t *, uint32_t *);
+int LIBMTP_Update_Object_Cache(LIBMTP_mtpdevice_t *, LIBMTP_event_t const,
+			       uint32_t const);
 
 /** @} */
 
@@ -0,0 +1,421 @@
+#include "journal.h"
+
+#include <string.h>
+
+#include "fileio.h"
+#include "exports.h"
+
+static const char JOURNAL_MAGIC[8] = {'M', 'T', 'P', 'J', 'R', 'N', 'L', '1'};
+
+static const char RECORD_PLAN = 'P';
+static const char RECORD_OFFSET = 'O';
+static const char RECORD_COMPLETE = 'C';
+
+/* type, 3 bytes padding, key length, value */
+static const size_t RECORD_HEADER = 16;
+static const size_t RECORD_TRAILER = 4;
+
+static uint32_t Checksum(const unsigned char *data, size_t length) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void EncodeRecord(std::vector<unsigned char> &out, char type, const std::string &key, uint64_t value) {
+    size_t start = out.size();
+    uint32_t keyLength = (uint32_t) key.size();
+
+    out.resize(start + RECORD_HEADER + key.size() + RECORD_TRAILER, 0);
+
+    unsigned char *record = &out[start];
+    record[0] = (unsigned char) type;
+    memcpy(record + 4, &keyLength, sizeof(keyLength));
+    memcpy(record + 8, &value, sizeof(value));
+    memcpy(record + RECORD_HEADER, key.data(), key.size());
+
+    uint32_t checksum = Checksum(record, RECORD_HEADER + key.size());
+    memcpy(record + RECORD_HEADER + key.size(), &checksum, sizeof(checksum));
+}
+
+transfer_journal_state_t::transfer_journal_state_t() : fd(-1), completed(0), records(0),
+                                                       syncInterval(transfer_journal_t::DEFAULT_SYNC_INTERVAL),
+                                                       unsynced(0),
+                                                       offsetStep(transfer_journal_t::DEFAULT_OFFSET_STEP) {}
+
+transfer_journal_t::transfer_journal_t() : m_state(std::make_shared<transfer_journal_state_t>()) {}
+
+transfer_journal_t::transfer_journal_t(const transfer_journal_t &journal) : m_state(journal.m_state) {}
+
+/**
+ * Opens the journal at `path`, creating it if needed, and replays it.
+ */
+bool transfer_journal_t::open(const std::string path) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+
+    if (m_state->fd >= 0) {
+        CloseFile(m_state->fd);
+    }
+
+    m_state->path = path;
+    m_state->entries.clear();
+    m_state->completed = 0;
+    m_state->records = 0;
+    m_state->unsynced = 0;
+    m_state->fd = OpenFileForUpdate(path.c_str());
+
+    if (m_state->fd < 0) {
+        return false;
+    }
+
+    if (!replay()) {
+        CloseFile(m_state->fd);
+        m_state->fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void transfer_journal_t::close() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+
+    if (m_state->fd >= 0) {
+        SyncFile(m_state->fd);
+        CloseFile(m_state->fd);
+        m_state->fd = -1;
+    }
+}
+
+bool transfer_journal_t::plan(const std::string key, const uint64_t size) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    journal_entry_t &entry = m_state->entries[key];
+
+    if (entry.completed) {
+        return true;
+    }
+
+    if (entry.size == size && entry.offset > 0) {
+        return true;
+    }
+
+    entry.size = size;
+    entry.offset = 0;
+    entry.loggedOffset = 0;
+
+    return append(RECORD_PLAN, key, size, false);
+}
+
+/**
+ * Offsets are kept in memory on every call but only journaled once they
+ * advanced by the offset step, to keep the journal small.
+ */
+bool transfer_journal_t::progress(const std::string key, const uint64_t offset) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    journal_entry_t &entry = m_state->entries[key];
+
+    if (entry.completed) {
+        return true;
+    }
+
+    entry.offset = offset;
+
+    if (offset < entry.loggedOffset + m_state->offsetStep) {
+        return true;
+    }
+
+    entry.loggedOffset = offset;
+
+    return append(RECORD_OFFSET, key, offset, false);
+}
+
+bool transfer_journal_t::complete(const std::string key) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    journal_entry_t &entry = m_state->entries[key];
+
+    if (entry.completed) {
+        return true;
+    }
+
+    entry.completed = true;
+    entry.offset = entry.size;
+    m_state->completed++;
+
+    if (!append(RECORD_COMPLETE, key, entry.size, true)) {
+        return false;
+    }
+
+    if (m_state->records > COMPACT_MIN_RECORDS && m_state->records > 2 * m_state->entries.size()) {
+        return rewrite();
+    }
+
+    return true;
+}
+
+bool transfer_journal_t::isCompleted(const std::string key) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    std::unordered_map<std::string, journal_entry_t>::iterator it = m_state->entries.find(key);
+
+    return it != m_state->entries.end() && it->second.completed;
+}
+
+uint64_t transfer_journal_t::getOffset(const std::string key) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    std::unordered_map<std::string, journal_entry_t>::iterator it = m_state->entries.find(key);
+
+    return it != m_state->entries.end() ? it->second.offset : 0;
+}
+
+uint32_t transfer_journal_t::getPlanned() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return (uint32_t) m_state->entries.size();
+}
+
+uint32_t transfer_journal_t::getCompleted() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->completed;
+}
+
+uint32_t transfer_journal_t::getSyncInterval() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->syncInterval;
+}
+
+/**
+ * Number of completed items after which the journal is flushed to disk.
+ * 1 syncs on every completion, 0 leaves syncing to sync() and close().
+ */
+void transfer_journal_t::setSyncInterval(const uint32_t syncInterval) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->syncInterval = syncInterval;
+}
+
+uint64_t transfer_journal_t::getOffsetStep() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->offsetStep;
+}
+
+void transfer_journal_t::setOffsetStep(const uint64_t offsetStep) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->offsetStep = offsetStep;
+}
+
+bool transfer_journal_t::sync() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+
+    if (m_state->fd < 0) {
+        return false;
+    }
+
+    m_state->unsynced = 0;
+
+    return 0 == SyncFile(m_state->fd);
+}
+
+bool transfer_journal_t::compact() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return rewrite();
+}
+
+/**
+ * Forgets every item, typically once the whole job has completed.
+ */
+bool transfer_journal_t::clear() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+
+    m_state->entries.clear();
+    m_state->completed = 0;
+
+    return rewrite();
+}
+
+bool transfer_journal_t::replay() {
+    int64_t size = FileSize(m_state->fd);
+
+    if (size < 0) {
+        return false;
+    }
+
+    if (0 == size) {
+        return WriteFully(m_state->fd, (const unsigned char *) JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) &&
+               0 == SyncFile(m_state->fd);
+    }
+
+    std::vector<unsigned char> data((size_t) size);
+
+    if (SeekFile(m_state->fd, 0) < 0 || ReadFully(m_state->fd, data.data(), data.size()) != size) {
+        return false;
+    }
+
+    if (data.size() < sizeof(JOURNAL_MAGIC) || 0 != memcmp(data.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC))) {
+        return false;
+    }
+
+    size_t pos = sizeof(JOURNAL_MAGIC);
+
+    while (pos + RECORD_HEADER + RECORD_TRAILER <= data.size()) {
+        const unsigned char *record = &data[pos];
+        uint32_t keyLength;
+        uint64_t value;
+        uint32_t checksum;
+
+        memcpy(&keyLength, record + 4, sizeof(keyLength));
+        memcpy(&value, record + 8, sizeof(value));
+
+        if (keyLength > data.size() - pos - RECORD_HEADER - RECORD_TRAILER) {
+            break;
+        }
+
+        memcpy(&checksum, record + RECORD_HEADER + keyLength, sizeof(checksum));
+
+        if (checksum != Checksum(record, RECORD_HEADER + keyLength)) {
+            break;
+        }
+
+        std::string key((const char *) record + RECORD_HEADER, keyLength);
+        journal_entry_t &entry = m_state->entries[key];
+
+        switch ((char) record[0]) {
+            case RECORD_PLAN:
+                if (entry.completed) {
+                    m_state->completed--;
+                }
+                entry = journal_entry_t();
+                entry.size = value;
+                break;
+            case RECORD_OFFSET:
+                entry.offset = entry.loggedOffset = value;
+                break;
+            case RECORD_COMPLETE:
+                if (!entry.completed) {
+                    m_state->completed++;
+                }
+                entry.size = entry.offset = entry.loggedOffset = value;
+                entry.completed = true;
+                break;
+            default:
+                break;
+        }
+
+        m_state->records++;
+        pos += RECORD_HEADER + keyLength + RECORD_TRAILER;
+    }
+
+    // drop a torn record left behind by a crash in the middle of a write
+    if (pos != data.size() && 0 != TruncateFile(m_state->fd, (int64_t) pos)) {
+        return false;
+    }
+
+    return SeekFile(m_state->fd, (int64_t) pos) >= 0;
+}
+
+bool transfer_journal_t::append(char type, const std::string &key, uint64_t value, bool durable) {
+    if (m_state->fd < 0) {
+        return false;
+    }
+
+    std::vector<unsigned char> record;
+    EncodeRecord(record, type, key, value);
+
+    if (!WriteFully(m_state->fd, record.data(), record.size())) {
+        return false;
+    }
+
+    m_state->records++;
+
+    if (durable && m_state->syncInterval > 0 && ++m_state->unsynced >= m_state->syncInterval) {
+        m_state->unsynced = 0;
+        return 0 == SyncFile(m_state->fd);
+    }
+
+    return true;
+}
+
+/**
+ * Writes the live state into a new file, which then atomically replaces
+ * the journal. A crash in between leaves the old journal intact.
+ */
+bool transfer_journal_t::rewrite() {
+    if (m_state->fd < 0) {
+        return false;
+    }
+
+    std::vector<unsigned char> data(JOURNAL_MAGIC, JOURNAL_MAGIC + sizeof(JOURNAL_MAGIC));
+    uint64_t records = 0;
+
+    for (std::unordered_map<std::string, journal_entry_t>::iterator it = m_state->entries.begin();
+         it != m_state->entries.end(); ++it) {
+        journal_entry_t &entry = it->second;
+
+        if (entry.completed) {
+            EncodeRecord(data, RECORD_COMPLETE, it->first, entry.size);
+            records++;
+            continue;
+        }
+
+        EncodeRecord(data, RECORD_PLAN, it->first, entry.size);
+        records++;
+
+        if (entry.loggedOffset > 0) {
+            EncodeRecord(data, RECORD_OFFSET, it->first, entry.loggedOffset);
+            records++;
+        }
+    }
+
+    std::string temporary = m_state->path + ".tmp";
+    int fd = OpenFileForWrite(temporary.c_str());
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (!WriteFully(fd, data.data(), data.size()) || 0 != SyncFile(fd)) {
+        CloseFile(fd);
+        RemoveFile(temporary.c_str());
+        return false;
+    }
+
+    CloseFile(fd);
+    CloseFile(m_state->fd);
+    m_state->fd = -1;
+
+    bool renamed = 0 == RenameFile(temporary.c_str(), m_state->path.c_str());
+
+    if (!renamed) {
+        RemoveFile(temporary.c_str());
+    }
+
+    m_state->fd = OpenFileForUpdate(m_state->path.c_str());
+
+    if (!renamed || m_state->fd < 0 || SeekFile(m_state->fd, FileSize(m_state->fd)) < 0) {
+        return false;
+    }
+
+    m_state->records = records;
+    m_state->unsynced = 0;
+
+    return true;
+}
+
+JS_CLASS(transfer_journal_t){
+        construct<>();
+        construct<const transfer_journal_t&>();
+        method(open);
+        method(close);
+        method(plan);
+        method(progress);
+        method(complete);
+        method(isCompleted);
+        method(getOffset);
+        getter(getPlanned);
+        getter(getCompleted);
+        getset(getSyncInterval, setSyncInterval);
+        getset(getOffsetStep, setOffsetStep);
+        method(sync);
+        method(compact);
+        method(clear);
+}
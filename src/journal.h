@@ -0,0 +1,101 @@
+#ifndef MTP_JOURNAL_H
+#define MTP_JOURNAL_H
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Durable state of one transfer, as replayed from the journal.
+ */
+struct journal_entry_t {
+    journal_entry_t() : size(0), offset(0), loggedOffset(0), completed(false) {}
+
+    uint64_t size;
+    uint64_t offset;
+    uint64_t loggedOffset;
+    bool completed;
+};
+
+struct transfer_journal_state_t {
+    transfer_journal_state_t();
+
+    std::mutex mx;
+    std::string path;
+    int fd;
+
+    std::unordered_map <std::string, journal_entry_t> entries;
+    uint32_t completed;
+    uint64_t records;
+
+    uint32_t syncInterval;
+    uint32_t unsynced;
+    uint64_t offsetStep;
+};
+
+/**
+ * Append-only journal of a (possibly huge) tree transfer.
+ *
+ * Every planned item, every completed item and the partial offsets of the
+ * running items are appended as checksummed records, so a job interrupted
+ * by a crash or a disconnect can be resumed by replaying the journal and
+ * skipping whatever already completed. A torn record at the end of the
+ * file is dropped on replay. Once most records are superseded, the journal
+ * is rewritten with one record per item.
+ */
+class transfer_journal_t {
+public:
+    static const uint32_t DEFAULT_SYNC_INTERVAL = 64;
+    static const uint64_t DEFAULT_OFFSET_STEP = 4 * 1024 * 1024;
+    static const uint64_t COMPACT_MIN_RECORDS = 4096;
+
+    transfer_journal_t();
+
+    transfer_journal_t(const transfer_journal_t &journal);
+
+    bool open(const std::string path);
+
+    void close();
+
+    bool plan(const std::string key, const uint64_t size);
+
+    bool progress(const std::string key, const uint64_t offset);
+
+    bool complete(const std::string key);
+
+    bool isCompleted(const std::string key);
+
+    uint64_t getOffset(const std::string key);
+
+    uint32_t getPlanned();
+
+    uint32_t getCompleted();
+
+    uint32_t getSyncInterval();
+
+    void setSyncInterval(const uint32_t syncInterval);
+
+    uint64_t getOffsetStep();
+
+    void setOffsetStep(const uint64_t offsetStep);
+
+    bool sync();
+
+    bool compact();
+
+    bool clear();
+
+private:
+    bool replay();
+
+    bool append(char type, const std::string &key, uint64_t value, bool durable);
+
+    bool rewrite();
+
+    std::shared_ptr <transfer_journal_state_t> m_state;
+};
+
+#endif
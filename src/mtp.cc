@@ -3,6 +3,7 @@
 #include <vector>
 #include <mutex>
 #include <future>
+#include <stdexcept>
 #include <libgen.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -11,8 +12,26 @@
 #include <WinSock2.h>
 #endif
 
-#include "nbind/nbind.h"
 #include "libmtp.h"
+#include "mtp.h"
+#include "transfer.h"
+#include "dispatcher.h"
+#include "executor.h"
+#include "scheduler.h"
+#include "ratelimit.h"
+#include "tree.h"
+#include "sync.h"
+#include "checksum.h"
+#include "cache.h"
+#include "readcache.h"
+#include "thumbnail.h"
+#include "archive.h"
+#include "extract.h"
+#include "scan.h"
+#include "registry.h"
+#include "fileio.h"
+#include "filetype.h"
+#include "exports.h"
 
 #ifndef min
 #define min(a, b) (((a) < (b)) ? (a) : (b))
@@ -28,12 +47,12 @@ public:
 
     uint32_t getSize() { return m_size; }
 
-    void write(nbind::Buffer buf, uint32_t len) {
+    void write(js_buffer_t buf, uint32_t len) {
         memcpy(&(m_data[m_length]), buf.data(), min(m_size - m_length, buf.length()));
         m_length += len;
     }
 
-    void read(nbind::Buffer buf, uint32_t len, uint32_t start) {
+    void read(js_buffer_t buf, uint32_t len, uint32_t start) {
         memcpy(buf.data(), &(m_data[start]), min(m_length - start, buf.length()));
     }
 
@@ -43,236 +62,301 @@ private:
     uint32_t m_size;
 };
 
-class raw_device_t {
-public:
-    raw_device_t(LIBMTP_raw_device_t rawDevice) : m_rawDevice(rawDevice) {}
-
-    raw_device_t(const raw_device_t &rawDevice) : m_rawDevice(rawDevice.m_rawDevice) {}
-
-    uint32_t getBusLocation() { return m_rawDevice.bus_location; }
-
-    void setBusLocation(const uint32_t busLocation) { m_rawDevice.bus_location = busLocation; }
-
-    uint8_t getDevNum() { return m_rawDevice.devnum; }
-
-    void setDevNum(const uint8_t devNum) { m_rawDevice.devnum = devNum; }
+int FileProgressCallback(uint64_t const sent, uint64_t const total, void const *const data) {
+    js_function_t cb = *((js_function_t *) data);
+    cb(sent, total);
+    return 0;
+}
 
-    char *getVendor() {
-        if (NULL == m_rawDevice.device_entry.vendor) {
-            return "";
-        }
+uint16_t MTPDataPutCallback(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen) {
+    js_function_t cb = *((js_function_t *) priv);
+    databuffer_t buf(data, sendlen, sendlen);
 
-        return m_rawDevice.device_entry.vendor;
+    if (false == cb.call<bool>(buf)) {
+        return LIBMTP_HANDLER_RETURN_ERROR;
     }
 
-    LIBMTP_raw_device_t *get() { return &m_rawDevice; }
+    *putlen = sendlen;
 
-private:
-    LIBMTP_raw_device_t m_rawDevice;
-};
+    return LIBMTP_HANDLER_RETURN_OK;
+}
 
-class file_t {
-public:
-    file_t(LIBMTP_file_t *file = nullptr) : m_name(file ? file->filename : "") {
-        if (file) {
-            memcpy(&m_file, file, sizeof(m_file));
-        } else {
-            memset(&m_file, 0, sizeof(m_file));
-        }
-        m_file.filename = (char *) m_name.c_str();
-    }
+uint16_t MTPDataGetCallback(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen) {
+    js_function_t cb = *((js_function_t *) priv);
+    databuffer_t buf(data, wantlen, 0);
 
-    file_t(const file_t &file) : m_file(file.m_file), m_name(file.m_name) {
-        m_file.filename = (char *) m_name.c_str();
+    if (false == cb.call<bool>(buf)) {
+        return LIBMTP_HANDLER_RETURN_ERROR;
     }
 
-    std::string getName() { return m_name; }
-
-    void setName(const std::string name) { m_name = name; }
+    *gotlen = buf.getLength();
 
-    uint32_t getId() { return m_file.item_id; }
+    return LIBMTP_HANDLER_RETURN_OK;
+}
 
-    void setId(const uint32_t id) { m_file.item_id = id; }
+class handler_ctx_t {
+public:
+    handler_ctx_t(LIBMTP_mtpdevice_t *device, js_function_t &cb, transfer_job_t &job, checksum_t &sum) :
+            m_device(device), m_cb(cb), m_job(job), m_sum(sum) {}
 
-    uint32_t getType() { return m_file.filetype; }
+    LIBMTP_mtpdevice_t *m_device;
+    js_function_t &m_cb;
+    transfer_job_t &m_job;
+    checksum_t &m_sum;
+};
 
-    void setType(const uint32_t type) { m_file.filetype = (LIBMTP_filetype_t) type; }
+/**
+ * The job handlers shape every chunk against the job and device rate limits
+ * before handing it on, so libmtp only asks for the next chunk in time.
+ */
+uint16_t MTPDataPutJobCallback(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen) {
+    handler_ctx_t *ctx = (handler_ctx_t *) priv;
 
-    uint64_t getSize() { return m_file.filesize; }
+    if (ctx->m_job.isAborted() || !ThrottleTransfer(ctx->m_device, ctx->m_job, sendlen)) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
 
-    void setSize(const uint64_t size) { m_file.filesize = size; }
+    ctx->m_sum.update(data, sendlen);
 
-    uint32_t getParentId() { return m_file.parent_id; }
+    return MTPDataPutCallback(params, (void *) &ctx->m_cb, sendlen, data, putlen);
+}
 
-    void setParentId(const uint32_t parentId) { m_file.parent_id = parentId; }
+uint16_t MTPDataGetJobCallback(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen) {
+    handler_ctx_t *ctx = (handler_ctx_t *) priv;
 
-    uint32_t getStorageId() { return m_file.storage_id; }
+    if (ctx->m_job.isAborted()) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
 
-    void setStorageId(const uint32_t storageId) { m_file.storage_id = storageId; }
+    uint16_t result = MTPDataGetCallback(params, (void *) &ctx->m_cb, wantlen, data, gotlen);
 
-    time_t getModificationDate() { return m_file.modificationdate; }
+    if (LIBMTP_HANDLER_RETURN_OK == result && !ThrottleTransfer(ctx->m_device, ctx->m_job, *gotlen)) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
 
-    LIBMTP_file_t *get() { return &m_file; }
+    if (LIBMTP_HANDLER_RETURN_OK == result) {
+        ctx->m_sum.update(data, *gotlen);
+    }
 
-private:
-    LIBMTP_file_t m_file;
-    std::string m_name;
-};
+    return result;
+}
 
-class folder_t {
-public:
-    folder_t(LIBMTP_folder_t *folder = nullptr) : m_name(folder ? folder->name : "") {
-        if (folder) {
-            memcpy(&m_folder, folder, sizeof(m_folder));
-        } else {
-            memset(&m_folder, 0, sizeof(m_folder));
-        }
-        m_folder.name = (char *) m_name.c_str();
+/**
+ * Publishes the digest of a completed transfer on its job.
+ */
+static void FinishChecksum(transfer_job_t &job, checksum_t &sum, int result) {
+    if (0 == result && sum.enabled()) {
+        job.setDigest(sum.hexDigest());
     }
+}
 
-    folder_t(const folder_t &folder) : m_folder(folder.m_folder), m_name(folder.m_name) {
-        m_folder.name = (char *) m_name.c_str();
+/**
+ * A cancelled send leaves the object created by the object info phase
+ * behind on the device, so remove it again.
+ */
+static void DiscardAbortedSend(mtpdevice_t device, file_t &filedata, transfer_job_t &job, int result) {
+    if (0 != result && job.isAborted() && 0 != filedata.getId()) {
+        LIBMTP_Delete_Object(device.m_device, filedata.getId());
+        LIBMTP_Clear_Errorstack(device.m_device);
     }
+}
 
-    std::string getName() { return m_name; }
+int Get_File_To_File(mtpdevice_t device, uint32_t const id, const std::string path, js_function_t &cb) {
+    device_guard_t guard(device.m_device);
 
-    void setName(const std::string name) { m_name = name; }
+    return LIBMTP_Get_File_To_File(device.m_device, id, path.c_str(), FileProgressCallback, (const void *) &cb);
+}
 
-    uint32_t getId() { return m_folder.folder_id; }
+int Get_File_To_File_Descriptor(mtpdevice_t device, uint32_t const id, int const fd, js_function_t &cb) {
+    device_guard_t guard(device.m_device);
 
-    void setId(const uint32_t id) { m_folder.folder_id = id; }
+    return LIBMTP_Get_File_To_File_Descriptor(device.m_device, id, fd, FileProgressCallback, (const void *) &cb);
+}
 
-    uint32_t getParentId() { return m_folder.parent_id; }
+int Get_File_To_Handler(mtpdevice_t device, uint32_t const id, js_function_t &dataPutCB,
+                        js_function_t &progressCB) {
+    device_guard_t guard(device.m_device);
 
-    void setParentId(const uint32_t parentId) { m_folder.parent_id = parentId; }
+    return LIBMTP_Get_File_To_Handler(device.m_device, id, MTPDataPutCallback, (void *) &dataPutCB,
+                                      FileProgressCallback, (const void *) &progressCB);
+}
 
-    uint32_t getStorageId() { return m_folder.storage_id; }
+int Send_File_From_File(mtpdevice_t device, const std::string path, file_t filedata, js_function_t &cb) {
+    device_guard_t guard(device.m_device);
 
-    void setStorageId(const uint32_t storageId) { m_folder.storage_id = storageId; }
+    return LIBMTP_Send_File_From_File(device.m_device, path.c_str(), filedata.get(), FileProgressCallback,
+                                      (const void *) &cb);
+}
 
-    LIBMTP_folder_t *getSibling() { return m_folder.sibling; }
+int Send_File_From_File_Descriptor(mtpdevice_t device, const int fd, file_t filedata, js_function_t &cb) {
+    device_guard_t guard(device.m_device);
 
-    LIBMTP_folder_t *getChild() { return m_folder.child; }
+    return LIBMTP_Send_File_From_File_Descriptor(device.m_device, fd, filedata.get(), FileProgressCallback,
+                                                 (const void *) &cb);
+}
 
-    LIBMTP_folder_t *get() { return &m_folder; }
+int Send_File_From_Handler(mtpdevice_t device, js_function_t &dataGetCB, file_t filedata,
+                           js_function_t &progressCB) {
+    device_guard_t guard(device.m_device);
 
-private:
-    LIBMTP_folder_t m_folder;
-    std::string m_name;
-};
+    return LIBMTP_Send_File_From_Handler(device.m_device, MTPDataGetCallback, (void *) &dataGetCB, filedata.get(),
+                                         FileProgressCallback, (const void *) &progressCB);
+}
 
-class devicestorage_t {
-public:
-    devicestorage_t(LIBMTP_devicestorage_t *storage = nullptr) : m_storage(*storage),
-                                                                 m_description(storage->StorageDescription) {}
+/**
+ * With a checksum selected on the job, the file transfers go through a
+ * handler so the data is hashed as it passes instead of in a second pass.
+ */
+int Get_File_To_File_Job(mtpdevice_t device, uint32_t const id, const std::string path, transfer_job_t &job) {
+    device_guard_t guard(device.m_device);
 
-    devicestorage_t(const devicestorage_t &storage) : m_storage(storage.m_storage),
-                                                      m_description(storage.m_description) {};
+    shaped_progress_t shaped(device.m_device, job);
+    checksum_t sum(job.getChecksum());
+    int result;
 
-    uint32_t getId() { return m_storage.id; }
+    job.beginFile();
 
-    void setId(const uint32_t id) { m_storage.id = id; }
+    if (sum.enabled()) {
+        int fd = OpenFileForWrite(path.c_str());
 
-    std::string getDescription() { return m_description; }
+        result = fd < 0 ? -1 : GetFileToDescriptorChecksummed(device.m_device, id, fd, job, sum);
 
-    void setDescription(const std::string description) { m_description = description; }
+        if (fd >= 0 && 0 != CloseFile(fd)) {
+            result = -1;
+        }
+        if (fd >= 0 && 0 != result) {
+            RemoveFile(path.c_str());
+        }
+    } else {
+        result = LIBMTP_Get_File_To_File(device.m_device, id, path.c_str(), ShapedProgressCallback,
+                                         (const void *) &shaped);
+    }
 
-private:
-    LIBMTP_devicestorage_t m_storage;
-    std::string m_description;
-};
+    FinishChecksum(job, sum, result);
+    job.endFile(0 == result);
+    return result;
+}
 
-class mtpdevice_t {
-public:
-    mtpdevice_t(LIBMTP_mtpdevice_t *device = nullptr) : m_device(device) {}
+int Get_File_To_File_Descriptor_Job(mtpdevice_t device, uint32_t const id, int const fd, transfer_job_t &job) {
+    device_guard_t guard(device.m_device);
 
-    mtpdevice_t(const mtpdevice_t &device) : m_device(device.m_device) {}
+    shaped_progress_t shaped(device.m_device, job);
+    checksum_t sum(job.getChecksum());
+    int result;
 
-    LIBMTP_mtpdevice_t *m_device;
+    job.beginFile();
 
-    std::vector <devicestorage_t> getStorages() {
-        std::vector <devicestorage_t> result;
-        for (LIBMTP_devicestorage_t *storage = m_device->storage; storage != nullptr; storage = storage->next) {
-            result.push_back(devicestorage_t(storage));
-        }
-        return result;
+    if (sum.enabled()) {
+        result = GetFileToDescriptorChecksummed(device.m_device, id, fd, job, sum);
+    } else {
+        result = LIBMTP_Get_File_To_File_Descriptor(device.m_device, id, fd, ShapedProgressCallback,
+                                                    (const void *) &shaped);
     }
-};
 
-int FileProgressCallback(uint64_t const sent, uint64_t const total, void const *const data) {
-    nbind::cbFunction cb = *((nbind::cbFunction *) data);
-    cb(sent, total);
-    return 0;
+    FinishChecksum(job, sum, result);
+    job.endFile(0 == result);
+    return result;
 }
 
-uint16_t MTPDataPutCallback(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen) {
-    nbind::cbFunction cb = *((nbind::cbFunction *) priv);
-    databuffer_t buf(data, sendlen, sendlen);
+int Get_File_To_Handler_Job(mtpdevice_t device, uint32_t const id, js_function_t &dataPutCB,
+                            transfer_job_t &job) {
+    device_guard_t guard(device.m_device);
 
-    if (false == cb.call<bool>(buf)) {
-        return LIBMTP_HANDLER_RETURN_ERROR;
-    }
-
-    *putlen = sendlen;
+    checksum_t sum(job.getChecksum());
+    handler_ctx_t ctx(device.m_device, dataPutCB, job, sum);
 
-    return LIBMTP_HANDLER_RETURN_OK;
+    job.beginFile();
+    int result = LIBMTP_Get_File_To_Handler(device.m_device, id, MTPDataPutJobCallback, (void *) &ctx,
+                                            TransferJobProgressCallback, (const void *) &job);
+    FinishChecksum(job, sum, result);
+    job.endFile(0 == result);
+    return result;
 }
 
-uint16_t MTPDataGetCallback(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen) {
-    nbind::cbFunction cb = *((nbind::cbFunction *) priv);
-    databuffer_t buf(data, wantlen, 0);
+int Send_File_From_File_Job(mtpdevice_t device, const std::string path, file_t filedata, transfer_job_t &job) {
+    device_guard_t guard(device.m_device);
 
-    if (false == cb.call<bool>(buf)) {
-        return LIBMTP_HANDLER_RETURN_ERROR;
-    }
+    shaped_progress_t shaped(device.m_device, job);
+    checksum_t sum(job.getChecksum());
+    int result;
 
-    *gotlen = buf.getLength();
+    job.beginFile();
 
-    return LIBMTP_HANDLER_RETURN_OK;
-}
+    if (sum.enabled()) {
+        int fd = OpenFileForRead(path.c_str());
 
-int Get_File_To_File(mtpdevice_t device, uint32_t const id, const std::string path, nbind::cbFunction &cb) {
-    return LIBMTP_Get_File_To_File(device.m_device, id, path.c_str(), FileProgressCallback, (const void *) &cb);
-}
+        result = fd < 0 ? -1 : SendFileFromDescriptorChecksummed(device.m_device, fd, filedata.get(), job, sum);
 
-int Get_File_To_File_Descriptor(mtpdevice_t device, uint32_t const id, int const fd, nbind::cbFunction &cb) {
-    return LIBMTP_Get_File_To_File_Descriptor(device.m_device, id, fd, FileProgressCallback, (const void *) &cb);
-}
+        if (fd >= 0) {
+            CloseFile(fd);
+        }
+    } else {
+        result = LIBMTP_Send_File_From_File(device.m_device, path.c_str(), filedata.get(), ShapedProgressCallback,
+                                            (const void *) &shaped);
+    }
 
-int Get_File_To_Handler(mtpdevice_t device, uint32_t const id, nbind::cbFunction &dataPutCB,
-                        nbind::cbFunction &progressCB) {
-    return LIBMTP_Get_File_To_Handler(device.m_device, id, MTPDataPutCallback, (void *) &dataPutCB,
-                                      FileProgressCallback, (const void *) &progressCB);
+    DiscardAbortedSend(device, filedata, job, result);
+    FinishChecksum(job, sum, result);
+    job.endFile(0 == result);
+    return result;
 }
 
-int Send_File_From_File(mtpdevice_t device, const std::string path, file_t filedata, nbind::cbFunction &cb) {
-    return LIBMTP_Send_File_From_File(device.m_device, path.c_str(), filedata.get(), FileProgressCallback,
-                                      (const void *) &cb);
-}
+int Send_File_From_File_Descriptor_Job(mtpdevice_t device, const int fd, file_t filedata, transfer_job_t &job) {
+    device_guard_t guard(device.m_device);
 
-int Send_File_From_File_Descriptor(mtpdevice_t device, const int fd, file_t filedata, nbind::cbFunction &cb) {
-    return LIBMTP_Send_File_From_File_Descriptor(device.m_device, fd, filedata.get(), FileProgressCallback,
-                                                 (const void *) &cb);
+    shaped_progress_t shaped(device.m_device, job);
+    checksum_t sum(job.getChecksum());
+    int result;
+
+    job.beginFile();
+
+    if (sum.enabled()) {
+        result = SendFileFromDescriptorChecksummed(device.m_device, fd, filedata.get(), job, sum);
+    } else {
+        result = LIBMTP_Send_File_From_File_Descriptor(device.m_device, fd, filedata.get(), ShapedProgressCallback,
+                                                       (const void *) &shaped);
+    }
+
+    DiscardAbortedSend(device, filedata, job, result);
+    FinishChecksum(job, sum, result);
+    job.endFile(0 == result);
+    return result;
 }
 
-int Send_File_From_Handler(mtpdevice_t device, nbind::cbFunction &dataGetCB, file_t filedata,
-                           nbind::cbFunction &progressCB) {
-    return LIBMTP_Send_File_From_Handler(device.m_device, MTPDataGetCallback, (void *) &dataGetCB, filedata.get(),
-                                         FileProgressCallback, (const void *) &progressCB);
+int Send_File_From_Handler_Job(mtpdevice_t device, js_function_t &dataGetCB, file_t filedata,
+                               transfer_job_t &job) {
+    device_guard_t guard(device.m_device);
+
+    checksum_t sum(job.getChecksum());
+    handler_ctx_t ctx(device.m_device, dataGetCB, job, sum);
+
+    job.beginFile();
+    int result = LIBMTP_Send_File_From_Handler(device.m_device, MTPDataGetJobCallback, (void *) &ctx,
+                                               filedata.get(), TransferJobProgressCallback, (const void *) &job);
+    DiscardAbortedSend(device, filedata, job, result);
+    FinishChecksum(job, sum, result);
+    job.endFile(0 == result);
+    return result;
 }
 
 int Set_File_Name(mtpdevice_t device, file_t file, const std::string path) {
+    device_guard_t guard(device.m_device);
+
     return LIBMTP_Set_File_Name(device.m_device, file.get(), path.c_str());
 }
 
 void Destroy_file(mtpdevice_t device, uint32_t const id) {
+    device_guard_t guard(device.m_device);
+
     LIBMTP_Delete_Object(device.m_device, id);
+    read_cache_t::forDevice(device.m_device)->invalidate(id);
 }
 
 int Create_Folder(mtpdevice_t device,
                   const std::string fileName,
                   int const parentId,
                   int const storageId) {
+    device_guard_t guard(device.m_device);
 
     char *cFileName = strdup(fileName.c_str());
 
@@ -284,7 +368,7 @@ int Create_Folder(mtpdevice_t device,
 
 class SharedBuffer {
 public:
-    SharedBuffer() : data(0), size(0), done(false) {}
+    SharedBuffer(checksum_t &checksum) : data(0), size(0), done(false), sum(checksum) {}
 
     std::mutex mx;
     std::condition_variable cv_put;
@@ -292,6 +376,7 @@ public:
     unsigned char *data;
     uint32_t size;
     bool done;
+    checksum_t &sum;
 };
 
 uint16_t MTPDataGet(void *params, void *priv,
@@ -308,6 +393,7 @@ uint16_t MTPDataGet(void *params, void *priv,
         if (shared_buf->size) {
             size = min(wantlen - (*gotlen), shared_buf->size);
             memcpy(data, shared_buf->data, size);
+            shared_buf->sum.update(data, size);
             *gotlen += size;
             data += size;
 
@@ -355,12 +441,17 @@ uint16_t MTPDataPut(void *params, void *priv,
     return LIBMTP_HANDLER_RETURN_OK;
 }
 
-int Send_File_From_Device(mtpdevice_t device, mtpdevice_t fromDevice, uint32_t const id, file_t filedata,
-                          nbind::cbFunction &progressCB) {
-    SharedBuffer *shared_buf = new SharedBuffer();
+static int Send_File_From_Device_Progress(mtpdevice_t device, mtpdevice_t fromDevice, uint32_t const id,
+                                          file_t filedata, LIBMTP_progressfunc_t const callback,
+                                          void const *const data, checksum_t &sum) {
+    device_guard_t guard(device.m_device);
+
+    SharedBuffer *shared_buf = new SharedBuffer(sum);
 
     LIBMTP_mtpdevice_t *dev = fromDevice.m_device;
-    std::future<int> resultGet = std::async([dev, shared_buf, id] {
+    bool sameDevice = dev == device.m_device;
+    std::future<int> resultGet = std::async([dev, sameDevice, shared_buf, id] {
+        std::unique_ptr <device_guard_t> guard(sameDevice ? nullptr : new device_guard_t(dev));
         int result = LIBMTP_Get_File_To_Handler(dev, id, MTPDataPut, shared_buf, nullptr, nullptr);
         {
             std::lock_guard <std::mutex> lk(shared_buf->mx);
@@ -371,7 +462,7 @@ int Send_File_From_Device(mtpdevice_t device, mtpdevice_t fromDevice, uint32_t c
     });
 
     int resultSend = LIBMTP_Send_File_From_Handler(device.m_device, MTPDataGet, shared_buf, filedata.get(),
-                                                   FileProgressCallback, (const void *) &progressCB);
+                                                   callback, data);
     {
         std::lock_guard <std::mutex> lk(shared_buf->mx);
         shared_buf->done = true;
@@ -393,7 +484,31 @@ int Send_File_From_Device(mtpdevice_t device, mtpdevice_t fromDevice, uint32_t c
     return result;
 }
 
+int Send_File_From_Device(mtpdevice_t device, mtpdevice_t fromDevice, uint32_t const id, file_t filedata,
+                          js_function_t &progressCB) {
+    checksum_t sum(CHECKSUM_NONE);
+
+    return Send_File_From_Device_Progress(device, fromDevice, id, filedata, FileProgressCallback,
+                                          (const void *) &progressCB, sum);
+}
+
+int Send_File_From_Device_Job(mtpdevice_t device, mtpdevice_t fromDevice, uint32_t const id, file_t filedata,
+                              transfer_job_t &job) {
+    shaped_progress_t shaped(device.m_device, job);
+    checksum_t sum(job.getChecksum());
+
+    job.beginFile();
+    int result = Send_File_From_Device_Progress(device, fromDevice, id, filedata, ShapedProgressCallback,
+                                                (const void *) &shaped, sum);
+    DiscardAbortedSend(device, filedata, job, result);
+    FinishChecksum(job, sum, result);
+    job.endFile(0 == result);
+    return result;
+}
+
 std::vector <file_t> Get_Files_And_Folders(mtpdevice_t device, uint32_t const storage, uint32_t const parent) {
+    device_guard_t guard(device.m_device);
+
     std::vector <file_t> result;
     LIBMTP_file_t *next = nullptr;
 
@@ -407,7 +522,29 @@ std::vector <file_t> Get_Files_And_Folders(mtpdevice_t device, uint32_t const st
     return result;
 }
 
+/**
+ * libmtp lists a folder in a single call, so the token is honoured before
+ * the listing starts and a listing that completes after the token was raised
+ * is discarded.
+ */
+std::vector <file_t> Get_Files_And_Folders_Abortable(mtpdevice_t device, uint32_t const storage,
+                                                     uint32_t const parent, abort_token_t &token) {
+    if (token.isAborted()) {
+        return std::vector<file_t>();
+    }
+
+    std::vector <file_t> result = Get_Files_And_Folders(device, storage, parent);
+
+    if (token.isAborted()) {
+        result.clear();
+    }
+
+    return result;
+}
+
 file_t Get_Filemetadata(mtpdevice_t device, uint32_t const id) {
+    device_guard_t guard(device.m_device);
+
     LIBMTP_file_t *file = LIBMTP_Get_Filemetadata(device.m_device, id);
 
     file_t result(file);
@@ -418,10 +555,14 @@ file_t Get_Filemetadata(mtpdevice_t device, uint32_t const id) {
 }
 
 int Get_Storage(mtpdevice_t device, const int sortby) {
+    device_guard_t guard(device.m_device);
+
     return LIBMTP_Get_Storage(device.m_device, sortby);
 }
 
 std::string Get_Friendlyname(mtpdevice_t device) {
+    device_guard_t guard(device.m_device);
+
     char *fn = LIBMTP_Get_Friendlyname(device.m_device);
     std::string result(fn);
     free(fn);
@@ -429,6 +570,8 @@ std::string Get_Friendlyname(mtpdevice_t device) {
 }
 
 std::string Get_Modelname(mtpdevice_t device) {
+    device_guard_t guard(device.m_device);
+
     char *fn = LIBMTP_Get_Modelname(device.m_device);
     std::string result(fn);
     free(fn);
@@ -436,6 +579,8 @@ std::string Get_Modelname(mtpdevice_t device) {
 }
 
 std::string Get_Serialnumber(mtpdevice_t device) {
+    device_guard_t guard(device.m_device);
+
     char *fn = LIBMTP_Get_Serialnumber(device.m_device);
     std::string result(fn);
     free(fn);
@@ -443,22 +588,114 @@ std::string Get_Serialnumber(mtpdevice_t device) {
 }
 
 std::string Get_Deviceversion(mtpdevice_t device) {
+    device_guard_t guard(device.m_device);
+
     char *fn = LIBMTP_Get_Deviceversion(device.m_device);
     std::string result(fn);
     free(fn);
     return result;
 }
 
-void Release_Device(mtpdevice_t device) {
-    LIBMTP_Release_Device(device.m_device);
+/**
+ * Drops the reference of this device object, which is otherwise dropped as
+ * the object is collected; the device is released when no worker uses it
+ * any more. Releasing it again does nothing.
+ */
+void Release_Device(mtpdevice_t &device) {
+    device.release();
+}
+
+/**
+ * Limits all job transfers of a device session to `rate` bytes per second.
+ * A rate of 0 lifts the limit. May be called while transfers are running.
+ */
+void Set_Device_Rate_Limit(mtpdevice_t device, uint64_t const rate, uint64_t const burst) {
+    token_bucket_t::forDevice(device.m_device)->configure(rate, burst);
+}
+
+uint64_t Get_Device_Rate_Limit(mtpdevice_t device) {
+    return token_bucket_t::forDevice(device.m_device)->getRate();
 }
 
 mtpdevice_t Open_Raw_Device_Uncached(raw_device_t rawDevice) {
-    return mtpdevice_t(LIBMTP_Open_Raw_Device_Uncached(rawDevice.get()));
+    uint32_t handle = 0;
+    LIBMTP_mtpdevice_t *device = device_registry_t::instance().open(rawDevice.get(), false, handle);
+
+    return mtpdevice_t(handle, device);
 }
 
 mtpdevice_t Open_Raw_Device(raw_device_t rawDevice) {
-    return mtpdevice_t(LIBMTP_Open_Raw_Device(rawDevice.get()));
+    uint32_t handle = 0;
+    LIBMTP_mtpdevice_t *device = device_registry_t::instance().open(rawDevice.get(), true, handle);
+
+    return mtpdevice_t(handle, device);
+}
+
+/**
+ * Shares a device opened in another worker, see mtpdevice_t::getHandle().
+ * Null if the device has been released since.
+ */
+mtpdevice_t Acquire_Device(uint32_t const handle) {
+    return mtpdevice_t(handle, device_registry_t::instance().retain(handle));
+}
+
+mtpdevice_t::mtpdevice_t(const mtpdevice_t &device) : m_device(device.m_device), m_handle(device.m_handle) {
+    if (0 != m_handle) {
+        m_device = device_registry_t::instance().retain(m_handle);
+    }
+
+    if (nullptr == m_device) {
+        m_handle = 0;
+        throw std::runtime_error("Device is not open");
+    }
+}
+
+std::vector <devicestorage_t> mtpdevice_t::getStorages() {
+    std::vector <devicestorage_t> result;
+
+    if (!isOpen()) {
+        throw std::runtime_error("Device is not open");
+    }
+
+    for (LIBMTP_devicestorage_t *storage = m_device->storage; storage != nullptr; storage = storage->next) {
+        result.push_back(devicestorage_t(storage));
+    }
+    return result;
+}
+
+mtpdevice_t::~mtpdevice_t() {
+    release();
+}
+
+void mtpdevice_t::release() {
+    if (0 != m_handle) {
+        device_registry_t::instance().release(m_handle);
+    }
+
+    m_handle = 0;
+    m_device = nullptr;
+}
+
+/**
+ * Applies a device event (a LIBMTP_event_t and its object or storage ID) to
+ * the object cache of a device opened with Open_Raw_Device, so the cache
+ * follows changes without a full reload. Returns 0 if the cache was updated
+ * in place and -1 if it was dropped, to be reloaded by the next listing.
+ * Without LIBMTP_Update_Object_Cache() (see MTP_HAVE_CACHE_EVENTS) only the
+ * read cache is updated and -1 is returned.
+ */
+int Update_Object_Cache(mtpdevice_t device, int const event, uint32_t const id) {
+    if (LIBMTP_EVENT_OBJECT_ADDED == event || LIBMTP_EVENT_OBJECT_REMOVED == event) {
+        read_cache_t::forDevice(device.m_device)->invalidate(id);
+    }
+
+#ifdef MTP_HAVE_CACHE_EVENTS
+    device_guard_t guard(device.m_device);
+
+    return LIBMTP_Update_Object_Cache(device.m_device, (LIBMTP_event_t) event, id);
+#else
+    return -1;
+#endif
 }
 
 uint32_t lookup_folder_id(LIBMTP_folder_t *folder, char *path, char *parent) {
@@ -556,7 +793,7 @@ int pathToId(const std::string path, file_t fileData, folder_t folderData) {
     return _return;
 }
 
-void Detect_Raw_Devices(nbind::cbFunction &cb) {
+void Detect_Raw_Devices(js_function_t &cb) {
     LIBMTP_raw_device_t *rawdevices = nullptr;
     int numrawdevices = 0;
 
@@ -573,11 +810,58 @@ void Detect_Raw_Devices(nbind::cbFunction &cb) {
     cb((int) err, result);
 }
 
+/**
+ * Every JS environment loading the addon calls this, libmtp is set up once
+ * per process.
+ */
 void Init() {
-    LIBMTP_Init();
+    static std::once_flag once;
+
+    std::call_once(once, LIBMTP_Init);
+}
+
+napi_value js_convert<std::vector <file_t> >::toJs(napi_env env, const std::vector <file_t> &files) {
+    js_columns_t columns(env, files.size(), 2 * sizeof(double) + 4 * sizeof(uint32_t));
+    double *sizes = columns.float64("sizes");
+    double *modificationDates = columns.float64("modificationDates");
+    uint32_t *ids = columns.uint32("ids");
+    uint32_t *types = columns.uint32("types");
+    uint32_t *parentIds = columns.uint32("parentIds");
+    uint32_t *storageIds = columns.uint32("storageIds");
+    std::string names;
+
+    if (!columns.ok()) {
+        return nullptr;
+    }
+
+    for (size_t i = 0; i < files.size(); i++) {
+        const file_t &file = files[i];
+
+        sizes[i] = (double) file.getSize();
+        modificationDates[i] = (double) file.getModificationDate();
+        ids[i] = file.getId();
+        types[i] = file.getType();
+        parentIds[i] = file.getParentId();
+        storageIds[i] = file.getStorageId();
+        names.append(file.getName()).push_back('\0');
+    }
+
+    columns.strings("names", names);
+
+    return columns.value();
+}
+
+napi_value js_convert<LIBMTP_folder_t *>::toJs(napi_env env, LIBMTP_folder_t *folder) {
+    if (nullptr == folder) {
+        napi_value result = nullptr;
+        napi_get_null(env, &result);
+        return result;
+    }
+
+    return js_convert<folder_t>::toJs(env, folder_t(folder));
 }
 
-NBIND_CLASS(file_t){
+JS_CLASS(file_t){
         construct<>();
         construct<const file_t&>();
         getset(getName, setName);
@@ -589,7 +873,7 @@ NBIND_CLASS(file_t){
         getter(getModificationDate);
 }
 
-NBIND_CLASS(folder_t){
+JS_CLASS(folder_t){
         construct<>();
         construct<const folder_t&>();
         getset(getName, setName);
@@ -600,28 +884,28 @@ NBIND_CLASS(folder_t){
         getter(getSibling);
 }
 
-NBIND_CLASS(mtpdevice_t){
+JS_CLASS(mtpdevice_t){
         construct<>();
         construct<const mtpdevice_t&>();
+        getter(getHandle);
         method(getStorages);
 }
 
-NBIND_CLASS(devicestorage_t){
+JS_CLASS(devicestorage_t){
         construct<>();
         construct<const devicestorage_t&>();
         getset(getId, setId);
         getset(getDescription, setDescription);
 }
 
-NBIND_CLASS(raw_device_t){
-        construct<LIBMTP_raw_device_t>();
+JS_CLASS(raw_device_t){
         construct<const raw_device_t&>();
         getset(getBusLocation, setBusLocation);
         getset(getDevNum, setDevNum);
         getter(getVendor);
 }
 
-NBIND_CLASS(databuffer_t){
+JS_CLASS(databuffer_t){
         construct<const databuffer_t &>();
         getter(getLength);
         getter(getSize);
@@ -629,11 +913,13 @@ NBIND_CLASS(databuffer_t){
         method(write);
 }
 
-NBIND_GLOBAL() {
+JS_GLOBAL() {
     function(Init);
     function(Detect_Raw_Devices);
     function(Open_Raw_Device);
     function(Open_Raw_Device_Uncached);
+    function(Acquire_Device);
+    function(Update_Object_Cache);
     function(Release_Device);
     function(Get_Friendlyname);
     function(Get_Modelname);
@@ -641,6 +927,7 @@ NBIND_GLOBAL() {
     function(Get_Deviceversion);
     function(Get_Storage);
     function(Get_Files_And_Folders);
+    function(Get_Files_And_Folders_Abortable);
     function(Get_File_To_File);
     function(Get_File_To_File_Descriptor);
     function(Get_File_To_Handler);
@@ -648,9 +935,36 @@ NBIND_GLOBAL() {
     function(Send_File_From_File_Descriptor);
     function(Send_File_From_Handler);
     function(Send_File_From_Device);
+    function(Get_File_To_File_Job);
+    function(Get_File_To_File_Descriptor_Job);
+    function(Get_File_To_Handler_Job);
+    function(Send_File_From_File_Job);
+    function(Send_File_From_File_Descriptor_Job);
+    function(Send_File_From_Handler_Job);
+    function(Send_File_From_Device_Job);
     function(Get_Filemetadata);
+    function(Get_Filetype);
     function(Set_File_Name);
     function(Destroy_file);
     function(Create_Folder);
     function(pathToId);
+    function(Schedule_Get_Files_And_Folders);
+    function(Schedule_Get_Filemetadata);
+    function(Schedule_Get_File_To_File);
+    function(Schedule_Send_File_From_File);
+    function(Set_Scheduler_Chunk_Size);
+    function(Schedule_Upload_Tree);
+    function(Scan_Local_Tree);
+    function(Schedule_Download_Tree);
+    function(Schedule_Upload_Small_Files);
+    function(Schedule_Sync_Tree);
+    function(Get_File_To_File_Cached);
+    function(Read_File_Range);
+    function(Invalidate_Read_Cache);
+    function(Set_Read_Cache_Capacity);
+    function(Schedule_Get_Thumbnails);
+    function(Schedule_Export_Archive);
+    function(Schedule_Import_Archive);
+    function(Set_Device_Rate_Limit);
+    function(Get_Device_Rate_Limit);
 }
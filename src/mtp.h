@@ -0,0 +1,297 @@
+#ifndef MTP_H
+#define MTP_H
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <string.h>
+
+#include "libmtp.h"
+#include "binding.h"
+
+class raw_device_t {
+public:
+    raw_device_t(LIBMTP_raw_device_t rawDevice) : m_rawDevice(rawDevice) {}
+
+    raw_device_t(const raw_device_t &rawDevice) : m_rawDevice(rawDevice.m_rawDevice) {}
+
+    uint32_t getBusLocation() { return m_rawDevice.bus_location; }
+
+    void setBusLocation(const uint32_t busLocation) { m_rawDevice.bus_location = busLocation; }
+
+    uint8_t getDevNum() { return m_rawDevice.devnum; }
+
+    void setDevNum(const uint8_t devNum) { m_rawDevice.devnum = devNum; }
+
+    char *getVendor() {
+        if (NULL == m_rawDevice.device_entry.vendor) {
+            return "";
+        }
+
+        return m_rawDevice.device_entry.vendor;
+    }
+
+    LIBMTP_raw_device_t *get() { return &m_rawDevice; }
+
+private:
+    LIBMTP_raw_device_t m_rawDevice;
+};
+
+class file_t {
+public:
+    file_t(LIBMTP_file_t *file = nullptr) : m_name(file ? file->filename : "") {
+        if (file) {
+            memcpy(&m_file, file, sizeof(m_file));
+        } else {
+            memset(&m_file, 0, sizeof(m_file));
+        }
+        m_file.filename = (char *) m_name.c_str();
+    }
+
+    file_t(const file_t &file) : m_file(file.m_file), m_name(file.m_name) {
+        m_file.filename = (char *) m_name.c_str();
+    }
+
+    file_t(file_t &&file) : m_file(file.m_file), m_name(std::move(file.m_name)) {
+        m_file.filename = (char *) m_name.c_str();
+    }
+
+    /* m_file.filename points into m_name, so it is never copied over */
+    file_t &operator=(const file_t &file) {
+        m_file = file.m_file;
+        m_name = file.m_name;
+        m_file.filename = (char *) m_name.c_str();
+        return *this;
+    }
+
+    file_t &operator=(file_t &&file) {
+        m_file = file.m_file;
+        m_name = std::move(file.m_name);
+        m_file.filename = (char *) m_name.c_str();
+        return *this;
+    }
+
+    std::string getName() const { return m_name; }
+
+    void setName(const std::string name) {
+        m_name = name;
+        m_file.filename = (char *) m_name.c_str();
+    }
+
+    uint32_t getId() const { return m_file.item_id; }
+
+    void setId(const uint32_t id) { m_file.item_id = id; }
+
+    uint32_t getType() const { return m_file.filetype; }
+
+    void setType(const uint32_t type) { m_file.filetype = (LIBMTP_filetype_t) type; }
+
+    uint64_t getSize() const { return m_file.filesize; }
+
+    void setSize(const uint64_t size) { m_file.filesize = size; }
+
+    uint32_t getParentId() const { return m_file.parent_id; }
+
+    void setParentId(const uint32_t parentId) { m_file.parent_id = parentId; }
+
+    uint32_t getStorageId() const { return m_file.storage_id; }
+
+    void setStorageId(const uint32_t storageId) { m_file.storage_id = storageId; }
+
+    time_t getModificationDate() const { return m_file.modificationdate; }
+
+    LIBMTP_file_t *get() { return &m_file; }
+
+private:
+    LIBMTP_file_t m_file;
+    std::string m_name;
+};
+
+/**
+ * Listings go to JS packed into columns, see js_columns_t; lib/mtp-helper.js
+ * turns them back into objects with the properties of file_t.
+ */
+template <>
+struct js_convert<std::vector <file_t> > {
+    typedef std::vector <file_t> holder_t;
+
+    static napi_value toJs(napi_env env, const std::vector <file_t> &files);
+
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder) { return JsToVector(env, value, holder); }
+
+    static std::vector <file_t> &get(holder_t &holder) { return holder; }
+};
+
+class folder_t {
+public:
+    folder_t(LIBMTP_folder_t *folder = nullptr) : m_name(folder ? folder->name : "") {
+        if (folder) {
+            memcpy(&m_folder, folder, sizeof(m_folder));
+        } else {
+            memset(&m_folder, 0, sizeof(m_folder));
+        }
+        m_folder.name = (char *) m_name.c_str();
+    }
+
+    folder_t(const folder_t &folder) : m_folder(folder.m_folder), m_name(folder.m_name) {
+        m_folder.name = (char *) m_name.c_str();
+    }
+
+    folder_t(folder_t &&folder) : m_folder(folder.m_folder), m_name(std::move(folder.m_name)) {
+        m_folder.name = (char *) m_name.c_str();
+    }
+
+    /* m_folder.name points into m_name, so it is never copied over */
+    folder_t &operator=(const folder_t &folder) {
+        m_folder = folder.m_folder;
+        m_name = folder.m_name;
+        m_folder.name = (char *) m_name.c_str();
+        return *this;
+    }
+
+    folder_t &operator=(folder_t &&folder) {
+        m_folder = folder.m_folder;
+        m_name = std::move(folder.m_name);
+        m_folder.name = (char *) m_name.c_str();
+        return *this;
+    }
+
+    std::string getName() { return m_name; }
+
+    void setName(const std::string name) {
+        m_name = name;
+        m_folder.name = (char *) m_name.c_str();
+    }
+
+    uint32_t getId() { return m_folder.folder_id; }
+
+    void setId(const uint32_t id) { m_folder.folder_id = id; }
+
+    uint32_t getParentId() { return m_folder.parent_id; }
+
+    void setParentId(const uint32_t parentId) { m_folder.parent_id = parentId; }
+
+    uint32_t getStorageId() { return m_folder.storage_id; }
+
+    void setStorageId(const uint32_t storageId) { m_folder.storage_id = storageId; }
+
+    LIBMTP_folder_t *getSibling() { return m_folder.sibling; }
+
+    LIBMTP_folder_t *getChild() { return m_folder.child; }
+
+    LIBMTP_folder_t *get() { return &m_folder; }
+
+private:
+    LIBMTP_folder_t m_folder;
+    std::string m_name;
+};
+
+/* the child and sibling of a folder_t, as a folder_t of their own or null */
+template <>
+struct js_convert<LIBMTP_folder_t *> {
+    static napi_value toJs(napi_env env, LIBMTP_folder_t *folder);
+};
+
+class devicestorage_t {
+public:
+    devicestorage_t(LIBMTP_devicestorage_t *storage = nullptr) : m_storage(*storage),
+                                                                 m_description(storage->StorageDescription) {}
+
+    devicestorage_t(const devicestorage_t &storage) : m_storage(storage.m_storage),
+                                                      m_description(storage.m_description) {};
+
+    uint32_t getId() { return m_storage.id; }
+
+    void setId(const uint32_t id) { m_storage.id = id; }
+
+    std::string getDescription() { return m_description; }
+
+    void setDescription(const std::string description) { m_description = description; }
+
+private:
+    LIBMTP_devicestorage_t m_storage;
+    std::string m_description;
+};
+
+/**
+ * A device for the duration of a call.
+ *
+ * Devices handed to JS hold a reference in device_registry_t under their
+ * handle; every copy takes a reference of its own, so a device cannot be
+ * released while a call is using it, and the device goes when the last
+ * object referring to it is released or collected. Copying a device which
+ * is not open throws. Devices made from a bare libmtp device, for the
+ * native code which already holds one, are not counted.
+ */
+class mtpdevice_t {
+public:
+    mtpdevice_t(LIBMTP_mtpdevice_t *device = nullptr) : m_device(device), m_handle(0) {}
+
+    /* adopts a reference taken from device_registry_t, if there is a device */
+    mtpdevice_t(uint32_t handle, LIBMTP_mtpdevice_t *device) : m_device(device), m_handle(device ? handle : 0) {}
+
+    mtpdevice_t(const mtpdevice_t &device);
+
+    mtpdevice_t(mtpdevice_t &&device) : m_device(device.m_device), m_handle(device.m_handle) {
+        device.m_device = nullptr;
+        device.m_handle = 0;
+    }
+
+    ~mtpdevice_t();
+
+    LIBMTP_mtpdevice_t *m_device;
+
+    bool isOpen() const { return nullptr != m_device; }
+
+    /* drops the reference of this object; releasing it again does nothing */
+    void release();
+
+    /* what another worker passes to Acquire_Device() to use this device */
+    uint32_t getHandle() { return m_handle; }
+
+    /* throws once the device is released */
+    std::vector <devicestorage_t> getStorages();
+
+private:
+    mtpdevice_t &operator=(const mtpdevice_t &);
+
+    uint32_t m_handle;
+};
+
+/**
+ * A device which could not be opened goes to JS as null. Only devices made
+ * by the addon are accepted from JS.
+ */
+template <>
+struct js_convert<mtpdevice_t> {
+    typedef mtpdevice_t *holder_t;
+
+    static napi_value toJs(napi_env env, const mtpdevice_t &device) {
+        napi_value result = nullptr;
+
+        if (!device.isOpen()) {
+            napi_get_null(env, &result);
+            return result;
+        }
+
+        return JsWrapNative(env, js_class_info<mtpdevice_t>::record(), new mtpdevice_t(device));
+    }
+
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder) {
+        holder = (mtpdevice_t *) JsUnwrapNative(env, js_class_info<mtpdevice_t>::record(), value);
+
+        if (nullptr == holder) {
+            JsThrowTypeError(env, "Type mismatch: expected mtpdevice_t");
+        }
+
+        return nullptr != holder;
+    }
+
+    static mtpdevice_t &get(holder_t &holder) { return *holder; }
+};
+
+std::vector <file_t> Get_Files_And_Folders(mtpdevice_t device, uint32_t const storage, uint32_t const parent);
+
+file_t Get_Filemetadata(mtpdevice_t device, uint32_t const id);
+
+#endif
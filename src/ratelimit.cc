@@ -0,0 +1,164 @@
+#include "ratelimit.h"
+
+#include <map>
+
+#include "transfer.h"
+
+/* upper bound for a single wait, so aborts and new limits are noticed */
+static const std::chrono::milliseconds MAX_WAIT(50);
+
+token_bucket_t::token_bucket_t() : m_rate(0), m_burst(0), m_tokens(0), m_last(std::chrono::steady_clock::now()) {}
+
+/**
+ * A burst of 0 allows one second worth of data at the configured rate.
+ */
+void token_bucket_t::configure(uint64_t rate, uint64_t burst) {
+    std::lock_guard <std::mutex> lk(m_mx);
+    refill();
+
+    bool unlimited = 0 == m_rate;
+
+    m_rate = (double) rate;
+    m_burst = (double) (burst ? burst : rate);
+
+    if (0 == rate) {
+        m_tokens = 0;
+    } else if (unlimited || m_tokens > m_burst) {
+        m_tokens = m_burst;
+    }
+
+    m_cv.notify_all();
+}
+
+uint64_t token_bucket_t::getRate() {
+    std::lock_guard <std::mutex> lk(m_mx);
+    return (uint64_t) m_rate;
+}
+
+uint64_t token_bucket_t::getBurst() {
+    std::lock_guard <std::mutex> lk(m_mx);
+    return (uint64_t) m_burst;
+}
+
+/**
+ * Takes `bytes` out of the bucket and blocks until the bucket is no longer
+ * in debt. Returns false if `cancelled` turned true while waiting.
+ */
+bool token_bucket_t::consume(uint64_t bytes, std::function<bool()> cancelled) {
+    std::unique_lock <std::mutex> lk(m_mx);
+    refill();
+
+    if (0 == m_rate) {
+        return true;
+    }
+
+    m_tokens -= (double) bytes;
+
+    while (m_tokens < 0) {
+        if (0 == m_rate) {
+            m_tokens = 0;
+            break;
+        }
+
+        if (cancelled && cancelled()) {
+            return false;
+        }
+
+        std::chrono::microseconds wait((int64_t) (-m_tokens / m_rate * 1e6) + 1);
+        m_cv.wait_for(lk, wait < MAX_WAIT ? wait : std::chrono::microseconds(MAX_WAIT));
+        refill();
+    }
+
+    return true;
+}
+
+/**
+ * Non-blocking variant of consume(): takes `bytes` out of the bucket and
+ * returns how long the caller has to wait until the debt is paid off.
+ */
+std::chrono::microseconds token_bucket_t::reserve(uint64_t bytes) {
+    std::lock_guard <std::mutex> lk(m_mx);
+    refill();
+
+    if (0 == m_rate) {
+        return std::chrono::microseconds(0);
+    }
+
+    m_tokens -= (double) bytes;
+
+    if (m_tokens >= 0) {
+        return std::chrono::microseconds(0);
+    }
+
+    return std::chrono::microseconds((int64_t) (-m_tokens / m_rate * 1e6) + 1);
+}
+
+void token_bucket_t::refill() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(now - m_last).count();
+
+    m_last = now;
+    m_tokens += elapsed * m_rate;
+
+    if (m_tokens > m_burst) {
+        m_tokens = m_burst;
+    }
+}
+
+static std::mutex &BucketsMutex() {
+    static std::mutex mx;
+    return mx;
+}
+
+static std::map<LIBMTP_mtpdevice_t *, std::shared_ptr <token_bucket_t>> &Buckets() {
+    static std::map<LIBMTP_mtpdevice_t *, std::shared_ptr <token_bucket_t>> buckets;
+    return buckets;
+}
+
+std::shared_ptr <token_bucket_t> token_bucket_t::forDevice(LIBMTP_mtpdevice_t *device) {
+    std::lock_guard <std::mutex> lk(BucketsMutex());
+    std::shared_ptr <token_bucket_t> &bucket = Buckets()[device];
+
+    if (!bucket) {
+        bucket = std::make_shared<token_bucket_t>();
+    }
+
+    return bucket;
+}
+
+void token_bucket_t::release(LIBMTP_mtpdevice_t *device) {
+    std::lock_guard <std::mutex> lk(BucketsMutex());
+    Buckets().erase(device);
+}
+
+/**
+ * Shapes a chunk against both the job's and the device's limit, blocking the
+ * calling thread. Returns false if the job got aborted while waiting.
+ */
+bool ThrottleTransfer(LIBMTP_mtpdevice_t *device, transfer_job_t &job, uint64_t bytes) {
+    transfer_job_t *aborted = &job;
+    std::function<bool()> cancelled = [aborted] { return aborted->isAborted(); };
+
+    return job.getRateLimiter()->consume(bytes, cancelled) &&
+           token_bucket_t::forDevice(device)->consume(bytes, cancelled);
+}
+
+std::chrono::microseconds ReserveTransfer(LIBMTP_mtpdevice_t *device, transfer_job_t &job, uint64_t bytes) {
+    std::chrono::microseconds jobWait = job.getRateLimiter()->reserve(bytes);
+    std::chrono::microseconds deviceWait = token_bucket_t::forDevice(device)->reserve(bytes);
+
+    return jobWait > deviceWait ? jobWait : deviceWait;
+}
+
+int ShapedProgressCallback(uint64_t const sent, uint64_t const total, void const *const data) {
+    shaped_progress_t *ctx = (shaped_progress_t *) data;
+    uint64_t chunk = sent >= ctx->m_sent ? sent - ctx->m_sent : sent;
+
+    ctx->m_sent = sent;
+
+    if (!ThrottleTransfer(ctx->m_device, ctx->m_job, chunk)) {
+        return 1;
+    }
+
+    return ctx->m_job.progress(sent, total);
+}
@@ -0,0 +1,71 @@
+#ifndef MTP_RATELIMIT_H
+#define MTP_RATELIMIT_H
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "libmtp.h"
+
+class transfer_job_t;
+
+/**
+ * Token bucket shaping the bytes moved over USB.
+ *
+ * The bucket refills at `rate` bytes per second and holds at most `burst`
+ * bytes. A chunk may overdraw the bucket; the debt is paid off by waiting
+ * before the next chunk. A rate of 0 disables shaping. The limits can be
+ * changed at any time and take effect on the next chunk.
+ */
+class token_bucket_t {
+public:
+    token_bucket_t();
+
+    void configure(uint64_t rate, uint64_t burst);
+
+    uint64_t getRate();
+
+    uint64_t getBurst();
+
+    bool consume(uint64_t bytes, std::function<bool()> cancelled);
+
+    std::chrono::microseconds reserve(uint64_t bytes);
+
+    static std::shared_ptr <token_bucket_t> forDevice(LIBMTP_mtpdevice_t *device);
+
+    static void release(LIBMTP_mtpdevice_t *device);
+
+private:
+    void refill();
+
+    std::mutex m_mx;
+    std::condition_variable m_cv;
+    double m_rate;
+    double m_burst;
+    double m_tokens;
+    std::chrono::steady_clock::time_point m_last;
+};
+
+/**
+ * Progress context which shapes transfers libmtp runs from a file or file
+ * descriptor, where no data handler of ours sees the chunks.
+ */
+class shaped_progress_t {
+public:
+    shaped_progress_t(LIBMTP_mtpdevice_t *device, transfer_job_t &job) : m_device(device), m_job(job), m_sent(0) {}
+
+    LIBMTP_mtpdevice_t *m_device;
+    transfer_job_t &m_job;
+    uint64_t m_sent;
+};
+
+int ShapedProgressCallback(uint64_t const sent, uint64_t const total, void const *const data);
+
+bool ThrottleTransfer(LIBMTP_mtpdevice_t *device, transfer_job_t &job, uint64_t bytes);
+
+std::chrono::microseconds ReserveTransfer(LIBMTP_mtpdevice_t *device, transfer_job_t &job, uint64_t bytes);
+
+#endif
@@ -0,0 +1,334 @@
+#include "readcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+
+#include "executor.h"
+
+/* read-ahead state is dropped wholesale once this many objects were read */
+static const size_t MAX_STREAMS = 1024;
+
+static std::mutex &CachesMutex() {
+    static std::mutex mx;
+    return mx;
+}
+
+static std::map<LIBMTP_mtpdevice_t *, std::shared_ptr<read_cache_t>> &Caches() {
+    static std::map<LIBMTP_mtpdevice_t *, std::shared_ptr<read_cache_t>> caches;
+    return caches;
+}
+
+std::shared_ptr <read_cache_t> read_cache_t::forDevice(LIBMTP_mtpdevice_t *device) {
+    std::lock_guard <std::mutex> lk(CachesMutex());
+    std::shared_ptr <read_cache_t> &cache = Caches()[device];
+
+    if (!cache) {
+        cache = std::make_shared<read_cache_t>();
+    }
+
+    return cache;
+}
+
+void read_cache_t::release(LIBMTP_mtpdevice_t *device) {
+    std::lock_guard <std::mutex> lk(CachesMutex());
+    Caches().erase(device);
+}
+
+/**
+ * Prefetches a few blocks of one object, one block per step, so a read
+ * ahead never holds the device for longer than a single block.
+ */
+class read_ahead_task_t : public scheduler_task_t {
+public:
+    read_ahead_task_t(std::shared_ptr <read_cache_t> cache, uint32_t id, const std::vector <uint64_t> &indices) :
+            scheduler_task_t(PRIORITY_BULK, 1), m_cache(cache), m_id(id), m_indices(indices), m_next(0) {}
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        std::shared_ptr <read_cache_t> cache = m_cache.lock();
+
+        if (cache && m_next < m_indices.size()) {
+            device_guard_t guard(device, getPriority());
+            cache->prefetch(device, m_id, m_indices[m_next++]);
+        }
+
+        if (!cache || m_next >= m_indices.size()) {
+            finish([] {});
+            return true;
+        }
+
+        return false;
+    }
+
+    void fail(int error) override {
+        finish([] {});
+    }
+
+private:
+    std::weak_ptr <read_cache_t> m_cache;
+    uint32_t m_id;
+    std::vector <uint64_t> m_indices;
+    size_t m_next;
+};
+
+read_cache_t::read_cache_t() : m_capacity(DEFAULT_CAPACITY), m_bytes(0) {}
+
+int64_t read_cache_t::read(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, unsigned char *data,
+                           uint32_t length) {
+    uint64_t size;
+
+    if (!objectSize(device, id, size)) {
+        return -1;
+    }
+
+    if (offset >= size) {
+        return 0;
+    }
+
+    uint64_t end = size - offset < length ? size : offset + length;
+
+    for (uint64_t position = offset; position < end;) {
+        uint64_t index = position / BLOCK_SIZE;
+        read_block_t block = this->block(device, id, index, size);
+        uint64_t start = position - index * BLOCK_SIZE;
+
+        if (!block || block->size() <= start) {
+            return -1;
+        }
+
+        uint64_t available = block->size() - start;
+        uint64_t count = end - position < available ? end - position : available;
+
+        memcpy(data + (position - offset), block->data() + start, (size_t) count);
+        position += count;
+    }
+
+    readAhead(device, id, offset, end, size);
+
+    return (int64_t) (end - offset);
+}
+
+void read_cache_t::invalidate(uint32_t id) {
+    std::lock_guard <std::mutex> lk(m_mx);
+
+    for (std::list<uint64_t>::iterator it = m_uses.begin(); it != m_uses.end();) {
+        if ((uint32_t) (*it >> 32) != id) {
+            ++it;
+            continue;
+        }
+
+        std::unordered_map<uint64_t, cached_block_t>::iterator block = m_blocks.find(*it);
+        m_bytes -= block->second.data->size();
+        m_blocks.erase(block);
+        it = m_uses.erase(it);
+    }
+
+    m_sizes.erase(id);
+    m_streams.erase(id);
+}
+
+void read_cache_t::setCapacity(uint64_t capacity) {
+    std::lock_guard <std::mutex> lk(m_mx);
+    m_capacity = capacity ? capacity : DEFAULT_CAPACITY;
+
+    while (m_bytes > m_capacity && !m_uses.empty()) {
+        std::unordered_map<uint64_t, cached_block_t>::iterator block = m_blocks.find(m_uses.back());
+        m_bytes -= block->second.data->size();
+        m_blocks.erase(block);
+        m_uses.pop_back();
+    }
+}
+
+void read_cache_t::prefetch(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t index) {
+    uint64_t size = 0;
+    bool wanted;
+
+    {
+        std::lock_guard <std::mutex> lk(m_mx);
+        std::unordered_map<uint32_t, uint64_t>::iterator it = m_sizes.find(id);
+
+        // the object may have been invalidated since the read-ahead was planned
+        wanted = it != m_sizes.end() && m_blocks.end() == m_blocks.find(keyOf(id, index));
+        if (wanted) {
+            size = it->second;
+        }
+    }
+
+    if (wanted) {
+        read_block_t block = fetch(device, id, index, size);
+
+        if (block) {
+            store(id, index, block);
+        }
+    }
+
+    std::lock_guard <std::mutex> lk(m_mx);
+    m_pending.erase(keyOf(id, index));
+}
+
+bool read_cache_t::objectSize(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t &size) {
+    {
+        std::lock_guard <std::mutex> lk(m_mx);
+        std::unordered_map<uint32_t, uint64_t>::iterator it = m_sizes.find(id);
+
+        if (it != m_sizes.end()) {
+            size = it->second;
+            return true;
+        }
+    }
+
+    LIBMTP_file_t *meta = LIBMTP_Get_Filemetadata(device, id);
+
+    if (nullptr == meta) {
+        LIBMTP_Clear_Errorstack(device);
+        return false;
+    }
+
+    size = meta->filesize;
+    LIBMTP_destroy_file_t(meta);
+
+    std::lock_guard <std::mutex> lk(m_mx);
+    m_sizes[id] = size;
+
+    return true;
+}
+
+read_block_t read_cache_t::block(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t index, uint64_t size) {
+    {
+        std::lock_guard <std::mutex> lk(m_mx);
+        std::unordered_map<uint64_t, cached_block_t>::iterator it = m_blocks.find(keyOf(id, index));
+
+        if (it != m_blocks.end()) {
+            m_uses.splice(m_uses.begin(), m_uses, it->second.use);
+            return it->second.data;
+        }
+    }
+
+    read_block_t block = fetch(device, id, index, size);
+
+    if (block) {
+        store(id, index, block);
+    }
+
+    return block;
+}
+
+read_block_t read_cache_t::fetch(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t index, uint64_t size) {
+    uint64_t start = index * BLOCK_SIZE;
+    uint32_t length = size - start < BLOCK_SIZE ? (uint32_t) (size - start) : BLOCK_SIZE;
+    unsigned char *data = nullptr;
+    unsigned int got = 0;
+
+    if (0 != GetPartialObjectSized(device, id, start, length, size, &data, &got)) {
+        LIBMTP_Clear_Errorstack(device);
+        free(data);
+        return read_block_t();
+    }
+
+    read_block_t block = std::make_shared<std::vector<unsigned char>>(data, data + got);
+    free(data);
+
+    // a short block would hide the rest of the object from later reads
+    if (got < length) {
+        return read_block_t();
+    }
+
+    return block;
+}
+
+void read_cache_t::store(uint32_t id, uint64_t index, read_block_t data) {
+    std::lock_guard <std::mutex> lk(m_mx);
+    uint64_t key = keyOf(id, index);
+
+    if (m_blocks.end() != m_blocks.find(key)) {
+        return;
+    }
+
+    cached_block_t &block = m_blocks[key];
+    block.data = data;
+    block.use = m_uses.insert(m_uses.begin(), key);
+    m_bytes += data->size();
+
+    while (m_bytes > m_capacity && m_uses.size() > 1) {
+        std::unordered_map<uint64_t, cached_block_t>::iterator oldest = m_blocks.find(m_uses.back());
+        m_bytes -= oldest->second.data->size();
+        m_blocks.erase(oldest);
+        m_uses.pop_back();
+    }
+}
+
+/**
+ * A read which starts where the last read of the object ended (give or
+ * take a block) continues a sequential run; from the second read of a run
+ * on, the next READ_AHEAD_BLOCKS blocks are queued for prefetching.
+ */
+void read_cache_t::readAhead(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, uint64_t end,
+                             uint64_t size) {
+    std::vector <uint64_t> indices;
+
+    {
+        std::lock_guard <std::mutex> lk(m_mx);
+
+        if (m_streams.size() >= MAX_STREAMS && m_streams.end() == m_streams.find(id)) {
+            m_streams.clear();
+        }
+
+        stream_t &stream = m_streams[id];
+        bool sequential = stream.end > 0 && offset >= stream.end && offset - stream.end <= BLOCK_SIZE;
+
+        stream.run = sequential ? stream.run + 1 : 0;
+        stream.end = end;
+
+        if (!sequential) {
+            stream.ahead = 0;
+            return;
+        }
+
+        uint64_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint64_t next = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint64_t last = next + READ_AHEAD_BLOCKS < blocks ? next + READ_AHEAD_BLOCKS : blocks;
+
+        for (uint64_t index = next > stream.ahead ? next : stream.ahead; index < last; index++) {
+            uint64_t key = keyOf(id, index);
+
+            if (m_blocks.end() == m_blocks.find(key) && m_pending.insert(key).second) {
+                indices.push_back(index);
+            }
+        }
+
+        if (last > stream.ahead) {
+            stream.ahead = last;
+        }
+    }
+
+    if (!indices.empty()) {
+        device_executor_t::forDevice(device)->submit(
+                std::make_shared<read_ahead_task_t>(shared_from_this(), id, indices));
+    }
+}
+
+int GetPartialObjectSized(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, uint32_t maxbytes,
+                          uint64_t filesize, unsigned char **data, unsigned int *size) {
+#ifdef MTP_HAVE_PARTIAL_SIZED
+    return LIBMTP_GetPartialObject_Sized(device, id, offset, maxbytes, filesize, data, size);
+#else
+    if (offset >= filesize) {
+        *size = 0;
+        return 0;
+    }
+
+    return LIBMTP_GetPartialObject(device, id, offset, maxbytes, data, size);
+#endif
+}
+
+void Invalidate_Read_Cache(mtpdevice_t device, uint32_t const id) {
+    read_cache_t::forDevice(device.m_device)->invalidate(id);
+}
+
+/**
+ * Caps the memory held by the read cache of a device; 0 restores the
+ * default.
+ */
+void Set_Read_Cache_Capacity(mtpdevice_t device, uint64_t const capacity) {
+    read_cache_t::forDevice(device.m_device)->setCapacity(capacity);
+}
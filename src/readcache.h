@@ -0,0 +1,110 @@
+#ifndef MTP_READCACHE_H
+#define MTP_READCACHE_H
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "libmtp.h"
+#include "mtp.h"
+
+typedef std::shared_ptr <std::vector<unsigned char>> read_block_t;
+
+/**
+ * Per-device cache in front of ranged reads.
+ *
+ * Objects are read in aligned blocks of BLOCK_SIZE bytes which are kept in
+ * memory up to a byte capacity, least recently used first out, so the many
+ * small reads of a preview or EXIF scanner turn into a few partial object
+ * requests. Object sizes are cached as well, so a read only needs the
+ * device for blocks it has not seen yet. When a reader moves sequentially
+ * through an object, the following blocks are prefetched as bulk tasks on
+ * the device executor, where any interactive request overtakes them.
+ */
+class read_cache_t : public std::enable_shared_from_this<read_cache_t> {
+public:
+    static const uint32_t BLOCK_SIZE = 256 * 1024;
+    static const uint64_t DEFAULT_CAPACITY = 32 * 1024 * 1024;
+    static const uint32_t READ_AHEAD_BLOCKS = 4;
+
+    static std::shared_ptr <read_cache_t> forDevice(LIBMTP_mtpdevice_t *device);
+
+    static void release(LIBMTP_mtpdevice_t *device);
+
+    read_cache_t();
+
+    /**
+     * Reads up to `length` bytes at `offset`. Returns the number of bytes
+     * read, or -1. The caller holds the device.
+     */
+    int64_t read(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, unsigned char *data, uint32_t length);
+
+    /**
+     * Forgets the size and the blocks of an object which changed or was
+     * deleted.
+     */
+    void invalidate(uint32_t id);
+
+    void setCapacity(uint64_t capacity);
+
+    /**
+     * Reads one block from the device unless it is cached already; used by
+     * the read-ahead. The caller holds the device.
+     */
+    void prefetch(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t index);
+
+private:
+    struct cached_block_t {
+        read_block_t data;
+        std::list <uint64_t>::iterator use;
+    };
+
+    /* where the last read of an object ended, and how many reads in a row were sequential */
+    struct stream_t {
+        stream_t() : end(0), run(0), ahead(0) {}
+
+        uint64_t end;
+        uint32_t run;
+        uint64_t ahead;
+    };
+
+    static uint64_t keyOf(uint32_t id, uint64_t index) { return ((uint64_t) id << 32) | index; }
+
+    bool objectSize(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t &size);
+
+    read_block_t block(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t index, uint64_t size);
+
+    read_block_t fetch(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t index, uint64_t size);
+
+    void store(uint32_t id, uint64_t index, read_block_t data);
+
+    void readAhead(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, uint64_t end, uint64_t size);
+
+    std::mutex m_mx;
+    uint64_t m_capacity;
+    uint64_t m_bytes;
+    std::list <uint64_t> m_uses;
+    std::unordered_map <uint64_t, cached_block_t> m_blocks;
+    std::unordered_map <uint32_t, uint64_t> m_sizes;
+    std::unordered_map <uint32_t, stream_t> m_streams;
+    std::unordered_set <uint64_t> m_pending;
+};
+
+/**
+ * Reads a part of an object of a known size. When the addon is built
+ * against a libmtp with LIBMTP_GetPartialObject_Sized() (see
+ * MTP_HAVE_PARTIAL_SIZED), this is a single PTP transaction; otherwise
+ * libmtp looks the size up again on every call.
+ */
+int GetPartialObjectSized(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, uint32_t maxbytes,
+                          uint64_t filesize, unsigned char **data, unsigned int *size);
+
+void Invalidate_Read_Cache(mtpdevice_t device, uint32_t const id);
+
+void Set_Read_Cache_Capacity(mtpdevice_t device, uint64_t const capacity);
+
+#endif
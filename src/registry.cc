@@ -0,0 +1,162 @@
+#include "registry.h"
+
+#include "executor.h"
+#include "ratelimit.h"
+#include "readcache.h"
+
+static const uint32_t GENERATION_MASK = (1u << (32 - device_registry_t::INDEX_BITS)) - 1;
+
+static uint32_t MakeHandle(uint32_t index, uint32_t generation) {
+    return (generation << device_registry_t::INDEX_BITS) | index;
+}
+
+device_registry_t &device_registry_t::instance() {
+    static device_registry_t registry;
+    return registry;
+}
+
+/* generation 0 is never used, so neither is handle 0 */
+device_registry_t::device_registry_t() {
+    for (uint32_t i = 0; i < MAX_DEVICES; i++) {
+        m_slots[i].state.store((uint64_t) 1 << 32);
+        m_slots[i].device.store(nullptr);
+        m_slots[i].busLocation = 0;
+        m_slots[i].devnum = 0;
+        m_slots[i].cached = false;
+    }
+}
+
+/**
+ * Opening is done under the lock, so two workers opening the same device
+ * at once end up sharing it.
+ */
+LIBMTP_mtpdevice_t *device_registry_t::open(LIBMTP_raw_device_t *rawDevice, bool cached, uint32_t &handle) {
+    std::lock_guard <std::mutex> lk(m_mx);
+    slot_t *free = nullptr;
+    uint32_t index = 0;
+
+    handle = 0;
+
+    for (uint32_t i = 0; i < MAX_DEVICES; i++) {
+        slot_t &slot = m_slots[i];
+        LIBMTP_mtpdevice_t *device = slot.device.load();
+
+        if (nullptr == device) {
+            if (nullptr == free) {
+                free = &slot;
+                index = i;
+            }
+            continue;
+        }
+
+        if (slot.busLocation == rawDevice->bus_location && slot.devnum == rawDevice->devnum) {
+            uint32_t shared = MakeHandle(i, (uint32_t) (slot.state.load() >> 32));
+
+            // the open device cannot change its cache mode for this caller
+            if (slot.cached != cached) {
+                return nullptr;
+            }
+
+            // without references the device is about to be released, still claimed
+            if (nullptr == retain(shared)) {
+                return nullptr;
+            }
+
+            handle = shared;
+            return device;
+        }
+    }
+
+    if (nullptr == free) {
+        return nullptr;
+    }
+
+    LIBMTP_mtpdevice_t *device = cached ? LIBMTP_Open_Raw_Device(rawDevice)
+                                        : LIBMTP_Open_Raw_Device_Uncached(rawDevice);
+
+    if (nullptr == device) {
+        return nullptr;
+    }
+
+    uint32_t generation = (uint32_t) (free->state.load() >> 32);
+
+    free->busLocation = rawDevice->bus_location;
+    free->devnum = rawDevice->devnum;
+    free->cached = cached;
+    free->device.store(device, std::memory_order_release);
+    free->state.store(((uint64_t) generation << 32) | 1, std::memory_order_release);
+
+    handle = MakeHandle(index, generation);
+
+    return device;
+}
+
+LIBMTP_mtpdevice_t *device_registry_t::retain(uint32_t handle) {
+    slot_t &slot = m_slots[handle & (MAX_DEVICES - 1)];
+    uint64_t generation = handle >> INDEX_BITS;
+    uint64_t state = slot.state.load(std::memory_order_acquire);
+
+    do {
+        if ((state >> 32) != generation || 0 == (uint32_t) state) {
+            return nullptr;
+        }
+    } while (!slot.state.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel,
+                                               std::memory_order_acquire));
+
+    return slot.device.load(std::memory_order_acquire);
+}
+
+uint32_t device_registry_t::retain(LIBMTP_mtpdevice_t *device) {
+    if (nullptr == device) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < MAX_DEVICES; i++) {
+        slot_t &slot = m_slots[i];
+
+        if (slot.device.load(std::memory_order_acquire) == device) {
+            uint32_t handle = MakeHandle(i, (uint32_t) (slot.state.load(std::memory_order_acquire) >> 32));
+            return nullptr != retain(handle) ? handle : 0;
+        }
+    }
+
+    return 0;
+}
+
+void device_registry_t::release(uint32_t handle) {
+    slot_t &slot = m_slots[handle & (MAX_DEVICES - 1)];
+    uint64_t generation = handle >> INDEX_BITS;
+    uint64_t state = slot.state.load(std::memory_order_acquire);
+
+    do {
+        if ((state >> 32) != generation || 0 == (uint32_t) state) {
+            return;
+        }
+    } while (!slot.state.compare_exchange_weak(state, state - 1, std::memory_order_acq_rel,
+                                               std::memory_order_acquire));
+
+    if (1 == (uint32_t) state) {
+        close(slot, (uint32_t) generation);
+    }
+}
+
+/**
+ * Releases the device of a slot which lost its last reference; no retain()
+ * succeeds any more. Every scheduled task holds a reference until it is
+ * done, so the executor is idle and stopping it does not wait for a step.
+ * The slot keeps its device until it is released, so open() neither hands
+ * the device out nor reuses the slot meanwhile.
+ */
+void device_registry_t::close(slot_t &slot, uint32_t generation) {
+    LIBMTP_mtpdevice_t *device = slot.device.load();
+    uint32_t next = (generation + 1) & GENERATION_MASK;
+
+    device_executor_t::release(device);
+    token_bucket_t::release(device);
+    read_cache_t::release(device);
+    LIBMTP_Release_Device(device);
+
+    std::lock_guard <std::mutex> lk(m_mx);
+    slot.device.store(nullptr);
+    slot.state.store((uint64_t) (0 == next ? 1 : next) << 32, std::memory_order_release);
+}
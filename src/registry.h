@@ -0,0 +1,79 @@
+#ifndef MTP_REGISTRY_H
+#define MTP_REGISTRY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+#include "libmtp.h"
+
+/**
+ * The devices open in this process, shared by every JS environment which
+ * loads the addon.
+ *
+ * Opening a device which is open already, in the same or in another worker,
+ * hands out the open one instead of claiming its USB interface a second
+ * time. Devices are known by handles: the index of a slot and the
+ * generation of the slot at the time the device was opened, so the handle
+ * of a released device never matches the device opened in its slot later.
+ * Every reference, held by a mtpdevice_t, is counted and the device is
+ * released along with the last one.
+ *
+ * Taking and dropping references does not lock: the generation and the
+ * count of a slot share one atomic word. Only opening a device and
+ * claiming or freeing a slot take the lock; a device is released outside
+ * of it, with its slot still claimed.
+ */
+class device_registry_t {
+public:
+    static const uint32_t INDEX_BITS = 8;
+    static const uint32_t MAX_DEVICES = 1 << INDEX_BITS;
+
+    static device_registry_t &instance();
+
+    /**
+     * Opens the device, or takes another reference to it if it is open. The
+     * handle of the reference is stored in `handle`; returns nullptr if the
+     * device cannot be opened, is being released or is open with the other
+     * cache mode.
+     */
+    LIBMTP_mtpdevice_t *open(LIBMTP_raw_device_t *rawDevice, bool cached, uint32_t &handle);
+
+    /**
+     * Takes another reference to the device with the given handle, or
+     * returns nullptr if the handle is stale.
+     */
+    LIBMTP_mtpdevice_t *retain(uint32_t handle);
+
+    /**
+     * Takes another reference to an open device, as the scheduler does for
+     * each task. Returns the handle of the reference, 0 if the device is not
+     * open or being released.
+     */
+    uint32_t retain(LIBMTP_mtpdevice_t *device);
+
+    /**
+     * Drops one reference, releasing the device with the last one. Stale
+     * handles are ignored.
+     */
+    void release(uint32_t handle);
+
+private:
+    struct slot_t {
+        /* the generation in the upper half, the number of references in the lower */
+        std::atomic <uint64_t> state;
+        std::atomic <LIBMTP_mtpdevice_t *> device;
+        uint32_t busLocation;
+        uint8_t devnum;
+        bool cached;
+    };
+
+    device_registry_t();
+
+    void close(slot_t &slot, uint32_t generation);
+
+    std::mutex m_mx;
+    slot_t m_slots[MAX_DEVICES];
+};
+
+#endif
@@ -0,0 +1,408 @@
+#include "scan.h"
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "dispatcher.h"
+#include "fileio.h"
+
+static const uint32_t DEFAULT_SCAN_THREADS = 8;
+
+/* a getdents64 batch; large enough for a few hundred names */
+static const size_t DIRENT_BUFFER = 64 * 1024;
+
+struct scan_entry_t {
+    scan_entry_t() : size(0), folder(false), child(0) {}
+
+    std::string name;
+    uint64_t size;
+    bool folder;
+    /* the scanned folder of a subfolder entry, 0 if it was not scanned */
+    size_t child;
+};
+
+struct scan_folder_t {
+    std::string path;
+    std::vector <scan_entry_t> entries;
+};
+
+static std::string JoinPath(const std::string &parent, const std::string &name) {
+    return !parent.empty() && '/' == parent[parent.size() - 1] ? parent + name : parent + "/" + name;
+}
+
+static bool ByName(const scan_entry_t &a, const scan_entry_t &b) {
+    return a.name < b.name;
+}
+
+static bool StartsWith(const std::string &name, const char *prefix) {
+    return 0 == name.compare(0, strlen(prefix), prefix);
+}
+
+/**
+ * The names the junk package flags, which listLocalFileTree leaves out.
+ */
+static bool IsJunk(const std::string &name) {
+    size_t length = name.size();
+
+    return "npm-debug.log" == name || ".DS_Store" == name || ".AppleDouble" == name || ".LSOverride" == name ||
+           "Icon\r" == name || "__MACOSX" == name || "Thumbs.db" == name || "ehthumbs.db" == name ||
+           "Desktop.ini" == name || ".Spotlight-V100" == name || StartsWith(name, "._") ||
+           std::string::npos != name.find(".Trashes") || (length > 0 && '~' == name[length - 1]) ||
+           (length >= 5 && 0 == name.compare(length - 5, 5, "@eaDir")) ||
+           (length >= 5 && '.' == name[0] && 0 == name.compare(length - 4, 4, ".swp"));
+}
+
+#ifndef _WIN32
+/**
+ * Fills in a directory entry of `dirfd`. Only the size of a file needs a
+ * stat call, and only where the file system reports no entry type.
+ */
+static bool StatEntry(int dirfd, const char *name, unsigned char type, scan_entry_t &entry) {
+    if (DT_DIR == type) {
+        entry.folder = true;
+    } else if (DT_REG == type || DT_UNKNOWN == type) {
+#if defined(__linux__) && defined(STATX_SIZE)
+        struct statx st;
+
+        if (0 != statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE, &st)) {
+            return false;
+        }
+
+        mode_t mode = st.stx_mode;
+        uint64_t size = st.stx_size;
+#else
+        struct stat st;
+
+        if (0 != fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+            return false;
+        }
+
+        mode_t mode = st.st_mode;
+        uint64_t size = (uint64_t) st.st_size;
+#endif
+        if (!S_ISDIR(mode) && !S_ISREG(mode)) {
+            return false;
+        }
+
+        entry.folder = S_ISDIR(mode);
+        entry.size = entry.folder ? 0 : size;
+    } else {
+        return false;
+    }
+
+    entry.name = name;
+
+    return 0 == faccessat(dirfd, name, R_OK | W_OK, 0);
+}
+#endif
+
+/**
+ * Reads the entries of one folder. Returns false if it cannot be read.
+ */
+static bool ListFolder(const std::string &path, std::vector <scan_entry_t> &entries) {
+#ifdef _WIN32
+    struct _finddata64_t data;
+    intptr_t handle = _findfirst64((path + "/*").c_str(), &data);
+
+    if (-1 == handle) {
+        return false;
+    }
+
+    do {
+        scan_entry_t entry;
+        entry.name = data.name;
+        entry.folder = 0 != (data.attrib & _A_SUBDIR);
+
+        // the read-only attribute of a folder does not protect its content
+        if ("." == entry.name || ".." == entry.name || IsJunk(entry.name) ||
+            (!entry.folder && 0 != (data.attrib & _A_RDONLY))) {
+            continue;
+        }
+
+        entry.size = entry.folder ? 0 : (uint64_t) data.size;
+        entries.push_back(entry);
+    } while (0 == _findnext64(handle, &data));
+
+    _findclose(handle);
+
+    return true;
+#else
+    int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirfd < 0) {
+        return false;
+    }
+
+#ifdef __linux__
+    std::vector <char> buffer(DIRENT_BUFFER);
+
+    for (;;) {
+        long got = syscall(SYS_getdents64, dirfd, buffer.data(), buffer.size());
+
+        if (got <= 0) {
+            close(dirfd);
+            return 0 == got;
+        }
+
+        // struct linux_dirent64: inode, offset, record length, type, name
+        for (long pos = 0; pos < got;) {
+            const char *record = buffer.data() + pos;
+            unsigned short length;
+
+            memcpy(&length, record + 16, sizeof(length));
+            pos += length;
+
+            const char *name = record + 19;
+            scan_entry_t entry;
+
+            if (0 == strcmp(name, ".") || 0 == strcmp(name, "..") || IsJunk(name) ||
+                !StatEntry(dirfd, name, (unsigned char) record[18], entry)) {
+                continue;
+            }
+
+            entries.push_back(entry);
+        }
+    }
+#else
+    DIR *dir = fdopendir(dirfd);
+
+    if (nullptr == dir) {
+        close(dirfd);
+        return false;
+    }
+
+    for (struct dirent *ent = readdir(dir); nullptr != ent; ent = readdir(dir)) {
+        scan_entry_t entry;
+
+        if (0 == strcmp(ent->d_name, ".") || 0 == strcmp(ent->d_name, "..") || IsJunk(ent->d_name) ||
+            !StatEntry(dirfd, ent->d_name, ent->d_type, entry)) {
+            continue;
+        }
+
+        entries.push_back(entry);
+    }
+
+    closedir(dir);
+
+    return true;
+#endif
+#endif
+}
+
+class local_scanner_t {
+public:
+    local_scanner_t(const std::string &root, bool recursive, uint32_t threads) :
+            m_recursive(recursive), m_pending(1), m_queued(1), m_failed(false) {
+        for (uint32_t i = 0; i < (threads ? threads : DEFAULT_SCAN_THREADS); i++) {
+            m_queues.push_back(std::unique_ptr<queue_t>(new queue_t()));
+        }
+
+        std::string::size_type end = root.find_last_not_of("/\\");
+
+        m_folders.push_back(scan_folder_t());
+        m_folders.back().path = std::string::npos == end ? root.substr(0, 1) : root.substr(0, end + 1);
+        m_queues[0]->folders.push_back(0);
+    }
+
+    bool run(std::vector <tree_item_t> &items) {
+        std::vector <std::thread> workers;
+
+        for (size_t i = 1; i < m_queues.size(); i++) {
+            workers.push_back(std::thread(&local_scanner_t::work, this, i));
+        }
+
+        work(0);
+
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        if (m_failed) {
+            return false;
+        }
+
+        flatten(0, -1, items);
+
+        return true;
+    }
+
+private:
+    struct queue_t {
+        std::mutex mx;
+        std::deque <size_t> folders;
+    };
+
+    void work(size_t self) {
+        for (;;) {
+            size_t index;
+
+            if (take(self, index)) {
+                scan(self, index);
+                continue;
+            }
+
+            std::unique_lock <std::mutex> lk(m_mx);
+
+            m_cv.wait(lk, [this] { return m_queued > 0 || 0 == m_pending || m_failed; });
+
+            if (0 == m_pending || m_failed) {
+                return;
+            }
+        }
+    }
+
+    /**
+     * Takes the folder queued last by this thread, which keeps its walk
+     * depth first, or else steals the oldest folder of another thread,
+     * which tends to be the root of a large subtree.
+     */
+    bool take(size_t self, size_t &index) {
+        for (size_t i = 0; i < m_queues.size(); i++) {
+            queue_t &queue = *m_queues[(self + i) % m_queues.size()];
+            std::unique_lock <std::mutex> lk(queue.mx);
+
+            if (queue.folders.empty()) {
+                continue;
+            }
+
+            if (0 == i) {
+                index = queue.folders.back();
+                queue.folders.pop_back();
+            } else {
+                index = queue.folders.front();
+                queue.folders.pop_front();
+            }
+
+            lk.unlock();
+
+            std::lock_guard <std::mutex> counters(m_mx);
+            m_queued--;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    void scan(size_t self, size_t index) {
+        scan_folder_t *folder;
+
+        // deque elements stay put while other threads append folders
+        {
+            std::lock_guard <std::mutex> lk(m_mx);
+            folder = &m_folders[index];
+        }
+
+        std::vector <scan_entry_t> entries;
+        bool ok = ListFolder(folder->path, entries);
+        std::vector <size_t> children;
+
+        std::sort(entries.begin(), entries.end(), ByName);
+
+        {
+            std::lock_guard <std::mutex> lk(m_mx);
+
+            if (!ok) {
+                m_failed = true;
+                m_cv.notify_all();
+                return;
+            }
+
+            for (scan_entry_t &entry : entries) {
+                if (!entry.folder || !m_recursive) {
+                    continue;
+                }
+
+                entry.child = m_folders.size();
+                m_folders.push_back(scan_folder_t());
+                m_folders.back().path = JoinPath(folder->path, entry.name);
+                children.push_back(entry.child);
+            }
+
+            folder->entries.swap(entries);
+            m_pending += children.size();
+        }
+
+        {
+            std::lock_guard <std::mutex> lk(m_queues[self]->mx);
+
+            // the first child ends up at the back, so it is scanned next
+            m_queues[self]->folders.insert(m_queues[self]->folders.end(), children.rbegin(), children.rend());
+        }
+
+        std::lock_guard <std::mutex> lk(m_mx);
+
+        m_queued += (int64_t) children.size();
+        m_pending--;
+        m_cv.notify_all();
+    }
+
+    void flatten(size_t index, int32_t parent, std::vector <tree_item_t> &items) {
+        scan_folder_t &folder = m_folders[index];
+
+        for (scan_entry_t &entry : folder.entries) {
+            tree_item_t item;
+            item.setName(entry.name);
+            item.setPath(JoinPath(folder.path, entry.name));
+            item.setParent(parent);
+            item.setIsFolder(entry.folder);
+            item.setSize(entry.size);
+
+            items.push_back(item);
+
+            if (0 != entry.child) {
+                flatten(entry.child, (int32_t) (items.size() - 1), items);
+            }
+        }
+    }
+
+    bool m_recursive;
+    std::vector <std::unique_ptr<queue_t>> m_queues;
+    std::mutex m_mx;
+    std::condition_variable m_cv;
+    std::deque <scan_folder_t> m_folders;
+    /* folders queued or being scanned */
+    size_t m_pending;
+    /* may dip below zero while a thread steals a folder not counted yet */
+    int64_t m_queued;
+    bool m_failed;
+};
+
+void Scan_Local_Tree(std::string root, bool const recursive, uint32_t const threads, js_function_t &cb) {
+    std::shared_ptr <js_function_t> done = MakeJsCallback(cb);
+    bool deep = recursive;
+    uint32_t count = threads;
+
+    std::shared_ptr <js_dispatcher_t> dispatcher = done->getDispatcher();
+
+    if (dispatcher) {
+        dispatcher->hold();
+    }
+
+    std::thread([root, deep, count, done, dispatcher] {
+        std::shared_ptr <std::vector<tree_item_t>> items = std::make_shared<std::vector<tree_item_t>>();
+        local_scanner_t scanner(root, deep, count);
+        int error = scanner.run(*items) ? (int) LIBMTP_ERROR_NONE : (int) LIBMTP_ERROR_GENERAL;
+
+        if (dispatcher) {
+            dispatcher->post([done, error, items, dispatcher] {
+                (*done)(error, *items);
+                dispatcher->unhold();
+            });
+        }
+    }).detach();
+}
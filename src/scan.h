@@ -0,0 +1,26 @@
+#ifndef MTP_SCAN_H
+#define MTP_SCAN_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "binding.h"
+#include "tree.h"
+
+/**
+ * Lists the local tree below `root` on a pool of `threads` scanner threads
+ * (0 for the default), one folder at a time. Each thread works through its
+ * own folder queue and steals from the other queues when it runs dry, so
+ * one huge folder does not keep the other threads idle.
+ *
+ * Calls back on the JS thread with cb(error, items), where `items` is the
+ * flattened tree Schedule_Upload_Tree takes: folders precede their content,
+ * names within a folder are sorted. Junk files, entries the user cannot
+ * read and write, and anything but regular files and folders are left
+ * out; symbolic links are not followed. A folder which cannot be read
+ * fails the scan.
+ */
+void Scan_Local_Tree(std::string root, bool const recursive, uint32_t const threads, js_function_t &cb);
+
+#endif
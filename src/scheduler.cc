@@ -0,0 +1,490 @@
+#include "scheduler.h"
+
+#include <stdlib.h>
+#include <memory>
+#include <vector>
+
+#include "checksum.h"
+#include "dispatcher.h"
+#include "executor.h"
+#include "fileio.h"
+#include "filetype.h"
+#include "ratelimit.h"
+#include "readcache.h"
+
+static uint16_t EmptyDataGet(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen) {
+    *gotlen = 0;
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+class list_task_t : public scheduler_task_t {
+public:
+    list_task_t(int priority, uint32_t storage, uint32_t parent, abort_token_t token,
+                std::shared_ptr <js_function_t> cb) : scheduler_task_t(priority, 1), m_storage(storage),
+                                                          m_parent(parent), m_token(token), m_cb(cb) {}
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_token.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        std::vector <file_t> files;
+
+        {
+            device_guard_t guard(device, getPriority());
+            files = Get_Files_And_Folders(mtpdevice_t(device), m_storage, m_parent);
+        }
+
+        if (m_token.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        finish([cb, files] { (*cb)((int) LIBMTP_ERROR_NONE, files); });
+
+        return true;
+    }
+
+    void fail(int error) override {
+        std::shared_ptr <js_function_t> cb = m_cb;
+        finish([cb, error] { (*cb)(error, std::vector<file_t>()); });
+    }
+
+private:
+    uint32_t m_storage;
+    uint32_t m_parent;
+    abort_token_t m_token;
+    std::shared_ptr <js_function_t> m_cb;
+};
+
+class metadata_task_t : public scheduler_task_t {
+public:
+    metadata_task_t(int priority, uint32_t id, std::shared_ptr <js_function_t> cb) :
+            scheduler_task_t(priority, 1), m_id(id), m_cb(cb) {}
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        LIBMTP_file_t *meta;
+
+        {
+            device_guard_t guard(device, getPriority());
+            meta = LIBMTP_Get_Filemetadata(device, m_id);
+        }
+
+        if (nullptr == meta) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        file_t file(meta);
+        LIBMTP_destroy_file_t(meta);
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        finish([cb, file] { (*cb)((int) LIBMTP_ERROR_NONE, file); });
+
+        return true;
+    }
+
+    void fail(int error) override {
+        std::shared_ptr <js_function_t> cb = m_cb;
+        finish([cb, error] { (*cb)(error, file_t()); });
+    }
+
+private:
+    uint32_t m_id;
+    std::shared_ptr <js_function_t> m_cb;
+};
+
+/**
+ * Downloads an object in GetPartialObject sized chunks, so the device is
+ * free for more urgent requests between two chunks. Devices without partial
+ * reads fall back to a single, non-preemptible transfer.
+ */
+class download_task_t : public scheduler_task_t {
+public:
+    download_task_t(uint32_t weight, uint32_t id, const std::string &path, transfer_job_t job, uint32_t chunkSize,
+                    std::shared_ptr <js_function_t> cb) : scheduler_task_t(PRIORITY_BULK, weight), m_id(id),
+                                                              m_path(path), m_job(job), m_chunkSize(chunkSize),
+                                                              m_cb(cb), m_fd(-1), m_started(false), m_size(0),
+                                                              m_offset(0), m_sum(job.getChecksum()) {}
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_job.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        if (!m_started) {
+            return start(device);
+        }
+
+        unsigned char *data = nullptr;
+        unsigned int size = 0;
+        int ret;
+
+        {
+            device_guard_t guard(device, getPriority());
+            ret = GetPartialObjectSized(device, m_id, m_offset, m_chunkSize, m_size, &data, &size);
+        }
+
+        bool written = 0 == ret && size > 0 && WriteFully(m_fd, data, size);
+
+        if (written) {
+            m_sum.update(data, size);
+        }
+        free(data);
+
+        if (!written) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_offset += size;
+        m_job.progress(m_offset, m_size);
+
+        if (m_offset < m_size) {
+            defer(ReserveTransfer(device, m_job, size));
+            return false;
+        }
+
+        complete(0);
+
+        return true;
+    }
+
+    void fail(int error) override {
+        if (m_fd >= 0) {
+            CloseFile(m_fd);
+            RemoveFile(m_path.c_str());
+            m_fd = -1;
+        }
+        if (m_started) {
+            m_job.endFile(false);
+        }
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        finish([cb, error] { (*cb)(error); });
+    }
+
+private:
+    bool start(LIBMTP_mtpdevice_t *device) {
+        bool partial;
+
+        {
+            device_guard_t guard(device, getPriority());
+            LIBMTP_file_t *meta = LIBMTP_Get_Filemetadata(device, m_id);
+
+            if (nullptr == meta || LIBMTP_FILETYPE_FOLDER == meta->filetype) {
+                LIBMTP_destroy_file_t(meta);
+                fail(LIBMTP_ERROR_GENERAL);
+                return true;
+            }
+
+            m_size = meta->filesize;
+            LIBMTP_destroy_file_t(meta);
+
+            partial = 0 != LIBMTP_Check_Capability(device, LIBMTP_DEVICECAP_GetPartialObject);
+        }
+
+        m_fd = OpenFileForWrite(m_path.c_str());
+        if (m_fd < 0) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_started = true;
+        m_job.beginFile();
+
+        if (partial && m_size > m_chunkSize) {
+            return false;
+        }
+
+        shaped_progress_t shaped(device, m_job);
+        int ret;
+
+        {
+            device_guard_t guard(device, getPriority());
+
+            if (m_sum.enabled()) {
+                ret = GetFileToDescriptorChecksummed(device, m_id, m_fd, m_job, m_sum);
+            } else {
+                ret = LIBMTP_Get_File_To_File_Descriptor(device, m_id, m_fd, ShapedProgressCallback,
+                                                         (const void *) &shaped);
+            }
+        }
+
+        if (0 != ret) {
+            fail(m_job.isAborted() ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        complete(0);
+
+        return true;
+    }
+
+    void complete(int error) {
+        CloseFile(m_fd);
+        m_fd = -1;
+
+        if (m_sum.enabled()) {
+            m_job.setDigest(m_sum.hexDigest());
+        }
+        m_job.endFile(true);
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        finish([cb, error] { (*cb)(error); });
+    }
+
+    uint32_t m_id;
+    std::string m_path;
+    transfer_job_t m_job;
+    uint32_t m_chunkSize;
+    std::shared_ptr <js_function_t> m_cb;
+    int m_fd;
+    bool m_started;
+    uint64_t m_size;
+    uint64_t m_offset;
+    checksum_t m_sum;
+};
+
+/**
+ * Uploads a local file in chunks through the Android edit object extension:
+ * an empty object is created first and then filled with SendPartialObject.
+ * Other devices get a single, non-preemptible transfer.
+ */
+class upload_task_t : public scheduler_task_t {
+public:
+    upload_task_t(uint32_t weight, const std::string &path, file_t filedata, transfer_job_t job, uint32_t chunkSize,
+                  std::shared_ptr <js_function_t> cb) : scheduler_task_t(PRIORITY_BULK, weight), m_path(path),
+                                                            m_file(filedata), m_job(job), m_chunkSize(chunkSize),
+                                                            m_cb(cb), m_device(nullptr), m_fd(-1), m_started(false),
+                                                            m_editing(false), m_size(0), m_offset(0),
+                                                            m_sum(job.getChecksum()) {}
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_job.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        if (!m_started) {
+            return start(device);
+        }
+
+        uint64_t left = m_size - m_offset;
+        int64_t length = ReadFully(m_fd, m_buffer.data(), left < m_chunkSize ? left : m_chunkSize);
+
+        if (length <= 0) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        int ret;
+
+        {
+            device_guard_t guard(device, getPriority());
+            ret = LIBMTP_SendPartialObject(device, m_file.getId(), m_offset, m_buffer.data(),
+                                           (unsigned int) length);
+        }
+
+        if (0 != ret) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_sum.update(m_buffer.data(), (size_t) length);
+        m_offset += length;
+        m_job.progress(m_offset, m_size);
+
+        if (m_offset < m_size) {
+            defer(ReserveTransfer(device, m_job, length));
+            return false;
+        }
+
+        {
+            device_guard_t guard(device, getPriority());
+            ret = LIBMTP_EndEditObject(device, m_file.getId());
+        }
+        m_editing = false;
+
+        if (0 != ret) {
+            discard(device);
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_file.setSize(m_size);
+        complete(0);
+
+        return true;
+    }
+
+    void fail(int error) override {
+        if (m_editing) {
+            // the executor only fails tasks between two steps, so the device is idle
+            discard(m_device);
+        }
+        if (m_fd >= 0) {
+            CloseFile(m_fd);
+            m_fd = -1;
+        }
+        if (m_started) {
+            m_job.endFile(false);
+        }
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        file_t file = m_file;
+        finish([cb, error, file] { (*cb)(error, file); });
+    }
+
+private:
+    bool start(LIBMTP_mtpdevice_t *device) {
+        m_device = device;
+        m_fd = OpenFileForRead(m_path.c_str());
+
+        int64_t size = m_fd >= 0 ? FileSize(m_fd) : -1;
+        if (size < 0) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        if (LIBMTP_FILETYPE_UNKNOWN == m_file.getType()) {
+            m_file.setType(ClassifyFileDescriptor(m_file.getName(), m_fd));
+        }
+
+        m_size = (uint64_t) size;
+        m_started = true;
+        m_job.beginFile();
+
+        bool partial = false;
+
+        if (m_size > m_chunkSize) {
+            device_guard_t guard(device, getPriority());
+            partial = 0 != LIBMTP_Check_Capability(device, LIBMTP_DEVICECAP_SendPartialObject) &&
+                      0 != LIBMTP_Check_Capability(device, LIBMTP_DEVICECAP_EditObjects);
+
+            if (partial) {
+                m_file.setSize(0);
+
+                partial = 0 == LIBMTP_Send_File_From_Handler(device, EmptyDataGet, nullptr, m_file.get(), nullptr,
+                                                             nullptr);
+
+                if (partial) {
+                    m_editing = 0 == LIBMTP_BeginEditObject(device, m_file.getId());
+
+                    if (!m_editing) {
+                        LIBMTP_Delete_Object(device, m_file.getId());
+                        partial = false;
+                    }
+                }
+
+                LIBMTP_Clear_Errorstack(device);
+            }
+        }
+
+        if (partial) {
+            m_buffer.resize(m_chunkSize);
+            return false;
+        }
+
+        m_file.setSize(m_size);
+
+        shaped_progress_t shaped(device, m_job);
+        int ret;
+
+        {
+            device_guard_t guard(device, getPriority());
+            if (m_sum.enabled()) {
+                ret = SendFileFromDescriptorChecksummed(device, m_fd, m_file.get(), m_job, m_sum);
+            } else {
+                ret = LIBMTP_Send_File_From_File_Descriptor(device, m_fd, m_file.get(), ShapedProgressCallback,
+                                                            (const void *) &shaped);
+            }
+
+            if (0 != ret && m_job.isAborted() && 0 != m_file.getId()) {
+                LIBMTP_Delete_Object(device, m_file.getId());
+            }
+        }
+
+        if (0 != ret) {
+            fail(m_job.isAborted() ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        complete(0);
+
+        return true;
+    }
+
+    void discard(LIBMTP_mtpdevice_t *device) {
+        device_guard_t guard(device, getPriority());
+
+        if (m_editing) {
+            LIBMTP_EndEditObject(device, m_file.getId());
+            m_editing = false;
+        }
+        LIBMTP_Delete_Object(device, m_file.getId());
+        LIBMTP_Clear_Errorstack(device);
+    }
+
+    void complete(int error) {
+        CloseFile(m_fd);
+        m_fd = -1;
+
+        if (m_sum.enabled()) {
+            m_job.setDigest(m_sum.hexDigest());
+        }
+        m_job.endFile(true);
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        file_t file = m_file;
+        finish([cb, error, file] { (*cb)(error, file); });
+    }
+
+    std::string m_path;
+    file_t m_file;
+    transfer_job_t m_job;
+    uint32_t m_chunkSize;
+    std::shared_ptr <js_function_t> m_cb;
+    LIBMTP_mtpdevice_t *m_device;
+    int m_fd;
+    bool m_started;
+    bool m_editing;
+    uint64_t m_size;
+    uint64_t m_offset;
+    std::vector<unsigned char> m_buffer;
+    checksum_t m_sum;
+};
+
+void Schedule_Get_Files_And_Folders(mtpdevice_t device, uint32_t const storage, uint32_t const parent,
+                                    int const priority, abort_token_t &token, js_function_t &cb) {
+    device_executor_t::forDevice(device.m_device)->submit(
+            std::make_shared<list_task_t>(priority, storage, parent, token, MakeJsCallback(cb)));
+}
+
+void Schedule_Get_Filemetadata(mtpdevice_t device, uint32_t const id, int const priority, js_function_t &cb) {
+    device_executor_t::forDevice(device.m_device)->submit(
+            std::make_shared<metadata_task_t>(priority, id, MakeJsCallback(cb)));
+}
+
+void Schedule_Get_File_To_File(mtpdevice_t device, uint32_t const id, const std::string path, transfer_job_t &job,
+                               uint32_t const weight, js_function_t &cb) {
+    std::shared_ptr <device_executor_t> executor = device_executor_t::forDevice(device.m_device);
+
+    executor->submit(std::make_shared<download_task_t>(weight, id, path, job, executor->getChunkSize(),
+                                                       MakeJsCallback(cb)));
+}
+
+void Schedule_Send_File_From_File(mtpdevice_t device, const std::string path, file_t filedata, transfer_job_t &job,
+                                  uint32_t const weight, js_function_t &cb) {
+    std::shared_ptr <device_executor_t> executor = device_executor_t::forDevice(device.m_device);
+
+    executor->submit(std::make_shared<upload_task_t>(weight, path, filedata, job, executor->getChunkSize(),
+                                                     MakeJsCallback(cb)));
+}
+
+void Set_Scheduler_Chunk_Size(mtpdevice_t device, uint32_t const chunkSize) {
+    device_executor_t::forDevice(device.m_device)->setChunkSize(chunkSize);
+}
@@ -0,0 +1,24 @@
+#ifndef MTP_SCHEDULER_H
+#define MTP_SCHEDULER_H
+
+#include <stdint.h>
+#include <string>
+
+#include "binding.h"
+#include "mtp.h"
+#include "transfer.h"
+
+void Schedule_Get_Files_And_Folders(mtpdevice_t device, uint32_t const storage, uint32_t const parent,
+                                    int const priority, abort_token_t &token, js_function_t &cb);
+
+void Schedule_Get_Filemetadata(mtpdevice_t device, uint32_t const id, int const priority, js_function_t &cb);
+
+void Schedule_Get_File_To_File(mtpdevice_t device, uint32_t const id, const std::string path, transfer_job_t &job,
+                               uint32_t const weight, js_function_t &cb);
+
+void Schedule_Send_File_From_File(mtpdevice_t device, const std::string path, file_t filedata, transfer_job_t &job,
+                                  uint32_t const weight, js_function_t &cb);
+
+void Set_Scheduler_Chunk_Size(mtpdevice_t device, uint32_t const chunkSize);
+
+#endif
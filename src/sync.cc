@@ -0,0 +1,887 @@
+#include "sync.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+#include "checksum.h"
+#include "dispatcher.h"
+#include "executor.h"
+#include "fileio.h"
+#include "filetype.h"
+#include "ratelimit.h"
+#include "tree.h"
+#include "exports.h"
+
+/* FAT keeps modification times with a resolution of two seconds */
+static const time_t MTIME_TOLERANCE = 2;
+
+static const size_t HASH_BLOCK_SIZE = 1024 * 1024;
+
+struct sync_entry_t {
+    sync_entry_t() : id(0), size(0), mtime(0), folder(false) {}
+
+    uint32_t id;
+    uint64_t size;
+    time_t mtime;
+    bool folder;
+};
+
+/* ordered by path, so a folder always precedes its content */
+typedef std::map <std::string, sync_entry_t> sync_tree_t;
+
+struct local_scan_t {
+    local_scan_t() : ok(false), missing(false) {}
+
+    bool ok;
+    bool missing;
+    sync_tree_t entries;
+};
+
+static std::string JoinPath(const std::string &parent, const std::string &name) {
+    return parent.empty() ? name : parent + "/" + name;
+}
+
+static std::string ParentPath(const std::string &path) {
+    std::string::size_type slash = path.rfind('/');
+    return std::string::npos == slash ? std::string() : path.substr(0, slash);
+}
+
+static std::string BaseName(const std::string &path) {
+    std::string::size_type slash = path.rfind('/');
+    return std::string::npos == slash ? path : path.substr(slash + 1);
+}
+
+static bool IsInside(const std::string &path, const std::string &folder) {
+    return !folder.empty() && path.size() > folder.size() && '/' == path[folder.size()] &&
+           0 == path.compare(0, folder.size(), folder);
+}
+
+static bool SameTime(time_t a, time_t b) {
+    return a <= b + MTIME_TOLERANCE && b <= a + MTIME_TOLERANCE;
+}
+
+/**
+ * Lists a local tree with paths relative to `root`. Runs on its own thread
+ * while the device side is being listed. A subfolder which cannot be read
+ * fails the whole scan, so its content is never mistaken for deleted.
+ */
+static local_scan_t ScanLocalTree(std::string root) {
+    local_scan_t scan;
+    std::vector <std::string> pending(1, std::string());
+
+    while (!pending.empty()) {
+        std::string folder = pending.back();
+        pending.pop_back();
+
+        std::string directory = folder.empty() ? root : root + "/" + folder;
+#ifdef _WIN32
+        struct _finddata64_t data;
+        intptr_t handle = _findfirst64((directory + "/*").c_str(), &data);
+
+        if (-1 == handle) {
+            scan.missing = folder.empty() && ENOENT == errno;
+            return scan;
+        }
+
+        do {
+            std::string name = data.name;
+
+            if ("." == name || ".." == name) {
+                continue;
+            }
+
+            sync_entry_t entry;
+            entry.folder = 0 != (data.attrib & _A_SUBDIR);
+            entry.size = entry.folder ? 0 : (uint64_t) data.size;
+            entry.mtime = (time_t) data.time_write;
+
+            std::string path = JoinPath(folder, name);
+            scan.entries[path] = entry;
+
+            if (entry.folder) {
+                pending.push_back(path);
+            }
+        } while (0 == _findnext64(handle, &data));
+
+        _findclose(handle);
+#else
+        DIR *dir = opendir(directory.c_str());
+
+        if (nullptr == dir) {
+            scan.missing = folder.empty() && ENOENT == errno;
+            return scan;
+        }
+
+        for (struct dirent *ent = readdir(dir); nullptr != ent; ent = readdir(dir)) {
+            std::string name = ent->d_name;
+
+            if ("." == name || ".." == name) {
+                continue;
+            }
+
+            std::string path = JoinPath(folder, name);
+            struct stat st;
+
+            if (0 != stat((root + "/" + path).c_str(), &st) || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+                continue;
+            }
+
+            sync_entry_t entry;
+            entry.folder = S_ISDIR(st.st_mode);
+            entry.size = entry.folder ? 0 : (uint64_t) st.st_size;
+            entry.mtime = st.st_mtime;
+
+            scan.entries[path] = entry;
+
+            if (entry.folder) {
+                pending.push_back(path);
+            }
+        }
+
+        closedir(dir);
+#endif
+    }
+
+    scan.ok = true;
+
+    return scan;
+}
+
+static std::pair<bool, std::string> HashLocalFile(std::string path) {
+    std::pair<bool, std::string> result(false, std::string());
+    int fd = OpenFileForRead(path.c_str());
+
+    if (fd < 0) {
+        return result;
+    }
+
+    checksum_t sum(CHECKSUM_XXH64);
+    std::vector<unsigned char> block(HASH_BLOCK_SIZE);
+    int64_t got;
+
+    while ((got = ReadFully(fd, block.data(), block.size())) > 0) {
+        sum.update(block.data(), (size_t) got);
+    }
+
+    CloseFile(fd);
+    result.first = 0 == got;
+    result.second = sum.hexDigest();
+
+    return result;
+}
+
+class device_hash_ctx_t {
+public:
+    device_hash_ctx_t(LIBMTP_mtpdevice_t *device, transfer_job_t &job) : m_device(device), m_job(job),
+                                                                          m_sum(CHECKSUM_XXH64) {}
+
+    LIBMTP_mtpdevice_t *m_device;
+    transfer_job_t &m_job;
+    checksum_t m_sum;
+};
+
+static uint16_t HashDataPut(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen) {
+    device_hash_ctx_t *ctx = (device_hash_ctx_t *) priv;
+
+    if (ctx->m_job.isAborted() || !ThrottleTransfer(ctx->m_device, ctx->m_job, sendlen)) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    ctx->m_sum.update(data, sendlen);
+    *putlen = sendlen;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+/* order of execution: folders first, then renames, transfers and deletions */
+static int ActionRank(int kind) {
+    switch (kind) {
+        case SYNC_ACTION_MKDIR_LOCAL:
+        case SYNC_ACTION_MKDIR_DEVICE:
+            return 0;
+        case SYNC_ACTION_RENAME_LOCAL:
+        case SYNC_ACTION_RENAME_DEVICE:
+            return 1;
+        case SYNC_ACTION_DOWNLOAD:
+        case SYNC_ACTION_UPLOAD:
+            return 2;
+        case SYNC_ACTION_DELETE_LOCAL:
+        case SYNC_ACTION_DELETE_DEVICE:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+static bool ActionBefore(sync_action_t a, sync_action_t b) {
+    int rankA = ActionRank(a.getKind());
+    int rankB = ActionRank(b.getKind());
+
+    if (rankA != rankB) {
+        return rankA < rankB;
+    }
+
+    // the content of a folder is deleted before the folder
+    return 3 == rankA && a.getPath() > b.getPath();
+}
+
+/**
+ * Brings a local folder and a device folder in sync.
+ *
+ * Both sides are listed first, the local one on a separate thread while the
+ * device is listed one folder per step. The listings are compared by size
+ * and modification time (and by content, with SYNC_COMPARE_HASH, when only
+ * the times differ) and turned into a plan:
+ *
+ *  - SYNC_MODE_DOWNLOAD and SYNC_MODE_UPLOAD mirror one side onto the other.
+ *    With SYNC_DELETE_EXTRANEOUS, files only found on the mirror are deleted,
+ *    and a mirror file which matches a missing one is renamed instead of
+ *    transferring it again. Local files are matched by size and time, since
+ *    downloads take over the device time; device files, whose times are set
+ *    by the device, only by content.
+ *  - SYNC_MODE_TWO_WAY copies what is missing on either side and replaces
+ *    the older copy of a changed file. It never deletes. After an upload the
+ *    local file takes over the time of the device copy, so the next sync
+ *    does not copy it back.
+ *
+ * A file facing a folder of the same name, or two changed copies with the
+ * same time, are reported as conflicts and left alone. With SYNC_DRY_RUN
+ * the plan is returned without being executed. Otherwise it is executed one
+ * action per step; local changes go through a write-behind pool so the
+ * executor thread only talks to the device.
+ */
+class sync_task_t : public scheduler_task_t {
+public:
+    sync_task_t(uint32_t weight, const std::string &root, uint32_t storage, uint32_t parent, int mode,
+                uint32_t flags, transfer_job_t job, std::shared_ptr <js_function_t> cb) :
+            scheduler_task_t(PRIORITY_BULK, weight), m_root(root), m_storage(storage), m_mode(mode),
+            m_flags(flags), m_job(job), m_cb(cb), m_phase(PHASE_LIST), m_scanning(false), m_createRoot(false),
+            m_index(0), m_downloadBytes(0), m_uploadBytes(0) {
+        m_folders.push_back(std::string());
+        m_folderIds[std::string()] = parent;
+    }
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_job.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        switch (m_phase) {
+            case PHASE_LIST:
+                return list(device);
+            case PHASE_VERIFY:
+                return verify(device);
+            default:
+                return run(device);
+        }
+    }
+
+    void fail(int error) override {
+        std::shared_ptr <js_function_t> cb = m_cb;
+        std::vector <sync_action_t> plan = m_plan;
+        uint64_t downloadBytes = m_downloadBytes;
+        uint64_t uploadBytes = m_uploadBytes;
+
+        finish([cb, error, plan, downloadBytes, uploadBytes] {
+            (*cb)(error, plan, downloadBytes, uploadBytes);
+        });
+    }
+
+private:
+    enum phase_t {
+        PHASE_LIST,
+        PHASE_VERIFY,
+        PHASE_RUN
+    };
+
+    bool list(LIBMTP_mtpdevice_t *device) {
+        if (!m_scanning) {
+            m_scan = std::async(std::launch::async, ScanLocalTree, m_root);
+            m_scanning = true;
+        }
+
+        if (!m_folders.empty()) {
+            std::string folder = m_folders.front();
+            std::vector <file_t> files;
+
+            m_folders.pop_front();
+
+            {
+                device_guard_t guard(device, getPriority());
+                files = Get_Files_And_Folders(mtpdevice_t(device), m_storage, m_folderIds[folder]);
+            }
+
+            for (file_t &file : files) {
+                std::string path = JoinPath(folder, file.getName());
+                sync_entry_t &entry = m_remote[path];
+
+                entry.id = file.getId();
+                entry.size = file.getSize();
+                entry.mtime = file.getModificationDate();
+                entry.folder = LIBMTP_FILETYPE_FOLDER == file.getType();
+
+                if (entry.folder) {
+                    m_folderIds[path] = entry.id;
+                    m_folders.push_back(path);
+                }
+            }
+
+            return false;
+        }
+
+        local_scan_t scan = m_scan.get();
+
+        // a missing local folder is fine if it is about to be filled
+        if (!scan.ok && !(scan.missing && SYNC_MODE_UPLOAD != m_mode)) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_local.swap(scan.entries);
+        m_createRoot = !scan.ok;
+
+        plan();
+        m_phase = PHASE_VERIFY;
+
+        return false;
+    }
+
+    void add(int kind, const std::string &path, uint32_t id, uint64_t size, bool folder, bool verify = false) {
+        if (verify) {
+            m_verify.push_back(m_plan.size());
+        }
+        m_plan.push_back(sync_action_t(kind, path, id, size, folder));
+    }
+
+    void plan() {
+        bool download = SYNC_MODE_DOWNLOAD == m_mode;
+        bool deleteExtraneous = 0 != (m_flags & SYNC_DELETE_EXTRANEOUS) && SYNC_MODE_TWO_WAY != m_mode;
+        bool compareHash = 0 != (m_flags & SYNC_COMPARE_HASH);
+
+        // files only found on the mirror side, by size, and files missing there
+        std::multimap <uint64_t, std::string> spare;
+        std::vector <size_t> missing;
+        std::string blocked;
+
+        sync_tree_t::iterator r = m_remote.begin();
+        sync_tree_t::iterator l = m_local.begin();
+
+        while (r != m_remote.end() || l != m_local.end()) {
+            sync_entry_t *remote = nullptr;
+            sync_entry_t *local = nullptr;
+            std::string path;
+
+            if (l == m_local.end() || (r != m_remote.end() && r->first < l->first)) {
+                path = r->first;
+                remote = &(r++)->second;
+            } else if (r == m_remote.end() || l->first < r->first) {
+                path = l->first;
+                local = &(l++)->second;
+            } else {
+                path = r->first;
+                remote = &(r++)->second;
+                local = &(l++)->second;
+            }
+
+            if (IsInside(path, blocked)) {
+                continue;
+            }
+
+            if (remote && local && remote->folder != local->folder) {
+                add(SYNC_ACTION_CONFLICT, path, remote->id, 0, remote->folder);
+                blocked = path;
+                continue;
+            }
+
+            if (SYNC_MODE_TWO_WAY == m_mode) {
+                if (!local) {
+                    add(remote->folder ? SYNC_ACTION_MKDIR_LOCAL : SYNC_ACTION_DOWNLOAD, path, remote->id,
+                        remote->size, remote->folder);
+                } else if (!remote) {
+                    add(local->folder ? SYNC_ACTION_MKDIR_DEVICE : SYNC_ACTION_UPLOAD, path, 0, local->size,
+                        local->folder);
+                } else if (!remote->folder && (remote->size != local->size || !SameTime(remote->mtime, local->mtime))) {
+                    bool verify = compareHash && remote->size == local->size;
+
+                    if (SameTime(remote->mtime, local->mtime)) {
+                        add(SYNC_ACTION_CONFLICT, path, remote->id, 0, false);
+                    } else if (remote->mtime > local->mtime) {
+                        add(SYNC_ACTION_DOWNLOAD, path, remote->id, remote->size, false, verify);
+                    } else {
+                        add(SYNC_ACTION_UPLOAD, path, remote->id, local->size, false, verify);
+                    }
+                }
+                continue;
+            }
+
+            sync_entry_t *source = download ? remote : local;
+            sync_entry_t *target = download ? local : remote;
+            uint32_t id = remote ? remote->id : 0;
+
+            if (!source) {
+                if (deleteExtraneous) {
+                    add(download ? SYNC_ACTION_DELETE_LOCAL : SYNC_ACTION_DELETE_DEVICE, path, id, 0, target->folder);
+
+                    if (!target->folder) {
+                        spare.insert(std::make_pair(target->size, path));
+                    }
+                }
+            } else if (!target) {
+                if (source->folder) {
+                    add(download ? SYNC_ACTION_MKDIR_LOCAL : SYNC_ACTION_MKDIR_DEVICE, path, 0, 0, true);
+                } else {
+                    missing.push_back(m_plan.size());
+                    add(download ? SYNC_ACTION_DOWNLOAD : SYNC_ACTION_UPLOAD, path, id, source->size, false);
+                }
+            } else if (!source->folder) {
+                bool changed = download ? !SameTime(source->mtime, target->mtime)
+                                        : source->mtime > target->mtime + MTIME_TOLERANCE;
+
+                if (source->size != target->size || changed) {
+                    add(download ? SYNC_ACTION_DOWNLOAD : SYNC_ACTION_UPLOAD, path, id, source->size, false,
+                        compareHash && source->size == target->size);
+                }
+            }
+        }
+
+        if (download || compareHash) {
+            matchRenames(spare, missing, download);
+        }
+    }
+
+    /**
+     * Turns the transfer of a missing file into the rename of a spare file
+     * found on the mirror side, and drops the deletion of the spare file.
+     */
+    void matchRenames(std::multimap <uint64_t, std::string> &spare, std::vector <size_t> &missing, bool download) {
+        std::unordered_map <std::string, size_t> deletes;
+
+        for (size_t i = 0; i < m_plan.size(); i++) {
+            int kind = m_plan[i].getKind();
+
+            if (SYNC_ACTION_DELETE_LOCAL == kind || SYNC_ACTION_DELETE_DEVICE == kind) {
+                deletes[m_plan[i].getPath()] = i;
+            }
+        }
+
+        std::vector <bool> dropped(m_plan.size(), false);
+
+        for (size_t index : missing) {
+            sync_action_t &action = m_plan[index];
+            std::string path = action.getPath();
+            std::pair<std::multimap<uint64_t, std::string>::iterator, std::multimap<uint64_t, std::string>::iterator>
+                    range = spare.equal_range(action.getSize());
+
+            for (std::multimap<uint64_t, std::string>::iterator it = range.first; it != range.second; ++it) {
+                bool match = download ? SameTime(m_local[it->second].mtime, m_remote[path].mtime)
+                                      : ParentPath(it->second) == ParentPath(path);
+
+                if (!match) {
+                    continue;
+                }
+
+                // a device rename is only trusted once the content matched
+                sync_action_t rename(download ? SYNC_ACTION_RENAME_LOCAL : SYNC_ACTION_RENAME_DEVICE, path,
+                                     download ? action.getId() : m_remote[it->second].id, action.getSize(), false);
+                rename.setFrom(it->second);
+                action = rename;
+
+                if (!download || 0 != (m_flags & SYNC_COMPARE_HASH)) {
+                    m_verify.push_back(index);
+                }
+
+                dropped[deletes[it->second]] = true;
+                spare.erase(it);
+                break;
+            }
+        }
+
+        compact(dropped);
+    }
+
+    void compact(const std::vector <bool> &dropped) {
+        std::vector <size_t> renumbered(m_plan.size());
+        std::vector <sync_action_t> plan;
+
+        for (size_t i = 0; i < m_plan.size(); i++) {
+            renumbered[i] = plan.size();
+
+            if (!dropped[i]) {
+                plan.push_back(m_plan[i]);
+            }
+        }
+
+        for (size_t &index : m_verify) {
+            index = renumbered[index];
+        }
+
+        m_plan.swap(plan);
+    }
+
+    /**
+     * Compares the content of one pair of copies per step. The local copy
+     * is hashed on another thread while the device copy is being read.
+     */
+    bool verify(LIBMTP_mtpdevice_t *device) {
+        if (m_index >= m_verify.size()) {
+            complete();
+            return false;
+        }
+
+        size_t index = m_verify[m_index++];
+        sync_action_t &action = m_plan[index];
+        bool deviceRename = SYNC_ACTION_RENAME_DEVICE == action.getKind();
+        std::string localPath = localPathOf(SYNC_ACTION_RENAME_LOCAL == action.getKind() ? action.getFrom()
+                                                                                     : action.getPath());
+        uint32_t id = action.getId();
+
+        std::future <std::pair<bool, std::string>> local = std::async(std::launch::async, HashLocalFile, localPath);
+        device_hash_ctx_t ctx(device, m_job);
+        int ret;
+
+        {
+            device_guard_t guard(device, getPriority());
+            ret = LIBMTP_Get_File_To_Handler(device, id, HashDataPut, (void *) &ctx, nullptr, nullptr);
+
+            if (0 != ret) {
+                LIBMTP_Clear_Errorstack(device);
+            }
+        }
+
+        std::pair<bool, std::string> localHash = local.get();
+        bool same = 0 == ret && localHash.first && localHash.second == ctx.m_sum.hexDigest();
+
+        if (m_job.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        switch (action.getKind()) {
+            case SYNC_ACTION_DOWNLOAD:
+            case SYNC_ACTION_UPLOAD:
+                if (same) {
+                    m_skipped.insert(index);
+                }
+                break;
+
+            case SYNC_ACTION_RENAME_LOCAL:
+            case SYNC_ACTION_RENAME_DEVICE:
+                if (!same) {
+                    // not the same file after all: transfer it and delete the spare one
+                    std::string from = action.getFrom();
+
+                    action = sync_action_t(deviceRename ? SYNC_ACTION_UPLOAD : SYNC_ACTION_DOWNLOAD, action.getPath(),
+                                           deviceRename ? 0 : id, action.getSize(), false);
+                    add(deviceRename ? SYNC_ACTION_DELETE_DEVICE : SYNC_ACTION_DELETE_LOCAL, from,
+                        deviceRename ? id : 0, 0, false);
+                }
+                break;
+        }
+
+        return false;
+    }
+
+    void complete() {
+        std::vector <bool> dropped(m_plan.size(), false);
+
+        for (size_t index : m_skipped) {
+            dropped[index] = true;
+        }
+
+        m_verify.clear();
+        compact(dropped);
+        std::stable_sort(m_plan.begin(), m_plan.end(), ActionBefore);
+
+        for (sync_action_t &action : m_plan) {
+            if (SYNC_ACTION_DOWNLOAD == action.getKind()) {
+                m_downloadBytes += action.getSize();
+            } else if (SYNC_ACTION_UPLOAD == action.getKind()) {
+                m_uploadBytes += action.getSize();
+            }
+        }
+
+        m_index = 0;
+        m_phase = PHASE_RUN;
+    }
+
+    bool run(LIBMTP_mtpdevice_t *device) {
+        if (0 != (m_flags & SYNC_DRY_RUN)) {
+            succeed();
+            return true;
+        }
+
+        if (!m_writer) {
+            m_writer.reset(new write_behind_t(write_behind_t::DEFAULT_THREADS, write_behind_t::DEFAULT_QUEUE_BYTES,
+                                              false));
+
+            if (m_createRoot) {
+                m_writer->makeDirectory(m_root);
+            }
+        }
+
+        if (m_index >= m_plan.size()) {
+            if (!m_writer->drain()) {
+                fail(LIBMTP_ERROR_GENERAL);
+                return true;
+            }
+
+            succeed();
+            return true;
+        }
+
+        int error = execute(device, m_plan[m_index]);
+
+        if (LIBMTP_ERROR_NONE != error) {
+            fail(error);
+            return true;
+        }
+
+        m_index++;
+
+        return false;
+    }
+
+    int execute(LIBMTP_mtpdevice_t *device, sync_action_t &action) {
+        std::string path = action.getPath();
+
+        switch (action.getKind()) {
+            case SYNC_ACTION_MKDIR_LOCAL:
+                m_writer->makeDirectory(localPathOf(path));
+                return LIBMTP_ERROR_NONE;
+
+            case SYNC_ACTION_RENAME_LOCAL:
+                m_writer->rename(localPathOf(action.getFrom()), localPathOf(path));
+                return LIBMTP_ERROR_NONE;
+
+            case SYNC_ACTION_DELETE_LOCAL:
+                m_writer->remove(localPathOf(path), action.getIsFolder());
+                return LIBMTP_ERROR_NONE;
+
+            case SYNC_ACTION_DOWNLOAD:
+                return downloadFile(device, action);
+
+            case SYNC_ACTION_UPLOAD:
+                return uploadFile(device, action);
+
+            case SYNC_ACTION_CONFLICT:
+                return LIBMTP_ERROR_NONE;
+        }
+
+        device_guard_t guard(device, getPriority());
+
+        switch (action.getKind()) {
+            case SYNC_ACTION_MKDIR_DEVICE: {
+                std::unordered_map<std::string, uint32_t>::iterator parent = m_folderIds.find(ParentPath(path));
+
+                if (parent == m_folderIds.end()) {
+                    return LIBMTP_ERROR_GENERAL;
+                }
+
+                char *name = strdup(BaseName(path).c_str());
+                uint32_t id = LIBMTP_Create_Folder(device, name, parent->second, m_storage);
+                free(name);
+
+                if (0 == id) {
+                    LIBMTP_Clear_Errorstack(device);
+                    return LIBMTP_ERROR_GENERAL;
+                }
+
+                m_folderIds[path] = id;
+                return LIBMTP_ERROR_NONE;
+            }
+
+            case SYNC_ACTION_RENAME_DEVICE: {
+                LIBMTP_file_t *file = LIBMTP_Get_Filemetadata(device, action.getId());
+                int ret = nullptr == file ? -1 : LIBMTP_Set_File_Name(device, file, BaseName(path).c_str());
+
+                if (nullptr != file) {
+                    LIBMTP_destroy_file_t(file);
+                }
+                if (0 != ret) {
+                    LIBMTP_Clear_Errorstack(device);
+                    return LIBMTP_ERROR_GENERAL;
+                }
+
+                return LIBMTP_ERROR_NONE;
+            }
+
+            case SYNC_ACTION_DELETE_DEVICE:
+                if (0 != LIBMTP_Delete_Object(device, action.getId())) {
+                    LIBMTP_Clear_Errorstack(device);
+                    return LIBMTP_ERROR_GENERAL;
+                }
+                return LIBMTP_ERROR_NONE;
+        }
+
+        return LIBMTP_ERROR_GENERAL;
+    }
+
+    int downloadFile(LIBMTP_mtpdevice_t *device, sync_action_t &action) {
+        tree_download_ctx_t ctx(device, m_job, *m_writer,
+                                m_writer->open(localPathOf(action.getPath()), action.getSize(),
+                                               m_remote[action.getPath()].mtime));
+        int ret;
+
+        m_job.beginFile();
+
+        {
+            device_guard_t guard(device, getPriority());
+            ret = LIBMTP_Get_File_To_Handler(device, action.getId(), TreeDownloadDataPut, (void *) &ctx,
+                                             TransferJobProgressCallback, (const void *) &m_job);
+
+            if (0 != ret) {
+                LIBMTP_Clear_Errorstack(device);
+            }
+        }
+
+        bool completed = 0 == ret && (ctx.m_block.empty() || m_writer->write(ctx.m_file, ctx.m_block));
+
+        m_writer->close(ctx.m_file, completed);
+        m_job.endFile(completed);
+
+        if (!completed) {
+            return m_job.isAborted() ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL;
+        }
+
+        return LIBMTP_ERROR_NONE;
+    }
+
+    int uploadFile(LIBMTP_mtpdevice_t *device, sync_action_t &action) {
+        std::string path = action.getPath();
+        std::string localPath = localPathOf(path);
+        std::unordered_map<std::string, uint32_t>::iterator parent = m_folderIds.find(ParentPath(path));
+
+        if (parent == m_folderIds.end()) {
+            return LIBMTP_ERROR_GENERAL;
+        }
+
+        int fd = OpenFileForRead(localPath.c_str());
+        int64_t size = fd >= 0 ? FileSize(fd) : -1;
+
+        if (size < 0) {
+            if (fd >= 0) {
+                CloseFile(fd);
+            }
+            return LIBMTP_ERROR_GENERAL;
+        }
+
+        device_guard_t guard(device, getPriority());
+
+        // the outdated copy makes room for the new one
+        if (0 != action.getId() && 0 != LIBMTP_Delete_Object(device, action.getId())) {
+            LIBMTP_Clear_Errorstack(device);
+            CloseFile(fd);
+            return LIBMTP_ERROR_GENERAL;
+        }
+
+        file_t file;
+        file.setName(BaseName(path));
+        file.setSize((uint64_t) size);
+        file.setType(ClassifyFileDescriptor(path, fd));
+        file.setParentId(parent->second);
+        file.setStorageId(m_storage);
+
+        shaped_progress_t shaped(device, m_job);
+
+        m_job.beginFile();
+        int ret = LIBMTP_Send_File_From_File_Descriptor(device, fd, file.get(), ShapedProgressCallback,
+                                                        (const void *) &shaped);
+        m_job.endFile(0 == ret);
+        CloseFile(fd);
+
+        if (0 != ret) {
+            bool aborted = m_job.isAborted();
+
+            if (aborted && 0 != file.getId()) {
+                LIBMTP_Delete_Object(device, file.getId());
+            }
+            LIBMTP_Clear_Errorstack(device);
+
+            return aborted ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL;
+        }
+
+        if (SYNC_MODE_TWO_WAY == m_mode) {
+            LIBMTP_file_t *sent = LIBMTP_Get_Filemetadata(device, file.getId());
+
+            if (nullptr != sent) {
+                SetModificationTime(localPath.c_str(), sent->modificationdate);
+                LIBMTP_destroy_file_t(sent);
+            } else {
+                LIBMTP_Clear_Errorstack(device);
+            }
+        }
+
+        return LIBMTP_ERROR_NONE;
+    }
+
+    void succeed() {
+        m_job.flush();
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        std::vector <sync_action_t> plan = m_plan;
+        uint64_t downloadBytes = m_downloadBytes;
+        uint64_t uploadBytes = m_uploadBytes;
+
+        finish([cb, plan, downloadBytes, uploadBytes] {
+            (*cb)((int) LIBMTP_ERROR_NONE, plan, downloadBytes, uploadBytes);
+        });
+    }
+
+    std::string localPathOf(const std::string &path) {
+        return m_root + "/" + path;
+    }
+
+    std::string m_root;
+    uint32_t m_storage;
+    int m_mode;
+    uint32_t m_flags;
+    transfer_job_t m_job;
+    std::shared_ptr <js_function_t> m_cb;
+    phase_t m_phase;
+    bool m_scanning;
+    bool m_createRoot;
+    std::future <local_scan_t> m_scan;
+    std::deque <std::string> m_folders;
+    std::unordered_map <std::string, uint32_t> m_folderIds;
+    sync_tree_t m_remote;
+    sync_tree_t m_local;
+    std::vector <sync_action_t> m_plan;
+    std::vector <size_t> m_verify;
+    std::set <size_t> m_skipped;
+    std::unique_ptr <write_behind_t> m_writer;
+    size_t m_index;
+    uint64_t m_downloadBytes;
+    uint64_t m_uploadBytes;
+};
+
+void Schedule_Sync_Tree(mtpdevice_t device, std::string localPath, uint32_t const storage, uint32_t const parent,
+                        int const mode, uint32_t const flags, transfer_job_t &job, uint32_t const weight,
+                        js_function_t &cb) {
+    device_executor_t::forDevice(device.m_device)->submit(
+            std::make_shared<sync_task_t>(weight, localPath, storage, parent, mode, flags, job, MakeJsCallback(cb)));
+}
+
+JS_CLASS(sync_action_t){
+        construct<>();
+        construct<const sync_action_t&>();
+        getter(getKind);
+        getter(getPath);
+        getset(getFrom, setFrom);
+        getter(getId);
+        getter(getSize);
+        getter(getIsFolder);
+}
@@ -0,0 +1,90 @@
+#ifndef MTP_SYNC_H
+#define MTP_SYNC_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "binding.h"
+#include "mtp.h"
+#include "transfer.h"
+
+enum sync_mode_t {
+    SYNC_MODE_DOWNLOAD = 0,
+    SYNC_MODE_UPLOAD = 1,
+    SYNC_MODE_TWO_WAY = 2
+};
+
+enum sync_flag_t {
+    SYNC_DELETE_EXTRANEOUS = 1,
+    SYNC_COMPARE_HASH = 2,
+    SYNC_DRY_RUN = 4
+};
+
+enum sync_action_kind_t {
+    SYNC_ACTION_MKDIR_LOCAL = 0,
+    SYNC_ACTION_MKDIR_DEVICE = 1,
+    SYNC_ACTION_RENAME_LOCAL = 2,
+    SYNC_ACTION_RENAME_DEVICE = 3,
+    SYNC_ACTION_DOWNLOAD = 4,
+    SYNC_ACTION_UPLOAD = 5,
+    SYNC_ACTION_DELETE_LOCAL = 6,
+    SYNC_ACTION_DELETE_DEVICE = 7,
+    SYNC_ACTION_CONFLICT = 8
+};
+
+/**
+ * One step of a sync plan. `path` is relative to the synced folders and
+ * uses '/' as separator; `from` is the old path of a rename. `id` is the
+ * device object the action reads, replaces, renames or deletes, 0 if there
+ * is none.
+ */
+class sync_action_t {
+public:
+    sync_action_t() : m_kind(SYNC_ACTION_CONFLICT), m_id(0), m_size(0), m_folder(false) {}
+
+    sync_action_t(int kind, const std::string &path, uint32_t id, uint64_t size, bool folder) :
+            m_kind(kind), m_path(path), m_id(id), m_size(size), m_folder(folder) {}
+
+    sync_action_t(const sync_action_t &action) : m_kind(action.m_kind), m_path(action.m_path),
+                                                 m_from(action.m_from), m_id(action.m_id), m_size(action.m_size),
+                                                 m_folder(action.m_folder) {}
+
+    sync_action_t &operator=(const sync_action_t &action) {
+        m_kind = action.m_kind;
+        m_path = action.m_path;
+        m_from = action.m_from;
+        m_id = action.m_id;
+        m_size = action.m_size;
+        m_folder = action.m_folder;
+        return *this;
+    }
+
+    int getKind() { return m_kind; }
+
+    std::string getPath() { return m_path; }
+
+    std::string getFrom() { return m_from; }
+
+    void setFrom(const std::string from) { m_from = from; }
+
+    uint32_t getId() { return m_id; }
+
+    uint64_t getSize() { return m_size; }
+
+    bool getIsFolder() { return m_folder; }
+
+private:
+    int m_kind;
+    std::string m_path;
+    std::string m_from;
+    uint32_t m_id;
+    uint64_t m_size;
+    bool m_folder;
+};
+
+void Schedule_Sync_Tree(mtpdevice_t device, std::string localPath, uint32_t const storage, uint32_t const parent,
+                        int const mode, uint32_t const flags, transfer_job_t &job, uint32_t const weight,
+                        js_function_t &cb);
+
+#endif
@@ -0,0 +1,335 @@
+#include "thumbnail.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <string>
+
+#include "dispatcher.h"
+#include "executor.h"
+#include "fileio.h"
+#include "readcache.h"
+
+/* SOI, maybe an APP0 segment, and an APP1 segment of at most 64 KiB */
+static const uint32_t EXIF_WINDOW = 72 * 1024;
+
+static const char THUMBNAIL_KEY_SUFFIX[] = ":thumbnail";
+
+static uint32_t ExifShort(const unsigned char *p, bool little) {
+    return little ? (uint32_t) p[0] | (uint32_t) p[1] << 8 : (uint32_t) p[0] << 8 | (uint32_t) p[1];
+}
+
+static uint32_t ExifLong(const unsigned char *p, bool little) {
+    return little ? ExifShort(p, true) | ExifShort(p + 2, true) << 16
+                  : ExifShort(p, false) << 16 | ExifShort(p + 2, false);
+}
+
+/**
+ * Reads JPEGInterchangeFormat and JPEGInterchangeFormatLength from IFD1
+ * of the TIFF structure at `tiff`. The thumbnail has to lie within the
+ * APP1 segment, which ends at `end`.
+ */
+static bool FindIfd1Thumbnail(const unsigned char *data, size_t length, size_t tiff, size_t end, uint64_t &offset,
+                              uint32_t &size) {
+    size_t limit = end < length ? end : length;
+
+    if (tiff + 8 > limit) {
+        return false;
+    }
+
+    bool little = 'I' == data[tiff] && 'I' == data[tiff + 1];
+
+    if ((!little && ('M' != data[tiff] || 'M' != data[tiff + 1])) || 42 != ExifShort(data + tiff + 2, little)) {
+        return false;
+    }
+
+    // IFD0 is only skipped, IFD1 describes the thumbnail
+    size_t ifd = ExifLong(data + tiff + 4, little);
+
+    for (int level = 0; level < 2; level++) {
+        if (0 == ifd || ifd > limit - tiff || tiff + ifd + 2 > limit) {
+            return false;
+        }
+
+        const unsigned char *p = data + tiff + ifd;
+        size_t entries = ExifShort(p, little);
+
+        if (tiff + ifd + 2 + entries * 12 + 4 > limit) {
+            return false;
+        }
+
+        if (0 == level) {
+            ifd = ExifLong(p + 2 + entries * 12, little);
+            continue;
+        }
+
+        uint32_t jpegOffset = 0;
+        uint32_t jpegLength = 0;
+
+        for (size_t i = 0; i < entries; i++) {
+            const unsigned char *entry = p + 2 + i * 12;
+            uint32_t tag = ExifShort(entry, little);
+            uint32_t value = 3 == ExifShort(entry + 2, little) ? ExifShort(entry + 8, little)
+                                                                : ExifLong(entry + 8, little);
+
+            if (0x0201 == tag) {
+                jpegOffset = value;
+            } else if (0x0202 == tag) {
+                jpegLength = value;
+            }
+        }
+
+        if (0 == jpegOffset || 0 == jpegLength || jpegOffset > end - tiff || jpegLength > end - tiff - jpegOffset) {
+            return false;
+        }
+
+        offset = tiff + jpegOffset;
+        size = jpegLength;
+
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Locates the thumbnail in the EXIF header of a JPEG file whose first
+ * `length` bytes are in `data`; `offset` is relative to the file.
+ */
+static bool FindExifThumbnail(const unsigned char *data, size_t length, uint64_t &offset, uint32_t &size) {
+    if (length < 4 || 0xFF != data[0] || 0xD8 != data[1]) {
+        return false;
+    }
+
+    size_t pos = 2;
+
+    while (pos + 4 <= length) {
+        if (0xFF != data[pos]) {
+            return false;
+        }
+
+        unsigned char marker = data[pos + 1];
+
+        // fill byte
+        if (0xFF == marker) {
+            pos++;
+            continue;
+        }
+
+        // the compressed image data starts, the header is over
+        if (0xDA == marker || 0xD9 == marker) {
+            return false;
+        }
+
+        size_t segment = (size_t) data[pos + 2] << 8 | data[pos + 3];
+
+        if (segment < 2) {
+            return false;
+        }
+
+        if (0xE1 == marker && segment >= 8 && pos + 10 <= length && 0 == memcmp(data + pos + 4, "Exif\0\0", 6)) {
+            return FindIfd1Thumbnail(data, length, pos + 10, pos + 2 + segment, offset, size);
+        }
+
+        pos += 2 + segment;
+    }
+
+    return false;
+}
+
+static bool IsJpeg(LIBMTP_file_t *meta) {
+    if (LIBMTP_FILETYPE_JPEG == meta->filetype || LIBMTP_FILETYPE_JFIF == meta->filetype) {
+        return true;
+    }
+
+    const char *dot = nullptr != meta->filename ? strrchr(meta->filename, '.') : nullptr;
+
+    return nullptr != dot && (0 == strcasecmp(dot, ".jpg") || 0 == strcasecmp(dot, ".jpeg"));
+}
+
+static bool IsJpegData(const std::vector <unsigned char> &data) {
+    return data.size() > 2 && 0xFF == data[0] && 0xD8 == data[1];
+}
+
+static bool DeviceThumbnail(LIBMTP_mtpdevice_t *device, uint32_t id, std::vector <unsigned char> &thumbnail) {
+    unsigned char *data = nullptr;
+    unsigned int size = 0;
+
+    if (0 != LIBMTP_Get_Thumbnail(device, id, &data, &size)) {
+        LIBMTP_Clear_Errorstack(device);
+        free(data);
+        return false;
+    }
+
+    thumbnail.assign(data, data + size);
+    free(data);
+
+    return !thumbnail.empty();
+}
+
+static bool ReadRange(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t offset, uint32_t length, uint64_t filesize,
+                      std::vector <unsigned char> &out) {
+    unsigned char *data = nullptr;
+    unsigned int size = 0;
+
+    if (0 != GetPartialObjectSized(device, id, offset, length, filesize, &data, &size)) {
+        LIBMTP_Clear_Errorstack(device);
+        free(data);
+        return false;
+    }
+
+    out.assign(data, data + size);
+    free(data);
+
+    return true;
+}
+
+/**
+ * Reads the EXIF header of a JPEG file and then the thumbnail it embeds,
+ * unless the thumbnail was part of the header read already.
+ */
+static bool ExifThumbnail(LIBMTP_mtpdevice_t *device, uint32_t id, uint64_t filesize,
+                          std::vector <unsigned char> &thumbnail) {
+    if (0 == LIBMTP_Check_Capability(device, LIBMTP_DEVICECAP_GetPartialObject)) {
+        return false;
+    }
+
+    std::vector <unsigned char> header;
+    uint64_t offset;
+    uint32_t size;
+
+    if (!ReadRange(device, id, 0, EXIF_WINDOW, filesize, header) ||
+        !FindExifThumbnail(header.data(), header.size(), offset, size)) {
+        return false;
+    }
+
+    if (offset + size <= header.size()) {
+        thumbnail.assign(header.begin() + (size_t) offset, header.begin() + (size_t) (offset + size));
+    } else if (!ReadRange(device, id, offset, size, filesize, thumbnail) || thumbnail.size() != size) {
+        return false;
+    }
+
+    return IsJpegData(thumbnail);
+}
+
+class thumbnails_task_t : public scheduler_task_t {
+public:
+    thumbnails_task_t(int priority, const std::vector <uint32_t> &ids, download_cache_t cache, abort_token_t token,
+                      std::shared_ptr <js_function_t> itemCb, std::shared_ptr <js_function_t> cb) :
+            scheduler_task_t(priority, 1), m_ids(ids), m_cache(cache), m_token(token), m_itemCb(itemCb), m_cb(cb),
+            m_index(0), m_fetched(0) {}
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_token.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        // thumbnails are only handed out as cache entries
+        if (!m_cache.isOpen()) {
+            fail(LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        if (m_index < m_ids.size()) {
+            uint32_t id = m_ids[m_index++];
+            int source = THUMBNAIL_CACHED;
+            std::string path = fetch(device, id, source);
+            int error = path.empty() ? (int) LIBMTP_ERROR_GENERAL : (int) LIBMTP_ERROR_NONE;
+            std::shared_ptr <js_function_t> itemCb = m_itemCb;
+
+            if (!path.empty()) {
+                m_fetched++;
+            }
+
+            PostJsCallback(itemCb, [itemCb, id, error, path, source] {
+                (*itemCb)(id, error, path, source);
+            });
+        }
+
+        if (m_index < m_ids.size()) {
+            return false;
+        }
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        uint32_t fetched = m_fetched;
+        finish([cb, fetched] { (*cb)((int) LIBMTP_ERROR_NONE, fetched); });
+
+        return true;
+    }
+
+    void fail(int error) override {
+        std::shared_ptr <js_function_t> cb = m_cb;
+        uint32_t fetched = m_fetched;
+        finish([cb, error, fetched] { (*cb)(error, fetched); });
+    }
+
+private:
+    std::string fetch(LIBMTP_mtpdevice_t *device, uint32_t id, int &source) {
+        std::vector <unsigned char> thumbnail;
+        std::string key;
+
+        {
+            device_guard_t guard(device, getPriority());
+            LIBMTP_file_t *meta = LIBMTP_Get_Filemetadata(device, id);
+
+            if (nullptr == meta) {
+                LIBMTP_Clear_Errorstack(device);
+                return std::string();
+            }
+
+            uint64_t size = meta->filesize;
+            bool jpeg = IsJpeg(meta);
+
+            key = download_cache_t::keyFor(device, id, size, meta->modificationdate) + THUMBNAIL_KEY_SUFFIX;
+            LIBMTP_destroy_file_t(meta);
+
+            std::string cached = m_cache.lookup(key);
+
+            if (!cached.empty()) {
+                source = THUMBNAIL_CACHED;
+                return cached;
+            }
+
+            if (DeviceThumbnail(device, id, thumbnail)) {
+                source = THUMBNAIL_DEVICE;
+            } else if (jpeg && ExifThumbnail(device, id, size, thumbnail)) {
+                source = THUMBNAIL_EXIF;
+            } else {
+                return std::string();
+            }
+        }
+
+        std::string temporary = m_cache.reserve();
+        int fd = OpenFileForWrite(temporary.c_str());
+
+        if (fd < 0) {
+            return std::string();
+        }
+
+        bool written = WriteFully(fd, thumbnail.data(), thumbnail.size());
+
+        if (0 != CloseFile(fd) || !written) {
+            RemoveFile(temporary.c_str());
+            return std::string();
+        }
+
+        return m_cache.commit(key, temporary);
+    }
+
+    std::vector <uint32_t> m_ids;
+    download_cache_t m_cache;
+    abort_token_t m_token;
+    std::shared_ptr <js_function_t> m_itemCb;
+    std::shared_ptr <js_function_t> m_cb;
+    size_t m_index;
+    uint32_t m_fetched;
+};
+
+void Schedule_Get_Thumbnails(mtpdevice_t device, std::vector <uint32_t> ids, int const priority,
+                             download_cache_t &cache, abort_token_t &token, js_function_t &itemCb,
+                             js_function_t &cb) {
+    device_executor_t::forDevice(device.m_device)->submit(
+            std::make_shared<thumbnails_task_t>(priority, ids, cache, token, MakeJsCallback(itemCb),
+                                                MakeJsCallback(cb)));
+}
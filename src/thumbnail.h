@@ -0,0 +1,29 @@
+#ifndef MTP_THUMBNAIL_H
+#define MTP_THUMBNAIL_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "binding.h"
+#include "mtp.h"
+#include "transfer.h"
+#include "cache.h"
+
+enum thumbnail_source_t {
+    THUMBNAIL_CACHED = 0,
+    THUMBNAIL_DEVICE = 1,
+    THUMBNAIL_EXIF = 2
+};
+
+/**
+ * Fetches the thumbnails of `ids`, in the given order, into `cache`. The
+ * device thumbnail is used when there is one; for JPEG files without one
+ * the thumbnail embedded in the EXIF header is read with a ranged read.
+ * `itemCb(id, error, path, source)` is called as each thumbnail becomes
+ * available, `cb(error, fetched)` once all are done.
+ */
+void Schedule_Get_Thumbnails(mtpdevice_t device, std::vector <uint32_t> ids, int const priority,
+                             download_cache_t &cache, abort_token_t &token, js_function_t &itemCb,
+                             js_function_t &cb);
+
+#endif
@@ -0,0 +1,400 @@
+#include "transfer.h"
+
+#include "dispatcher.h"
+#include "ratelimit.h"
+#include "exports.h"
+
+static_assert(sizeof(std::atomic <uint64_t>) == sizeof(uint64_t), "progress counter slots must be plain 64-bit words");
+static_assert(sizeof(std::atomic <int32_t>) == sizeof(int32_t), "abort slots must be plain 32-bit words");
+
+abort_token_state_t::abort_token_state_t() : aborted(false), slot(nullptr) {}
+
+bool abort_token_state_t::raised() {
+    if (aborted.load(std::memory_order_relaxed)) {
+        return true;
+    }
+
+    std::atomic <int32_t> *shared = slot.load(std::memory_order_relaxed);
+
+    return nullptr != shared && 0 != shared->load(std::memory_order_relaxed);
+}
+
+abort_token_t::abort_token_t() : m_state(std::make_shared<abort_token_state_t>()) {}
+
+abort_token_t::abort_token_t(const abort_token_t &token) : m_state(token.m_state) {}
+
+void abort_token_t::abort() {
+    m_state->aborted.store(true);
+
+    std::atomic <int32_t> *slot = m_state->slot.load();
+    if (nullptr != slot) {
+        slot->store(1);
+    }
+}
+
+void abort_token_t::reset() {
+    m_state->aborted.store(false);
+
+    std::atomic <int32_t> *slot = m_state->slot.load();
+    if (nullptr != slot) {
+        slot->store(0);
+    }
+}
+
+bool abort_token_t::isAborted() {
+    return m_state->raised();
+}
+
+/**
+ * Attaches a caller owned 32-bit slot which other threads may set to abort
+ * the token. The token keeps the memory alive until detach() is called or
+ * the last copy of the token is gone.
+ */
+bool abort_token_t::attach(js_buffer_ref_t buf) {
+    if (buf.length() < sizeof(int32_t) || 0 != (reinterpret_cast<uintptr_t>(buf.data()) % sizeof(int32_t))) {
+        return false;
+    }
+
+    m_state->slot.store(reinterpret_cast<std::atomic <int32_t> *>(buf.data()));
+    m_state->slotBuffer = buf;
+
+    return true;
+}
+
+void abort_token_t::detach() {
+    m_state->slot.store(nullptr);
+    m_state->slotBuffer = js_buffer_ref_t();
+}
+
+transfer_job_state_t::transfer_job_state_t() : minInterval(0), minBytes(0), total(0), base(0), fileSent(0),
+                                               fileTotal(0), files(0), reportedBytes(0), pending(false),
+                                               limiter(std::make_shared<token_bucket_t>()), checksum(0),
+                                               counter(nullptr) {}
+
+transfer_job_t::transfer_job_t() : m_state(std::make_shared<transfer_job_state_t>()) {}
+
+transfer_job_t::transfer_job_t(const transfer_job_t &job) : m_state(job.m_state) {}
+
+uint32_t transfer_job_t::getMinInterval() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->minInterval;
+}
+
+void transfer_job_t::setMinInterval(const uint32_t minInterval) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->minInterval = minInterval;
+}
+
+uint64_t transfer_job_t::getMinBytes() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->minBytes;
+}
+
+void transfer_job_t::setMinBytes(const uint64_t minBytes) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->minBytes = minBytes;
+}
+
+uint64_t transfer_job_t::getTotal() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->total;
+}
+
+void transfer_job_t::setTotal(const uint64_t total) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->total = total;
+    publish();
+}
+
+uint64_t transfer_job_t::getTransferred() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return transferred();
+}
+
+uint32_t transfer_job_t::getFiles() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->files;
+}
+
+void transfer_job_t::setProgressCallback(js_function_t &cb) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->cb = MakeJsCallback(cb);
+}
+
+void transfer_job_t::clearProgressCallback() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->cb.reset();
+}
+
+/**
+ * Binds the job to `token`. A job bound to another token is left alone and
+ * false returned: clear its token first to rebind it on purpose.
+ */
+bool transfer_job_t::setAbortToken(abort_token_t &token) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    std::shared_ptr <abort_token_state_t> state = token.getState();
+
+    if (m_state->token && m_state->token != state) {
+        return false;
+    }
+
+    m_state->token = state;
+
+    return true;
+}
+
+void transfer_job_t::clearAbortToken() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->token.reset();
+}
+
+bool transfer_job_t::isAborted() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->token && m_state->token->raised();
+}
+
+uint64_t transfer_job_t::getRateLimit() {
+    return getRateLimiter()->getRate();
+}
+
+/**
+ * Limits the job to `rate` bytes per second, on top of any device limit.
+ * A rate of 0 lifts the limit. May be called while the job is running.
+ */
+void transfer_job_t::setRateLimit(const uint64_t rate, const uint64_t burst) {
+    getRateLimiter()->configure(rate, burst);
+}
+
+std::shared_ptr <token_bucket_t> transfer_job_t::getRateLimiter() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->limiter;
+}
+
+int transfer_job_t::getChecksum() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->checksum;
+}
+
+void transfer_job_t::setChecksum(const int checksum) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->checksum = checksum;
+}
+
+std::string transfer_job_t::getDigest() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    return m_state->digest;
+}
+
+void transfer_job_t::setDigest(const std::string &digest) {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->digest = digest;
+}
+
+/**
+ * Points the job at a caller owned memory slot (typically a Buffer over the
+ * ArrayBuffer of a BigUint64Array) which is updated on every chunk, so JS can
+ * poll the progress without registering a callback at all. The job keeps
+ * the memory alive until clearCounter() is called or the last copy of the
+ * job is gone.
+ */
+bool transfer_job_t::setCounter(js_buffer_ref_t buf) {
+    if (buf.length() < COUNTER_SLOTS * sizeof(uint64_t) ||
+        0 != (reinterpret_cast<uintptr_t>(buf.data()) % sizeof(uint64_t))) {
+        return false;
+    }
+
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->counter = reinterpret_cast<std::atomic <uint64_t> *>(buf.data());
+    m_state->counterBuffer = buf;
+    publish();
+
+    return true;
+}
+
+void transfer_job_t::clearCounter() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->counter = nullptr;
+    m_state->counterBuffer = js_buffer_ref_t();
+}
+
+/**
+ * Reports whatever is still pending. A job without a total only knows it
+ * is done when it is flushed: the tasks transferring many files flush their
+ * job as they complete, a caller spreading a job over several calls flushes
+ * it after the last one.
+ */
+void transfer_job_t::flush() {
+    std::unique_lock <std::mutex> lk(m_state->mx);
+    if (m_state->pending) {
+        report(lk, true);
+    }
+}
+
+void transfer_job_t::reset() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->base = 0;
+    m_state->fileSent = 0;
+    m_state->fileTotal = 0;
+    m_state->files = 0;
+    m_state->reportedBytes = 0;
+    m_state->reportedAt = std::chrono::steady_clock::time_point();
+    m_state->pending = false;
+    m_state->digest.clear();
+    publish();
+}
+
+void transfer_job_t::beginFile() {
+    std::lock_guard <std::mutex> lk(m_state->mx);
+    m_state->fileSent = 0;
+    m_state->fileTotal = 0;
+    m_state->digest.clear();
+}
+
+void transfer_job_t::endFile(bool completed) {
+    std::unique_lock <std::mutex> lk(m_state->mx);
+    m_state->base += completed ? m_state->fileTotal : m_state->fileSent;
+    m_state->fileSent = 0;
+    m_state->fileTotal = 0;
+
+    if (completed) {
+        m_state->files++;
+    }
+
+    publish();
+
+    if (m_state->pending && m_state->total > 0 && transferred() >= m_state->total) {
+        report(lk, true);
+    }
+}
+
+/**
+ * Returns non-zero once the job's abort token is raised, which makes libmtp
+ * cancel the running transaction after the current chunk.
+ */
+int transfer_job_t::progress(uint64_t const sent, uint64_t const total) {
+    std::unique_lock <std::mutex> lk(m_state->mx);
+
+    if (m_state->token && m_state->token->raised()) {
+        return 1;
+    }
+
+    m_state->fileSent = sent;
+    m_state->fileTotal = total;
+    m_state->pending = true;
+    publish();
+
+    // the last chunk of a job of known size is always reported, whatever the
+    // thresholds; any other job is reported in full when it is flushed
+    bool force = m_state->total > 0 && sent >= total && (m_state->base + sent) >= m_state->total;
+
+    report(lk, force);
+
+    return 0;
+}
+
+uint64_t transfer_job_t::transferred() {
+    uint64_t result = m_state->base + m_state->fileSent;
+
+    if (m_state->total > 0 && result > m_state->total) {
+        return m_state->total;
+    }
+
+    return result;
+}
+
+void transfer_job_t::publish() {
+    std::atomic <uint64_t> *counter = m_state->counter;
+
+    if (nullptr == counter) {
+        return;
+    }
+
+    counter[0].store(transferred(), std::memory_order_relaxed);
+    counter[1].store(m_state->total, std::memory_order_relaxed);
+    counter[2].store(m_state->files, std::memory_order_relaxed);
+}
+
+/**
+ * Invokes the JS callback if the configured thresholds allow it. The lock is
+ * released before calling into JS so the callback may freely use the job.
+ * Reports from a device executor thread are posted to the JS thread.
+ */
+void transfer_job_t::report(std::unique_lock <std::mutex> &lk, bool force) {
+    std::shared_ptr <js_function_t> cb = m_state->cb;
+    uint64_t current = transferred();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (!cb) {
+        m_state->pending = false;
+        return;
+    }
+
+    if (!force) {
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - m_state->reportedAt).count();
+
+        if (elapsed < m_state->minInterval || (current - m_state->reportedBytes) < m_state->minBytes) {
+            return;
+        }
+    }
+
+    uint64_t sent = m_state->fileSent;
+    uint64_t total = m_state->fileTotal;
+    uint64_t jobTotal = m_state->total;
+
+    m_state->reportedBytes = current;
+    m_state->reportedAt = now;
+    m_state->pending = false;
+
+    lk.unlock();
+
+    std::shared_ptr <js_dispatcher_t> dispatcher = cb->getDispatcher();
+
+    if (!dispatcher) {
+        return;
+    }
+
+    if (dispatcher->onThread()) {
+        (*cb)(sent, total, current, jobTotal);
+    } else {
+        dispatcher->post([cb, sent, total, current, jobTotal] { (*cb)(sent, total, current, jobTotal); });
+    }
+}
+
+int TransferJobProgressCallback(uint64_t const sent, uint64_t const total, void const *const data) {
+    transfer_job_t *job = (transfer_job_t *) data;
+    return job->progress(sent, total);
+}
+
+JS_CLASS(transfer_job_t){
+        construct<>();
+        construct<const transfer_job_t&>();
+        getset(getMinInterval, setMinInterval);
+        getset(getMinBytes, setMinBytes);
+        getset(getTotal, setTotal);
+        getter(getTransferred);
+        getter(getFiles);
+        method(setProgressCallback);
+        method(clearProgressCallback);
+        method(setCounter);
+        method(clearCounter);
+        method(setAbortToken);
+        method(clearAbortToken);
+        method(isAborted);
+        getter(getRateLimit);
+        method(setRateLimit);
+        getset(getChecksum, setChecksum);
+        getter(getDigest);
+        method(flush);
+        method(reset);
+}
+
+JS_CLASS(abort_token_t){
+        construct<>();
+        construct<const abort_token_t&>();
+        method(abort);
+        method(reset);
+        method(isAborted);
+        method(attach);
+        method(detach);
+}
@@ -0,0 +1,169 @@
+#ifndef MTP_TRANSFER_H
+#define MTP_TRANSFER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "binding.h"
+
+class token_bucket_t;
+
+/**
+ * Cancellation flag shared by every copy of an abort_token_t.
+ *
+ * The flag can be raised from any thread. When a slot is attached (an
+ * Int32Array over a SharedArrayBuffer), a non-zero value stored there by
+ * another JS thread with Atomics.store() aborts the token as well.
+ */
+struct abort_token_state_t {
+    abort_token_state_t();
+
+    bool raised();
+
+    std::atomic<bool> aborted;
+    std::atomic<std::atomic <int32_t> *> slot;
+
+    /* keeps the memory of `slot` alive, only touched on the JS thread */
+    js_buffer_ref_t slotBuffer;
+};
+
+class abort_token_t {
+public:
+    abort_token_t();
+
+    abort_token_t(const abort_token_t &token);
+
+    void abort();
+
+    void reset();
+
+    bool isAborted();
+
+    bool attach(js_buffer_ref_t buf);
+
+    void detach();
+
+    std::shared_ptr <abort_token_state_t> getState() { return m_state; }
+
+private:
+    std::shared_ptr <abort_token_state_t> m_state;
+};
+
+/**
+ * Progress bookkeeping shared by every copy of a transfer_job_t.
+ *
+ * A job spans one or more file transfers. Bytes are aggregated across all
+ * files of the job and the JS progress callback is only invoked once both
+ * the minimum interval and the minimum byte delta since the last report
+ * have elapsed, so small USB chunks no longer turn into one JS call each.
+ */
+struct transfer_job_state_t {
+    transfer_job_state_t();
+
+    std::mutex mx;
+
+    uint32_t minInterval;
+    uint64_t minBytes;
+
+    uint64_t total;
+    uint64_t base;
+    uint64_t fileSent;
+    uint64_t fileTotal;
+    uint32_t files;
+
+    uint64_t reportedBytes;
+    std::chrono::steady_clock::time_point reportedAt;
+    bool pending;
+
+    std::shared_ptr <js_function_t> cb;
+    std::shared_ptr <abort_token_state_t> token;
+    std::shared_ptr <token_bucket_t> limiter;
+
+    /* see checksum_algorithm_t; the digest is the one of the last completed file */
+    int checksum;
+    std::string digest;
+
+    /* [0] transferred bytes, [1] total bytes, [2] completed files */
+    std::atomic <uint64_t> *counter;
+    js_buffer_ref_t counterBuffer;
+};
+
+class transfer_job_t {
+public:
+    static const uint32_t COUNTER_SLOTS = 3;
+
+    transfer_job_t();
+
+    transfer_job_t(const transfer_job_t &job);
+
+    uint32_t getMinInterval();
+
+    void setMinInterval(const uint32_t minInterval);
+
+    uint64_t getMinBytes();
+
+    void setMinBytes(const uint64_t minBytes);
+
+    uint64_t getTotal();
+
+    void setTotal(const uint64_t total);
+
+    uint64_t getTransferred();
+
+    uint32_t getFiles();
+
+    void setProgressCallback(js_function_t &cb);
+
+    void clearProgressCallback();
+
+    bool setAbortToken(abort_token_t &token);
+
+    void clearAbortToken();
+
+    bool isAborted();
+
+    uint64_t getRateLimit();
+
+    void setRateLimit(const uint64_t rate, const uint64_t burst);
+
+    std::shared_ptr <token_bucket_t> getRateLimiter();
+
+    int getChecksum();
+
+    void setChecksum(const int checksum);
+
+    std::string getDigest();
+
+    void setDigest(const std::string &digest);
+
+    bool setCounter(js_buffer_ref_t buf);
+
+    void clearCounter();
+
+    void flush();
+
+    void reset();
+
+    void beginFile();
+
+    void endFile(bool completed);
+
+    int progress(uint64_t const sent, uint64_t const total);
+
+private:
+    uint64_t transferred();
+
+    void publish();
+
+    void report(std::unique_lock <std::mutex> &lk, bool force);
+
+    std::shared_ptr <transfer_job_state_t> m_state;
+};
+
+int TransferJobProgressCallback(uint64_t const sent, uint64_t const total, void const *const data);
+
+#endif
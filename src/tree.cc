@@ -0,0 +1,670 @@
+#include "tree.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <unordered_map>
+
+#include "dispatcher.h"
+#include "executor.h"
+#include "fileio.h"
+#include "filetype.h"
+#include "ratelimit.h"
+#include "exports.h"
+
+static const uint32_t NO_TARGET = 0;
+
+/* LIBMTP_FILES_AND_FOLDERS_ROOT, which older libmtp headers lack */
+static const uint32_t ROOT_FOLDER = 0xffffffff;
+
+/**
+ * Returns "name (n).ext" for the smallest n which is not taken yet.
+ */
+std::string UniqueName(const folder_listing_t &listing, const std::string &name) {
+    std::string::size_type dot = name.rfind('.');
+    std::string stem = (std::string::npos == dot || 0 == dot) ? name : name.substr(0, dot);
+    std::string extension = (std::string::npos == dot || 0 == dot) ? "" : name.substr(dot);
+
+    for (uint32_t n = 1;; n++) {
+        std::string candidate = stem + " (" + std::to_string(n) + ")" + extension;
+
+        if (listing.end() == listing.find(candidate)) {
+            return candidate;
+        }
+    }
+}
+
+/**
+ * Uploads a flattened local tree, one node per step.
+ *
+ * Each destination folder is listed at most once; folders created by the
+ * task start out with an empty listing, and every object the task creates
+ * or deletes is applied to the cached listings. Name conflicts are
+ * resolved in memory according to the conflict policy instead of asking
+ * the device for every single file.
+ */
+class tree_upload_task_t : public scheduler_task_t {
+public:
+    tree_upload_task_t(uint32_t weight, const std::vector <tree_item_t> &items, uint32_t storage, uint32_t parent,
+                       int policy, transfer_job_t job, std::shared_ptr <js_function_t> cb) :
+            scheduler_task_t(PRIORITY_BULK, weight), m_items(items), m_storage(storage), m_parent(parent),
+            m_policy(policy), m_job(job), m_cb(cb), m_targets(items.size(), NO_TARGET), m_index(0),
+            m_uploaded(0), m_skipped(0) {}
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_job.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        if (m_index >= m_items.size()) {
+            complete();
+            return true;
+        }
+
+        tree_item_t &item = m_items[m_index];
+        int32_t parentIndex = item.getParent();
+        uint32_t parentId = NO_TARGET;
+
+        if (parentIndex < 0) {
+            parentId = m_parent;
+        } else if ((size_t) parentIndex < m_index) {
+            parentId = m_targets[parentIndex];
+        }
+
+        if (NO_TARGET == parentId) {
+            // the enclosing folder was skipped, and so is its content
+            m_skipped++;
+            m_index++;
+            return false;
+        }
+
+        device_guard_t guard(device, getPriority());
+
+        folder_listing_t &listing = listingFor(device, parentId);
+        int error = item.getIsFolder() ? uploadFolder(device, item, parentId, listing)
+                                       : uploadFile(device, item, parentId, listing);
+
+        if (LIBMTP_ERROR_NONE != error) {
+            fail(error);
+            return true;
+        }
+
+        m_index++;
+
+        return false;
+    }
+
+    void fail(int error) override {
+        std::shared_ptr <js_function_t> cb = m_cb;
+        uint32_t uploaded = m_uploaded;
+        uint32_t skipped = m_skipped;
+
+        finish([cb, error, uploaded, skipped] { (*cb)(error, uploaded, skipped); });
+    }
+
+private:
+    folder_listing_t &listingFor(LIBMTP_mtpdevice_t *device, uint32_t parentId) {
+        std::unordered_map<uint32_t, folder_listing_t>::iterator it = m_listings.find(parentId);
+
+        if (it != m_listings.end()) {
+            return it->second;
+        }
+
+        folder_listing_t &listing = m_listings[parentId];
+        std::vector <file_t> files = Get_Files_And_Folders(mtpdevice_t(device), m_storage, parentId);
+
+        for (file_t &file : files) {
+            listing.insert(std::make_pair(file.getName(), file));
+        }
+
+        return listing;
+    }
+
+    /**
+     * Resolves a name conflict. Returns false if the node is to be skipped,
+     * otherwise `name` holds the name to upload the node under.
+     */
+    bool resolve(LIBMTP_mtpdevice_t *device, tree_item_t &item, folder_listing_t &listing, std::string &name) {
+        folder_listing_t::iterator existing = listing.find(item.getName());
+        name = item.getName();
+
+        if (listing.end() == existing) {
+            return true;
+        }
+
+        bool existingFolder = LIBMTP_FILETYPE_FOLDER == existing->second.getType();
+
+        if (item.getIsFolder() && existingFolder) {
+            return true;
+        }
+
+        if (CONFLICT_SKIP == m_policy) {
+            return false;
+        }
+
+        // folders are never deleted to make room for a node
+        if (CONFLICT_RENAME == m_policy || existingFolder) {
+            name = UniqueName(listing, name);
+            return true;
+        }
+
+        if (0 != LIBMTP_Delete_Object(device, existing->second.getId())) {
+            LIBMTP_Clear_Errorstack(device);
+            name = UniqueName(listing, name);
+            return true;
+        }
+
+        listing.erase(existing);
+
+        return true;
+    }
+
+    int uploadFolder(LIBMTP_mtpdevice_t *device, tree_item_t &item, uint32_t parentId, folder_listing_t &listing) {
+        std::string name;
+
+        if (!resolve(device, item, listing, name)) {
+            m_skipped++;
+            return LIBMTP_ERROR_NONE;
+        }
+
+        folder_listing_t::iterator existing = listing.find(name);
+
+        if (listing.end() != existing) {
+            m_targets[m_index] = existing->second.getId();
+            return LIBMTP_ERROR_NONE;
+        }
+
+        char *cName = strdup(name.c_str());
+        uint32_t id = LIBMTP_Create_Folder(device, cName, parentId, m_storage);
+
+        // libmtp may have adjusted the name to the device's constraints
+        name = cName;
+        free(cName);
+
+        if (0 == id) {
+            LIBMTP_Clear_Errorstack(device);
+            return LIBMTP_ERROR_GENERAL;
+        }
+
+        file_t folder;
+        folder.setName(name);
+        folder.setId(id);
+        folder.setType(LIBMTP_FILETYPE_FOLDER);
+        folder.setParentId(parentId);
+        folder.setStorageId(m_storage);
+
+        listing.insert(std::make_pair(name, folder));
+        m_listings[id];
+        m_targets[m_index] = id;
+
+        return LIBMTP_ERROR_NONE;
+    }
+
+    int uploadFile(LIBMTP_mtpdevice_t *device, tree_item_t &item, uint32_t parentId, folder_listing_t &listing) {
+        std::string name;
+
+        if (!resolve(device, item, listing, name)) {
+            m_skipped++;
+            return LIBMTP_ERROR_NONE;
+        }
+
+        int fd = OpenFileForRead(item.getPath().c_str());
+        int64_t size = fd >= 0 ? FileSize(fd) : -1;
+
+        if (size < 0) {
+            if (fd >= 0) {
+                CloseFile(fd);
+            }
+            return LIBMTP_ERROR_GENERAL;
+        }
+
+        file_t file;
+        file.setName(name);
+        file.setSize((uint64_t) size);
+        file.setType(ClassifyFileDescriptor(item.getName(), fd));
+        file.setParentId(parentId);
+        file.setStorageId(m_storage);
+
+        shaped_progress_t shaped(device, m_job);
+
+        m_job.beginFile();
+        int ret = LIBMTP_Send_File_From_File_Descriptor(device, fd, file.get(), ShapedProgressCallback,
+                                                        (const void *) &shaped);
+        m_job.endFile(0 == ret);
+        CloseFile(fd);
+
+        if (0 != ret) {
+            bool aborted = m_job.isAborted();
+
+            if (aborted && 0 != file.getId()) {
+                LIBMTP_Delete_Object(device, file.getId());
+            }
+            LIBMTP_Clear_Errorstack(device);
+
+            return aborted ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL;
+        }
+
+        listing.insert(std::make_pair(name, file));
+        m_uploaded++;
+
+        return LIBMTP_ERROR_NONE;
+    }
+
+    void complete() {
+        m_job.flush();
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        uint32_t uploaded = m_uploaded;
+        uint32_t skipped = m_skipped;
+
+        finish([cb, uploaded, skipped] { (*cb)((int) LIBMTP_ERROR_NONE, uploaded, skipped); });
+    }
+
+    std::vector <tree_item_t> m_items;
+    uint32_t m_storage;
+    uint32_t m_parent;
+    int m_policy;
+    transfer_job_t m_job;
+    std::shared_ptr <js_function_t> m_cb;
+    std::vector <uint32_t> m_targets;
+    std::unordered_map <uint32_t, folder_listing_t> m_listings;
+    size_t m_index;
+    uint32_t m_uploaded;
+    uint32_t m_skipped;
+};
+
+uint16_t TreeDownloadDataPut(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen) {
+    tree_download_ctx_t *ctx = (tree_download_ctx_t *) priv;
+
+    if (ctx->m_job.isAborted() || !ThrottleTransfer(ctx->m_device, ctx->m_job, sendlen)) {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    if (ctx->m_block.empty()) {
+        ctx->m_block.reserve(WRITE_BLOCK_SIZE);
+    }
+    ctx->m_block.insert(ctx->m_block.end(), data, data + sendlen);
+
+    if (ctx->m_block.size() >= WRITE_BLOCK_SIZE && !ctx->m_writer.write(ctx->m_file, ctx->m_block)) {
+        return LIBMTP_HANDLER_RETURN_ERROR;
+    }
+
+    *putlen = sendlen;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+/**
+ * Downloads a flattened device tree, one node per step, into the local
+ * paths of the nodes. The executor thread only reads from USB: directory
+ * creation, writes, preallocation and syncing run on a write-behind pool,
+ * so the device is asked for the next file while the last one is still
+ * being written.
+ */
+class tree_download_task_t : public scheduler_task_t {
+public:
+    tree_download_task_t(uint32_t weight, const std::vector <tree_item_t> &items, transfer_job_t job,
+                         uint32_t writers, bool sync, std::shared_ptr <js_function_t> cb) :
+            scheduler_task_t(PRIORITY_BULK, weight), m_items(items), m_job(job), m_writers(writers), m_sync(sync),
+            m_cb(cb), m_index(0), m_downloaded(0) {}
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_job.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        if (!m_writer) {
+            m_writer.reset(new write_behind_t(m_writers, write_behind_t::DEFAULT_QUEUE_BYTES, m_sync));
+        }
+
+        if (m_index >= m_items.size()) {
+            if (!m_writer->drain()) {
+                fail(LIBMTP_ERROR_GENERAL);
+                return true;
+            }
+
+            m_job.flush();
+
+            std::shared_ptr <js_function_t> cb = m_cb;
+            uint32_t downloaded = m_downloaded;
+
+            finish([cb, downloaded] { (*cb)((int) LIBMTP_ERROR_NONE, downloaded); });
+
+            return true;
+        }
+
+        tree_item_t &item = m_items[m_index];
+
+        if (item.getIsFolder()) {
+            m_writer->makeDirectory(item.getPath());
+            m_index++;
+            return false;
+        }
+
+        tree_download_ctx_t ctx(device, m_job, *m_writer, m_writer->open(item.getPath(), item.getSize()));
+        int ret;
+
+        m_job.beginFile();
+
+        {
+            device_guard_t guard(device, getPriority());
+            ret = LIBMTP_Get_File_To_Handler(device, item.getId(), TreeDownloadDataPut, (void *) &ctx,
+                                             TransferJobProgressCallback, (const void *) &m_job);
+
+            if (0 != ret) {
+                LIBMTP_Clear_Errorstack(device);
+            }
+        }
+
+        bool completed = 0 == ret && (ctx.m_block.empty() || m_writer->write(ctx.m_file, ctx.m_block));
+
+        m_writer->close(ctx.m_file, completed);
+        m_job.endFile(completed);
+
+        if (!completed) {
+            fail(m_job.isAborted() ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL);
+            return true;
+        }
+
+        m_downloaded++;
+        m_index++;
+
+        return false;
+    }
+
+    void fail(int error) override {
+        std::shared_ptr <js_function_t> cb = m_cb;
+        uint32_t downloaded = m_downloaded;
+
+        finish([cb, error, downloaded] { (*cb)(error, downloaded); });
+    }
+
+private:
+    std::vector <tree_item_t> m_items;
+    transfer_job_t m_job;
+    uint32_t m_writers;
+    bool m_sync;
+    std::shared_ptr <js_function_t> m_cb;
+    std::unique_ptr <write_behind_t> m_writer;
+    size_t m_index;
+    uint32_t m_downloaded;
+};
+
+/* files sent per step of a small-file batch, between two chances to preempt it */
+static const size_t SMALL_FILES_PER_STEP = 64;
+
+class memory_source_t {
+public:
+    memory_source_t() : m_offset(0) {}
+
+    std::vector<unsigned char> m_data;
+    size_t m_offset;
+};
+
+static uint16_t MemorySourceDataGet(void *params, void *priv, uint32_t wantlen, unsigned char *data,
+                                    uint32_t *gotlen) {
+    memory_source_t *source = (memory_source_t *) priv;
+    size_t left = source->m_data.size() - source->m_offset;
+    size_t length = left < wantlen ? left : wantlen;
+
+    memcpy(data, source->m_data.data() + source->m_offset, length);
+    source->m_offset += length;
+    *gotlen = (uint32_t) length;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+/**
+ * Sends many small files into one folder. The destination is checked once
+ * per batch and every file carries its storage and parent, so libmtp never
+ * has to look them up per file. When the addon is built against a libmtp
+ * with LIBMTP_Send_Files_From_Handler_Batch() (see MTP_HAVE_SEND_BATCH),
+ * the object properties are also fetched once per format and the objects
+ * are optionally not read back after sending; the round trips it saved are
+ * reported to the caller. Otherwise libmtp does not tell how many
+ * transactions a send issued, so only the destination checks are counted
+ * and no baseline is reported.
+ */
+class small_files_task_t : public scheduler_task_t {
+public:
+    small_files_task_t(uint32_t weight, const std::vector <tree_item_t> &items, uint32_t storage, uint32_t parent,
+                       bool skipMetadata, transfer_job_t job, std::shared_ptr <js_function_t> cb) :
+            scheduler_task_t(PRIORITY_BULK, weight), m_items(items), m_storage(storage), m_parent(parent),
+            m_skipMetadata(skipMetadata), m_job(job), m_cb(cb), m_checked(false), m_index(0), m_sent(0),
+            m_roundTrips(0), m_baselineRoundTrips(0) {}
+
+    bool step(LIBMTP_mtpdevice_t *device) override {
+        if (m_job.isAborted()) {
+            fail(LIBMTP_ERROR_CANCELLED);
+            return true;
+        }
+
+        device_guard_t guard(device, getPriority());
+
+        if (!m_checked) {
+            if (!checkDestination(device)) {
+                fail(LIBMTP_ERROR_GENERAL);
+                return true;
+            }
+            m_checked = true;
+        }
+
+        size_t end = m_index + SMALL_FILES_PER_STEP < m_items.size() ? m_index + SMALL_FILES_PER_STEP
+                                                                      : m_items.size();
+        std::vector <file_t> files;
+        std::vector <memory_source_t> sources(end - m_index);
+
+        for (size_t i = m_index; i < end; i++) {
+            memory_source_t &source = sources[i - m_index];
+            int fd = OpenFileForRead(m_items[i].getPath().c_str());
+            int64_t size = fd >= 0 ? FileSize(fd) : -1;
+
+            if (size >= 0) {
+                source.m_data.resize((size_t) size);
+                if (ReadFully(fd, source.m_data.data(), source.m_data.size()) != size) {
+                    size = -1;
+                }
+            }
+            if (fd >= 0) {
+                CloseFile(fd);
+            }
+            if (size < 0) {
+                fail(LIBMTP_ERROR_GENERAL);
+                return true;
+            }
+
+            file_t file;
+            file.setName(m_items[i].getName());
+            file.setSize((uint64_t) size);
+            file.setType(ClassifyFile(m_items[i].getName(), source.m_data.data(), source.m_data.size()));
+            file.setParentId(m_parent);
+            file.setStorageId(m_storage);
+            files.push_back(file);
+        }
+
+        int error = send(device, files, sources);
+
+        if (LIBMTP_ERROR_NONE != error) {
+            LIBMTP_Clear_Errorstack(device);
+            fail(error);
+            return true;
+        }
+
+        m_index = end;
+
+        if (m_index < m_items.size()) {
+            return false;
+        }
+
+        m_job.flush();
+
+        std::shared_ptr <js_function_t> cb = m_cb;
+        uint32_t sent = m_sent;
+        uint32_t roundTrips = m_roundTrips;
+        uint32_t baselineRoundTrips = m_baselineRoundTrips;
+
+        finish([cb, sent, roundTrips, baselineRoundTrips] {
+            (*cb)((int) LIBMTP_ERROR_NONE, sent, roundTrips, baselineRoundTrips);
+        });
+
+        return true;
+    }
+
+    void fail(int error) override {
+        std::shared_ptr <js_function_t> cb = m_cb;
+        uint32_t sent = m_sent;
+        uint32_t roundTrips = m_roundTrips;
+        uint32_t baselineRoundTrips = m_baselineRoundTrips;
+
+        finish([cb, error, sent, roundTrips, baselineRoundTrips] {
+            (*cb)(error, sent, roundTrips, baselineRoundTrips);
+        });
+    }
+
+private:
+    bool checkDestination(LIBMTP_mtpdevice_t *device) {
+        if (0 == m_parent || ROOT_FOLDER == m_parent) {
+            if (0 == m_storage && nullptr != device->storage) {
+                m_storage = device->storage->id;
+            }
+            return 0 != m_storage;
+        }
+
+        LIBMTP_file_t *folder = LIBMTP_Get_Filemetadata(device, m_parent);
+        bool valid = nullptr != folder && LIBMTP_FILETYPE_FOLDER == folder->filetype;
+
+        if (valid && 0 == m_storage) {
+            m_storage = folder->storage_id;
+        }
+
+        LIBMTP_destroy_file_t(folder);
+        m_roundTrips++;
+
+        return valid;
+    }
+
+    int send(LIBMTP_mtpdevice_t *device, std::vector <file_t> &files, std::vector <memory_source_t> &sources) {
+#ifdef MTP_HAVE_SEND_BATCH
+        std::vector <LIBMTP_file_t *> metadata;
+        std::vector<void *> privs;
+        LIBMTP_send_batch_stats_t stats;
+
+        for (size_t i = 0; i < files.size(); i++) {
+            metadata.push_back(files[i].get());
+            privs.push_back(&sources[i]);
+        }
+
+        m_job.beginFile();
+        int ret = LIBMTP_Send_Files_From_Handler_Batch(device, m_storage, m_parent, metadata.data(),
+                                                       (uint32_t) metadata.size(), MemorySourceDataGet,
+                                                       privs.data(),
+                                                       m_skipMetadata ? LIBMTP_SEND_BATCH_SKIP_METADATA : 0,
+                                                       TransferJobProgressCallback, (const void *) &m_job, &stats);
+        m_job.endFile(0 == ret);
+
+        m_sent += stats.files;
+        m_roundTrips += stats.round_trips;
+        m_baselineRoundTrips += stats.baseline_round_trips;
+
+        if (0 != ret) {
+            return m_job.isAborted() ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL;
+        }
+#else
+        for (size_t i = 0; i < files.size(); i++) {
+            m_job.beginFile();
+            int ret = LIBMTP_Send_File_From_Handler(device, MemorySourceDataGet, &sources[i], files[i].get(),
+                                                    TransferJobProgressCallback, (const void *) &m_job);
+            m_job.endFile(0 == ret);
+
+            if (0 != ret) {
+                bool aborted = m_job.isAborted();
+
+                if (aborted && 0 != files[i].getId()) {
+                    LIBMTP_Delete_Object(device, files[i].getId());
+                }
+
+                return aborted ? LIBMTP_ERROR_CANCELLED : LIBMTP_ERROR_GENERAL;
+            }
+
+            m_sent++;
+        }
+#endif
+        return LIBMTP_ERROR_NONE;
+    }
+
+    std::vector <tree_item_t> m_items;
+    uint32_t m_storage;
+    uint32_t m_parent;
+    bool m_skipMetadata;
+    transfer_job_t m_job;
+    std::shared_ptr <js_function_t> m_cb;
+    bool m_checked;
+    size_t m_index;
+    uint32_t m_sent;
+    uint32_t m_roundTrips;
+    uint32_t m_baselineRoundTrips;
+};
+
+void Schedule_Upload_Tree(mtpdevice_t device, std::vector <tree_item_t> items, uint32_t const storage,
+                          uint32_t const parent, int const policy, transfer_job_t &job, uint32_t const weight,
+                          js_function_t &cb) {
+    device_executor_t::forDevice(device.m_device)->submit(
+            std::make_shared<tree_upload_task_t>(weight, items, storage, parent, policy, job, MakeJsCallback(cb)));
+}
+
+void Schedule_Download_Tree(mtpdevice_t device, std::vector <tree_item_t> items, transfer_job_t &job,
+                            uint32_t const writers, bool const sync, uint32_t const weight, js_function_t &cb) {
+    device_executor_t::forDevice(device.m_device)->submit(
+            std::make_shared<tree_download_task_t>(weight, items, job, writers, sync, MakeJsCallback(cb)));
+}
+
+void Schedule_Upload_Small_Files(mtpdevice_t device, std::vector <tree_item_t> items, uint32_t const storage,
+                                 uint32_t const parent, bool const skipMetadata, transfer_job_t &job,
+                                 uint32_t const weight, js_function_t &cb) {
+    device_executor_t::forDevice(device.m_device)->submit(
+            std::make_shared<small_files_task_t>(weight, items, storage, parent, skipMetadata, job,
+                                                 MakeJsCallback(cb)));
+}
+
+napi_value js_convert<std::vector <tree_item_t> >::toJs(napi_env env, const std::vector <tree_item_t> &items) {
+    js_columns_t columns(env, items.size(), sizeof(double) + sizeof(int32_t) + sizeof(uint32_t) + sizeof(uint8_t));
+    double *sizes = columns.float64("sizes");
+    int32_t *parents = columns.int32("parents");
+    uint32_t *ids = columns.uint32("ids");
+    uint8_t *folders = columns.uint8("isFolder");
+    std::string names;
+    std::string paths;
+
+    if (!columns.ok()) {
+        return nullptr;
+    }
+
+    for (size_t i = 0; i < items.size(); i++) {
+        const tree_item_t &item = items[i];
+
+        sizes[i] = (double) item.getSize();
+        parents[i] = item.getParent();
+        ids[i] = item.getId();
+        folders[i] = item.getIsFolder() ? 1 : 0;
+        names.append(item.getName()).push_back('\0');
+        paths.append(item.getPath()).push_back('\0');
+    }
+
+    columns.strings("names", names);
+    columns.strings("paths", paths);
+
+    return columns.value();
+}
+
+JS_CLASS(tree_item_t){
+        construct<>();
+        construct<const tree_item_t&>();
+        getset(getName, setName);
+        getset(getPath, setPath);
+        getset(getParent, setParent);
+        getset(getIsFolder, setIsFolder);
+        getset(getSize, setSize);
+        getset(getId, setId);
+}
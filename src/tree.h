@@ -0,0 +1,118 @@
+#ifndef MTP_TREE_H
+#define MTP_TREE_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "binding.h"
+#include "mtp.h"
+#include "transfer.h"
+#include "writebehind.h"
+
+enum tree_conflict_policy_t {
+    CONFLICT_SKIP = 0,
+    CONFLICT_OVERWRITE = 1,
+    CONFLICT_RENAME = 2
+};
+
+/**
+ * One node of a flattened file tree. Nodes are ordered so that a folder
+ * always precedes its children; `parent` is the index of the enclosing
+ * folder node, or -1 for nodes at the top of the tree.
+ */
+class tree_item_t {
+public:
+    tree_item_t() : m_parent(-1), m_folder(false), m_size(0), m_id(0) {}
+
+    tree_item_t(const tree_item_t &item) : m_name(item.m_name), m_path(item.m_path), m_parent(item.m_parent),
+                                           m_folder(item.m_folder), m_size(item.m_size), m_id(item.m_id) {}
+
+    std::string getName() const { return m_name; }
+
+    void setName(const std::string name) { m_name = name; }
+
+    std::string getPath() const { return m_path; }
+
+    void setPath(const std::string path) { m_path = path; }
+
+    int32_t getParent() const { return m_parent; }
+
+    void setParent(const int32_t parent) { m_parent = parent; }
+
+    bool getIsFolder() const { return m_folder; }
+
+    void setIsFolder(const bool folder) { m_folder = folder; }
+
+    uint64_t getSize() const { return m_size; }
+
+    void setSize(const uint64_t size) { m_size = size; }
+
+    uint32_t getId() const { return m_id; }
+
+    void setId(const uint32_t id) { m_id = id; }
+
+private:
+    std::string m_name;
+    std::string m_path;
+    int32_t m_parent;
+    bool m_folder;
+    uint64_t m_size;
+    uint32_t m_id;
+};
+
+/**
+ * Scans go to JS packed into columns like listings, see js_convert for
+ * file_t; tree items coming back from JS may be plain objects.
+ */
+template <>
+struct js_convert<std::vector <tree_item_t> > {
+    typedef std::vector <tree_item_t> holder_t;
+
+    static napi_value toJs(napi_env env, const std::vector <tree_item_t> &items);
+
+    static bool fromJs(napi_env env, napi_value value, holder_t &holder) { return JsToVector(env, value, holder); }
+
+    static std::vector <tree_item_t> &get(holder_t &holder) { return holder; }
+};
+
+/* the objects of one device folder, by name */
+typedef std::unordered_map <std::string, file_t> folder_listing_t;
+
+std::string UniqueName(const folder_listing_t &listing, const std::string &name);
+
+/* device data is handed to the writers in blocks of this size */
+static const size_t WRITE_BLOCK_SIZE = 1024 * 1024;
+
+/**
+ * Download state for TreeDownloadDataPut(), which forwards the data of one
+ * device file to a write-behind file in WRITE_BLOCK_SIZE blocks. The last,
+ * partial block is left in `m_block` for the caller.
+ */
+class tree_download_ctx_t {
+public:
+    tree_download_ctx_t(LIBMTP_mtpdevice_t *device, transfer_job_t &job, write_behind_t &writer, uint32_t file) :
+            m_device(device), m_job(job), m_writer(writer), m_file(file) {}
+
+    LIBMTP_mtpdevice_t *m_device;
+    transfer_job_t &m_job;
+    write_behind_t &m_writer;
+    uint32_t m_file;
+    std::vector<unsigned char> m_block;
+};
+
+uint16_t TreeDownloadDataPut(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen);
+
+void Schedule_Upload_Tree(mtpdevice_t device, std::vector <tree_item_t> items, uint32_t const storage,
+                          uint32_t const parent, int const policy, transfer_job_t &job, uint32_t const weight,
+                          js_function_t &cb);
+
+void Schedule_Download_Tree(mtpdevice_t device, std::vector <tree_item_t> items, transfer_job_t &job,
+                            uint32_t const writers, bool const sync, uint32_t const weight, js_function_t &cb);
+
+void Schedule_Upload_Small_Files(mtpdevice_t device, std::vector <tree_item_t> items, uint32_t const storage,
+                                 uint32_t const parent, bool const skipMetadata, transfer_job_t &job,
+                                 uint32_t const weight, js_function_t &cb);
+
+#endif
@@ -0,0 +1,292 @@
+#include "writebehind.h"
+
+#include "fileio.h"
+
+/**
+ * Creates `path` and all of its missing parents.
+ */
+static bool MakeDirectories(const std::string &path) {
+    for (std::string::size_type pos = path.find_first_of("/\\", 1); std::string::npos != pos;
+         pos = path.find_first_of("/\\", pos + 1)) {
+        MakeDirectory(path.substr(0, pos).c_str());
+    }
+
+    return MakeDirectory(path.c_str());
+}
+
+static std::string ParentDirectory(const std::string &path) {
+    std::string::size_type pos = path.find_last_of("/\\");
+    return std::string::npos == pos || 0 == pos ? std::string() : path.substr(0, pos);
+}
+
+write_behind_t::write_behind_t(uint32_t threads, uint64_t queueBytes, bool sync) :
+        m_queueBytes(queueBytes ? queueBytes : DEFAULT_QUEUE_BYTES), m_queued(0), m_nextFile(0), m_sync(sync),
+        m_stopping(false), m_failed(false) {
+    if (0 == threads) {
+        threads = DEFAULT_THREADS;
+    }
+
+    for (uint32_t i = 0; i < threads; i++) {
+        m_workers.push_back(std::unique_ptr<worker_t>(new worker_t()));
+    }
+
+    for (uint32_t i = 0; i < threads; i++) {
+        m_workers[i]->thread = std::thread(&write_behind_t::run, this, i);
+    }
+}
+
+/**
+ * Finishes every queued operation before the writers are stopped.
+ */
+write_behind_t::~write_behind_t() {
+    drain();
+
+    {
+        std::lock_guard <std::mutex> lk(m_mx);
+        m_stopping = true;
+        m_work.notify_all();
+    }
+
+    for (std::unique_ptr <worker_t> &worker : m_workers) {
+        worker->thread.join();
+    }
+}
+
+void write_behind_t::makeDirectory(const std::string &path) {
+    op_t op;
+    op.kind = OP_MKDIR;
+    op.path = path;
+
+    std::lock_guard <std::mutex> lk(m_mx);
+    push(0, op);
+}
+
+void write_behind_t::rename(const std::string &from, const std::string &to) {
+    op_t op;
+    op.kind = OP_RENAME;
+    op.path = from;
+    op.target = to;
+
+    std::lock_guard <std::mutex> lk(m_mx);
+    push(0, op);
+}
+
+void write_behind_t::remove(const std::string &path, bool folder) {
+    op_t op;
+    op.kind = OP_REMOVE;
+    op.path = path;
+    op.folder = folder;
+
+    std::lock_guard <std::mutex> lk(m_mx);
+    push(0, op);
+}
+
+/**
+ * Queues the creation of a local file. The parent directories are created
+ * and `size` bytes are preallocated by the writer. A non-zero `mtime` is
+ * applied once the file completed.
+ */
+uint32_t write_behind_t::open(const std::string &path, uint64_t size, time_t mtime) {
+    op_t op;
+    op.kind = OP_OPEN;
+    op.path = path;
+    op.size = size;
+    op.mtime = mtime;
+
+    std::lock_guard <std::mutex> lk(m_mx);
+    uint32_t file = op.file = m_nextFile++;
+    push(file % m_workers.size(), op);
+
+    return file;
+}
+
+/**
+ * Queues a block of file data, taking over the content of `data`. Blocks
+ * while the queue is full. Returns false once any write failed.
+ */
+bool write_behind_t::write(uint32_t file, std::vector<unsigned char> &data) {
+    op_t op;
+    op.kind = OP_WRITE;
+    op.file = file;
+    op.data.swap(data);
+
+    std::unique_lock <std::mutex> lk(m_mx);
+
+    // a block larger than the whole queue is admitted once the queue is empty
+    m_space.wait(lk, [this, &op] {
+        return m_failed || 0 == m_queued || m_queued + op.data.size() <= m_queueBytes;
+    });
+
+    if (m_failed) {
+        return false;
+    }
+
+    m_queued += op.data.size();
+    push(file % m_workers.size(), op);
+
+    return true;
+}
+
+/**
+ * Queues the completion of a file: it is synced and closed when the
+ * transfer completed, removed otherwise.
+ */
+void write_behind_t::close(uint32_t file, bool completed) {
+    op_t op;
+    op.kind = OP_CLOSE;
+    op.file = file;
+    op.completed = completed;
+
+    std::lock_guard <std::mutex> lk(m_mx);
+    push(file % m_workers.size(), op);
+}
+
+/**
+ * Waits until every queued operation ran. Returns false if any failed.
+ */
+bool write_behind_t::drain() {
+    std::unique_lock <std::mutex> lk(m_mx);
+
+    m_idle.wait(lk, [this] {
+        for (std::unique_ptr <worker_t> &worker : m_workers) {
+            if (worker->busy || !worker->queue.empty()) {
+                return false;
+            }
+        }
+
+        return true;
+    });
+
+    return !m_failed;
+}
+
+bool write_behind_t::failed() {
+    std::lock_guard <std::mutex> lk(m_mx);
+    return m_failed;
+}
+
+void write_behind_t::push(uint32_t worker, op_t &op) {
+    m_workers[worker]->queue.push_back(op_t());
+    std::swap(m_workers[worker]->queue.back(), op);
+    m_work.notify_all();
+}
+
+void write_behind_t::run(uint32_t index) {
+    worker_t &worker = *m_workers[index];
+
+    while (true) {
+        op_t op;
+
+        {
+            std::unique_lock <std::mutex> lk(m_mx);
+            worker.busy = false;
+            m_idle.notify_all();
+
+            m_work.wait(lk, [this, &worker] { return m_stopping || !worker.queue.empty(); });
+
+            if (worker.queue.empty()) {
+                return;
+            }
+
+            std::swap(op, worker.queue.front());
+            worker.queue.pop_front();
+            worker.busy = true;
+        }
+
+        execute(worker, op);
+
+        if (OP_WRITE == op.kind) {
+            std::lock_guard <std::mutex> lk(m_mx);
+            m_queued -= op.data.size();
+            m_space.notify_all();
+        }
+    }
+}
+
+/**
+ * Runs on the writer thread. The open file table of a worker is only ever
+ * touched by that worker, so it needs no locking.
+ */
+void write_behind_t::execute(worker_t &worker, op_t &op) {
+    bool ok = true;
+
+    switch (op.kind) {
+        case OP_MKDIR:
+            ok = MakeDirectories(op.path);
+            break;
+
+        case OP_RENAME: {
+            std::string parent = ParentDirectory(op.target);
+
+            if (!parent.empty()) {
+                MakeDirectories(parent);
+            }
+
+            ok = 0 == RenameFile(op.path.c_str(), op.target.c_str());
+            break;
+        }
+
+        case OP_REMOVE:
+            ok = op.folder ? RemoveDirectory(op.path.c_str()) : 0 == RemoveFile(op.path.c_str());
+            break;
+
+        case OP_OPEN: {
+            open_file_t &file = worker.files[op.file];
+            std::string parent = ParentDirectory(op.path);
+
+            file.path = op.path;
+            file.mtime = op.mtime;
+
+            if (!parent.empty()) {
+                MakeDirectories(parent);
+            }
+
+            file.fd = OpenFileForWrite(op.path.c_str());
+            file.failed = file.fd < 0;
+            ok = !file.failed;
+
+            if (ok) {
+                PreallocateFile(file.fd, op.size);
+            }
+            break;
+        }
+
+        case OP_WRITE: {
+            open_file_t &file = worker.files[op.file];
+
+            if (!file.failed && !WriteFully(file.fd, op.data.data(), op.data.size())) {
+                file.failed = true;
+                ok = false;
+            }
+            break;
+        }
+
+        case OP_CLOSE: {
+            open_file_t &file = worker.files[op.file];
+            bool keep = op.completed && !file.failed;
+
+            if (file.fd >= 0) {
+                if (keep && m_sync && 0 != SyncFile(file.fd)) {
+                    keep = false;
+                    ok = false;
+                }
+                CloseFile(file.fd);
+            }
+
+            if (!keep && !file.path.empty()) {
+                RemoveFile(file.path.c_str());
+            } else if (keep && 0 != file.mtime) {
+                SetModificationTime(file.path.c_str(), file.mtime);
+            }
+
+            worker.files.erase(op.file);
+            break;
+        }
+    }
+
+    if (!ok) {
+        std::lock_guard <std::mutex> lk(m_mx);
+        m_failed = true;
+        m_space.notify_all();
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef MTP_WRITEBEHIND_H
+#define MTP_WRITEBEHIND_H
+
+#include <stdint.h>
+#include <time.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Local write-behind for downloads.
+ *
+ * The USB reader hands directory creation, file data and file completion
+ * over to a small pool of writer threads and moves on to the next chunk
+ * right away. All operations on one file run in order on the same writer;
+ * different files are written in parallel. The queue is bounded by bytes,
+ * so a slow disk throttles the reader instead of buffering without limit.
+ * Structural operations (directories, renames, removals) all run in order
+ * on the first writer.
+ */
+class write_behind_t {
+public:
+    static const uint32_t DEFAULT_THREADS = 4;
+    static const uint64_t DEFAULT_QUEUE_BYTES = 64 * 1024 * 1024;
+
+    write_behind_t(uint32_t threads, uint64_t queueBytes, bool sync);
+
+    ~write_behind_t();
+
+    void makeDirectory(const std::string &path);
+
+    void rename(const std::string &from, const std::string &to);
+
+    void remove(const std::string &path, bool folder);
+
+    uint32_t open(const std::string &path, uint64_t size, time_t mtime = 0);
+
+    bool write(uint32_t file, std::vector<unsigned char> &data);
+
+    void close(uint32_t file, bool completed);
+
+    bool drain();
+
+    bool failed();
+
+private:
+    enum op_kind_t {
+        OP_MKDIR,
+        OP_RENAME,
+        OP_REMOVE,
+        OP_OPEN,
+        OP_WRITE,
+        OP_CLOSE
+    };
+
+    struct op_t {
+        op_t() : kind(OP_MKDIR), file(0), size(0), mtime(0), completed(false), folder(false) {}
+
+        op_kind_t kind;
+        uint32_t file;
+        std::string path;
+        std::string target;
+        uint64_t size;
+        time_t mtime;
+        bool completed;
+        bool folder;
+        std::vector<unsigned char> data;
+    };
+
+    struct open_file_t {
+        open_file_t() : fd(-1), mtime(0), failed(false) {}
+
+        std::string path;
+        int fd;
+        time_t mtime;
+        bool failed;
+    };
+
+    struct worker_t {
+        worker_t() : busy(false) {}
+
+        std::deque <op_t> queue;
+        std::unordered_map <uint32_t, open_file_t> files;
+        bool busy;
+        std::thread thread;
+    };
+
+    void push(uint32_t worker, op_t &op);
+
+    void run(uint32_t index);
+
+    void execute(worker_t &worker, op_t &op);
+
+    std::mutex m_mx;
+    std::condition_variable m_work;
+    std::condition_variable m_space;
+    std::condition_variable m_idle;
+    std::vector <std::unique_ptr<worker_t>> m_workers;
+    uint64_t m_queueBytes;
+    uint64_t m_queued;
+    uint32_t m_nextFile;
+    bool m_sync;
+    bool m_stopping;
+    bool m_failed;
+};
+
+#endif
@@ -1,6 +1,6 @@
 'use strict';
 
-const MTP = require('./lib').MTP;
+const { MTP, createProgressCounter } = require('./lib');
 const findLodash = require('lodash/find');
 const MTP_FLAGS = require('./lib/mtp-device-flags').FLAGS;
 
@@ -235,6 +235,41 @@ async function run(resetmtp = false, searchDir = null) {
 
   console.log(downloadFileTreeData);*/
 
+  /**
+   * =====================================================================
+   * Download file tree with throttled progress
+   */
+
+  /* const progressCounter = createProgressCounter();
+  const job = mtpObj.createTransferJob({
+    minInterval: 250,
+    minBytes: 1024 * 1024,
+    counter: progressCounter
+  });
+
+  const {
+    error: downloadFileTreeError,
+    data: downloadFileTreeData
+  } = await mtpObj.downloadFileTree({
+    rootNode: true,
+    nodes: listMtpFileTreeData,
+    destinationFilePath: `/Users/ganeshr/Desktop/3`,
+    job,
+    callback: ({ jobSent, jobTotal, file }) => {
+      process.stdout.write(
+        `Downloaded: ${jobSent} / ${jobTotal} (${progressCounter[2]} files), now ${file.name}\n`
+      );
+    }
+  });
+  job.flush();
+
+  if (downloadFileTreeError) {
+    console.error(downloadFileTreeError);
+    return;
+  }
+
+  console.log(downloadFileTreeData);*/
+
   /**
    * =====================================================================
    * Upload file tree
@@ -0,0 +1,242 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const {
+  lib,
+  ERROR_CANCELLED,
+  test,
+  openDevice,
+  tmpdir,
+  makeFolder,
+  sendFile,
+  crc32,
+  exportArchive
+} = require('./helpers');
+
+const LONG_NAME = `${'x'.repeat(120)}.txt`;
+const PHOTO = Buffer.from(Array.from({ length: 20000 }, (_, i) => i % 251));
+
+const cString = data => data.toString('utf8').replace(/\0.*$/s, '');
+
+const parseTar = data => {
+  const entries = [];
+  let longName = null;
+
+  for (let offset = 0; offset + 512 <= data.length; ) {
+    const header = data.subarray(offset, offset + 512);
+
+    if (header.every(byte => byte === 0)) break;
+
+    const checksum = header.reduce(
+      (sum, byte, i) => sum + (i >= 148 && i < 156 ? 0x20 : byte),
+      0
+    );
+
+    assert.strictEqual(
+      checksum,
+      parseInt(cString(header.subarray(148, 156)), 8)
+    );
+
+    const type = String.fromCharCode(header[156]);
+    const size = parseInt(cString(header.subarray(124, 136)), 8);
+    const body = data.subarray(offset + 512, offset + 512 + size);
+    const prefix = cString(header.subarray(345, 500));
+    let name = cString(header.subarray(0, 100));
+
+    offset += 512 + Math.ceil(size / 512) * 512;
+
+    if (type === 'L') {
+      longName = cString(body);
+      continue; // eslint-disable-line no-continue
+    }
+    if (prefix) name = `${prefix}/${name}`;
+    if (longName) name = longName;
+    longName = null;
+
+    entries.push({ name, type, data: Buffer.from(body) });
+  }
+
+  return entries;
+};
+
+const parseZip = data => {
+  let end = data.length - 22;
+
+  while (data.readUInt32LE(end) !== 0x06054b50) end -= 1;
+
+  const count = data.readUInt16LE(end + 10);
+  const entries = [];
+  let offset = data.readUInt32LE(end + 16);
+
+  for (let i = 0; i < count; i += 1) {
+    assert.strictEqual(data.readUInt32LE(offset), 0x02014b50);
+
+    const nameLength = data.readUInt16LE(offset + 28);
+    const local = data.readUInt32LE(offset + 42);
+    const start =
+      local +
+      30 +
+      data.readUInt16LE(local + 26) +
+      data.readUInt16LE(local + 28);
+    const entry = {
+      name: data.toString('utf8', offset + 46, offset + 46 + nameLength),
+      method: data.readUInt16LE(offset + 10),
+      crc: data.readUInt32LE(offset + 16),
+      data: data.subarray(start, start + data.readUInt32LE(offset + 20))
+    };
+
+    assert.strictEqual(data.readUInt32LE(local), 0x04034b50);
+    entries.push(entry);
+    offset +=
+      46 +
+      nameLength +
+      data.readUInt16LE(offset + 30) +
+      data.readUInt16LE(offset + 32);
+  }
+
+  return entries;
+};
+
+const makeSource = (session, name) => {
+  const folderId = makeFolder(session, name);
+
+  sendFile(session, folderId, 'a.jpg', PHOTO, FLAGS.FILETYPE_JPEG);
+
+  const subfolderId = makeFolder(session, 'sub', folderId);
+
+  sendFile(session, subfolderId, 'c.txt', Buffer.from('hello'));
+  sendFile(session, subfolderId, 'empty.txt', Buffer.alloc(0));
+  sendFile(session, folderId, LONG_NAME, Buffer.from('long'));
+
+  return folderId;
+};
+
+test('a subtree exports depth first into a tar file', async () => {
+  const session = openDevice(0);
+  const folderId = makeSource(session, 'export-tar');
+  const dir = tmpdir();
+  const fd = fs.openSync(path.join(dir, 'out.tar'), 'w');
+  const { error, files, bytes } = await exportArchive(
+    session,
+    folderId,
+    'photos',
+    FLAGS.ARCHIVE_TAR,
+    { fd }
+  );
+
+  fs.closeSync(fd);
+
+  assert.strictEqual(error, 0);
+  assert.strictEqual(files, 4);
+  assert.strictEqual(bytes, PHOTO.length + 5 + 4);
+
+  const entries = parseTar(fs.readFileSync(path.join(dir, 'out.tar')));
+
+  assert.deepStrictEqual(
+    entries.map(({ name, type }) => `${type} ${name}`),
+    [
+      '5 photos/',
+      '0 photos/a.jpg',
+      '5 photos/sub/',
+      '0 photos/sub/c.txt',
+      '0 photos/sub/empty.txt',
+      `0 photos/${LONG_NAME}`
+    ]
+  );
+  assert.ok(entries[1].data.equals(PHOTO));
+  assert.strictEqual(entries[3].data.toString(), 'hello');
+  assert.strictEqual(entries[4].data.length, 0);
+  assert.strictEqual(entries[5].data.toString(), 'long');
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a zip export streams through chunks JS acknowledges', async () => {
+  const session = openDevice(0);
+  const folderId = makeSource(session, 'export-zip');
+  const { error, files, data } = await exportArchive(
+    session,
+    folderId,
+    '',
+    FLAGS.ARCHIVE_ZIP,
+    { chunkSize: 1024 }
+  );
+
+  assert.strictEqual(error, 0);
+  assert.strictEqual(files, 4);
+
+  const entries = parseZip(data);
+
+  assert.deepStrictEqual(entries.map(({ name }) => name), [
+    'a.jpg',
+    'sub/',
+    'sub/c.txt',
+    'sub/empty.txt',
+    LONG_NAME
+  ]);
+  entries.forEach(entry => {
+    assert.strictEqual(entry.method, 0);
+    assert.strictEqual(entry.crc, crc32(entry.data));
+  });
+  assert.ok(entries[0].data.equals(PHOTO));
+
+  lib.Release_Device(session.device);
+});
+
+test('a device call from JS in the middle of an export goes through', async () => {
+  const session = openDevice(0);
+  const folderId = makeSource(session, 'export-listing');
+  let listings = 0;
+
+  // device 0 has no partial reads, so a.jpg comes in one libmtp call,
+  // which passes several chunks to JS
+  lib.Set_Scheduler_Chunk_Size(session.device, 4096);
+
+  const { error, data } = await exportArchive(
+    session,
+    folderId,
+    '',
+    FLAGS.ARCHIVE_ZIP,
+    {
+      chunkSize: 1024,
+      onChunk: () => {
+        lib.Get_Files_And_Folders(session.device, session.storageId, folderId);
+        listings += 1;
+      }
+    }
+  );
+
+  assert.strictEqual(error, 0);
+  assert.ok(listings > 1);
+  assert.ok(parseZip(data)[0].data.equals(PHOTO));
+
+  lib.Set_Scheduler_Chunk_Size(session.device, 0);
+  lib.Release_Device(session.device);
+});
+
+test('an aborted export calls back cancelled', async () => {
+  const session = openDevice(0);
+  const folderId = makeSource(session, 'export-abort');
+  const job = new lib.transfer_job_t(); // eslint-disable-line new-cap
+  const token = new lib.abort_token_t(); // eslint-disable-line new-cap
+
+  job.setAbortToken(token);
+  job.setRateLimit(4096, 4096);
+  setTimeout(() => token.abort(), 100);
+
+  const { error } = await exportArchive(
+    session,
+    folderId,
+    '',
+    FLAGS.ARCHIVE_TAR,
+    { job }
+  );
+
+  assert.strictEqual(error, ERROR_CANCELLED);
+
+  lib.Release_Device(session.device);
+});
@@ -0,0 +1,51 @@
+{
+	# The addon linked against fake/libmtp.c, an in-memory device, so the
+	# tests run without a phone attached. Built by "npm test". The fake has
+	# LIBMTP_Update_Object_Cache(), so the object cache deltas are tested too
+	"targets": [
+		{
+			"target_name": "mtp",
+			"sources": [
+				"../src/binding.cc",
+				"../src/mtp.cc",
+				"../src/transfer.cc",
+				"../src/dispatcher.cc",
+				"../src/registry.cc",
+				"../src/executor.cc",
+				"../src/scheduler.cc",
+				"../src/ratelimit.cc",
+				"../src/journal.cc",
+				"../src/tree.cc",
+				"../src/writebehind.cc",
+				"../src/sync.cc",
+				"../src/checksum.cc",
+				"../src/cache.cc",
+				"../src/readcache.cc",
+				"../src/thumbnail.cc",
+				"../src/archive.cc",
+				"../src/extract.cc",
+				"../src/scan.cc",
+				"../src/filetype.cc",
+				"fake/libmtp.c"
+			],
+			"include_dirs": [
+				"../src/inc"
+			],
+			"defines": [
+				"NAPI_VERSION=8",
+				"MTP_HAVE_CACHE_EVENTS"
+			],
+			"cflags_cc!": [
+				"-fno-exceptions"
+			],
+			"cflags_cc": [
+				"-std=c++11"
+			],
+			"xcode_settings": {
+				"GCC_ENABLE_CPP_EXCEPTIONS": "YES",
+				"CLANG_CXX_LANGUAGE_STANDARD": "c++11",
+				"MACOSX_DEPLOYMENT_TARGET": "10.10"
+			}
+		}
+	]
+}
@@ -0,0 +1,152 @@
+'use strict';
+
+const assert = require('assert');
+const crypto = require('crypto');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const {
+  lib,
+  test,
+  openDevice,
+  tmpdir,
+  makeFolder,
+  sendFile
+} = require('./helpers');
+
+const sha256 = data => crypto.createHash('sha256').update(data).digest('hex');
+
+/* device objects by name */
+const listFolder = ({ device, storageId }, folderId) =>
+  unpackFiles(lib.Get_Files_And_Folders(device, storageId, folderId)).reduce(
+    (files, file) => Object.assign(files, { [file.name]: file }),
+    {}
+  );
+
+/* download_cache_t::keyFor, hashed into the entry name */
+const entryName = ({ device }, { id, size, modificationDate }) =>
+  `${sha256(
+    `${lib.Get_Serialnumber(device)}:${id}:${size}:${modificationDate}`
+  )}.obj`;
+
+test('the download cache serves hits and evicts the least recently used', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'cache-lru');
+  const dir = tmpdir();
+  const cacheDir = path.join(dir, 'cache');
+  const cache = new lib.download_cache_t(); // eslint-disable-line new-cap
+
+  ['a', 'b', 'c'].forEach(name =>
+    sendFile(session, folderId, name, Buffer.from(`${name}${name}${name}..`))
+  );
+
+  const files = listFolder(session, folderId);
+  const get = name => {
+    const job = new lib.transfer_job_t(); // eslint-disable-line new-cap
+    const out = path.join(dir, name);
+
+    job.checksum = FLAGS.CHECKSUM_SHA256;
+    assert.strictEqual(
+      lib.Get_File_To_File_Cached(
+        session.device,
+        files[name].id,
+        out,
+        cache,
+        job
+      ),
+      0
+    );
+
+    const data = fs.readFileSync(out, 'utf8');
+
+    // the digest covers the data whether it came from the device or not
+    assert.strictEqual(job.digest, sha256(data));
+
+    return data;
+  };
+  const stats = () => ({
+    entries: cache.entries,
+    size: cache.size,
+    hits: cache.hits,
+    misses: cache.misses
+  });
+  const cached = () => fs.readdirSync(cacheDir).sort();
+
+  // room for two of the 5 byte objects
+  assert.ok(cache.open(cacheDir, 12));
+
+  assert.strictEqual(get('a'), 'aaa..');
+  assert.deepStrictEqual(stats(), { entries: 1, size: 5, hits: 0, misses: 1 });
+  assert.deepStrictEqual(cached(), [entryName(session, files.a)]);
+
+  assert.strictEqual(get('a'), 'aaa..');
+  assert.strictEqual(get('b'), 'bbb..');
+  assert.deepStrictEqual(stats(), {
+    entries: 2,
+    size: 10,
+    hits: 1,
+    misses: 2
+  });
+
+  // a was used after b, so b makes room for c
+  get('a');
+  get('c');
+  assert.deepStrictEqual(stats(), {
+    entries: 2,
+    size: 10,
+    hits: 2,
+    misses: 3
+  });
+  assert.deepStrictEqual(
+    cached(),
+    [entryName(session, files.a), entryName(session, files.c)].sort()
+  );
+
+  get('b');
+  assert.strictEqual(cache.misses, 4);
+
+  cache.close();
+
+  // entries survive a restart, unfinished downloads do not
+  fs.writeFileSync(path.join(cacheDir, '1-1.part'), 'partial');
+
+  const reopened = new lib.download_cache_t(); // eslint-disable-line new-cap
+
+  assert.ok(reopened.open(cacheDir, 0));
+  assert.strictEqual(reopened.entries, 2);
+  assert.strictEqual(reopened.size, 10);
+  assert.ok(!cached().includes('1-1.part'));
+
+  assert.ok(reopened.clear());
+  assert.deepStrictEqual(cached(), []);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a ranged read of a small object fills the cache and reads it locally', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'cache-range');
+  const dir = tmpdir();
+  const cache = new lib.download_cache_t(); // eslint-disable-line new-cap
+  const buffer = Buffer.alloc(4);
+
+  assert.ok(cache.open(path.join(dir, 'cache'), 0));
+  sendFile(session, folderId, 'a.txt', Buffer.from('0123456789'));
+
+  const { id } = listFolder(session, folderId)['a.txt'];
+
+  // the device has no partial reads, so only the cache can serve the range
+  const read = offset =>
+    lib.Read_File_Range(session.device, id, offset, buffer, cache);
+
+  assert.strictEqual(read(3), 4);
+  assert.strictEqual(buffer.toString(), '3456');
+  assert.strictEqual(read(8), 2);
+  assert.strictEqual(buffer.toString('utf8', 0, 2), '89');
+  assert.deepStrictEqual([cache.hits, cache.misses], [1, 1]);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
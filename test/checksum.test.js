@@ -0,0 +1,120 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const { lib, test, openDevice, tmpdir, makeFolder } = require('./helpers');
+
+const pattern = length =>
+  Buffer.from(Array.from({ length }, (_, i) => i % 251));
+
+/* data, XXH64 with seed 0, SHA-256 */
+const VECTORS = [
+  [
+    Buffer.alloc(0),
+    'ef46db3751d8e999',
+    'e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855'
+  ],
+  [
+    Buffer.from('abc'),
+    '44bc2cf5ad770999',
+    'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad'
+  ],
+  [
+    Buffer.from('Nobody inspects the spammish repetition'),
+    'fbcea83c8a378bf1',
+    '031edd7d41651593c5fe5c006fa5752b37fddff7bc4e843aa6af0c950f4b9406'
+  ],
+  // more than one transfer chunk, and neither a multiple of a stripe nor of
+  // a block
+  [
+    pattern(100003),
+    'cbab15ce50b1eb20',
+    '635e9a7d2f64ce04a46b1503cbe287b8721795f215f4b8cf24b256908acaab1a'
+  ]
+];
+
+const newJob = checksum => {
+  const job = new lib.transfer_job_t(); // eslint-disable-line new-cap
+
+  job.checksum = checksum;
+
+  return job;
+};
+
+const roundTrip = (session, folderId, dir, data, checksum) => {
+  const name = `${checksum}-${data.length}.bin`;
+  const file = new lib.file_t(); // eslint-disable-line new-cap
+  const sent = newJob(checksum);
+  const received = newJob(checksum);
+
+  fs.writeFileSync(path.join(dir, name), data);
+  file.name = name;
+  file.size = data.length;
+  file.type = FLAGS.FILETYPE_UNKNOWN;
+  file.parentId = folderId;
+  file.storageId = session.storageId;
+
+  assert.strictEqual(
+    lib.Send_File_From_File_Job(
+      session.device,
+      path.join(dir, name),
+      file,
+      sent
+    ),
+    0
+  );
+
+  const { id } = unpackFiles(
+    lib.Get_Files_And_Folders(session.device, session.storageId, folderId)
+  ).find(object => object.name === name);
+
+  assert.strictEqual(
+    lib.Get_File_To_File_Job(
+      session.device,
+      id,
+      path.join(dir, `${name}.out`),
+      received
+    ),
+    0
+  );
+  assert.ok(fs.readFileSync(path.join(dir, `${name}.out`)).equals(data));
+
+  return { sent: sent.digest, received: received.digest };
+};
+
+test('transfers hash their data into the reference digests', () => {
+  const session = openDevice(1);
+  const folderId = makeFolder(session, 'checksum-vectors');
+  const dir = tmpdir();
+
+  VECTORS.forEach(([data, xxh64, sha256]) => {
+    assert.deepStrictEqual(
+      roundTrip(session, folderId, dir, data, FLAGS.CHECKSUM_XXH64),
+      { sent: xxh64, received: xxh64 }
+    );
+    assert.deepStrictEqual(
+      roundTrip(session, folderId, dir, data, FLAGS.CHECKSUM_SHA256),
+      { sent: sha256, received: sha256 }
+    );
+  });
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a job without a checksum reports no digest', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'checksum-none');
+  const dir = tmpdir();
+
+  assert.deepStrictEqual(
+    roundTrip(session, folderId, dir, pattern(1000), FLAGS.CHECKSUM_NONE),
+    { sent: '', received: '' }
+  );
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
@@ -0,0 +1,87 @@
+'use strict';
+
+const assert = require('assert');
+const { unpackFiles } = require('../lib/unpack');
+const {
+  lib,
+  ROOT,
+  test,
+  openDevice,
+  makeFolder,
+  sendFile
+} = require('./helpers');
+
+/* LIBMTP_event_t */
+const OBJECT_ADDED = 3;
+const OBJECT_REMOVED = 4;
+
+const list = ({ device, storageId }, folderId) =>
+  unpackFiles(lib.Get_Files_And_Folders(device, storageId, folderId));
+
+const names = (session, folderId) =>
+  list(session, folderId).map(({ name }) => name);
+
+test('object events patch the object cache of a cached device', () => {
+  // both raw devices open onto the same storage, so what one of them creates
+  // is news to the other one
+  const watcher = openDevice(1);
+  const writer = openDevice(0);
+  const folderId = makeFolder(watcher, 'events');
+  const cache = new lib.download_cache_t(); // eslint-disable-line new-cap
+
+  sendFile(writer, folderId, 'a.bin', Buffer.alloc(100, 7));
+
+  const [{ id }] = list(writer, folderId);
+
+  assert.deepStrictEqual(names(watcher, folderId), []);
+  assert.strictEqual(
+    lib.Update_Object_Cache(watcher.device, OBJECT_ADDED, id),
+    0
+  );
+  assert.deepStrictEqual(names(watcher, folderId), ['a.bin']);
+
+  // a removal drops the read cache blocks of the object along with it
+  const buffer = Buffer.alloc(10);
+
+  assert.strictEqual(
+    lib.Read_File_Range(watcher.device, id, 0, buffer, cache),
+    10
+  );
+  lib.Destroy_file(writer.device, id);
+  assert.strictEqual(
+    lib.Read_File_Range(watcher.device, id, 0, buffer, cache),
+    10
+  );
+  assert.strictEqual(
+    lib.Update_Object_Cache(watcher.device, OBJECT_REMOVED, id),
+    0
+  );
+  assert.ok(lib.Read_File_Range(watcher.device, id, 0, buffer, cache) < 0);
+  assert.deepStrictEqual(names(watcher, folderId), []);
+
+  lib.Release_Device(writer.device);
+  lib.Release_Device(watcher.device);
+});
+
+test('an object whose parent is not cached drops the object cache', () => {
+  const watcher = openDevice(1);
+  const writer = openDevice(0);
+  const folderId = makeFolder(writer, 'events-unknown');
+
+  sendFile(writer, folderId, 'b.bin', Buffer.alloc(10));
+
+  const [{ id }] = list(writer, folderId);
+
+  assert.ok(!names(watcher, ROOT).includes('events-unknown'));
+
+  // the next listing reloads every object, the new folder included
+  assert.strictEqual(
+    lib.Update_Object_Cache(watcher.device, OBJECT_ADDED, id),
+    -1
+  );
+  assert.ok(names(watcher, ROOT).includes('events-unknown'));
+  assert.deepStrictEqual(names(watcher, folderId), ['b.bin']);
+
+  lib.Release_Device(writer.device);
+  lib.Release_Device(watcher.device);
+});
@@ -0,0 +1,136 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const {
+  lib,
+  test,
+  openDevice,
+  releaseDevice,
+  tmpdir,
+  makeFolder,
+  sendFile
+} = require('./helpers');
+
+const KiB = 1024;
+const MiB = 1024 * KiB;
+
+/* device object ids by name */
+const fileIds = ({ device, storageId }, folderId) =>
+  unpackFiles(lib.Get_Files_And_Folders(device, storageId, folderId)).reduce(
+    (ids, { name, id }) => Object.assign(ids, { [name]: id }),
+    {}
+  );
+
+const download = (session, id, filePath, weight, done) =>
+  new Promise(resolve =>
+    lib.Schedule_Get_File_To_File(
+      session.device,
+      id,
+      filePath,
+      new lib.transfer_job_t(), // eslint-disable-line new-cap
+      weight,
+      error => {
+        done();
+        resolve(error);
+      }
+    )
+  );
+
+const metadata = (session, id, priority, done) =>
+  new Promise(resolve =>
+    lib.Schedule_Get_Filemetadata(session.device, id, priority, file => {
+      done();
+      resolve(file);
+    })
+  );
+
+test('an interactive call overtakes queued work between bulk chunks', async () => {
+  const session = openDevice(1);
+  const folderId = makeFolder(session, 'executor-priority');
+
+  sendFile(session, folderId, 'big.bin', Buffer.alloc(4 * MiB));
+  sendFile(session, folderId, 'small.txt', Buffer.from('hi'));
+
+  const { 'big.bin': bigId, 'small.txt': smallId } = fileIds(session, folderId);
+  const dir = tmpdir();
+  const order = [];
+  const pending = [];
+
+  lib.Set_Scheduler_Chunk_Size(session.device, 16 * KiB);
+
+  pending.push(
+    download(session, bigId, path.join(dir, 'a.bin'), 1, () =>
+      order.push('bulk')
+    )
+  );
+
+  // holding the device in a call of our own parks the executor between
+  // chunks, so everything queued meanwhile waits for the same pick
+  let queued = false;
+
+  lib.Get_File_To_File(session.device, smallId, path.join(dir, 's'), () => {
+    if (!queued) {
+      queued = true;
+      pending.push(
+        metadata(session, smallId, FLAGS.SCHEDULER_PRIORITY_NORMAL, () =>
+          order.push('normal')
+        ),
+        metadata(session, smallId, FLAGS.SCHEDULER_PRIORITY_INTERACTIVE, () =>
+          order.push('interactive')
+        )
+      );
+    }
+  });
+
+  assert.ok(queued);
+
+  const [error] = await Promise.all(pending);
+
+  assert.strictEqual(error, 0);
+  assert.deepStrictEqual(order, ['interactive', 'normal', 'bulk']);
+  assert.strictEqual(fs.statSync(path.join(dir, 'a.bin')).size, 4 * MiB);
+
+  lib.Set_Scheduler_Chunk_Size(session.device, 0);
+  fs.rmSync(dir, { recursive: true });
+  await releaseDevice(session);
+});
+
+test('bulk transfers share the device by weight', async () => {
+  const session = openDevice(1);
+  const folderId = makeFolder(session, 'executor-weight');
+  const data = Buffer.alloc(2 * MiB);
+
+  sendFile(session, folderId, 'light.bin', data);
+  sendFile(session, folderId, 'heavy.bin', data);
+
+  const { 'light.bin': lightId, 'heavy.bin': heavyId } = fileIds(
+    session,
+    folderId
+  );
+  const dir = tmpdir();
+  const order = [];
+
+  lib.Set_Scheduler_Chunk_Size(session.device, 16 * KiB);
+
+  // the light transfer starts first, but the heavy one gets four chunks a
+  // turn and finishes well ahead of it
+  const errors = await Promise.all([
+    download(session, lightId, path.join(dir, 'light.bin'), 1, () =>
+      order.push('light')
+    ),
+    download(session, heavyId, path.join(dir, 'heavy.bin'), 4, () =>
+      order.push('heavy')
+    )
+  ]);
+
+  assert.deepStrictEqual(errors, [0, 0]);
+  assert.deepStrictEqual(order, ['heavy', 'light']);
+
+  lib.Set_Scheduler_Chunk_Size(session.device, 0);
+  fs.rmSync(dir, { recursive: true });
+  await releaseDevice(session);
+});
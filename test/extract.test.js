@@ -0,0 +1,386 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const zlib = require('zlib');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const {
+  lib,
+  ROOT,
+  ERROR_GENERAL,
+  test,
+  openDevice,
+  tmpdir,
+  makeFolder,
+  sendFile,
+  readTree,
+  crc32,
+  exportArchive,
+  importArchive
+} = require('./helpers');
+
+const tarHeader = (name, size, type) => {
+  const header = Buffer.alloc(512);
+
+  header.write(name, 0, 100);
+  header.write('0000644\0', 100);
+  header.write('0000000\0', 108);
+  header.write('0000000\0', 116);
+  header.write(`${size.toString(8).padStart(11, '0')}\0`, 124);
+  header.write('14500000000\0', 136);
+  header.write(' '.repeat(8), 148);
+  header.write(type, 156);
+  header.write('ustar\0', 257);
+  header.write('00', 263);
+
+  const checksum = header.reduce((sum, byte) => sum + byte, 0);
+
+  header.write(`${checksum.toString(8).padStart(6, '0')}\0 `, 148);
+
+  return header;
+};
+
+const tarEntry = (name, data = Buffer.alloc(0), type = '0') =>
+  Buffer.concat([
+    tarHeader(name, data.length, type),
+    data,
+    Buffer.alloc((512 - (data.length % 512)) % 512)
+  ]);
+
+const paxEntry = (name, data) => {
+  const record = ` path=${name}\n`;
+  let length = record.length;
+
+  length += String(length + String(length).length).length;
+
+  return Buffer.concat([
+    tarEntry('PaxHeader', Buffer.from(`${length}${record}`), 'x'),
+    tarEntry('ignored.txt', data)
+  ]);
+};
+
+const longNameEntry = (name, data) =>
+  Buffer.concat([
+    tarEntry('././@LongLink', Buffer.from(`${name}\0`), 'L'),
+    tarEntry(name.slice(0, 99), data)
+  ]);
+
+/* stored or deflated entries, with the sizes in the local headers */
+const zipArchive = entries => {
+  const locals = [];
+  const centrals = [];
+  let offset = 0;
+
+  entries.forEach(({ name, data, deflate = false, crc = crc32(data) }) => {
+    const packed = deflate ? zlib.deflateRawSync(data) : data;
+    const local = Buffer.alloc(30);
+    const central = Buffer.alloc(46);
+
+    local.writeUInt32LE(0x04034b50, 0);
+    local.writeUInt16LE(20, 4);
+    local.writeUInt16LE(deflate ? 8 : 0, 8);
+    local.writeUInt16LE(0, 10);
+    local.writeUInt16LE((44 << 9) | (1 << 5) | 1, 12); // eslint-disable-line no-bitwise
+    local.writeUInt32LE(crc, 14);
+    local.writeUInt32LE(packed.length, 18);
+    local.writeUInt32LE(data.length, 22);
+    local.writeUInt16LE(Buffer.byteLength(name), 26);
+
+    central.writeUInt32LE(0x02014b50, 0);
+    central.writeUInt16LE(20, 4);
+    central.writeUInt16LE(20, 6);
+    local.copy(central, 10, 8, 30);
+    central.writeUInt32LE(offset, 42);
+
+    locals.push(local, Buffer.from(name), packed);
+    centrals.push(central, Buffer.from(name));
+    offset += 30 + Buffer.byteLength(name) + packed.length;
+  });
+
+  const directory = Buffer.concat(centrals);
+  const end = Buffer.alloc(22);
+
+  end.writeUInt32LE(0x06054b50, 0);
+  end.writeUInt16LE(entries.length, 8);
+  end.writeUInt16LE(entries.length, 10);
+  end.writeUInt32LE(directory.length, 12);
+  end.writeUInt32LE(offset, 16);
+
+  return Buffer.concat([...locals, directory, end]);
+};
+
+const importFile = async (session, folderId, format, data, options = {}) => {
+  const dir = tmpdir();
+  const filePath = path.join(dir, 'archive');
+
+  fs.writeFileSync(filePath, data);
+
+  const fd = fs.openSync(filePath, 'r');
+  const result = await importArchive(
+    session,
+    folderId,
+    format,
+    Object.assign({ fd }, options)
+  );
+
+  fs.closeSync(fd);
+  fs.rmSync(dir, { recursive: true });
+
+  return result;
+};
+
+const SOURCE = {
+  'a.jpg': Buffer.from(Array.from({ length: 70000 }, (_, i) => i % 253)),
+  'sub/': null,
+  'sub/c.txt': Buffer.from('hello'),
+  'sub/empty.txt': Buffer.alloc(0),
+  'sub/deeper/': null,
+  'sub/deeper/d.txt': Buffer.from('deep')
+};
+
+const makeSource = (session, name) => {
+  const folderIds = { '': makeFolder(session, name) };
+
+  Object.keys(SOURCE).forEach(key => {
+    const parent = key.replace(/[^/]+\/?$/, '');
+    const base = key.slice(parent.length);
+
+    if (SOURCE[key] === null) {
+      folderIds[key] = makeFolder(session, base.slice(0, -1), folderIds[parent]);
+    } else {
+      sendFile(session, folderIds[parent], base, SOURCE[key]);
+    }
+  });
+
+  return folderIds[''];
+};
+
+[FLAGS.ARCHIVE_TAR, FLAGS.ARCHIVE_ZIP].forEach(format => {
+  const kind = format === FLAGS.ARCHIVE_TAR ? 'tar' : 'zip';
+
+  test(`a ${kind} export imports back unchanged`, async () => {
+    const session = openDevice(0);
+    const sourceId = makeSource(session, `roundtrip-${kind}`);
+    const { error, data } = await exportArchive(
+      session,
+      sourceId,
+      '',
+      format
+    );
+
+    assert.strictEqual(error, 0);
+
+    const fromFile = makeFolder(session, `roundtrip-${kind}-file`);
+    const fromStream = makeFolder(session, `roundtrip-${kind}-stream`);
+
+    assert.deepStrictEqual(await importFile(session, fromFile, format, data), {
+      error: 0,
+      imported: 4,
+      skipped: 0
+    });
+    assert.deepStrictEqual(
+      await importArchive(session, fromStream, format, {
+        data,
+        chunkSize: 1000
+      }),
+      { error: 0, imported: 4, skipped: 0 }
+    );
+    assert.deepStrictEqual(readTree(session, fromFile), SOURCE);
+    assert.deepStrictEqual(readTree(session, fromStream), SOURCE);
+
+    lib.Release_Device(session.device);
+  });
+});
+
+test('a folder listed in the middle of an import goes through', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'extract-listing');
+  const data = Buffer.concat([
+    tarEntry('a.jpg', SOURCE['a.jpg']),
+    tarEntry('b.txt', Buffer.from('b')),
+    Buffer.alloc(1024)
+  ]);
+  let listings = 0;
+
+  const result = await importArchive(session, folderId, FLAGS.ARCHIVE_TAR, {
+    data,
+    chunkSize: 1000,
+    onNeed: () => {
+      lib.Get_Files_And_Folders(session.device, session.storageId, folderId);
+      listings += 1;
+    }
+  });
+
+  assert.deepStrictEqual(result, { error: 0, imported: 2, skipped: 0 });
+  assert.ok(listings > 70);
+  assert.ok(readTree(session, folderId)['a.jpg'].equals(SOURCE['a.jpg']));
+
+  lib.Release_Device(session.device);
+});
+
+test('a large streamed entry is staged in a temporary file', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'extract-large');
+  const large = Buffer.alloc(9 * 1024 * 1024, 7);
+
+  large.write('end', large.length - 3);
+
+  const result = await importArchive(session, folderId, FLAGS.ARCHIVE_ZIP, {
+    data: zipArchive([{ name: 'large.bin', data: large }]),
+    chunkSize: 256 * 1024
+  });
+
+  assert.deepStrictEqual(result, { error: 0, imported: 1, skipped: 0 });
+  assert.ok(readTree(session, folderId)['large.bin'].equals(large));
+
+  lib.Release_Device(session.device);
+});
+
+test('tar entries leaving the destination are skipped', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'extract-tar');
+  const paxName = `pax/${'p'.repeat(150)}.txt`;
+  const longName = `${'q'.repeat(130)}.txt`;
+  const archive = Buffer.concat([
+    tarEntry('../evil.txt', Buffer.from('evil')),
+    tarEntry('ok/../../x.txt', Buffer.from('evil')),
+    tarEntry('a\\..\\..\\w.txt', Buffer.from('evil')),
+    tarEntry('./dot/./y.txt', Buffer.from('y')),
+    tarEntry('link', Buffer.alloc(0), '2'),
+    paxEntry(paxName, Buffer.from('pax')),
+    longNameEntry(longName, Buffer.from('long')),
+    tarEntry('good.txt', Buffer.from('good')),
+    Buffer.alloc(1024)
+  ]);
+  const before = readTree(session, ROOT);
+
+  assert.deepStrictEqual(
+    await importArchive(session, folderId, FLAGS.ARCHIVE_TAR, {
+      data: archive,
+      chunkSize: 700
+    }),
+    { error: 0, imported: 4, skipped: 4 }
+  );
+  assert.deepStrictEqual(readTree(session, folderId), {
+    'dot/': null,
+    'dot/y.txt': Buffer.from('y'),
+    'pax/': null,
+    [paxName]: Buffer.from('pax'),
+    [longName]: Buffer.from('long'),
+    'good.txt': Buffer.from('good')
+  });
+
+  const after = readTree(session, ROOT);
+
+  // nothing was written outside of the destination folder
+  Object.keys(before).forEach(key => delete after[key]);
+  assert.deepStrictEqual(Object.keys(after), [
+    'extract-tar/dot/',
+    'extract-tar/dot/y.txt',
+    'extract-tar/pax/',
+    `extract-tar/${paxName}`,
+    `extract-tar/${longName}`,
+    'extract-tar/good.txt'
+  ]);
+
+  lib.Release_Device(session.device);
+});
+
+test('zip entries are read from the central directory or in order', async () => {
+  const session = openDevice(0);
+  const text = Buffer.from('deflated '.repeat(1000));
+  const archive = zipArchive([
+    { name: '../z.txt', data: Buffer.from('evil') },
+    { name: 'dir/', data: Buffer.alloc(0) },
+    { name: 'dir/fine.txt', data: Buffer.from('fine') },
+    { name: 'deflated.txt', data: text, deflate: true }
+  ]);
+  const expected = {
+    'dir/': null,
+    'dir/fine.txt': Buffer.from('fine'),
+    'deflated.txt': text
+  };
+  const fromFile = makeFolder(session, 'extract-zip-file');
+  const fromStream = makeFolder(session, 'extract-zip-stream');
+
+  assert.deepStrictEqual(
+    await importFile(session, fromFile, FLAGS.ARCHIVE_ZIP, archive),
+    { error: 0, imported: 2, skipped: 1 }
+  );
+  assert.deepStrictEqual(
+    await importArchive(session, fromStream, FLAGS.ARCHIVE_ZIP, {
+      data: archive,
+      chunkSize: 100
+    }),
+    { error: 0, imported: 2, skipped: 1 }
+  );
+  assert.deepStrictEqual(readTree(session, fromFile), expected);
+  assert.deepStrictEqual(readTree(session, fromStream), expected);
+
+  lib.Release_Device(session.device);
+});
+
+test('a damaged entry fails the import and is not left behind', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'extract-damaged');
+  const archive = zipArchive([
+    { name: 'first.txt', data: Buffer.from('first') },
+    { name: 'broken.txt', data: Buffer.from('broken'), crc: 1234 }
+  ]);
+  const { error, imported } = await importFile(
+    session,
+    folderId,
+    FLAGS.ARCHIVE_ZIP,
+    archive
+  );
+
+  assert.strictEqual(error, ERROR_GENERAL);
+  assert.strictEqual(imported, 1);
+  assert.deepStrictEqual(readTree(session, folderId), {
+    'first.txt': Buffer.from('first')
+  });
+
+  lib.Release_Device(session.device);
+});
+
+test('name conflicts follow the conflict policy', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'extract-conflicts');
+  const archive = Buffer.concat([
+    tarEntry('a.txt', Buffer.from('new')),
+    tarEntry('b.txt', Buffer.from('new')),
+    Buffer.alloc(1024)
+  ]);
+  const run = policy =>
+    importArchive(session, folderId, FLAGS.ARCHIVE_TAR, {
+      data: archive,
+      policy
+    });
+
+  sendFile(session, folderId, 'a.txt', Buffer.from('old'));
+
+  assert.deepStrictEqual(await run(FLAGS.CONFLICT_SKIP), {
+    error: 0,
+    imported: 1,
+    skipped: 1
+  });
+  assert.deepStrictEqual(await run(FLAGS.CONFLICT_RENAME), {
+    error: 0,
+    imported: 2,
+    skipped: 0
+  });
+  assert.deepStrictEqual(await run(FLAGS.CONFLICT_OVERWRITE), {
+    error: 0,
+    imported: 2,
+    skipped: 0
+  });
+  assert.deepStrictEqual(readTree(session, folderId), {
+    'a (1).txt': Buffer.from('new'),
+    'b (1).txt': Buffer.from('new'),
+    'a.txt': Buffer.from('new'),
+    'b.txt': Buffer.from('new')
+  });
+
+  lib.Release_Device(session.device);
+});
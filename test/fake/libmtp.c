@@ -0,0 +1,644 @@
+/**
+ * In-memory stand-in for libmtp, linked into the test build of the addon.
+ *
+ * Every detected raw device opens onto the same storage, whose objects live
+ * in a list in memory. The first raw device has no partial object support,
+ * so transfers run as a single libmtp call; the second one has it, so the
+ * scheduler moves the data chunk by chunk. libmtp calls move the data in
+ * FAKE_CHUNK sized pieces through the handlers and progress callbacks, the
+ * way libmtp does over USB, so throttling, aborting and streaming see more
+ * than a single call.
+ *
+ * A device opened cached lists only the objects in its object cache, the
+ * IDs it saw when the cache was loaded plus those it created itself. Objects
+ * created through another device show up once LIBMTP_Update_Object_Cache()
+ * adds them, or once a dropped cache is loaded again.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmtp.h"
+
+#define FAKE_STORAGE 0x00010001
+#define FAKE_ROOT 0xffffffff
+#define FAKE_CHUNK 16384
+#define FAKE_RAW_DEVICES 2
+
+typedef struct fake_object_struct {
+  uint32_t id;
+  uint32_t parent_id;
+  uint32_t storage_id;
+  char *name;
+  LIBMTP_filetype_t type;
+  unsigned char *data;
+  uint64_t size;
+  time_t mtime;
+  struct fake_object_struct *next;
+} fake_object_t;
+
+typedef struct {
+  LIBMTP_mtpdevice_t device;
+  int partial;
+  int cached;
+  /* the object cache, loaded by the next listing while `loaded` is 0 */
+  int loaded;
+  uint32_t *known;
+  size_t nknown;
+} fake_device_t;
+
+static pthread_mutex_t g_mx = PTHREAD_MUTEX_INITIALIZER;
+static fake_object_t *g_objects = NULL;
+static uint32_t g_next_id = 1;
+
+/* root objects have parent 0, the listing of the root asks for FAKE_ROOT */
+static uint32_t fake_parent(uint32_t parent)
+{
+  return parent == FAKE_ROOT ? 0 : parent;
+}
+
+static fake_object_t *fake_find(uint32_t id)
+{
+  fake_object_t *object;
+
+  for (object = g_objects; object != NULL; object = object->next) {
+    if (object->id == id) {
+      return object;
+    }
+  }
+  return NULL;
+}
+
+static int fake_is_folder(uint32_t id)
+{
+  fake_object_t *object = fake_find(id);
+
+  return id == 0 || (object != NULL && object->type == LIBMTP_FILETYPE_FOLDER);
+}
+
+static fake_object_t *fake_add(const char *name, uint32_t parent, uint32_t storage, LIBMTP_filetype_t type)
+{
+  fake_object_t *object = calloc(1, sizeof(fake_object_t));
+  fake_object_t **tail = &g_objects;
+
+  object->id = g_next_id++;
+  object->parent_id = parent;
+  object->storage_id = storage;
+  object->name = strdup(name);
+  object->type = type;
+  object->mtime = time(NULL);
+
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
+  }
+  *tail = object;
+
+  return object;
+}
+
+static void fake_remove(uint32_t id)
+{
+  fake_object_t **link = &g_objects;
+
+  while (*link != NULL) {
+    fake_object_t *object = *link;
+
+    if (object->id != id) {
+      link = &object->next;
+      continue;
+    }
+    *link = object->next;
+    free(object->name);
+    free(object->data);
+    free(object);
+  }
+}
+
+static void fake_remove_tree(uint32_t id)
+{
+  fake_object_t *object = g_objects;
+
+  while (object != NULL) {
+    if (object->parent_id == id) {
+      fake_remove_tree(object->id);
+      object = g_objects;
+      continue;
+    }
+    object = object->next;
+  }
+  fake_remove(id);
+}
+
+static LIBMTP_file_t *fake_file(const fake_object_t *object)
+{
+  LIBMTP_file_t *file = calloc(1, sizeof(LIBMTP_file_t));
+
+  file->item_id = object->id;
+  file->parent_id = object->parent_id;
+  file->storage_id = object->storage_id;
+  file->filename = strdup(object->name);
+  file->filesize = object->size;
+  file->modificationdate = object->mtime;
+  file->filetype = object->type;
+
+  return file;
+}
+
+static int fake_cache_has(const fake_device_t *fake, uint32_t id)
+{
+  size_t i;
+
+  for (i = 0; i < fake->nknown; i++) {
+    if (fake->known[i] == id) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void fake_cache_add(fake_device_t *fake, uint32_t id)
+{
+  if (!fake->cached || !fake->loaded || fake_cache_has(fake, id)) {
+    return;
+  }
+  fake->known = realloc(fake->known, (fake->nknown + 1) * sizeof(uint32_t));
+  fake->known[fake->nknown++] = id;
+}
+
+static void fake_cache_remove(fake_device_t *fake, uint32_t id)
+{
+  size_t i;
+
+  for (i = 0; i < fake->nknown; i++) {
+    if (fake->known[i] == id) {
+      fake->known[i] = fake->known[--fake->nknown];
+      return;
+    }
+  }
+}
+
+static void fake_cache_load(fake_device_t *fake)
+{
+  fake_object_t *object;
+
+  fake->nknown = 0;
+  fake->loaded = 1;
+  for (object = g_objects; object != NULL; object = object->next) {
+    fake_cache_add(fake, object->id);
+  }
+}
+
+/* creates the object a send writes into, as libmtp does before the data phase */
+static fake_object_t *fake_begin_send(LIBMTP_mtpdevice_t *device, LIBMTP_file_t * const filedata)
+{
+  fake_object_t *object;
+
+  pthread_mutex_lock(&g_mx);
+  if (!fake_is_folder(fake_parent(filedata->parent_id))) {
+    pthread_mutex_unlock(&g_mx);
+    return NULL;
+  }
+  object = fake_add(filedata->filename, fake_parent(filedata->parent_id), filedata->storage_id,
+                    filedata->filetype);
+  object->data = malloc(filedata->filesize > 0 ? filedata->filesize : 1);
+  object->mtime = filedata->modificationdate != 0 ? filedata->modificationdate : object->mtime;
+  filedata->item_id = object->id;
+  filedata->parent_id = object->parent_id;
+  fake_cache_add((fake_device_t *) device, object->id);
+  pthread_mutex_unlock(&g_mx);
+
+  return object;
+}
+
+static unsigned char *fake_copy(uint32_t id, uint64_t *size)
+{
+  fake_object_t *object;
+  unsigned char *data = NULL;
+
+  pthread_mutex_lock(&g_mx);
+  object = fake_find(id);
+  if (object != NULL && object->type != LIBMTP_FILETYPE_FOLDER) {
+    data = malloc(object->size > 0 ? object->size : 1);
+    memcpy(data, object->data, object->size);
+    *size = object->size;
+  }
+  pthread_mutex_unlock(&g_mx);
+
+  return data;
+}
+
+void LIBMTP_Init(void)
+{
+}
+
+LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t **devices, int *count)
+{
+  int i;
+
+  *devices = calloc(FAKE_RAW_DEVICES, sizeof(LIBMTP_raw_device_t));
+  for (i = 0; i < FAKE_RAW_DEVICES; i++) {
+    (*devices)[i].bus_location = 1;
+    (*devices)[i].devnum = (uint8_t) (i + 1);
+    (*devices)[i].device_entry.vendor = "Fake";
+    (*devices)[i].device_entry.product = "Storage";
+  }
+  *count = FAKE_RAW_DEVICES;
+
+  return LIBMTP_ERROR_NONE;
+}
+
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *raw)
+{
+  fake_device_t *fake = calloc(1, sizeof(fake_device_t));
+  LIBMTP_mtpdevice_t *device = &fake->device;
+
+  fake->partial = raw->devnum > 1;
+
+  device->storage = calloc(1, sizeof(LIBMTP_devicestorage_t));
+  device->storage->id = FAKE_STORAGE;
+  device->storage->StorageDescription = strdup("Internal storage");
+  device->storage->MaxCapacity = 1 << 30;
+  device->storage->FreeSpaceInBytes = 1 << 30;
+
+  return device;
+}
+
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *raw)
+{
+  LIBMTP_mtpdevice_t *device = LIBMTP_Open_Raw_Device_Uncached(raw);
+
+  ((fake_device_t *) device)->cached = 1;
+  pthread_mutex_lock(&g_mx);
+  fake_cache_load((fake_device_t *) device);
+  pthread_mutex_unlock(&g_mx);
+
+  return device;
+}
+
+void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
+{
+  free(((fake_device_t *) device)->known);
+  free(device->storage->StorageDescription);
+  free(device->storage);
+  free((fake_device_t *) device);
+}
+
+char *LIBMTP_Get_Modelname(LIBMTP_mtpdevice_t *device)
+{
+  return strdup("Fake Storage");
+}
+
+char *LIBMTP_Get_Serialnumber(LIBMTP_mtpdevice_t *device)
+{
+  return strdup("0000");
+}
+
+char *LIBMTP_Get_Deviceversion(LIBMTP_mtpdevice_t *device)
+{
+  return strdup("1.0");
+}
+
+char *LIBMTP_Get_Friendlyname(LIBMTP_mtpdevice_t *device)
+{
+  return strdup("Fake");
+}
+
+int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
+{
+  return 0;
+}
+
+int LIBMTP_Check_Capability(LIBMTP_mtpdevice_t *device, LIBMTP_devicecap_t cap)
+{
+  return ((fake_device_t *) device)->partial &&
+         (cap == LIBMTP_DEVICECAP_GetPartialObject || cap == LIBMTP_DEVICECAP_SendPartialObject ||
+          cap == LIBMTP_DEVICECAP_EditObjects);
+}
+
+void LIBMTP_Clear_Errorstack(LIBMTP_mtpdevice_t *device)
+{
+}
+
+uint32_t LIBMTP_Create_Folder(LIBMTP_mtpdevice_t *device, char *name, uint32_t parent, uint32_t storage)
+{
+  uint32_t id = 0;
+
+  pthread_mutex_lock(&g_mx);
+  if (fake_is_folder(fake_parent(parent))) {
+    id = fake_add(name, fake_parent(parent), storage, LIBMTP_FILETYPE_FOLDER)->id;
+    fake_cache_add((fake_device_t *) device, id);
+  }
+  pthread_mutex_unlock(&g_mx);
+
+  return id;
+}
+
+int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t *device, uint32_t id)
+{
+  int ret = -1;
+
+  pthread_mutex_lock(&g_mx);
+  if (fake_find(id) != NULL) {
+    fake_remove_tree(id);
+    fake_cache_remove((fake_device_t *) device, id);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&g_mx);
+
+  return ret;
+}
+
+int LIBMTP_Set_File_Name(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file, const char *name)
+{
+  fake_object_t *object;
+
+  pthread_mutex_lock(&g_mx);
+  object = fake_find(file->item_id);
+  if (object != NULL) {
+    free(object->name);
+    object->name = strdup(name);
+    free(file->filename);
+    file->filename = strdup(name);
+  }
+  pthread_mutex_unlock(&g_mx);
+
+  return object != NULL ? 0 : -1;
+}
+
+LIBMTP_file_t *LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device, uint32_t const storage,
+                                            uint32_t const parent)
+{
+  LIBMTP_file_t *head = NULL;
+  LIBMTP_file_t **tail = &head;
+  fake_device_t *fake = (fake_device_t *) device;
+  fake_object_t *object;
+
+  pthread_mutex_lock(&g_mx);
+  if (fake->cached && !fake->loaded) {
+    fake_cache_load(fake);
+  }
+  for (object = g_objects; object != NULL; object = object->next) {
+    if (fake->cached && !fake_cache_has(fake, object->id)) {
+      continue;
+    }
+    if (object->parent_id == fake_parent(parent) && object->storage_id == storage) {
+      *tail = fake_file(object);
+      tail = &(*tail)->next;
+    }
+  }
+  pthread_mutex_unlock(&g_mx);
+
+  return head;
+}
+
+LIBMTP_file_t *LIBMTP_Get_Filemetadata(LIBMTP_mtpdevice_t *device, uint32_t const id)
+{
+  LIBMTP_file_t *file = NULL;
+  fake_object_t *object;
+
+  pthread_mutex_lock(&g_mx);
+  object = fake_find(id);
+  if (object != NULL) {
+    file = fake_file(object);
+  }
+  pthread_mutex_unlock(&g_mx);
+
+  return file;
+}
+
+void LIBMTP_destroy_file_t(LIBMTP_file_t *file)
+{
+  if (file == NULL) {
+    return;
+  }
+  free(file->filename);
+  free(file);
+}
+
+int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t *device, uint32_t const id, MTPDataPutFunc put, void *priv,
+                               LIBMTP_progressfunc_t const callback, void const * const data)
+{
+  uint64_t size = 0;
+  uint64_t sent = 0;
+  unsigned char *content = fake_copy(id, &size);
+
+  if (content == NULL) {
+    return -1;
+  }
+
+  while (sent < size) {
+    uint32_t chunk = size - sent < FAKE_CHUNK ? (uint32_t) (size - sent) : FAKE_CHUNK;
+    uint32_t putlen = 0;
+
+    if (put(NULL, priv, chunk, content + sent, &putlen) != LIBMTP_HANDLER_RETURN_OK || putlen != chunk) {
+      free(content);
+      return -1;
+    }
+    sent += chunk;
+
+    if (callback != NULL && callback(sent, size, data) != 0) {
+      free(content);
+      return -1;
+    }
+  }
+
+  free(content);
+  return 0;
+}
+
+static uint16_t fake_put_fd(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen)
+{
+  if (write(*(int *) priv, data, sendlen) != (ssize_t) sendlen) {
+    return LIBMTP_HANDLER_RETURN_ERROR;
+  }
+  *putlen = sendlen;
+
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+int LIBMTP_Get_File_To_File_Descriptor(LIBMTP_mtpdevice_t *device, uint32_t const id, int const fd,
+                                       LIBMTP_progressfunc_t const callback, void const * const data)
+{
+  int out = fd;
+
+  return LIBMTP_Get_File_To_Handler(device, id, fake_put_fd, &out, callback, data);
+}
+
+int LIBMTP_Get_File_To_File(LIBMTP_mtpdevice_t *device, uint32_t id, char const * const path,
+                            LIBMTP_progressfunc_t const callback, void const * const data)
+{
+  FILE *file = fopen(path, "wb");
+  int ret;
+
+  if (file == NULL) {
+    return -1;
+  }
+  ret = LIBMTP_Get_File_To_File_Descriptor(device, id, fileno(file), callback, data);
+  fclose(file);
+
+  return ret;
+}
+
+int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device, MTPDataGetFunc get, void *priv,
+                                  LIBMTP_file_t * const filedata, LIBMTP_progressfunc_t const callback,
+                                  void const * const data)
+{
+  fake_object_t *object = fake_begin_send(device, filedata);
+  uint64_t received = 0;
+
+  if (object == NULL) {
+    return -1;
+  }
+
+  /* a failed send leaves the created object behind, like libmtp */
+  while (received < filedata->filesize) {
+    uint64_t left = filedata->filesize - received;
+    uint32_t want = left < FAKE_CHUNK ? (uint32_t) left : FAKE_CHUNK;
+    uint32_t got = 0;
+
+    if (get(NULL, priv, want, object->data + received, &got) != LIBMTP_HANDLER_RETURN_OK || got == 0) {
+      return -1;
+    }
+    received += got;
+
+    pthread_mutex_lock(&g_mx);
+    object->size = received;
+    pthread_mutex_unlock(&g_mx);
+
+    if (callback != NULL && callback(received, filedata->filesize, data) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static uint16_t fake_get_fd(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen)
+{
+  ssize_t got = read(*(int *) priv, data, wantlen);
+
+  if (got <= 0) {
+    return LIBMTP_HANDLER_RETURN_ERROR;
+  }
+  *gotlen = (uint32_t) got;
+
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device, int const fd, LIBMTP_file_t * const filedata,
+                                          LIBMTP_progressfunc_t const callback, void const * const data)
+{
+  int in = fd;
+
+  return LIBMTP_Send_File_From_Handler(device, fake_get_fd, &in, filedata, callback, data);
+}
+
+int LIBMTP_Send_File_From_File(LIBMTP_mtpdevice_t *device, char const * const path, LIBMTP_file_t * const filedata,
+                               LIBMTP_progressfunc_t const callback, void const * const data)
+{
+  FILE *file = fopen(path, "rb");
+  int ret;
+
+  if (file == NULL) {
+    return -1;
+  }
+  ret = LIBMTP_Send_File_From_File_Descriptor(device, fileno(file), filedata, callback, data);
+  fclose(file);
+
+  return ret;
+}
+
+int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id, uint64_t offset, uint32_t maxbytes,
+                            unsigned char **data, unsigned int *size)
+{
+  uint64_t total = 0;
+  unsigned char *content = fake_copy(id, &total);
+  uint64_t count;
+
+  if (content == NULL || offset > total) {
+    free(content);
+    return -1;
+  }
+
+  count = total - offset < maxbytes ? total - offset : maxbytes;
+  *data = malloc(count > 0 ? count : 1);
+  memcpy(*data, content + offset, count);
+  *size = (unsigned int) count;
+  free(content);
+
+  return 0;
+}
+
+int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id, uint64_t offset, unsigned char *data,
+                             unsigned int size)
+{
+  fake_object_t *object;
+  int ret = -1;
+
+  pthread_mutex_lock(&g_mx);
+  object = fake_find(id);
+  if (object != NULL && offset <= object->size) {
+    if (offset + size > object->size) {
+      object->data = realloc(object->data, offset + size);
+      object->size = offset + size;
+    }
+    memcpy(object->data + offset, data, size);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&g_mx);
+
+  return ret;
+}
+
+int LIBMTP_BeginEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
+{
+  return 0;
+}
+
+int LIBMTP_EndEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
+{
+  return 0;
+}
+
+int LIBMTP_Get_Thumbnail(LIBMTP_mtpdevice_t *device, uint32_t const id, unsigned char **data, unsigned int *size)
+{
+  return -1;
+}
+
+/* like libmtp, an added object whose parent is not cached drops the cache */
+int LIBMTP_Update_Object_Cache(LIBMTP_mtpdevice_t *device, LIBMTP_event_t const event, uint32_t const param1)
+{
+  fake_device_t *fake = (fake_device_t *) device;
+  fake_object_t *object;
+  int ret = 0;
+
+  pthread_mutex_lock(&g_mx);
+  switch (event) {
+  case LIBMTP_EVENT_OBJECT_ADDED:
+    fake_cache_remove(fake, param1);
+    if (!fake->cached || !fake->loaded) {
+      break;
+    }
+    object = fake_find(param1);
+    if (object == NULL || (object->parent_id != 0 && !fake_cache_has(fake, object->parent_id))) {
+      fake->loaded = 0;
+      ret = -1;
+      break;
+    }
+    fake_cache_add(fake, param1);
+    break;
+  case LIBMTP_EVENT_OBJECT_REMOVED:
+    fake_cache_remove(fake, param1);
+    break;
+  default:
+    break;
+  }
+  pthread_mutex_unlock(&g_mx);
+
+  return ret;
+}
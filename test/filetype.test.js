@@ -0,0 +1,198 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const { lib, test, openDevice, tmpdir, makeFolder } = require('./helpers');
+
+/* every extension FiletypeForName() knows */
+const EXTENSIONS = {
+  wav: FLAGS.FILETYPE_WAV,
+  mp3: FLAGS.FILETYPE_MP3,
+  wma: FLAGS.FILETYPE_WMA,
+  ogg: FLAGS.FILETYPE_OGG,
+  oga: FLAGS.FILETYPE_OGG,
+  opus: FLAGS.FILETYPE_OGG,
+  aa: FLAGS.FILETYPE_AUDIBLE,
+  mp4: FLAGS.FILETYPE_MP4,
+  m4v: FLAGS.FILETYPE_MP4,
+  wmv: FLAGS.FILETYPE_WMV,
+  avi: FLAGS.FILETYPE_AVI,
+  mpeg: FLAGS.FILETYPE_MPEG,
+  mpg: FLAGS.FILETYPE_MPEG,
+  asf: FLAGS.FILETYPE_ASF,
+  qt: FLAGS.FILETYPE_QT,
+  mov: FLAGS.FILETYPE_QT,
+  jpg: FLAGS.FILETYPE_JPEG,
+  jpeg: FLAGS.FILETYPE_JPEG,
+  jpe: FLAGS.FILETYPE_JPEG,
+  jfif: FLAGS.FILETYPE_JFIF,
+  tif: FLAGS.FILETYPE_TIFF,
+  tiff: FLAGS.FILETYPE_TIFF,
+  bmp: FLAGS.FILETYPE_BMP,
+  gif: FLAGS.FILETYPE_GIF,
+  pic: FLAGS.FILETYPE_PICT,
+  pict: FLAGS.FILETYPE_PICT,
+  png: FLAGS.FILETYPE_PNG,
+  wmf: FLAGS.FILETYPE_WINDOWSIMAGEFORMAT,
+  vcs: FLAGS.FILETYPE_VCALENDAR1,
+  ics: FLAGS.FILETYPE_VCALENDAR2,
+  vcf: FLAGS.FILETYPE_VCARD3,
+  exe: FLAGS.FILETYPE_WINEXEC,
+  com: FLAGS.FILETYPE_WINEXEC,
+  bat: FLAGS.FILETYPE_WINEXEC,
+  dll: FLAGS.FILETYPE_WINEXEC,
+  sys: FLAGS.FILETYPE_WINEXEC,
+  txt: FLAGS.FILETYPE_TEXT,
+  htm: FLAGS.FILETYPE_HTML,
+  html: FLAGS.FILETYPE_HTML,
+  bin: FLAGS.FILETYPE_FIRMWARE,
+  aac: FLAGS.FILETYPE_AAC,
+  flac: FLAGS.FILETYPE_FLAC,
+  mp2: FLAGS.FILETYPE_MP2,
+  m4a: FLAGS.FILETYPE_M4A,
+  doc: FLAGS.FILETYPE_DOC,
+  xml: FLAGS.FILETYPE_XML,
+  xls: FLAGS.FILETYPE_XLS,
+  ppt: FLAGS.FILETYPE_PPT,
+  mht: FLAGS.FILETYPE_MHT,
+  jp2: FLAGS.FILETYPE_JP2,
+  jpx: FLAGS.FILETYPE_JPX
+};
+
+const bytes = (...parts) =>
+  Buffer.concat(
+    parts.map(part =>
+      typeof part === 'string' ? Buffer.from(part, 'latin1') : Buffer.from(part)
+    )
+  );
+
+/* names without a known extension, their data and the type it gives */
+const SIGNATURES = [
+  ['photo', bytes([0xff, 0xd8, 0xff, 0xe0]), FLAGS.FILETYPE_JPEG],
+  ['image.dat', bytes('\x89PNG\r\n\x1a\n'), FLAGS.FILETYPE_PNG],
+  ['anim', bytes('GIF89a'), FLAGS.FILETYPE_GIF],
+  ['scan', bytes('MM\0*'), FLAGS.FILETYPE_TIFF],
+  ['sound', bytes('RIFF', [0, 0, 0, 0], 'WAVE'), FLAGS.FILETYPE_WAV],
+  ['clip', bytes('RIFF', [0, 0, 0, 0], 'AVI '), FLAGS.FILETYPE_AVI],
+  ['riff', bytes('RIFF', [0, 0, 0, 0], 'WEBP'), FLAGS.FILETYPE_UNKNOWN],
+  ['video', bytes([0, 0, 0, 0x18], 'ftypisom'), FLAGS.FILETYPE_MP4],
+  ['book', bytes([0, 0, 0, 0x18], 'ftypM4B '), FLAGS.FILETYPE_M4A],
+  ['movie', bytes([0, 0, 0, 0x14], 'ftypqt  '), FLAGS.FILETYPE_QT],
+  ['vorbis', bytes('OggS'), FLAGS.FILETYPE_OGG],
+  ['lossless', bytes('fLaC'), FLAGS.FILETYPE_FLAC],
+  ['tagged', bytes('ID3', [4, 0]), FLAGS.FILETYPE_MP3],
+  [
+    'windows',
+    bytes([0x30, 0x26, 0xb2, 0x75, 0x8e, 0x66, 0xcf, 0x11]),
+    FLAGS.FILETYPE_ASF
+  ],
+  ['stream', bytes([0, 0, 1, 0xba]), FLAGS.FILETYPE_MPEG],
+  [
+    'bitmap',
+    bytes('BM', [0x3a, 0, 0, 0, 0, 0, 0, 0, 0x36, 0, 0, 0]),
+    FLAGS.FILETYPE_BMP
+  ],
+  ['adts', bytes([0xff, 0xf1, 0x50, 0x80]), FLAGS.FILETYPE_AAC],
+  ['layer3', bytes([0xff, 0xfb, 0x90, 0x64]), FLAGS.FILETYPE_MP3],
+  ['layer2', bytes([0xff, 0xfd, 0x90, 0x64]), FLAGS.FILETYPE_MP2],
+  ['plain', bytes('just some text'), FLAGS.FILETYPE_UNKNOWN],
+  ['tiny', bytes([0xff, 0xd8]), FLAGS.FILETYPE_UNKNOWN],
+  // a known extension wins over the data
+  ['notes.txt', bytes('\x89PNG\r\n\x1a\n'), FLAGS.FILETYPE_TEXT],
+  ['cover.JPG', bytes('GIF89a'), FLAGS.FILETYPE_JPEG]
+];
+
+test('names are classified by their extension', () => {
+  Object.keys(EXTENSIONS).forEach(extension => {
+    assert.strictEqual(
+      lib.Get_Filetype(`file.${extension}`),
+      EXTENSIONS[extension],
+      extension
+    );
+    assert.strictEqual(
+      lib.Get_Filetype(`FILE.${extension.toUpperCase()}`),
+      EXTENSIONS[extension],
+      extension
+    );
+  });
+
+  // only the last extension counts, and it has to be a known one
+  [
+    ['archive.txt.gz', FLAGS.FILETYPE_UNKNOWN],
+    ['notes.gz.txt', FLAGS.FILETYPE_TEXT],
+    ['photo.jpegs', FLAGS.FILETYPE_UNKNOWN],
+    ['photo.jp', FLAGS.FILETYPE_UNKNOWN],
+    ['photo.', FLAGS.FILETYPE_UNKNOWN],
+    ['jpg', FLAGS.FILETYPE_UNKNOWN]
+  ].forEach(([name, type]) =>
+    assert.strictEqual(lib.Get_Filetype(name), type, name)
+  );
+});
+
+const uploadedTypes = (session, folderId) =>
+  unpackFiles(
+    lib.Get_Files_And_Folders(session.device, session.storageId, folderId)
+  ).reduce(
+    (types, { name, type }) => Object.assign(types, { [name]: type }),
+    {}
+  );
+
+const expectedTypes = () =>
+  SIGNATURES.reduce(
+    (types, [name, , type]) => Object.assign(types, { [name]: type }),
+    {}
+  );
+
+test('uploads without a known extension are classified by their data', async () => {
+  const session = openDevice(0);
+  const dir = tmpdir();
+  const items = SIGNATURES.map(([name, data]) => {
+    const item = new lib.tree_item_t(); // eslint-disable-line new-cap
+
+    fs.writeFileSync(path.join(dir, name), data);
+    item.name = name;
+    item.path = path.join(dir, name);
+    item.parent = -1;
+
+    return item;
+  });
+
+  // tree uploads sniff the open file, small file batches the data in memory
+  const treeId = makeFolder(session, 'filetype-tree');
+  const tree = await new Promise(resolve =>
+    lib.Schedule_Upload_Tree(
+      session.device,
+      items,
+      session.storageId,
+      treeId,
+      FLAGS.CONFLICT_SKIP,
+      new lib.transfer_job_t(), // eslint-disable-line new-cap
+      1,
+      resolve
+    )
+  );
+  const batchId = makeFolder(session, 'filetype-batch');
+  const batch = await new Promise(resolve =>
+    lib.Schedule_Upload_Small_Files(
+      session.device,
+      items,
+      session.storageId,
+      batchId,
+      false,
+      new lib.transfer_job_t(), // eslint-disable-line new-cap
+      1,
+      resolve
+    )
+  );
+
+  assert.strictEqual(tree, 0);
+  assert.strictEqual(batch, 0);
+  assert.deepStrictEqual(uploadedTypes(session, treeId), expectedTypes());
+  assert.deepStrictEqual(uploadedTypes(session, batchId), expectedTypes());
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
@@ -0,0 +1,269 @@
+'use strict';
+
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+
+/* the test build, linked against fake/libmtp.c */
+const lib = require(path.resolve(__dirname, 'build/Release/mtp.node'));
+
+const ROOT = 0xffffffff;
+/* LIBMTP_error_number_t */
+const ERROR_GENERAL = 1;
+const ERROR_CANCELLED = 8;
+const tests = [];
+
+lib.Init();
+
+const test = (name, fn) => {
+  tests.push({ name, fn });
+};
+
+const rawDevices = () => {
+  let devices = null;
+
+  lib.Detect_Raw_Devices((error, raws) => {
+    devices = raws;
+  });
+
+  return devices;
+};
+
+/**
+ * Every fake raw device shares one in-memory storage; a test creates its
+ * own folder on it, so the tests do not see each other's objects.
+ */
+const openDevice = (index = 0) => {
+  const device = lib.Open_Raw_Device(rawDevices()[index]);
+  const storageId = device.getStorages()[0].id;
+
+  return { device, storageId };
+};
+
+/**
+ * Releases a device and waits until it is closed; a scheduled task drops its
+ * reference on the JS thread some time after its completion ran.
+ */
+const releaseDevice = async ({ device }) => {
+  const { handle } = device;
+
+  lib.Release_Device(device);
+
+  for (;;) {
+    const held = lib.Acquire_Device(handle);
+
+    if (!held) {
+      return;
+    }
+    lib.Release_Device(held);
+    // eslint-disable-next-line no-await-in-loop
+    await new Promise(resolve => setImmediate(resolve));
+  }
+};
+
+const tmpdir = () => fs.mkdtempSync(path.join(os.tmpdir(), 'mtp-test-'));
+
+const makeFolder = ({ device, storageId }, name, parentId = ROOT) =>
+  lib.Create_Folder(device, name, parentId, storageId);
+
+const sendFile = (
+  { device, storageId },
+  parentId,
+  name,
+  data,
+  type = FLAGS.FILETYPE_UNKNOWN
+) => {
+  const dir = tmpdir();
+  const file = new lib.file_t(); // eslint-disable-line new-cap
+
+  fs.writeFileSync(path.join(dir, name), data);
+  file.name = name;
+  file.size = data.length;
+  file.type = type;
+  file.parentId = parentId;
+  file.storageId = storageId;
+
+  const error = lib.Send_File_From_File(
+    device,
+    path.join(dir, name),
+    file,
+    () => 0
+  );
+
+  fs.rmSync(dir, { recursive: true });
+
+  return error;
+};
+
+const readFile = ({ device }, id) => {
+  const dir = tmpdir();
+  const filePath = path.join(dir, 'out');
+
+  lib.Get_File_To_File(device, id, filePath, () => 0);
+
+  const data = fs.readFileSync(filePath);
+
+  fs.rmSync(dir, { recursive: true });
+
+  return data;
+};
+
+/* lists a device folder as { 'path/file': Buffer, 'path/folder/': null } */
+const readTree = (session, folderId, prefix = '') => {
+  const { device, storageId } = session;
+  const files = unpackFiles(
+    lib.Get_Files_And_Folders(device, storageId, folderId)
+  );
+
+  return files.reduce((tree, file) => {
+    if (file.type === FLAGS.FILETYPE_FOLDER) {
+      return Object.assign(
+        tree,
+        { [`${prefix}${file.name}/`]: null },
+        readTree(session, file.id, `${prefix}${file.name}/`)
+      );
+    }
+
+    return Object.assign(tree, {
+      [`${prefix}${file.name}`]: readFile(session, file.id)
+    });
+  }, {});
+};
+
+/* eslint-disable no-bitwise */
+const CRC_TABLE = Array.from({ length: 256 }, (_, n) => {
+  let c = n;
+
+  for (let k = 0; k < 8; k += 1) {
+    c = c & 1 ? 0xedb88320 ^ (c >>> 1) : c >>> 1;
+  }
+
+  return c >>> 0;
+});
+
+const crc32 = data => {
+  let crc = 0xffffffff;
+
+  for (const byte of data) {
+    crc = CRC_TABLE[(crc ^ byte) & 0xff] ^ (crc >>> 8);
+  }
+
+  return (crc ^ 0xffffffff) >>> 0;
+};
+/* eslint-enable no-bitwise */
+
+/**
+ * Exports a device folder to `fd` or, without one, through an
+ * archive_stream_t of `chunkSize` bytes, collected into `data`.
+ */
+const exportArchive = (
+  { device, storageId },
+  parentId,
+  root,
+  format,
+  {
+    fd = -1,
+    chunkSize = 4096,
+    job = new lib.transfer_job_t(), // eslint-disable-line new-cap
+    onChunk = () => {}
+  } = {}
+) =>
+  new Promise(resolve => {
+    const stream = new lib.archive_stream_t(); // eslint-disable-line new-cap
+    const buffer = Buffer.alloc(chunkSize);
+    const chunks = [];
+
+    if (fd < 0) {
+      stream.attach(buffer);
+    }
+
+    lib.Schedule_Export_Archive(
+      device,
+      storageId,
+      parentId,
+      root,
+      format,
+      fd,
+      stream,
+      job,
+      1,
+      length => {
+        chunks.push(Buffer.from(buffer.subarray(0, length)));
+        onChunk();
+        setImmediate(() => stream.ack());
+      },
+      (error, files, bytes) =>
+        resolve({ error, files, bytes, data: Buffer.concat(chunks) })
+    );
+  });
+
+/**
+ * Imports an archive from `fd` or, without one, feeds `data` through an
+ * archive_stream_t of `chunkSize` bytes.
+ */
+const importArchive = (
+  { device, storageId },
+  parentId,
+  format,
+  {
+    fd = -1,
+    data = null,
+    chunkSize = 4096,
+    policy = FLAGS.CONFLICT_OVERWRITE,
+    job = new lib.transfer_job_t(), // eslint-disable-line new-cap
+    onNeed = () => {}
+  } = {}
+) =>
+  new Promise(resolve => {
+    const stream = new lib.archive_stream_t(); // eslint-disable-line new-cap
+    const buffer = Buffer.alloc(chunkSize);
+    let offset = 0;
+
+    if (fd < 0) {
+      stream.attach(buffer);
+    }
+
+    lib.Schedule_Import_Archive(
+      device,
+      storageId,
+      parentId,
+      format,
+      fd,
+      stream,
+      policy,
+      job,
+      1,
+      () => {
+        onNeed();
+        setImmediate(() => {
+          const length = data.copy(buffer, 0, offset);
+
+          offset += length;
+          stream.supply(length);
+        });
+      },
+      (error, imported, skipped) => resolve({ error, imported, skipped })
+    );
+  });
+
+module.exports = {
+  lib,
+  ROOT,
+  ERROR_GENERAL,
+  ERROR_CANCELLED,
+  tests,
+  test,
+  rawDevices,
+  openDevice,
+  releaseDevice,
+  tmpdir,
+  makeFolder,
+  sendFile,
+  readFile,
+  readTree,
+  crc32,
+  exportArchive,
+  importArchive
+};
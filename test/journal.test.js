@@ -0,0 +1,147 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { lib, test, tmpdir } = require('./helpers');
+
+const openJournal = file => {
+  const journal = new lib.transfer_journal_t(); // eslint-disable-line new-cap
+
+  assert.ok(journal.open(file));
+
+  return journal;
+};
+
+const writeJournal = file => {
+  const journal = openJournal(file);
+
+  journal.offsetStep = 100;
+  assert.ok(journal.plan('a.jpg', 1000));
+  assert.ok(journal.plan('b.jpg', 500));
+  assert.ok(journal.plan('c.jpg', 10));
+  assert.ok(journal.progress('a.jpg', 150));
+  // below the offset step, so only kept in memory
+  assert.ok(journal.progress('a.jpg', 200));
+  assert.ok(journal.complete('b.jpg'));
+  journal.close();
+};
+
+const assertReplayed = journal => {
+  assert.strictEqual(journal.planned, 3);
+  assert.strictEqual(journal.completed, 1);
+  assert.ok(journal.isCompleted('b.jpg'));
+  assert.ok(!journal.isCompleted('a.jpg'));
+  assert.strictEqual(journal.getOffset('a.jpg'), 150);
+  assert.strictEqual(journal.getOffset('b.jpg'), 500);
+  assert.strictEqual(journal.getOffset('c.jpg'), 0);
+};
+
+test('a reopened journal replays planned, partial and completed items', () => {
+  const dir = tmpdir();
+  const file = path.join(dir, 'journal');
+
+  writeJournal(file);
+
+  const journal = openJournal(file);
+
+  assertReplayed(journal);
+
+  // planning a completed item again keeps it completed
+  assert.ok(journal.plan('b.jpg', 500));
+  assert.ok(journal.isCompleted('b.jpg'));
+  journal.close();
+
+  fs.rmSync(dir, { recursive: true });
+});
+
+test('a torn record at the end of the journal is dropped', () => {
+  const dir = tmpdir();
+  const file = path.join(dir, 'journal');
+
+  writeJournal(file);
+
+  const size = fs.statSync(file).size;
+
+  fs.appendFileSync(file, Buffer.from([0x43, 0, 0, 0, 5, 0, 0]));
+
+  const journal = openJournal(file);
+
+  assertReplayed(journal);
+  assert.strictEqual(fs.statSync(file).size, size);
+
+  // records appended after the repair replay as well
+  assert.ok(journal.complete('c.jpg'));
+  journal.close();
+  assert.strictEqual(openJournal(file).completed, 2);
+
+  fs.rmSync(dir, { recursive: true });
+});
+
+test('a damaged record ends the replay', () => {
+  const dir = tmpdir();
+  const file = path.join(dir, 'journal');
+
+  writeJournal(file);
+
+  const data = fs.readFileSync(file);
+
+  // the last record, the completion of b.jpg
+  data[data.length - 1] ^= 0xff;
+  fs.writeFileSync(file, data);
+
+  const journal = openJournal(file);
+
+  assert.strictEqual(journal.planned, 3);
+  assert.strictEqual(journal.completed, 0);
+  assert.strictEqual(journal.getOffset('a.jpg'), 150);
+  journal.close();
+
+  fs.rmSync(dir, { recursive: true });
+});
+
+test('compacting and clearing the journal keep the live state', () => {
+  const dir = tmpdir();
+  const file = path.join(dir, 'journal');
+
+  writeJournal(file);
+
+  let journal = openJournal(file);
+
+  journal.offsetStep = 1;
+  for (let offset = 1; offset <= 100; offset += 1) {
+    assert.ok(journal.progress('c.jpg', offset % 10));
+  }
+
+  const size = fs.statSync(file).size;
+
+  assert.ok(journal.compact());
+  assert.ok(fs.statSync(file).size < size);
+  journal.close();
+
+  journal = openJournal(file);
+  assert.strictEqual(journal.planned, 3);
+  assert.strictEqual(journal.completed, 1);
+  assert.strictEqual(journal.getOffset('a.jpg'), 150);
+
+  assert.ok(journal.clear());
+  journal.close();
+
+  journal = openJournal(file);
+  assert.strictEqual(journal.planned, 0);
+  assert.strictEqual(journal.completed, 0);
+  journal.close();
+
+  fs.rmSync(dir, { recursive: true });
+});
+
+test('a file which is not a journal is not opened', () => {
+  const dir = tmpdir();
+  const file = path.join(dir, 'journal');
+  const journal = new lib.transfer_journal_t(); // eslint-disable-line new-cap
+
+  fs.writeFileSync(file, 'not a journal');
+  assert.ok(!journal.open(file));
+
+  fs.rmSync(dir, { recursive: true });
+});
@@ -0,0 +1,195 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const {
+  lib,
+  ERROR_CANCELLED,
+  test,
+  openDevice,
+  tmpdir,
+  makeFolder,
+  sendFile
+} = require('./helpers');
+
+const KiB = 1024;
+
+const newJob = (rate, burst) => {
+  const job = new lib.transfer_job_t(); // eslint-disable-line new-cap
+
+  job.setRateLimit(rate, burst);
+
+  return job;
+};
+
+const localFile = (name, size) => {
+  const dir = tmpdir();
+  const filePath = path.join(dir, name);
+
+  fs.writeFileSync(filePath, Buffer.alloc(size, 7));
+
+  return { dir, filePath };
+};
+
+const newFile = (session, parentId, name, size) => {
+  const file = new lib.file_t(); // eslint-disable-line new-cap
+
+  file.name = name;
+  file.size = size;
+  file.type = FLAGS.FILETYPE_UNKNOWN;
+  file.parentId = parentId;
+  file.storageId = session.storageId;
+
+  return file;
+};
+
+test('a job rate limit paces a transfer libmtp runs in one call', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'ratelimit-single');
+  const { dir, filePath } = localFile('a.bin', 96 * KiB);
+  const job = newJob(64 * KiB, 16 * KiB);
+  const started = Date.now();
+
+  assert.strictEqual(job.rateLimit, 64 * KiB);
+  assert.strictEqual(
+    lib.Send_File_From_File_Job(
+      session.device,
+      filePath,
+      newFile(session, folderId, 'a.bin', 96 * KiB),
+      job
+    ),
+    0
+  );
+
+  // the burst goes right away, the other 80 KiB take 1.25 s
+  const elapsed = Date.now() - started;
+
+  assert.ok(elapsed >= 1100, `took ${elapsed} ms`);
+  assert.ok(elapsed < 4000, `took ${elapsed} ms`);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a throttled chunked download lets other requests in', async () => {
+  const session = openDevice(1);
+  const folderId = makeFolder(session, 'ratelimit-chunked');
+  const dir = tmpdir();
+
+  assert.strictEqual(
+    sendFile(session, folderId, 'b.bin', Buffer.alloc(64 * KiB, 3)),
+    0
+  );
+
+  const [{ id }] = unpackFiles(
+    lib.Get_Files_And_Folders(session.device, session.storageId, folderId)
+  );
+  const job = newJob(32 * KiB, 16 * KiB);
+  const started = Date.now();
+  let metadataAt = 0;
+
+  lib.Set_Scheduler_Chunk_Size(session.device, 16 * KiB);
+
+  const downloaded = new Promise(resolve =>
+    lib.Schedule_Get_File_To_File(
+      session.device,
+      id,
+      path.join(dir, 'b.bin'),
+      job,
+      1,
+      error => resolve({ error, elapsed: Date.now() - started })
+    )
+  );
+
+  setTimeout(() => {
+    lib.Schedule_Get_Filemetadata(
+      session.device,
+      id,
+      FLAGS.SCHEDULER_PRIORITY_INTERACTIVE,
+      () => {
+        metadataAt = Date.now() - started;
+      }
+    );
+  }, 200);
+
+  const { error, elapsed } = await downloaded;
+
+  assert.strictEqual(error, 0);
+  // four chunks: the burst pays the first, the two after it wait 0.5 s each
+  assert.ok(elapsed >= 900, `took ${elapsed} ms`);
+  assert.ok(metadataAt > 0 && metadataAt < 700, `metadata at ${metadataAt} ms`);
+  assert.strictEqual(fs.statSync(path.join(dir, 'b.bin')).size, 64 * KiB);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('an abort ends a throttled wait', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'ratelimit-abort');
+  const { dir, filePath } = localFile('c.bin', 256 * KiB);
+  const job = newJob(16 * KiB, 16 * KiB);
+  const token = new lib.abort_token_t(); // eslint-disable-line new-cap
+  const started = Date.now();
+
+  assert.ok(job.setAbortToken(token));
+  setTimeout(() => token.abort(), 200);
+
+  const error = await new Promise(resolve =>
+    lib.Schedule_Send_File_From_File(
+      session.device,
+      filePath,
+      newFile(session, folderId, 'c.bin', 256 * KiB),
+      job,
+      1,
+      resolve
+    )
+  );
+  const elapsed = Date.now() - started;
+
+  assert.strictEqual(error, ERROR_CANCELLED);
+  assert.ok(elapsed < 1000, `took ${elapsed} ms`);
+  // the partly sent object is removed again
+  assert.deepStrictEqual(
+    lib.Get_Files_And_Folders(session.device, session.storageId, folderId)
+      .length,
+    0
+  );
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a device rate limit holds for every job of the device', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'ratelimit-device');
+  const { dir, filePath } = localFile('d.bin', 64 * KiB);
+
+  lib.Set_Device_Rate_Limit(session.device, 48 * KiB, 16 * KiB);
+  assert.strictEqual(lib.Get_Device_Rate_Limit(session.device), 48 * KiB);
+
+  const started = Date.now();
+
+  assert.strictEqual(
+    lib.Send_File_From_File_Job(
+      session.device,
+      filePath,
+      newFile(session, folderId, 'd.bin', 64 * KiB),
+      newJob(0, 0)
+    ),
+    0
+  );
+
+  const elapsed = Date.now() - started;
+
+  assert.ok(elapsed >= 900, `took ${elapsed} ms`);
+
+  lib.Set_Device_Rate_Limit(session.device, 0, 0);
+  assert.strictEqual(lib.Get_Device_Rate_Limit(session.device), 0);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
@@ -0,0 +1,85 @@
+'use strict';
+
+const assert = require('assert');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const {
+  lib,
+  test,
+  openDevice,
+  releaseDevice,
+  makeFolder,
+  sendFile
+} = require('./helpers');
+
+/* read_cache_t::BLOCK_SIZE */
+const BLOCK = 256 * 1024;
+
+/* a bulk task queued behind the read-ahead runs after its next step */
+const afterBulkStep = ({ device }, id) =>
+  new Promise(resolve =>
+    lib.Schedule_Get_Filemetadata(
+      device,
+      id,
+      FLAGS.SCHEDULER_PRIORITY_BULK,
+      resolve
+    )
+  );
+
+test('ranged reads are served from cached and read-ahead blocks', async () => {
+  // both raw devices open onto the same storage, so the reader's cache does
+  // not hear of a deletion made through the other one
+  const reader = openDevice(1);
+  const writer = openDevice(0);
+  const folderId = makeFolder(reader, 'readcache');
+  const data = Buffer.from(
+    Array.from({ length: 6 * BLOCK }, (_, i) => i % 251)
+  );
+  const cache = new lib.download_cache_t(); // eslint-disable-line new-cap
+
+  sendFile(reader, folderId, 'a.bin', data);
+
+  const [{ id }] = unpackFiles(
+    lib.Get_Files_And_Folders(reader.device, reader.storageId, folderId)
+  );
+  const read = (offset, length) => {
+    const buffer = Buffer.alloc(length);
+    const got = lib.Read_File_Range(reader.device, id, offset, buffer, cache);
+
+    return got < 0 ? null : buffer.subarray(0, got);
+  };
+  const expect = (offset, length) =>
+    assert.deepStrictEqual(
+      read(offset, length),
+      data.subarray(offset, offset + length)
+    );
+
+  // across a block boundary, then sequentially on, which queues blocks 2-5
+  expect(BLOCK - 10, 20);
+  expect(BLOCK + 10, 100);
+
+  for (let step = 0; step < 4; step += 1) {
+    // eslint-disable-next-line no-await-in-loop
+    await afterBulkStep(reader, id);
+  }
+
+  lib.Destroy_file(writer.device, id);
+
+  // every block is in memory, the object is not needed any more
+  expect(5 * BLOCK, BLOCK);
+  expect(2 * BLOCK - 5, 10);
+  expect(6 * BLOCK - 3, 3);
+  assert.strictEqual(read(6 * BLOCK, 10).length, 0);
+
+  // a capacity of one block keeps only the most recently used one
+  lib.Set_Read_Cache_Capacity(reader.device, BLOCK);
+  expect(5 * BLOCK, 10);
+  assert.strictEqual(read(4 * BLOCK, 10), null);
+
+  lib.Invalidate_Read_Cache(reader.device, id);
+  assert.strictEqual(read(5 * BLOCK, 10), null);
+
+  lib.Set_Read_Cache_Capacity(reader.device, 0);
+  lib.Release_Device(writer.device);
+  await releaseDevice(reader);
+});
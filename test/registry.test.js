@@ -0,0 +1,66 @@
+'use strict';
+
+const assert = require('assert');
+const { lib, test, rawDevices } = require('./helpers');
+
+/* device_registry_t::INDEX_BITS */
+const INDEX_MASK = 0xff;
+
+test('a handle shares the device until its last reference goes', () => {
+  const raw = rawDevices()[1];
+  const device = lib.Open_Raw_Device(raw);
+  const handle = device.handle;
+
+  assert.notStrictEqual(handle, 0);
+
+  const shared = lib.Acquire_Device(handle);
+
+  assert.ok(shared);
+  assert.strictEqual(shared.handle, handle);
+
+  // the open device keeps its cache mode
+  assert.strictEqual(lib.Open_Raw_Device_Uncached(raw), null);
+
+  // every reference is released on its own, the device stays open
+  lib.Release_Device(device);
+
+  const again = lib.Acquire_Device(handle);
+
+  assert.ok(again);
+  lib.Release_Device(again);
+  lib.Release_Device(shared);
+  assert.strictEqual(lib.Acquire_Device(handle), null);
+});
+
+test('a reopened device gets a new generation of its slot', () => {
+  const raw = rawDevices()[1];
+  const device = lib.Open_Raw_Device(raw);
+  const handle = device.handle;
+
+  lib.Release_Device(device);
+
+  const reopened = lib.Open_Raw_Device_Uncached(raw);
+  const next = reopened.handle;
+
+  assert.strictEqual(next & INDEX_MASK, handle & INDEX_MASK);
+  assert.notStrictEqual(next, handle);
+
+  // the stale handle does not reach the device opened since
+  assert.strictEqual(lib.Acquire_Device(handle), null);
+
+  const shared = lib.Acquire_Device(next);
+
+  assert.strictEqual(shared.handle, next);
+
+  lib.Release_Device(shared);
+  lib.Release_Device(reopened);
+});
+
+test('a released device throws instead of reaching libmtp', () => {
+  const device = lib.Open_Raw_Device(rawDevices()[1]);
+
+  lib.Release_Device(device);
+
+  assert.throws(() => device.getStorages(), /Device is not open/);
+  assert.throws(() => lib.Get_Friendlyname(device), /Device is not open/);
+});
@@ -0,0 +1,42 @@
+'use strict';
+
+/**
+ * Runs the *.test.js files next to this one, or the ones named on the
+ * command line, one test after the other.
+ *
+ * $ node test/run.js [journal archive ...]
+ */
+
+const fs = require('fs');
+const path = require('path');
+const { tests } = require('./helpers');
+
+const only = process.argv.slice(2);
+const files = fs
+  .readdirSync(__dirname)
+  .filter(file => file.endsWith('.test.js'))
+  .filter(file => !only.length || only.includes(file.replace('.test.js', '')))
+  .sort();
+
+files.forEach(file => require(path.join(__dirname, file)));
+
+const run = async () => {
+  let failed = 0;
+
+  for (const { name, fn } of tests) {
+    try {
+      await fn();
+      console.log(`ok - ${name}`);
+    } catch (e) {
+      failed += 1;
+      console.log(`not ok - ${name}`);
+      console.log(e.stack || e);
+    }
+  }
+
+  console.log(`\n${tests.length - failed}/${tests.length} passed`);
+
+  process.exit(failed ? 1 : 0);
+};
+
+run();
@@ -0,0 +1,117 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { unpackTreeItems } = require('../lib/unpack');
+const { lib, ERROR_GENERAL, test, tmpdir } = require('./helpers');
+
+const scanTree = (root, recursive = true, threads = 0) =>
+  new Promise(resolve =>
+    lib.Scan_Local_Tree(root, recursive, threads, (error, items) =>
+      resolve({ error, items: unpackTreeItems(items) })
+    )
+  );
+
+/* items as [path below the root, parent, size], folders ending in a slash */
+const relative = (root, items) =>
+  items.map(item => [
+    `${path.relative(root, item.path)}${item.isFolder ? '/' : ''}`,
+    item.parent,
+    item.size
+  ]);
+
+const writeTree = (root, files) =>
+  Object.keys(files).forEach(name => {
+    const filePath = path.join(root, name);
+
+    fs.mkdirSync(path.dirname(filePath), { recursive: true });
+    fs.writeFileSync(filePath, files[name]);
+  });
+
+test('a scan lists folders before their sorted content', async () => {
+  const root = tmpdir();
+
+  writeTree(root, {
+    'b.txt': 'bb',
+    'a/m.txt': 'mmm',
+    'c/z.txt': 'z',
+    'c/y/x.txt': 'xxxx',
+    'c/B.txt': '',
+    // junk the scan leaves out
+    '.DS_Store': 'junk',
+    'a/Thumbs.db': 'junk',
+    'c/notes.txt~': 'junk'
+  });
+  fs.mkdirSync(path.join(root, 'empty'));
+  // links are neither listed nor followed
+  fs.symlinkSync(path.join(root, 'b.txt'), path.join(root, 'link.txt'));
+  fs.symlinkSync(path.join(root, 'c'), path.join(root, 'linked'));
+
+  // a trailing separator does not end up in the paths
+  const { error, items } = await scanTree(`${root}/`, true, 3);
+
+  assert.strictEqual(error, 0);
+  assert.deepStrictEqual(relative(root, items), [
+    ['a/', -1, 0],
+    ['a/m.txt', 0, 3],
+    ['b.txt', -1, 2],
+    ['c/', -1, 0],
+    ['c/B.txt', 3, 0],
+    ['c/y/', 3, 0],
+    ['c/y/x.txt', 5, 4],
+    ['c/z.txt', 3, 1],
+    ['empty/', -1, 0]
+  ]);
+  assert.deepStrictEqual(
+    items.map(({ name }) => name),
+    ['a', 'm.txt', 'b.txt', 'c', 'B.txt', 'y', 'x.txt', 'z.txt', 'empty']
+  );
+
+  const shallow = await scanTree(root, false);
+
+  assert.deepStrictEqual(relative(root, shallow.items), [
+    ['a/', -1, 0],
+    ['b.txt', -1, 2],
+    ['c/', -1, 0],
+    ['empty/', -1, 0]
+  ]);
+
+  fs.rmSync(root, { recursive: true });
+});
+
+test('a scan comes out the same whatever the number of threads', async () => {
+  const root = tmpdir();
+  const files = {};
+
+  for (let i = 0; i < 40; i += 1) {
+    for (let j = 0; j < 5; j += 1) {
+      files[`f${i % 7}/g${i}/h${j}/file${i * j}.bin`] = 'x'.repeat(j);
+    }
+  }
+  writeTree(root, files);
+
+  const single = await scanTree(root, true, 1);
+  const many = await scanTree(root, true, 8);
+
+  assert.strictEqual(single.error, 0);
+  assert.strictEqual(single.items.filter(item => !item.isFolder).length, 200);
+  assert.deepStrictEqual(many, single);
+
+  fs.rmSync(root, { recursive: true });
+});
+
+test('a root which cannot be listed fails the scan', async () => {
+  const root = tmpdir();
+
+  fs.writeFileSync(path.join(root, 'file'), 'not a folder');
+
+  const missing = await scanTree(path.join(root, 'missing'));
+  const file = await scanTree(path.join(root, 'file'));
+
+  assert.strictEqual(missing.error, ERROR_GENERAL);
+  assert.deepStrictEqual(missing.items, []);
+  assert.strictEqual(file.error, ERROR_GENERAL);
+
+  fs.rmSync(root, { recursive: true });
+});
@@ -0,0 +1,251 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const {
+  lib,
+  test,
+  openDevice,
+  tmpdir,
+  makeFolder,
+  sendFile,
+  readTree
+} = require('./helpers');
+
+const syncTree = (session, localPath, parentId, mode, flags = 0) =>
+  new Promise(resolve => {
+    lib.Schedule_Sync_Tree(
+      session.device,
+      localPath,
+      session.storageId,
+      parentId,
+      mode,
+      flags,
+      new lib.transfer_job_t(), // eslint-disable-line new-cap
+      1,
+      (error, plan, downloadBytes, uploadBytes) =>
+        resolve({
+          error,
+          plan: plan.map(action => ({
+            kind: action.kind,
+            path: action.path,
+            from: action.from,
+            size: action.size
+          })),
+          downloadBytes,
+          uploadBytes
+        })
+    );
+  });
+
+/* device modification times by name, in seconds */
+const deviceTimes = ({ device, storageId }, folderId) =>
+  unpackFiles(lib.Get_Files_And_Folders(device, storageId, folderId)).reduce(
+    (times, { name, modificationDate }) =>
+      Object.assign(times, { [name]: modificationDate }),
+    {}
+  );
+
+const writeLocal = (dir, name, data, mtime) => {
+  const filePath = path.join(dir, name);
+
+  fs.mkdirSync(path.dirname(filePath), { recursive: true });
+  fs.writeFileSync(filePath, data);
+  fs.utimesSync(filePath, mtime, mtime);
+};
+
+test('a dry run plans a mirror and adds up its bytes', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'sync-dry');
+  const subId = makeFolder(session, 'sub', folderId);
+  const dir = tmpdir();
+
+  sendFile(session, folderId, 'a.txt', Buffer.from('hello'));
+  sendFile(session, subId, 'b.txt', Buffer.from('abc'));
+  writeLocal(dir, 'c.txt', 'four', Date.now() / 1000);
+
+  const result = await syncTree(
+    session,
+    dir,
+    folderId,
+    FLAGS.SYNC_MODE_DOWNLOAD,
+    // eslint-disable-next-line no-bitwise
+    FLAGS.SYNC_DELETE_EXTRANEOUS | FLAGS.SYNC_DRY_RUN
+  );
+
+  assert.strictEqual(result.error, 0);
+  assert.deepStrictEqual(
+    result.plan.map(({ kind, path: actionPath }) => [kind, actionPath]),
+    [
+      [FLAGS.SYNC_ACTION_MKDIR_LOCAL, 'sub'],
+      [FLAGS.SYNC_ACTION_DOWNLOAD, 'a.txt'],
+      [FLAGS.SYNC_ACTION_DOWNLOAD, 'sub/b.txt'],
+      [FLAGS.SYNC_ACTION_DELETE_LOCAL, 'c.txt']
+    ]
+  );
+  assert.strictEqual(result.downloadBytes, 8);
+  assert.strictEqual(result.uploadBytes, 0);
+
+  // nothing was carried out
+  assert.deepStrictEqual(fs.readdirSync(dir), ['c.txt']);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a mirror download renames a moved local file instead of fetching it', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'sync-rename');
+  const dir = tmpdir();
+
+  sendFile(session, folderId, 'new.txt', Buffer.from('moved'));
+  writeLocal(
+    dir,
+    'old.txt',
+    'moved',
+    deviceTimes(session, folderId)['new.txt']
+  );
+  writeLocal(dir, 'extra.txt', 'gone', Date.now() / 1000);
+
+  const result = await syncTree(
+    session,
+    dir,
+    folderId,
+    FLAGS.SYNC_MODE_DOWNLOAD,
+    FLAGS.SYNC_DELETE_EXTRANEOUS
+  );
+
+  assert.strictEqual(result.error, 0);
+  assert.deepStrictEqual(result.plan, [
+    {
+      kind: FLAGS.SYNC_ACTION_RENAME_LOCAL,
+      path: 'new.txt',
+      from: 'old.txt',
+      size: 5
+    },
+    {
+      kind: FLAGS.SYNC_ACTION_DELETE_LOCAL,
+      path: 'extra.txt',
+      from: '',
+      size: 0
+    }
+  ]);
+  assert.strictEqual(result.downloadBytes, 0);
+  assert.deepStrictEqual(fs.readdirSync(dir), ['new.txt']);
+  assert.strictEqual(
+    fs.readFileSync(path.join(dir, 'new.txt'), 'utf8'),
+    'moved'
+  );
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a two-way sync keeps the newer copy and leaves same-time changes alone', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'sync-two-way');
+  const dir = tmpdir();
+
+  sendFile(session, folderId, 'device-newer.txt', Buffer.from('device'));
+  sendFile(session, folderId, 'local-newer.txt', Buffer.from('device'));
+  sendFile(session, folderId, 'conflict.txt', Buffer.from('device'));
+  sendFile(session, folderId, 'device-only.txt', Buffer.from('d'));
+
+  const times = deviceTimes(session, folderId);
+
+  const { 'device-newer.txt': deviceNewer, 'local-newer.txt': localNewer } =
+    times;
+
+  writeLocal(dir, 'device-newer.txt', 'old local', deviceNewer - 1000);
+  writeLocal(dir, 'local-newer.txt', 'new local', localNewer + 1000);
+  writeLocal(dir, 'conflict.txt', 'changed', times['conflict.txt']);
+  writeLocal(dir, 'local-only.txt', 'l', times['conflict.txt']);
+
+  const result = await syncTree(
+    session,
+    dir,
+    folderId,
+    FLAGS.SYNC_MODE_TWO_WAY
+  );
+
+  assert.strictEqual(result.error, 0);
+  assert.deepStrictEqual(
+    result.plan.map(({ kind, path: actionPath }) => [kind, actionPath]),
+    [
+      [FLAGS.SYNC_ACTION_DOWNLOAD, 'device-newer.txt'],
+      [FLAGS.SYNC_ACTION_DOWNLOAD, 'device-only.txt'],
+      [FLAGS.SYNC_ACTION_UPLOAD, 'local-newer.txt'],
+      [FLAGS.SYNC_ACTION_UPLOAD, 'local-only.txt'],
+      [FLAGS.SYNC_ACTION_CONFLICT, 'conflict.txt']
+    ]
+  );
+  assert.strictEqual(result.downloadBytes, 7);
+  assert.strictEqual(result.uploadBytes, 10);
+
+  const device = readTree(session, folderId);
+  const local = name => fs.readFileSync(path.join(dir, name), 'utf8');
+
+  assert.strictEqual(local('device-newer.txt'), 'device');
+  assert.strictEqual(local('device-only.txt'), 'd');
+  assert.strictEqual(device['local-newer.txt'].toString(), 'new local');
+  assert.strictEqual(device['local-only.txt'].toString(), 'l');
+  assert.strictEqual(local('conflict.txt'), 'changed');
+  assert.strictEqual(device['conflict.txt'].toString(), 'device');
+
+  // the uploads took over the device times, so a second sync has nothing to do
+  const again = await syncTree(session, dir, folderId, FLAGS.SYNC_MODE_TWO_WAY);
+
+  assert.deepStrictEqual(
+    again.plan.map(({ kind }) => kind),
+    [FLAGS.SYNC_ACTION_CONFLICT]
+  );
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('comparing content skips files whose only change is the time', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'sync-hash');
+  const dir = tmpdir();
+
+  sendFile(session, folderId, 'same.txt', Buffer.from('same'));
+  sendFile(session, folderId, 'other.txt', Buffer.from('abcd'));
+
+  const times = deviceTimes(session, folderId);
+
+  writeLocal(dir, 'same.txt', 'same', times['same.txt'] - 1000);
+  writeLocal(dir, 'other.txt', 'wxyz', times['other.txt'] - 1000);
+
+  const flags = FLAGS.SYNC_DRY_RUN;
+  const byTime = await syncTree(
+    session,
+    dir,
+    folderId,
+    FLAGS.SYNC_MODE_DOWNLOAD,
+    flags
+  );
+  const byContent = await syncTree(
+    session,
+    dir,
+    folderId,
+    FLAGS.SYNC_MODE_DOWNLOAD,
+    flags | FLAGS.SYNC_COMPARE_HASH // eslint-disable-line no-bitwise
+  );
+
+  assert.deepStrictEqual(
+    byTime.plan.map(({ path: actionPath }) => actionPath),
+    ['other.txt', 'same.txt']
+  );
+  assert.deepStrictEqual(
+    byContent.plan.map(({ path: actionPath }) => actionPath),
+    ['other.txt']
+  );
+  assert.strictEqual(byContent.downloadBytes, 4);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
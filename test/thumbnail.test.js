@@ -0,0 +1,192 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const {
+  lib,
+  ERROR_GENERAL,
+  ERROR_CANCELLED,
+  test,
+  openDevice,
+  tmpdir,
+  makeFolder,
+  sendFile
+} = require('./helpers');
+
+/* SOI, "thum", EOI */
+const THUMBNAIL = Buffer.from([
+  0xff, 0xd8, 0x74, 0x68, 0x75, 0x6d, 0xff, 0xd9
+]);
+
+/* an IFD entry holding a single little endian LONG */
+const ifdLong = (tag, value) => {
+  const entry = Buffer.alloc(12);
+
+  entry.writeUInt16LE(tag, 0);
+  entry.writeUInt16LE(4, 2);
+  entry.writeUInt32LE(1, 4);
+  entry.writeUInt32LE(value, 8);
+
+  return entry;
+};
+
+/**
+ * A JPEG file whose APP1 segment embeds THUMBNAIL through IFD1, followed
+ * by enough scan data to need a ranged read for the header.
+ */
+const exifJpeg = () => {
+  const ifd1 = 14;
+  const thumbnailAt = ifd1 + 2 + 2 * 12 + 4;
+  const tiff = Buffer.concat([
+    Buffer.from('II*\0', 'latin1'),
+    Buffer.from([8, 0, 0, 0]),
+    // IFD0 without entries, then the offset of IFD1
+    Buffer.from([0, 0, ifd1, 0, 0, 0]),
+    Buffer.from([2, 0]),
+    ifdLong(0x0201, thumbnailAt),
+    ifdLong(0x0202, THUMBNAIL.length),
+    Buffer.alloc(4),
+    THUMBNAIL
+  ]);
+  const app1 = Buffer.alloc(4);
+
+  app1.writeUInt16BE(0xffe1, 0);
+  app1.writeUInt16BE(2 + 6 + tiff.length, 2);
+
+  return Buffer.concat([
+    Buffer.from([0xff, 0xd8]),
+    app1,
+    Buffer.from('Exif\0\0', 'latin1'),
+    tiff,
+    Buffer.from([0xff, 0xda]),
+    Buffer.alloc(200000, 0x55),
+    Buffer.from([0xff, 0xd9])
+  ]);
+};
+
+const getThumbnails = (
+  { device },
+  ids,
+  cache,
+  token = new lib.abort_token_t() // eslint-disable-line new-cap
+) =>
+  new Promise(resolve => {
+    const items = [];
+
+    lib.Schedule_Get_Thumbnails(
+      device,
+      ids,
+      FLAGS.SCHEDULER_PRIORITY_INTERACTIVE,
+      cache,
+      token,
+      (id, error, thumbnailPath, source) =>
+        items.push({ id, error, path: thumbnailPath, source }),
+      (error, fetched) => resolve({ error, fetched, items })
+    );
+  });
+
+const makeSource = (session, name) => {
+  const folderId = makeFolder(session, name);
+
+  sendFile(session, folderId, 'photo.jpg', exifJpeg(), FLAGS.FILETYPE_JPEG);
+  sendFile(
+    session,
+    folderId,
+    'plain.jpg',
+    Buffer.from([0xff, 0xd8, 0xff, 0xda, 0, 0, 0xff, 0xd9]),
+    FLAGS.FILETYPE_JPEG
+  );
+  sendFile(session, folderId, 'note.txt', Buffer.from('no picture'));
+
+  return unpackFiles(
+    lib.Get_Files_And_Folders(session.device, session.storageId, folderId)
+  ).reduce((ids, { name, id }) => Object.assign(ids, { [name]: id }), {});
+};
+
+test('a thumbnail batch reads EXIF thumbnails into the cache in order', async () => {
+  const session = openDevice(1);
+  const ids = makeSource(session, 'thumbnails');
+  const dir = tmpdir();
+  const cache = new lib.download_cache_t(); // eslint-disable-line new-cap
+
+  assert.ok(cache.open(dir, 0));
+
+  const first = await getThumbnails(
+    session,
+    [ids['note.txt'], ids['photo.jpg'], ids['plain.jpg']],
+    cache
+  );
+
+  assert.strictEqual(first.error, 0);
+  assert.strictEqual(first.fetched, 1);
+  assert.deepStrictEqual(
+    first.items.map(({ id, error, source }) => [id, error, source]),
+    [
+      [ids['note.txt'], ERROR_GENERAL, FLAGS.THUMBNAIL_CACHED],
+      [ids['photo.jpg'], 0, FLAGS.THUMBNAIL_EXIF],
+      [ids['plain.jpg'], ERROR_GENERAL, FLAGS.THUMBNAIL_CACHED]
+    ]
+  );
+  assert.deepStrictEqual(fs.readFileSync(first.items[1].path), THUMBNAIL);
+  assert.strictEqual(path.dirname(first.items[1].path), dir);
+
+  // the second time round the cache entry is handed out as it is
+  const again = await getThumbnails(session, [ids['photo.jpg']], cache);
+
+  assert.deepStrictEqual(again.items, [
+    {
+      id: ids['photo.jpg'],
+      error: 0,
+      path: first.items[1].path,
+      source: FLAGS.THUMBNAIL_CACHED
+    }
+  ]);
+  assert.strictEqual(cache.hits, 1);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a thumbnail batch needs partial reads, an open cache and no abort', async () => {
+  const session = openDevice(0);
+  const ids = makeSource(session, 'thumbnails-fail');
+  const dir = tmpdir();
+  const cache = new lib.download_cache_t(); // eslint-disable-line new-cap
+
+  // the EXIF header cannot be read on its own
+  assert.ok(cache.open(dir, 0));
+
+  const unread = await getThumbnails(session, [ids['photo.jpg']], cache);
+
+  assert.strictEqual(unread.fetched, 0);
+  assert.strictEqual(unread.items[0].error, ERROR_GENERAL);
+
+  const token = new lib.abort_token_t(); // eslint-disable-line new-cap
+
+  token.abort();
+
+  const aborted = await getThumbnails(
+    session,
+    [ids['photo.jpg']],
+    cache,
+    token
+  );
+
+  assert.deepStrictEqual(aborted, {
+    error: ERROR_CANCELLED,
+    fetched: 0,
+    items: []
+  });
+
+  cache.close();
+
+  const closed = await getThumbnails(session, [ids['photo.jpg']], cache);
+
+  assert.strictEqual(closed.error, ERROR_GENERAL);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
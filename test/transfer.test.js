@@ -0,0 +1,202 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const {
+  lib,
+  test,
+  openDevice,
+  tmpdir,
+  makeFolder,
+  sendFile
+} = require('./helpers');
+
+const KiB = 1024;
+
+/* ten FAKE_CHUNK sized chunks */
+const SIZE = 160 * KiB;
+
+/**
+ * Uploads SIZE bytes with `job` and returns the libmtp result and the job
+ * progress of every report in between, which is also passed to `onReport`.
+ */
+const upload = (session, folderId, name, job, onReport = () => {}) => {
+  const dir = tmpdir();
+  const file = new lib.file_t(); // eslint-disable-line new-cap
+  const reports = [];
+
+  fs.writeFileSync(path.join(dir, name), Buffer.alloc(SIZE, 1));
+  file.name = name;
+  file.size = SIZE;
+  file.type = FLAGS.FILETYPE_UNKNOWN;
+  file.parentId = folderId;
+  file.storageId = session.storageId;
+
+  job.setProgressCallback((sent, total, jobSent) => {
+    reports.push(jobSent);
+    onReport(reports);
+  });
+
+  const result = lib.Send_File_From_File_Job(
+    session.device,
+    path.join(dir, name),
+    file,
+    job
+  );
+
+  fs.rmSync(dir, { recursive: true });
+
+  return { result, reports };
+};
+
+const newJob = (minInterval, minBytes, total = 0) => {
+  const job = new lib.transfer_job_t(); // eslint-disable-line new-cap
+
+  job.minInterval = minInterval;
+  job.minBytes = minBytes;
+  job.total = total;
+
+  return job;
+};
+
+const listNames = ({ device, storageId }, folderId) =>
+  unpackFiles(lib.Get_Files_And_Folders(device, storageId, folderId)).map(
+    ({ name }) => name
+  );
+
+test('a job reports every chunk without thresholds', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'transfer-every');
+  const { result, reports } = upload(session, folderId, 'a.bin', newJob(0, 0));
+
+  assert.strictEqual(result, 0);
+  assert.deepStrictEqual(
+    reports,
+    Array.from({ length: 10 }, (_, i) => (i + 1) * 16 * KiB)
+  );
+
+  lib.Release_Device(session.device);
+});
+
+test('a job reports once the byte threshold is passed and on flush', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'transfer-bytes');
+  const job = newJob(0, 40 * KiB);
+  const counter = new BigUint64Array(3);
+
+  assert.ok(job.setCounter(Buffer.from(counter.buffer)));
+
+  const { result, reports } = upload(session, folderId, 'a.bin', job);
+
+  assert.strictEqual(result, 0);
+  assert.deepStrictEqual(reports, [48 * KiB, 96 * KiB, 144 * KiB]);
+
+  // the counter follows every chunk, reported or not
+  assert.deepStrictEqual(Array.from(counter), [BigInt(SIZE), 0n, 1n]);
+
+  // without a total only a flush knows the job is done
+  job.flush();
+  job.flush();
+  assert.deepStrictEqual(reports, [48 * KiB, 96 * KiB, 144 * KiB, SIZE]);
+
+  job.clearCounter();
+  lib.Release_Device(session.device);
+});
+
+test('a job reports at most once per interval but always at its end', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'transfer-interval');
+  const slow = newJob(60 * 1000, 0);
+  const first = upload(session, folderId, 'a.bin', slow);
+
+  // the first chunk is reported, the rest falls within the interval
+  assert.strictEqual(first.result, 0);
+  assert.deepStrictEqual(first.reports, [16 * KiB]);
+
+  slow.flush();
+  assert.deepStrictEqual(first.reports, [16 * KiB, SIZE]);
+
+  // a job of known size reports its last chunk whatever the thresholds
+  const sized = newJob(60 * 1000, 1024 * KiB, SIZE);
+  const second = upload(session, folderId, 'b.bin', sized);
+
+  assert.strictEqual(second.result, 0);
+  assert.deepStrictEqual(second.reports, [SIZE]);
+
+  sized.flush();
+  assert.deepStrictEqual(second.reports, [SIZE]);
+
+  lib.Release_Device(session.device);
+});
+
+test('an abort cancels the transfer after the current chunk', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'transfer-abort');
+  const token = new lib.abort_token_t(); // eslint-disable-line new-cap
+  const job = newJob(0, 0);
+
+  assert.ok(job.setAbortToken(token));
+
+  // the second report raises the token, the third chunk is refused
+  const { result, reports } = upload(session, folderId, 'a.bin', job, seen => {
+    if (seen.length === 2) {
+      token.abort();
+    }
+  });
+
+  assert.notStrictEqual(result, 0);
+  assert.deepStrictEqual(reports, [16 * KiB, 32 * KiB]);
+  assert.ok(job.isAborted());
+  assert.strictEqual(job.files, 0);
+
+  // the object created for the cancelled send is removed again
+  assert.deepStrictEqual(listNames(session, folderId), []);
+
+  // a job bound to a token stays bound until it is cleared
+  const other = new lib.abort_token_t(); // eslint-disable-line new-cap
+
+  assert.strictEqual(job.setAbortToken(other), false);
+  job.clearAbortToken();
+  assert.ok(job.setAbortToken(other));
+  assert.strictEqual(job.isAborted(), false);
+
+  lib.Release_Device(session.device);
+});
+
+test('a token raised through its shared slot cancels a download', () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'transfer-slot');
+  const dir = tmpdir();
+  const token = new lib.abort_token_t(); // eslint-disable-line new-cap
+  const slot = new Int32Array(new SharedArrayBuffer(4));
+  const job = newJob(0, 0);
+
+  sendFile(session, folderId, 'a.bin', Buffer.alloc(SIZE, 1));
+
+  const [{ id }] = unpackFiles(
+    lib.Get_Files_And_Folders(session.device, session.storageId, folderId)
+  );
+
+  assert.ok(token.attach(Buffer.from(slot.buffer)));
+  job.setAbortToken(token);
+  job.setProgressCallback(() => Atomics.store(slot, 0, 1));
+
+  assert.notStrictEqual(
+    lib.Get_File_To_File_Job(session.device, id, path.join(dir, 'a'), job),
+    0
+  );
+  assert.ok(token.isAborted());
+  assert.ok(job.transferred < SIZE);
+
+  // a reset lowers the slot as well
+  token.reset();
+  assert.strictEqual(Atomics.load(slot, 0), 0);
+  assert.strictEqual(token.isAborted(), false);
+
+  token.detach();
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
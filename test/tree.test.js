@@ -0,0 +1,258 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const { unpackFiles } = require('../lib/unpack');
+const {
+  lib,
+  ERROR_GENERAL,
+  test,
+  openDevice,
+  tmpdir,
+  makeFolder,
+  sendFile,
+  readTree
+} = require('./helpers');
+
+const MiB = 1024 * 1024;
+
+const treeItem = (name, itemPath, parent = -1, isFolder = false, id = 0) => {
+  const item = new lib.tree_item_t(); // eslint-disable-line new-cap
+
+  item.name = name;
+  item.path = itemPath;
+  item.parent = parent;
+  item.isFolder = isFolder;
+  item.id = id;
+
+  return item;
+};
+
+const uploadTree = (session, parentId, items, policy) =>
+  new Promise(resolve =>
+    lib.Schedule_Upload_Tree(
+      session.device,
+      items,
+      session.storageId,
+      parentId,
+      policy,
+      new lib.transfer_job_t(), // eslint-disable-line new-cap
+      1,
+      (error, uploaded, skipped) => resolve({ error, uploaded, skipped })
+    )
+  );
+
+const downloadTree = (session, items) =>
+  new Promise(resolve =>
+    lib.Schedule_Download_Tree(
+      session.device,
+      items,
+      new lib.transfer_job_t(), // eslint-disable-line new-cap
+      2,
+      false,
+      1,
+      (error, downloaded) => resolve({ error, downloaded })
+    )
+  );
+
+const writeLocal = (dir, files) =>
+  Object.keys(files).reduce((paths, name) => {
+    const filePath = path.join(dir, name);
+
+    fs.writeFileSync(filePath, files[name]);
+
+    return Object.assign(paths, { [name]: filePath });
+  }, {});
+
+/* readTree with the file data as strings */
+const deviceTree = (session, folderId) => {
+  const tree = readTree(session, folderId);
+
+  return Object.keys(tree).reduce(
+    (strings, key) =>
+      Object.assign(strings, { [key]: tree[key] && tree[key].toString() }),
+    {}
+  );
+};
+
+test('an upload resolves names against the folder listings it keeps', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'tree-listings');
+  const keepId = makeFolder(session, 'keep', folderId);
+  const dir = tmpdir();
+  const local = writeLocal(dir, { 'a.txt': 'a', 'b.txt': 'b', 'c.txt': 'c' });
+
+  sendFile(session, keepId, 'old.txt', Buffer.from('old'));
+
+  // the second a.txt only clashes with the first in the task's own listing,
+  // and the new folder is created once and then reused
+  const result = await uploadTree(
+    session,
+    folderId,
+    [
+      treeItem('keep', '', -1, true),
+      treeItem('a.txt', local['a.txt'], 0),
+      treeItem('a.txt', local['b.txt'], 0),
+      treeItem('new', '', -1, true),
+      treeItem('new', '', -1, true),
+      treeItem('c.txt', local['c.txt'], 4)
+    ],
+    FLAGS.CONFLICT_RENAME
+  );
+
+  assert.deepStrictEqual(result, { error: 0, uploaded: 3, skipped: 0 });
+  assert.deepStrictEqual(deviceTree(session, folderId), {
+    'keep/': null,
+    'keep/old.txt': 'old',
+    'keep/a.txt': 'a',
+    'keep/a (1).txt': 'b',
+    'new/': null,
+    'new/c.txt': 'c'
+  });
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('an upload applies its conflict policy to existing objects', async () => {
+  const session = openDevice(0);
+  const dir = tmpdir();
+  const local = writeLocal(dir, { 'a.txt': 'new', 'b.txt': 'file' });
+  const items = [
+    treeItem('a.txt', local['a.txt']),
+    treeItem('b.txt', local['b.txt']),
+    treeItem('sub', '', -1, true),
+    treeItem('c.txt', local['a.txt'], 2)
+  ];
+  const upload = async (name, policy) => {
+    const folderId = makeFolder(session, name);
+
+    sendFile(session, folderId, 'a.txt', Buffer.from('old'));
+    makeFolder(session, 'b.txt', folderId);
+    sendFile(session, folderId, 'sub', Buffer.from('not a folder'));
+
+    const result = await uploadTree(session, folderId, items, policy);
+
+    return { result, tree: deviceTree(session, folderId) };
+  };
+
+  // a skipped folder takes its content with it
+  const skipped = await upload('tree-skip', FLAGS.CONFLICT_SKIP);
+
+  assert.deepStrictEqual(skipped.result, {
+    error: 0,
+    uploaded: 0,
+    skipped: 4
+  });
+  assert.deepStrictEqual(skipped.tree, {
+    'a.txt': 'old',
+    'b.txt/': null,
+    sub: 'not a folder'
+  });
+
+  // files are replaced, folders never are
+  const overwritten = await upload('tree-overwrite', FLAGS.CONFLICT_OVERWRITE);
+
+  assert.deepStrictEqual(overwritten.result, {
+    error: 0,
+    uploaded: 3,
+    skipped: 0
+  });
+  assert.deepStrictEqual(overwritten.tree, {
+    'a.txt': 'new',
+    'b.txt/': null,
+    'b (1).txt': 'file',
+    'sub/': null,
+    'sub/c.txt': 'new'
+  });
+
+  const renamed = await upload('tree-rename', FLAGS.CONFLICT_RENAME);
+
+  assert.deepStrictEqual(renamed.result, {
+    error: 0,
+    uploaded: 3,
+    skipped: 0
+  });
+  assert.deepStrictEqual(renamed.tree, {
+    'a.txt': 'old',
+    'a (1).txt': 'new',
+    'b.txt/': null,
+    'b (1).txt': 'file',
+    sub: 'not a folder',
+    'sub (1)/': null,
+    'sub (1)/c.txt': 'new'
+  });
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a download hands whole and partial blocks to the writers', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'tree-download');
+  const subId = makeFolder(session, 'sub', folderId);
+  const big = Buffer.alloc(MiB + MiB / 2);
+  const dir = tmpdir();
+
+  big.forEach((_, i) => {
+    big[i] = i % 251;
+  });
+  sendFile(session, folderId, 'big.bin', big);
+  sendFile(session, subId, 'small.txt', Buffer.from('small'));
+
+  const [bigFile] = unpackFiles(
+    lib.Get_Files_And_Folders(session.device, session.storageId, folderId)
+  ).filter(({ name }) => name === 'big.bin');
+  const [smallFile] = unpackFiles(
+    lib.Get_Files_And_Folders(session.device, session.storageId, subId)
+  );
+
+  const result = await downloadTree(session, [
+    treeItem('big.bin', path.join(dir, 'big.bin'), -1, false, bigFile.id),
+    treeItem('sub', path.join(dir, 'sub'), -1, true, subId),
+    treeItem(
+      'small.txt',
+      path.join(dir, 'sub', 'small.txt'),
+      1,
+      false,
+      smallFile.id
+    )
+  ]);
+
+  assert.deepStrictEqual(result, { error: 0, downloaded: 2 });
+  assert.ok(fs.readFileSync(path.join(dir, 'big.bin')).equals(big));
+  assert.strictEqual(
+    fs.readFileSync(path.join(dir, 'sub', 'small.txt'), 'utf8'),
+    'small'
+  );
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
+
+test('a failed local write fails the download', async () => {
+  const session = openDevice(0);
+  const folderId = makeFolder(session, 'tree-write-failure');
+  const dir = tmpdir();
+
+  sendFile(session, folderId, 'a.txt', Buffer.from('data'));
+
+  const [file] = unpackFiles(
+    lib.Get_Files_And_Folders(session.device, session.storageId, folderId)
+  );
+
+  // a regular file in the way of the parent directory
+  fs.writeFileSync(path.join(dir, 'blocker'), '');
+
+  const result = await downloadTree(session, [
+    treeItem('a.txt', path.join(dir, 'blocker', 'a.txt'), -1, false, file.id)
+  ]);
+
+  assert.strictEqual(result.error, ERROR_GENERAL);
+  assert.deepStrictEqual(fs.readdirSync(dir), ['blocker']);
+
+  fs.rmSync(dir, { recursive: true });
+  lib.Release_Device(session.device);
+});
@@ -0,0 +1,124 @@
+'use strict';
+
+const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
+const { unpackFiles, unpackTreeItems } = require('../lib/unpack');
+const { FLAGS } = require('../lib/mtp-device-flags');
+const {
+  lib,
+  test,
+  openDevice,
+  tmpdir,
+  makeFolder,
+  sendFile
+} = require('./helpers');
+
+test('listings come packed into columns and unpack into plain objects', () => {
+  const session = openDevice();
+  const { device, storageId } = session;
+  const folderId = makeFolder(session, 'unpack');
+  const subfolderId = makeFolder(session, 'Camera', folderId);
+
+  const jpeg = Buffer.alloc(1234, 1);
+  const text = Buffer.from('hi');
+
+  assert.strictEqual(
+    sendFile(session, folderId, 'a.jpg', jpeg, FLAGS.FILETYPE_JPEG),
+    0
+  );
+  assert.strictEqual(
+    sendFile(session, folderId, 'ü b.txt', text, FLAGS.FILETYPE_TEXT),
+    0
+  );
+
+  const packed = lib.Get_Files_And_Folders(device, storageId, folderId);
+
+  assert.strictEqual(packed.length, 3);
+  assert.ok(packed.ids instanceof Uint32Array);
+  assert.ok(packed.sizes instanceof Float64Array);
+  assert.strictEqual(packed.names, 'Camera\0a.jpg\0ü b.txt\0');
+
+  const files = unpackFiles(packed);
+
+  assert.deepStrictEqual(
+    files.map(({ name, type, size, parentId, storageId: id }) => ({
+      name,
+      type,
+      size,
+      parentId,
+      storageId: id
+    })),
+    [
+      {
+        name: 'Camera',
+        type: FLAGS.FILETYPE_FOLDER,
+        size: 0,
+        parentId: folderId,
+        storageId
+      },
+      {
+        name: 'a.jpg',
+        type: FLAGS.FILETYPE_JPEG,
+        size: 1234,
+        parentId: folderId,
+        storageId
+      },
+      {
+        name: 'ü b.txt',
+        type: FLAGS.FILETYPE_TEXT,
+        size: 2,
+        parentId: folderId,
+        storageId
+      }
+    ]
+  );
+  assert.strictEqual(files[0].id, subfolderId);
+  assert.ok(files.every(file => typeof file.modificationDate === 'number'));
+  assert.ok(!(files[0] instanceof lib.file_t));
+
+  assert.deepStrictEqual(
+    unpackFiles(lib.Get_Files_And_Folders(device, storageId, subfolderId)),
+    []
+  );
+
+  lib.Release_Device(device);
+});
+
+test('local scans unpack into plain tree items', async () => {
+  const root = tmpdir();
+
+  fs.mkdirSync(path.join(root, 'b'));
+  fs.writeFileSync(path.join(root, 'a.txt'), 'abc');
+  fs.writeFileSync(path.join(root, 'b', 'c.txt'), 'hello');
+
+  const items = await new Promise((resolve, reject) =>
+    lib.Scan_Local_Tree(root, true, 2, (error, packed) =>
+      error
+        ? reject(new Error(`scan failed: ${error}`))
+        : resolve(unpackTreeItems(packed))
+    )
+  );
+
+  fs.rmSync(root, { recursive: true });
+
+  assert.deepStrictEqual(
+    items.map(({ name, parent, isFolder, size }) => ({
+      name,
+      parent,
+      isFolder,
+      size
+    })),
+    [
+      { name: 'a.txt', parent: -1, isFolder: false, size: 3 },
+      { name: 'b', parent: -1, isFolder: true, size: 0 },
+      { name: 'c.txt', parent: 1, isFolder: false, size: 5 }
+    ]
+  );
+  assert.strictEqual(items[2].path, path.join(root, 'b', 'c.txt'));
+});
+
+test('a missing listing stays null', () => {
+  assert.strictEqual(unpackFiles(null), null);
+  assert.strictEqual(unpackTreeItems(undefined), undefined);
+});